@@ -42,6 +42,24 @@
 // http://host/ptrain
 // input: GET request to turn on a PulseTrain device
 // return: response JSON formatted system state
+//
+// http://host/stats
+// return: response JSON formatted ISR latency and timing health per timer
+//
+// tcp://host:5000 and Serial at 115200 baud
+// input: binary batch frames of pApplyBatch, each sets, starts and stops
+// any number of ptrains at one instant.  Keep the connection open and send
+// frames back to back
+// return: a P_BATCH_ACK_SIZE binary ack per frame
+//
+// tcp://host:5001
+// return: a stream of JSON lines, one whenever a timer changes, at most every
+// STATUS_MIN_MS while runs go on and at once when a run starts, stops or hits
+// its limit.  Every STATUS_FULL_MS a line reports all the ptrains, so a new
+// observer is up to date within that time.  Each ptrain is
+// [ptrain, periods done, active, limit hit]:
+// {"ms":12034,"p":[[0,517,1,0]]}
+// Connect and read, as many observers as the Ethernet chip has sockets
 
 
 #define SERVER_IP 192,168,1,145
@@ -52,6 +70,17 @@
 #define VALUELEN 32
 
 #define P_USE_TIMER1
+#define P_USE_TIMER_STATS
+#define P_USE_BATCH
+
+#define BATCH_PORT  5000
+#define BATCH_BAUD  115200
+
+#define STATUS_PORT         5001
+#define STATUS_MIN_MS       50      // fastest the progress of a run is streamed
+#define STATUS_FULL_MS      1000    // every ptrain is streamed this often
+#define STATUS_LINE_SIZE    192
+#define STATUS_ENTRY_SIZE   24      // "[255,4294967295,1,1]," and the closing "]}\n"
 
 // Analog Pins
  
@@ -85,6 +114,22 @@ static uint8_t mac[] = {  MAC_ADDRESS };
 static uint8_t ip[] = {SERVER_IP}; 
 
 WebServer webserver(PREFIX, 80);
+EthernetServer batchserver(BATCH_PORT);
+
+// a batch frame being read in from one stream
+typedef struct {
+    uint8_t     bytes[P_BATCH_FRAME_SIZE(P_BATCH_MAX_RECORDS)];
+    uint16_t    length;
+} batchframe_t;
+
+batchframe_t tcp_frame;
+batchframe_t serial_frame;
+
+EthernetServer statusserver(STATUS_PORT);
+pprogress_t streamed[NUMBER_OF_16BIT_TIMERS];   // what the observers last got
+unsigned long status_ms = 0;
+unsigned long full_status_ms = 0;
+char status_line[STATUS_LINE_SIZE];
 
 //
 uint8_t waterp = pNewPTrain();
@@ -94,11 +139,16 @@ uint8_t waterp = pNewPTrain();
 
 void returnState(WebServer &server, WebServer::ConnectionType type) 
 {
-    // return system state.  
+    // return system state.  pGetProgress leaves the timer interrupts
+    // alone however often this is polled
+    pprogress_t progress;
+    pGetProgress(PTIMER1, &progress);
     server << "{ ";
     server << "\"PERIOD\": " << pGetPeriodCounts(waterp);
     server << ",\"PULSEWIDTH\": " << pGetPulseCounts(waterp);
     server << ",\"NUM_PERIODS\": " << pGetPeriodNumber(waterp);
+    server << ",\"PERIODS_DONE\": " << progress.periods;
+    server << ",\"ACTIVE\": " << (progress.active ? 1 : 0);
     server << " }";
 }
 
@@ -167,7 +217,7 @@ void pTrainParse(char* name, char* value, uint8_t* pt, uint8_t* ret_value)
             if (ARE_STRINGS_EQ(name, "PULSE")) {
                 value_copy =  atoi(value);
                 pSetPulseOnlyUS(*pt, (uint16_t) value_copy);
-                pReloadToTimer(waterp); 
+                pReloadToTimer(*pt); 
             } // end 
             else if (ARE_STRINGS_EQ(name, "PERIOD")) {
                 value_copy =  atoi(value);
@@ -190,6 +240,44 @@ void pulseTrainCmd(WebServer &server, WebServer::ConnectionType type, char *url_
     getCmd(server, type, url_tail, tail_complete, pTrainParse);
 }
 
+void statsCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete) {
+    // ISR health of every timer, latencies and durations are in timer counts
+    static const char *timer_names[NUMBER_OF_16BIT_TIMERS] = 
+                                    { "PTIMER1", "PTIMER3", "PTIMER4", "PTIMER5" };
+    ptimerstats_t stats;
+    if (type == WebServer::POST) {
+        server.httpFail();
+        return;
+    }
+
+    server.httpSuccess("application/json");
+
+    if (type == WebServer::HEAD)
+        return;
+
+    server << "{ ";
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        pGetTimerStats((timers16bit_t) timer, &stats);
+        if (timer != 0) {
+            server << ", ";
+        }
+        server << "\"" << timer_names[timer] << "\": { ";
+        server << "\"ISRS\": " << stats.isr_count;
+        server << ", \"MAX_LATENCY\": " << stats.max_latency;
+        server << ", \"MAX_ISR\": " << stats.max_isr_counts;
+        server << ", \"MISSED\": " << stats.missed_compares;
+        server << ", \"LATENCY\": [";
+        for (uint8_t i = 0; i < P_LATENCY_BUCKETS; i++) {
+            server << stats.latency[i];
+            if (i != P_LATENCY_BUCKETS - 1) {
+                server << ", ";
+            }
+        }
+        server << "] }";
+    }
+    server << " }";
+}
+
 // from Web_Demo.ino 
 void jsonCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete) {
     if (type == WebServer::POST) {
@@ -308,6 +396,128 @@ void defaultCmd(WebServer &server, WebServer::ConnectionType type, char *url_tai
     outputPins(server, type, false);  
 }
 
+// read what has arrived of a batch frame, apply it once it is all in
+// and answer with its ack.  Bytes that can't start a frame are dropped
+// one at a time until the stream is back in step
+void feedBatch(Stream &stream, batchframe_t *frame)
+{
+    while (stream.available() > 0) {
+        frame->bytes[frame->length++] = stream.read();
+        if (frame->length < P_BATCH_HEADER_SIZE) {
+            continue;
+        }
+        uint16_t size = pBatchFrameSize(frame->bytes);
+        if (size == 0) {
+            frame->length--;
+            memmove(frame->bytes, frame->bytes + 1, frame->length);
+        }
+        else if (frame->length == size) {
+            uint8_t ack[P_BATCH_ACK_SIZE];
+            pApplyBatch(frame->bytes, size, ack);
+            stream.write(ack, sizeof(ack));
+            frame->length = 0;
+        }
+    }
+}
+
+char *appendNumber(char *text, uint32_t value)
+{
+    char digits[10];
+    uint8_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (n > 0) {
+        *text++ = digits[--n];
+    }
+    return text;
+}
+
+char *beginStatusLine(unsigned long now)
+{
+    char *text = status_line;
+    memcpy(text, "{\"ms\":", 6);
+    text = appendNumber(text + 6, now);
+    memcpy(text, ",\"p\":[", 6);
+    return text + 6;
+}
+
+char *endStatusLine(char *text)
+{
+    if (text[-1] == ',') {
+        text--;
+    }
+    memcpy(text, "]}\n", 3);
+    return text + 3;
+}
+
+// send the ptrains of the timers with _BV(timer) set in timer_mask to every
+// observer, each line formatted first and written in one go
+void sendStatus(uint8_t timer_mask, const pprogress_t *progress, unsigned long now)
+{
+    char *text = beginStatusLine(now);
+    for (uint8_t ptrain = 0; ptrain < ptrain_count; ptrain++) {
+        timers16bit_t timer = pGetTimer(ptrain);
+        if (!pIsValidPTrain(ptrain) || !(timer_mask & _BV(timer))) {
+            continue;
+        }
+        if (text + STATUS_ENTRY_SIZE > status_line + STATUS_LINE_SIZE) {
+            text = endStatusLine(text);
+            statusserver.write((uint8_t *)status_line, text - status_line);
+            text = beginStatusLine(now);
+        }
+        *text++ = '[';
+        text = appendNumber(text, ptrain);
+        *text++ = ',';
+        text = appendNumber(text, progress[timer].periods);
+        *text++ = ',';
+        *text++ = progress[timer].active ? '1' : '0';
+        *text++ = ',';
+        *text++ = progress[timer].limit_hit ? '1' : '0';
+        *text++ = ']';
+        *text++ = ',';
+    }
+    text = endStatusLine(text);
+    statusserver.write((uint8_t *)status_line, text - status_line);
+}
+
+// stream the timers that changed since the observers last heard.  Only
+// pGetProgress runs when nothing did, so this is cheap to call every loop
+void streamStatus()
+{
+    unsigned long now = millis();
+    pprogress_t progress[NUMBER_OF_16BIT_TIMERS];
+    uint8_t changed = 0;
+    bool urgent = false;
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        pGetProgress((timers16bit_t)timer, &progress[timer]);
+        if ((progress[timer].active != streamed[timer].active) ||
+                (progress[timer].limit_hit != streamed[timer].limit_hit)) {
+            changed |= _BV(timer);
+            urgent = true;
+        }
+        else if (progress[timer].periods != streamed[timer].periods) {
+            changed |= _BV(timer);
+        }
+    }
+    if (now - full_status_ms >= STATUS_FULL_MS) {
+        changed = _BV(NUMBER_OF_16BIT_TIMERS) - 1;
+        urgent = true;
+        full_status_ms = now;
+    }
+    if ((changed == 0) || (!urgent && (now - status_ms < STATUS_MIN_MS))) {
+        return;
+    }
+    sendStatus(changed, progress, now);
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        if (changed & _BV(timer)) {
+            streamed[timer] = progress[timer];
+        }
+    }
+    status_ms = now;
+}
+
 void setup()
 {
     // set pins for digital output
@@ -317,10 +527,14 @@ void setup()
 
     Ethernet.begin(mac, ip);
     webserver.begin();
+    batchserver.begin();
+    statusserver.begin();
+    Serial.begin(BATCH_BAUD);
 
     webserver.setDefaultCommand(&defaultCmd);
     webserver.addCommand("json", &jsonCmd);
     webserver.addCommand("ptrain", &pulseTrainCmd);
+    webserver.addCommand("stats", &statsCmd);
     webserver.addCommand("form", &formCmd);
 }
 
@@ -330,5 +544,12 @@ void loop()
     int len = 64;
     // process incoming connections one at a time forever
     webserver.processConnection(buff, &len);
+    // batch frames from the one controller kept connected, and from Serial
+    EthernetClient batchclient = batchserver.available();
+    if (batchclient) {
+        feedBatch(batchclient, &tcp_frame);
+    }
+    feedBatch(Serial, &serial_frame);
+    streamStatus();
     // if you wanted to do other work based on a connecton, it would go here
 }
@@ -31,22 +31,79 @@
 //  8           0.5 us          32768 us                8.38 sec    2147 secs
 // 64           4 us            262 ms                  67.1 sec    17302 secs
 
-// we need a 16 bit counter to keep track of numbe rof pulses output in order
+// we need a 32 bit counter to keep track of numbe rof pulses output in order
 // to run stepper motors effectively as they have in excess of 2000 steps/rev
-// often when microstepping
+// often when microstepping, and a long move takes many revolutions
 
 #ifndef PULSETRAIN_H
 #define PULSETRAIN_H
 
 #include <inttypes.h>
 
+#ifdef P_SIMULATE
+// build on a host against the simulated Mega timers in pulsetrain_sim.h
+#include "pulsetrain_sim.h"
+#endif
+
+#ifdef P_USE_RAMP
+#include <math.h>
+#endif
+
+#if defined(P_USE_CONFIG) && !defined(P_SIMULATE)
+#include <avr/eeprom.h>
+#endif
+
 // Enums
 //////////
 // The 16 bit timer defines
 typedef enum { PTIMER1, PTIMER3, PTIMER4, PTIMER5, NUMBER_OF_16BIT_TIMERS } timers16bit_t;
 // Different states to Pulse in
 enum pulse_states { PPULSE_LO, PPULSE_HI, PDC_INIT, PDC_RUNNING, POFF};
-
+// How a timer schedules its edges
+// PMODE_CLEAR clears TCNTn every period, so ISR latency adds to each period
+// PMODE_FREERUN leaves TCNTn running and moves OCRnA on by each interval so
+// latency only delays single edges and never builds up
+// PMODE_SCHEDULE runs every attached ptrain with its own pulse, period and
+// count off one free running counter (needs P_USE_SCHEDULER)
+// PMODE_BAM gives every attached ptrain its own brightness by bit angle
+// modulation, one slot per duty bit with the pins of all ptrains written
+// together (needs P_USE_BAM)
+// PMODE_DDA steps every attached ptrain its own number of times in a line,
+// spread over the periods of the timer Bresenham style (needs P_USE_DDA)
+// PMODE_PROGRAM runs the waveform program loaded with pLoadProgram (needs
+// P_USE_PROGRAM)
+enum timer_modes { PMODE_CLEAR, PMODE_FREERUN, PMODE_SCHEDULE, PMODE_BAM, PMODE_DDA,
+                    PMODE_PROGRAM };
+// Velocity profiles of a ramp (needs P_USE_RAMP)
+// PRAMP_TRAPEZOID accelerates at a constant rate
+// PRAMP_SCURVE lets the acceleration rise and fall again over the ramp
+enum ramp_profiles { PRAMP_TRAPEZOID, PRAMP_SCURVE };
+// What the ISRs tell the main loop (needs P_USE_EVENTS)
+// PEVENT_DONE a run output all its periods
+// PEVENT_LIMIT the limit pin cut a run short
+// PEVENT_SEGMENT the next queued segment went live
+// PEVENT_UNDERRUN a run stopped because the segment queue ran dry
+// PEVENT_OVERRUN an ISR finished after its next compare, that edge is late
+enum event_types { PEVENT_DONE, PEVENT_LIMIT, PEVENT_SEGMENT, PEVENT_UNDERRUN, PEVENT_OVERRUN };
+// Why the limit of a timer last tripped, latched until pClearLimitCause
+// PLIMIT_POLLED the ISR read the pin at the end of a period
+// PLIMIT_INTERRUPT the external interrupt of the pin stopped the timer at once
+// PLIMIT_AT_START the pin was tripped when pStartTimer was called
+enum limit_causes { PLIMIT_NONE, PLIMIT_POLLED, PLIMIT_INTERRUPT, PLIMIT_AT_START };
+// Instructions of a waveform program, each opcode byte is followed by its
+// arguments, multi byte ones little endian (needs P_USE_PROGRAM)
+// POP_END stop the timer
+// POP_PULSE pulse counts, period counts (4 bytes each) for the periods that follow
+// POP_PERIODS output this many periods (4 bytes)
+// POP_DELAY keep the pins low for this many counts (4 bytes)
+// POP_WAIT pin, level: wait for the pin to read level, checked every period
+// POP_UNTIL pin, level: output periods until the pin reads level at the end of one
+// POP_LOOP repeat up to the matching POP_NEXT this many times (2 bytes)
+// POP_NEXT end of the innermost loop
+// POP_JUMP carry on at this byte of the program (2 bytes)
+// POP_PINS the attached ptrains to output on, bit i for the i-th attached (4 bytes)
+enum program_ops { POP_END, POP_PULSE, POP_PERIODS, POP_DELAY, POP_WAIT, POP_UNTIL,
+                    POP_LOOP, POP_NEXT, POP_JUMP, POP_PINS, NUMBER_OF_POPS };
 // Definitions
 //////////////
 #define PTRAIN_VERSION          1   // software version of this library 
@@ -61,10 +118,142 @@ enum pulse_states { PPULSE_LO, PPULSE_HI, PDC_INIT, PDC_RUNNING, POFF};
 #define PTRAINS_PER_TIMER       32  // the maximum number of ptrains controlled by one timer 
 #endif
 
+#ifndef P_PORT_GROUPS
+// REDEFINE this if your pins span more output ports
+#define P_PORT_GROUPS           11  // the Mega has output ports A to L (no I)
+#endif
+
+#ifndef P_TRACE_SIZE
+// REDEFINE this for a deeper edge trace, a power of 2 no larger than 128
+#define P_TRACE_SIZE            32  // number of edge records kept with P_USE_TRACE
+#endif
+
+#ifndef P_LATENCY_BUCKETS
+// REDEFINE this for a finer latency histogram with P_USE_TIMER_STATS
+#define P_LATENCY_BUCKETS       8   // buckets of 0, 1, 2-3, 4-7 ... 64+ counts
+#endif
+
+#ifndef P_SEGMENT_QUEUE_SIZE
+// REDEFINE this for a deeper segment queue, a power of 2 no larger than 128
+#define P_SEGMENT_QUEUE_SIZE    16  // segments queued per timer with P_USE_SEGMENTS
+#endif
+
+#ifndef P_EVENT_QUEUE_SIZE
+// REDEFINE this if the main loop drains events less often, a power of 2 no larger than 128
+#define P_EVENT_QUEUE_SIZE      16  // events kept with P_USE_EVENTS
+#endif
+
+// the rings index with uint8_t heads and tails masked by their size, which
+// wrap onto the same slot only for a power of 2 no larger than 128
+#define P_IS_RING_SIZE(_size)   (((_size) > 0) && ((_size) <= 128) && \
+                                    (((_size) & ((_size) - 1)) == 0))
+
+#ifndef P_RAMP_TABLE_SIZE
+// REDEFINE this to compute more of the first ramp steps exactly
+#define P_RAMP_TABLE_SIZE       16  // ramp steps taken from a table, the rest iterate
+#endif
+
+#ifndef P_SCHEDULE_ISR_CYCLES
+// REDEFINE this to match the scheduler ISR time measured on your board
+#define P_SCHEDULE_ISR_CYCLES   250 // CPU cycles for one batch of scheduled edges
+#endif
+
+#ifndef P_PROGRAM_LOOP_DEPTH
+// REDEFINE this if pLoadProgram refuses programs that nest loops deeper.
+// Each level costs 4 bytes of RAM per timer whether used or not
+#define P_PROGRAM_LOOP_DEPTH    4   // POP_LOOPs a waveform program can nest
+#endif
+
+#ifndef P_PROGRAM_OPS_PER_ISR
+// REDEFINE this to bound the ISR time of PMODE_PROGRAM.  Lower it when other
+// timers' edges come late behind long runs of untimed instructions, raise
+// it when a program has more of them between two pulses, where the yield
+// would put an idle period
+#define P_PROGRAM_OPS_PER_ISR   8   // untimed instructions one compare runs before it yields
+#endif
+
+#ifndef P_LOAD_ISR_CYCLES
+// REDEFINE this and the P_LOAD_ costs below, the cost model of
+// pAnalyzeLoad, to match a build that compiles to faster or slower ISRs
+#define P_LOAD_ISR_CYCLES       105 // CPU cycles of a timer ISR besides its port writes
+#endif
+
+#ifndef P_LOAD_PORT_CYCLES
+#define P_LOAD_PORT_CYCLES      10  // CPU cycles of one port write
+#endif
+
+#ifndef P_LOAD_READ_CYCLES
+#define P_LOAD_READ_CYCLES      52  // CPU cycles of the digitalRead of a polled limit
+#endif
+
+#ifndef P_LOAD_GROUP_CYCLES
+#define P_LOAD_GROUP_CYCLES     8   // CPU cycles of loading one port group from the table
+#endif
+
+#ifndef P_LOAD_COMPARE_CYCLES
+#define P_LOAD_COMPARE_CYCLES   12  // CPU cycles of moving the compare on by an interval
+#endif
+
+#ifndef P_LOAD_PERIOD_CYCLES
+#define P_LOAD_PERIOD_CYCLES    10  // CPU cycles of stepping or checking the period count
+#endif
+
+#ifndef P_LOAD_MAX_PERMILLE
+// REDEFINE this to the CPU share the ISRs may take before pStartTimer
+// returns ERROR_LOAD.  Lower it when loop() has serial or network work that
+// must keep up, raise it when loop() does little and timers are refused
+#define P_LOAD_MAX_PERMILLE     750 // CPU share pStartTimer leaves to the ISRs with P_USE_LOAD_CHECK
+#endif
+
+#ifndef P_BAM_BITS
+// REDEFINE this for finer or coarser PMODE_BAM duties.  Each bit doubles
+// the frame and adds a slot and P_PORT_GROUPS bytes to both mask tables
+#define P_BAM_BITS              8   // duty resolution of PMODE_BAM, up to 16 bits
+#endif
+
+#ifndef P_BAM_ISR_CYCLES
+// REDEFINE this to the slot ISR time measured on your board, pStartTimer
+// refuses PMODE_BAM slots shorter than it.  Lower it to allow shorter
+// slots with few ports, raise it if slots overrun with many
+#define P_BAM_ISR_CYCLES        200 // CPU cycles for one PMODE_BAM slot change
+#endif
+
+#ifndef P_BATCH_MAX_RECORDS
+// REDEFINE this, up to 255, when one frame has to set more ptrains at once.
+// A receiver needs P_BATCH_FRAME_SIZE(P_BATCH_MAX_RECORDS) bytes to hold a
+// frame, 454 at 32, and pApplyBatch keeps interrupts off longer per record
+#define P_BATCH_MAX_RECORDS     32  // records one pApplyBatch frame can carry
+#endif
+
+#ifndef P_SYNC_STORE_CYCLES
+// REDEFINE this if your compiler doesn't start the prescale 1 timers of 
+// pStartTimers with one sts each, the preload of each makes up for the
+// stores after its own
+#define P_SYNC_STORE_CYCLES     2   // CPU cycles from one TCCRnB store to the next
+#endif
+
+#ifndef P_SYNC_RELEASE_CYCLES
+// REDEFINE this with P_SYNC_STORE_CYCLES, GTCCR is in the I/O space and
+// released with an out after the last TCCRnB store
+#define P_SYNC_RELEASE_CYCLES   1   // CPU cycles from the last TCCRnB store to the release
+#endif
+
 #define DEFAULT_PTRAIN_PRESCALE 8   // default prescale value for all Timers
+#define P_PRESCALE_AUTO         0   // let _pSetPulseUS pick the prescale
 
 #define SMALL_COUNT             4
+#define P_LIMIT_INTERRUPTS      6   // INT0 to INT5 on pins 2, 3, 21, 20, 19 and 18
 
+#define ERROR_CONFIG            241
+#define ERROR_FRAME             242
+#define ERROR_LOAD              243
+#define ERROR_PROGRAM           244
+#define ERROR_LIMIT             245
+#define ERROR_OUT_OF_RANGE      246
+#define ERROR_RAMP              247
+#define ERROR_SEGMENT           248
+#define ERROR_QUEUE_FULL        249
+#define ERROR_SCHEDULE          250
 #define PTRAIN_REMOVED          251
 #define ERROR_PTRAIN_REMOVED    252
 #define ERROR_TIMER_RUNNING     253
@@ -72,12 +261,45 @@ enum pulse_states { PPULSE_LO, PPULSE_HI, PDC_INIT, PDC_RUNNING, POFF};
 #define ERROR_PTRAIN_IDX        255
 #define P_LIMIT_HIT             255
 
+#define P_TRACE_CLEARED         0x80    // trace state flag, TCNTn was cleared at the edge
+#define P_TRACE_DC              0x40    // trace state flag, edge of a DC run
+#define P_TRACE_LEVEL           0x01    // trace state mask for the level written
+
+#define P_BATCH_MAGIC           0x50    // 'P', first byte of a batch frame
+#define P_BATCH_ACK_MAGIC       0x41    // 'A', first byte of its ack
+#define P_BATCH_VERSION         1
+#define P_BATCH_HEADER_SIZE     4       // magic, version, sequence, record count
+#define P_BATCH_RECORD_SIZE     14      // ptrain, flags, pulse, period, count
+#define P_BATCH_ACK_SIZE        6       // magic, sequence, status, record, CRC
+#define P_BATCH_NO_RECORD       0xFF    // ack record when no one record is at fault
+#define P_BATCH_PULSE           0x01    // record flag, set the pulse width
+#define P_BATCH_PERIOD          0x02    // record flag, set the period
+#define P_BATCH_COUNT           0x04    // record flag, set the number of periods
+#define P_BATCH_START           0x08    // record flag, start the timer of the ptrain
+#define P_BATCH_STOP            0x10    // record flag, stop the timer of the ptrain
+
+#define P_CONFIG_MAGIC          0x53    // 'S', second byte of a snapshot after 'P'
+#define P_CONFIG_VERSION        1
+#define P_CONFIG_HEADER_SIZE    6       // 'P', 'S', version, ptrains, first released, timers
+#define P_CONFIG_TIMER_SIZE     21
+#define P_CONFIG_PTRAIN_SIZE    27
+#define P_CONFIG_LIMIT_POLLED   0x01    // timer limit flag, use_limit
+#define P_CONFIG_LIMIT_INTERRUPT 0x02   // timer limit flag, use_limit_interrupt
+#define P_CONFIG_DETACHED       0xFF    // index of a ptrain on no timer
+#define P_CONFIG_PORTS          13      // Arduino port numbers 1 (A) to 12 (L)
+
 // MACROS
 ////////////////
 #ifndef CLOCKCYCLESPERMICROSECOND
 #define CLOCKCYCLESPERMICROSECOND ( F_CPU / 1000000L ) 
 #endif
 
+// bytes of a batch frame of _n records, the last 2 are its CRC
+#define P_BATCH_FRAME_SIZE(_n)  (P_BATCH_HEADER_SIZE + (_n) * P_BATCH_RECORD_SIZE + 2)
+// bytes of a configuration snapshot of _n ptrains, the last 2 are its CRC
+#define P_CONFIG_SIZE(_n)       (P_CONFIG_HEADER_SIZE + NUMBER_OF_16BIT_TIMERS * \
+                                    P_CONFIG_TIMER_SIZE + (_n) * P_CONFIG_PTRAIN_SIZE + 2)
+
 #ifndef US_TO_COUNTS
 // converts microseconds to tick (assumes prescale of 8) 
 #define US_TO_COUNTS(_us,_scale)        (( CLOCKCYCLESPERMICROSECOND* _us) / _scale)
@@ -85,34 +307,268 @@ enum pulse_states { PPULSE_LO, PPULSE_HI, PDC_INIT, PDC_RUNNING, POFF};
 #define COUNTS_TO_US(_counts,_scale)    (( (unsigned)_counts * _scale)/ CLOCKCYCLESPERMICROSECOND )
 #endif
 
+#ifndef P_PORT_SET
+// sets and clears the bits of an output port, REDEFINE to hook the edge writes
+#define P_PORT_SET(_port,_mask)         (*(_port) |= (_mask))
+#define P_PORT_CLR(_port,_mask)         (*(_port) &= ~(_mask))
+#endif
+
+#ifndef P_PORT_WRITE
+// writes the bits of an output port under mask in one go, REDEFINE with P_PORT_SET
+#define P_PORT_WRITE(_port,_mask,_bits) (*(_port) = (*(_port) & ~(_mask)) | (_bits))
+#endif
+
+#ifndef P_SIM_COST
+// ISR work besides the pin writes, REDEFINE to charge it to a simulated clock
+#define P_SIM_COST(_cycles)
+#endif
+
 // Custom Structs
 /////////////////
+// Fields are laid out widest first so hosts don't pad them, the AVR never
+// does.  Check what they all add up to with p_ram_footprint
 typedef struct {
-    uint8_t         pin;            // a pin number from 0 to 63
-    uint8_t         timer_index;    // 0 to PTRAINS_PER_TIMER - 1, 
-                                    // this is the index into a timer16control_t
-                                        
-    timers16bit_t   timer_number;   // Timer this pin is assigned to 
-    uint16_t        pulse_counts;   // number of counts for pulse duration
-    uint16_t        period_counts;  // number of counts for pulse off
-    uint16_t        period_num_limit;   // number of periods allowed
+    volatile uint8_t *port;         // output register of the pin, NULL if none
+    uint32_t        pulse_counts;   // number of counts for pulse duration
+    uint32_t        period_counts;  // number of counts for pulse off
+    uint32_t        period_num_limit;   // number of periods allowed
     uint16_t        prescale;
+    timers16bit_t   timer_number : 8;   // Timer this pin is assigned to, a byte not an int,
+                                        // NUMBER_OF_16BIT_TIMERS while released
+    uint8_t         timer_index;    // 0 to PTRAINS_PER_TIMER - 1, this is the index 
+                                    // into ptrain_idxs of its timer16control_t, or
+                                    // the next free ptrain while released
+    uint8_t         pin;            // a pin number from 0 to 63
+    uint8_t         pin_mask;       // bit of the pin in that output register
+    bool            auto_prescale;  // pick the prescale on every pSetPulseUS
+#ifdef P_USE_HARDWARE_PWM
+    uint8_t         oc_channel;     // 1 to 3 for an OCnA to OCnC pin of its timer, else 0
+#endif
+#ifdef P_USE_SCHEDULER
+    // copies taken by pStartTimer so the ISR of a PMODE_SCHEDULE timer
+    // never reads values the main loop is changing
+    uint32_t        next_edge;      // scheduler time of the next edge
+    uint16_t        schedule_pulse;
+    uint16_t        schedule_period;
+    uint32_t        schedule_limit;
+    uint32_t        periods_done;   // periods output so far
+    uint8_t         schedule_state; // pulse_states value of this ptrain
+#endif
+#ifdef P_USE_BAM
+    uint16_t        bam_duty;       // slots on out of (1 << P_BAM_BITS) - 1
+#endif
+#ifdef P_USE_DDA
+    uint32_t        dda_steps;      // steps of this axis in a PMODE_DDA move
+    uint32_t        dda_error;      // Bresenham accumulator, steps when it passes the move length
+    uint8_t         dda_group;      // port group of the pin on its timer
+#endif
 } ptrain_t;
 
+typedef struct {
+    volatile uint8_t *port;         // output register PORTx
+    uint8_t         mask;           // the bits of PORTx driven by the timer
+} pportgroup_t;
+
 typedef struct {
     uint8_t     ptrain_idxs[PTRAINS_PER_TIMER];   // a ptrain index from 0 to NUMBER_OF_PTRAINS - 1
+    pportgroup_t port_groups[P_PORT_GROUPS];      // attached pins grouped by port
+    uint8_t     number_of_port_groups;           // number of port groups in use
     uint8_t     limit_pin;
-    bool        use_limit;
+    bool        use_limit;                      // the ISR reads limit_pin every period
     uint8_t     limit_state;
+    uint8_t     limit_cause;                    // a limit_causes value
+#ifdef P_USE_LIMIT_INTERRUPTS
+    bool        use_limit_interrupt;            // the interrupt of limit_pin stops the timer
+#endif
     uint8_t     number_of_ptrains;               // number of ptrains attached in use
-    uint16_t    number_of_periods;              // number of periods output currently
-    uint16_t    period_num_limit;               // number of periods allowed
-    uint16_t    pulse_counts;                   // number of counts for pulse duration
-    uint16_t    period_counts;                  // number of counts for pulse off
+    uint32_t    number_of_periods;              // number of periods output currently
+    uint32_t    period_num_limit;               // number of periods allowed
+    uint32_t    pulse_counts;                   // number of counts for pulse duration
+    uint32_t    period_counts;                  // number of counts for pulse off
+    uint16_t    compare_wraps;                  // compare matches to let pass before the next edge
     uint8_t     bit_prescale;                   // the bitwise prescale
     uint8_t     pulsed_state;                   // keeps track if we are in the pulse or dwell
+    uint8_t     timer_mode;                     // a timer_modes value
+    // shadow copies written by pReloadToTimer while the timer runs, the ISR
+    // makes them live together at the start of the next period
+    uint32_t    next_period_num_limit;
+    uint32_t    next_pulse_counts;
+    uint32_t    next_period_counts;
+    uint8_t     next_bit_prescale;
+    bool        update_pending;                 // shadow copies not yet live
+    uint32_t    update_period;                  // periods output when the last update went live
+    uint8_t     progress_seq;                   // moved by every ISR that changes the progress
+#ifdef P_USE_POSITION
+    int32_t     position;                       // steps forward less steps back
+    volatile uint8_t *direction_port;           // output register of the direction pin, NULL if none
+    uint8_t     direction_mask;                 // bit of the pin in that output register
+    uint8_t     direction_forward;              // direction_mask if HIGH is forward, else 0
+#endif
+#ifdef P_USE_HARDWARE_PWM
+    bool        hardware;                       // the last start left the pins to the OCnx units
+#endif
+#ifdef P_USE_SCHEDULER
+    uint8_t     schedule[PTRAINS_PER_TIMER];    // min-heap of ptrains by next_edge
+    uint8_t     schedule_size;                  // ptrains still running
+#endif
 } timer16control_t;
 
+// one consistent reading of a running timer, see pGetProgress
+typedef struct {
+    uint32_t    periods;        // number_of_periods
+    uint32_t    limit;          // period_num_limit
+#ifdef P_USE_POSITION
+    int32_t     position;
+#endif
+    uint8_t     state;          // a pulse_states value
+    bool        active;         // the timer is running
+    bool        limit_hit;      // the limit pin stopped the last run
+} pprogress_t;
+
+#ifdef P_USE_TRACE
+typedef struct {
+    uint8_t     timer;          // timers16bit_t that made the edge
+    uint8_t     state;          // level written plus the P_TRACE_ flags
+    uint16_t    count;          // TCNTn on entry to the ISR, or at the clear if cleared
+    uint16_t    period;         // low 16 bits of number_of_periods after the edge
+} ptrace_t;
+#endif
+
+#ifdef P_USE_LIMIT_INTERRUPTS
+typedef struct {
+    volatile uint8_t *port;     // input register PINx of the limit pin
+    uint8_t     mask;           // bit of the pin in that input register
+    uint8_t     timers;         // _BV(timer) of every timer this pin limits
+    uint8_t     debounce_us;    // the trip has to last this long
+} plimitinput_t;
+#endif
+
+#ifdef P_USE_EVENTS
+typedef struct {
+    uint8_t     type;           // an event_types value
+    uint8_t     timer;          // timers16bit_t it happened on
+    uint32_t    data;           // segments done for PEVENT_SEGMENT, else periods output
+} pevent_t;
+
+typedef void (*peventhandler_t)(const pevent_t *event);
+#endif
+
+#ifdef P_USE_SEGMENTS
+typedef struct {
+    uint16_t    pulse_counts;
+    uint16_t    period_counts;
+    uint32_t    period_num_limit;
+} psegment_t;
+
+typedef struct {
+    psegment_t  segments[P_SEGMENT_QUEUE_SIZE];
+    uint8_t     head;           // moved by the main loop only
+    uint8_t     tail;           // moved by the ISR only
+    bool        end;            // no more segments will be queued
+    uint16_t    segments_done;  // segments started in this run
+    uint16_t    underruns;      // runs stopped because the queue ran dry
+} psegmentqueue_t;
+
+static_assert(P_IS_RING_SIZE(P_SEGMENT_QUEUE_SIZE),
+                "P_SEGMENT_QUEUE_SIZE must be a power of 2 no larger than 128");
+#endif
+
+#ifdef P_USE_BAM
+typedef struct {
+    // the bits of each port group to output in each slot, the ISR reads
+    // masks[live] while pCommitBAM fills the other one
+    uint8_t     masks[2][P_BAM_BITS][P_PORT_GROUPS];
+    uint8_t     live;           // buffer the ISR outputs
+    bool        pending;        // the other buffer goes live at the next frame
+    uint8_t     bit;            // slot the next compare starts
+} pbam_t;
+#endif
+
+#ifdef P_USE_PROGRAM
+typedef struct {
+    const uint8_t *code;        // checked by pLoadProgram
+    uint16_t    length;
+    bool        progmem;        // code is in flash
+    uint16_t    pc;             // byte of the next instruction
+    uint8_t     op;             // POP_PERIODS or POP_UNTIL while outputting periods, else POP_END
+    uint32_t    remaining;      // periods of a POP_PERIODS still to output
+    volatile uint8_t *input;    // input register PINx of the pin a POP_WAIT or POP_UNTIL reads
+    uint8_t     input_mask;     // bit of the pin in that input register
+    uint8_t     input_level;    // input_mask for HIGH, else 0
+    uint8_t     depth;          // POP_LOOPs entered
+    uint16_t    loop_start[P_PROGRAM_LOOP_DEPTH];   // byte after each POP_LOOP
+    uint16_t    loop_count[P_PROGRAM_LOOP_DEPTH];   // passes left of each
+    uint8_t     masks[P_PORT_GROUPS];   // POP_PINS bits of each port group of the timer
+} pprogram_t;
+#endif
+
+#ifdef P_USE_RAMP
+typedef struct {
+    uint32_t    period;         // Q16.16 counts of the last step
+    uint32_t    accel_unit;     // acceleration factor per unit of profile weight
+    uint64_t    speed_sq;       // exact 1/p^2 of the last step
+    uint64_t    speed_sq_step;  // what the acceleration of that step added to speed_sq
+    uint64_t    speed_sq_jerk;  // change of speed_sq_step per step, PRAMP_SCURVE only
+    uint64_t    table_speed_sq;         // speed_sq and speed_sq_step at the
+    uint64_t    table_speed_sq_step;    // last step of the table
+    uint32_t    step;           // index of the next step
+    uint16_t    period_carry;   // fraction of a count left over from the last steps
+    uint16_t    accel_steps;    // steps from rest to cruise
+    uint32_t    decel_start;    // first step of the deceleration
+    uint32_t    total_steps;
+    uint16_t    half_steps;     // PRAMP_SCURVE acceleration peaks here, else 0
+    int8_t      shift;          // binary exponent of accel_unit
+    int8_t      newton_shift;   // binary exponent of speed_sq
+    bool        active;
+    uint16_t    cruise_period;  // fastest step in counts, for pAnalyzeLoad
+    uint16_t    table[P_RAMP_TABLE_SIZE];   // exact periods of the first steps
+} pramp_t;
+#endif
+
+// what pAnalyzeLoad expects of a timer
+typedef struct {
+    uint32_t    isr_per_second;     // interrupts, counting compare rollovers
+    uint32_t    isr_cycles;         // CPU cycles of the longest one
+    uint32_t    min_interval;       // CPU cycles between the two closest ones
+    uint16_t    load_permille;      // CPU share taken, 1000 is all of it
+    bool        feasible;           // every ISR ends before the next is due
+} ptimerload_t;
+
+typedef struct {
+    ptimerload_t timers[NUMBER_OF_16BIT_TIMERS];
+    uint16_t    load_permille;      // all the timers analyzed together
+    bool        feasible;           // each one feasible and under P_LOAD_MAX_PERMILLE
+} pload_t;
+
+#ifdef P_USE_BATCH
+typedef struct {
+    uint8_t     ptrain;
+    uint8_t     flags;              // P_BATCH_PULSE ... P_BATCH_STOP
+    uint32_t    pulse;              // microseconds
+    uint32_t    period;             // microseconds
+    uint32_t    count;              // periods, as period_num_limit
+} pbatchrecord_t;
+#endif
+
+#ifdef P_USE_CONFIG
+typedef struct {
+    const uint8_t *source;      // snapshot read from, NULL for the EEPROM
+    uint8_t     *dest;          // snapshot written to, NULL for the EEPROM
+    uint16_t    address;        // next byte of the snapshot or the EEPROM
+    uint16_t    crc;            // pCRC16 of the bytes so far
+} pconfigio_t;
+#endif
+
+#ifdef P_USE_TIMER_STATS
+typedef struct {
+    uint32_t    isr_count;                      // compare interrupts handled
+    uint16_t    latency[P_LATENCY_BUCKETS];     // counts past OCRnA on ISR entry
+    uint16_t    max_latency;                    // most counts past OCRnA on entry
+    uint16_t    max_isr_counts;                 // longest ISR in timer counts
+    uint16_t    missed_compares;                // next compare already passed on exit
+} ptimerstats_t;
+#endif
+
 // Function prototypes
 ///////////////////////
 uint8_t pSetupTimers();
@@ -120,25 +576,72 @@ uint8_t pNewPTrain();
 uint8_t pAttach(uint8_t ptrain_index, int pin, timers16bit_t timer);
 
 uint8_t pSetPulseUS(uint8_t ptrain_index, uint32_t period, 
-                        uint32_t pulse_width, uint16_t period_num_limit);
+                        uint32_t pulse_width, uint32_t period_num_limit);
 uint8_t _pSetPulseUS(uint8_t ptrain_index, uint32_t period, 
-                        uint32_t pulse_width,  uint16_t period_num_limit, 
+                        uint32_t pulse_width,  uint32_t period_num_limit, 
+                        uint16_t prescale);
+uint8_t pSetPulseMS(uint8_t ptrain_index, uint32_t period, 
+                    uint32_t pulse_width, uint32_t period_num_limit);
+uint8_t _pSetPulseMS(uint8_t ptrain_index, uint32_t period, 
+                        uint32_t pulse_width,  uint32_t period_num_limit, 
                         uint16_t prescale);
 uint8_t pSetPulseOnlyUS(uint8_t ptrain_index, uint32_t pulse_width);
 uint8_t pSetPeriodOnlyUS(uint8_t ptrain_index, uint32_t period);
-uint8_t pSetPeriodNumberOnly(uint8_t ptrain_index, uint16_t period_num_limit);
-uint16_t pGetPulseCounts(uint8_t ptrain_index);
-uint16_t pGetPeriodCounts(uint8_t ptrain_index);
-uint16_t pGetPeriodNumber(uint8_t ptrain_index);
+uint8_t pSetPeriodNumberOnly(uint8_t ptrain_index, uint32_t period_num_limit);
+uint32_t pGetPulseCounts(uint8_t ptrain_index);
+uint32_t pGetPeriodCounts(uint8_t ptrain_index);
+uint32_t pGetPeriodNumber(uint8_t ptrain_index);
 
-uint8_t pSetTimerPrescale(timers16bit_t timer, uint8_t prescale);
+uint8_t pSetTimerPrescale(timers16bit_t timer, uint16_t prescale);
+uint8_t pSetTimerMode(timers16bit_t timer, uint8_t mode);
 uint8_t pAddToTimer(timers16bit_t timer, uint8_t ptrain_idx);
 uint8_t pReloadToTimer(uint8_t ptrain_idx);
+bool pIsUpdatePending(timers16bit_t timer);
+uint32_t pGetUpdatePeriod(timers16bit_t timer);
+uint8_t pGetProgress(timers16bit_t timer, pprogress_t *progress);
+#ifdef P_USE_POSITION
+uint8_t pAttachDirectionTimer(timers16bit_t timer, int direction_pin, uint8_t forward_state);
+uint8_t pSetPosition(timers16bit_t timer, int32_t position);
+#endif
 uint8_t pRemoveFromTimer(timers16bit_t timer, uint8_t ptrain_index);
+uint8_t pReleasePTrain(uint8_t ptrain_index);
 uint8_t pStop(uint8_t ptrain_index);
 uint8_t pStartTimer(timers16bit_t timer);
+uint8_t pStartTimers(uint8_t timer_mask, const uint16_t *offsets);
+uint8_t pAnalyzeLoad(uint8_t timer_mask, pload_t *load);
 uint8_t pStopTimer(timers16bit_t timer);
 void pClearTimerOfPTrains(timers16bit_t timer);
+#ifdef P_USE_HARDWARE_PWM
+bool pIsTimerHardware(timers16bit_t timer);
+#endif
+#ifdef P_USE_BAM
+uint8_t pSetBAMDuty(uint8_t ptrain_idx, uint16_t duty);
+uint8_t pCommitBAM(timers16bit_t timer);
+#endif
+#ifdef P_USE_DDA
+uint8_t pSetDDASteps(uint8_t ptrain_idx, uint32_t steps);
+#endif
+#ifdef P_USE_PROGRAM
+uint8_t pLoadProgram(timers16bit_t timer, const uint8_t *code, uint16_t length, bool progmem);
+uint16_t pGetProgramCounter(timers16bit_t timer);
+#endif
+uint16_t pCRC16(uint16_t crc, const uint8_t *data, uint16_t length);
+#ifdef P_USE_BATCH
+uint16_t pBatchFrameSize(const uint8_t *header);
+uint16_t pPackBatch(uint8_t *frame, uint8_t seq, const pbatchrecord_t *records, uint8_t n);
+uint8_t pApplyBatch(const uint8_t *frame, uint16_t length, uint8_t *ack);
+#endif
+#ifdef P_USE_CONFIG
+uint16_t pSaveConfig(uint8_t *blob, uint16_t max_size);
+uint8_t pRestoreConfig(const uint8_t *blob, uint16_t size);
+uint16_t pSaveConfigEEPROM(uint16_t address);
+uint8_t pRestoreConfigEEPROM(uint16_t address);
+#endif
+#ifdef P_USE_EVENTS
+uint8_t pEventRead(pevent_t *events, uint8_t max_events);
+uint8_t pDispatchEvents(peventhandler_t handler);
+uint16_t pEventsDropped();
+#endif
 
 // Global Data Structure Allocation
 ///////////////////////////////////
@@ -146,7 +649,292 @@ static ptrain_t ptrains[NUMBER_OF_PTRAINS];// static array of ptrain structures
 
 // array of timer control data structures
 static volatile timer16control_t timer_array[NUMBER_OF_16BIT_TIMERS]; 
-uint8_t ptrain_count = 0;                // the total number of attached ptrains
+uint8_t ptrain_count = 0;                // ptrains ever handed out by pNewPTrain
+static uint8_t p_free_ptrains = ERROR_PTRAIN_IDX;   // first released ptrain, linked by timer_index
+static bool p_sync_start = false;       // pStartTimers holds the prescaler
+
+#ifdef P_USE_TRACE
+// edge trace ring, the ISRs only move the head and the main loop the tail
+static volatile ptrace_t p_trace[P_TRACE_SIZE];
+static volatile uint8_t p_trace_head = 0;
+static volatile uint8_t p_trace_tail = 0;
+static volatile uint16_t p_trace_dropped = 0;   // records lost to a full ring
+static_assert(P_IS_RING_SIZE(P_TRACE_SIZE), "P_TRACE_SIZE must be a power of 2 no larger than 128");
+
+static inline void pTraceEdge(timers16bit_t timer, uint8_t state, 
+                                uint16_t count, uint16_t period)
+{
+    uint8_t head = p_trace_head;
+    if ((uint8_t)(head - p_trace_tail) >= P_TRACE_SIZE) {
+        p_trace_dropped++;
+        return;
+    }
+    volatile ptrace_t *record = &p_trace[head & (P_TRACE_SIZE - 1)];
+    record->timer = timer;
+    record->state = state;
+    record->count = count;
+    record->period = period;
+    p_trace_head = head + 1;                // publish the record
+}
+#define P_TRACE_EDGE(_timer,_state,_count,_period)  pTraceEdge(_timer,_state,_count,_period)
+// a cleared edge records the counts up to the clear, which the counter 
+// made after the ISR was entered as well
+#define P_TRACE_CLEAR(_count,_TCNTn)                ((_count) = *(_TCNTn))
+#else
+#define P_TRACE_EDGE(_timer,_state,_count,_period)
+#define P_TRACE_CLEAR(_count,_TCNTn)
+#endif
+
+#ifdef P_USE_EVENTS
+// event ring, the ISRs only move the head and the main loop the tail
+static volatile pevent_t p_events[P_EVENT_QUEUE_SIZE];
+static volatile uint8_t p_event_head = 0;
+static volatile uint8_t p_event_tail = 0;
+static volatile uint16_t p_events_dropped = 0;  // events lost to a full ring
+static_assert(P_IS_RING_SIZE(P_EVENT_QUEUE_SIZE),
+                "P_EVENT_QUEUE_SIZE must be a power of 2 no larger than 128");
+
+static inline void pPostEvent(timers16bit_t timer, uint8_t type, uint32_t data)
+{
+    uint8_t head = p_event_head;
+    if ((uint8_t)(head - p_event_tail) >= P_EVENT_QUEUE_SIZE) {
+        p_events_dropped++;
+        return;
+    }
+    volatile pevent_t *event = &p_events[head & (P_EVENT_QUEUE_SIZE - 1)];
+    event->type = type;
+    event->timer = timer;
+    event->data = data;
+    p_event_head = head + 1;                // publish the event
+}
+#define P_POST_EVENT(_timer,_type,_data)    pPostEvent(_timer,_type,_data)
+#else
+#define P_POST_EVENT(_timer,_type,_data)    ((void)(_type))
+#endif
+
+static inline void pFinishTimer(timers16bit_t timer, uint8_t type)
+{
+    // every run the ISRs end goes through here, type is the event_types
+    // value that says why.  The compare, overflow, capture and limit
+    // ISRs all stop a timer here, so a pGetProgress copy it broke into
+    // is taken again
+    timer_array[timer].progress_seq += 1;
+    pStopTimer(timer);
+    P_POST_EVENT(timer, type, timer_array[timer].number_of_periods);
+}
+
+
+#ifdef P_USE_POSITION
+static inline void pStepPosition(volatile timer16control_t *timer_control)
+{
+    // count a step the way the direction pin is driven, this reads the
+    // output register so it sees the level the sketch wrote
+    volatile uint8_t *port = timer_control->direction_port;
+    if (port != NULL) {
+        if ((*port & timer_control->direction_mask) == timer_control->direction_forward) {
+            timer_control->position += 1;
+        }
+        else {
+            timer_control->position -= 1;
+        }
+    }
+}
+#define P_STEP_POSITION(_timer_control)     pStepPosition(_timer_control)
+#else
+#define P_STEP_POSITION(_timer_control)
+#endif
+
+#ifdef P_USE_TIMER_STATS
+static volatile ptimerstats_t p_timer_stats[NUMBER_OF_16BIT_TIMERS];
+#endif
+
+#ifdef P_USE_RAMP
+static volatile pramp_t p_ramps[NUMBER_OF_16BIT_TIMERS];
+
+static inline uint32_t pMulHigh32(uint32_t a, uint32_t b)
+{
+    // (a * b) >> 32 from three 16x16 bit products, dropping the low product
+    // makes it at most 1 too small.  Far cheaper on the AVR than 64 bits
+    uint16_t a_hi = a >> 16;
+    uint16_t a_lo = a;
+    uint16_t b_hi = b >> 16;
+    uint16_t b_lo = b;
+    uint32_t cross_a = (uint32_t)a_hi * b_lo;
+    uint32_t cross_b = (uint32_t)a_lo * b_hi;
+    uint32_t carry = ((cross_a & 0xFFFF) + (cross_b & 0xFFFF)) >> 16;
+    return (uint32_t)a_hi * b_hi + (cross_a >> 16) + (cross_b >> 16) + carry;
+}
+
+static inline uint32_t pRampFactor(volatile pramp_t *ramp, uint32_t period, uint16_t n)
+{
+    // q = m * p^2 in Q0.32 for the acceleration of step n, where m is the
+    // acceleration in steps/count^2 and p the period in counts
+    uint32_t accel = ramp->accel_unit;
+    if (ramp->half_steps != 0) {
+        // PRAMP_SCURVE weights the acceleration by a triangle over the ramp
+        accel *= (n < ramp->half_steps) ? (n + 1) : (ramp->accel_steps - n);
+    }
+    uint32_t q = pMulHigh32(pMulHigh32(accel, period), period);
+    return (ramp->shift >= 0) ? (q << ramp->shift) : (q >> -ramp->shift);
+}
+
+static inline uint32_t pRampNewton(volatile pramp_t *ramp, uint32_t period)
+{
+    // one Newton step of period towards 1/sqrt(speed_sq), each step squares
+    // the relative error so the error of the series never builds up
+    uint32_t speed_sq = ramp->speed_sq >> 32;
+    uint32_t normal = period;
+    int8_t shift = ramp->newton_shift;
+    while (!(normal & 0x80000000UL)) {
+        normal <<= 1;
+        shift -= 2;
+    }
+    // x = speed_sq * period^2 in Q2.30, 1.0 when period is right
+    uint32_t x = pMulHigh32(pMulHigh32(speed_sq, normal), normal);
+    x = (shift >= 0) ? (x << shift) : (x >> -shift);
+    uint32_t next = pMulHigh32(period, (3UL << 29) - (x >> 1));
+    return (next >= 0x40000000UL) ? 0xFFFFFFFFUL : (next << 2);
+}
+
+static inline void pNextRampPeriod(volatile timer16control_t *timer_control, 
+                                    volatile pramp_t *ramp)
+{
+    // work out the period of the next step from the last one.  Each step 
+    // adds 2*a to 1/p^2, so with q = a*p^2 the period goes to p/sqrt(1 + 2q)
+    // speeding up and p/sqrt(1 - 2q) slowing down.  The series 
+    // p*(1 -+ q + 1.5*q^2) gets close and a Newton step against the exactly 
+    // kept 1/p^2 does the rest.  Only multiplies and no divides
+    uint32_t n = ramp->step;
+    uint32_t period = ramp->period;
+    uint16_t half_steps = ramp->half_steps;
+    uint16_t r;                             // the step of the acceleration to use
+    bool speeding_up;
+    if (n < ramp->accel_steps) {
+        r = n;
+        speeding_up = true;
+    }
+    else if (n >= ramp->decel_start) {
+        r = ramp->total_steps - 1 - n;      // the mirror step of the acceleration
+        speeding_up = false;
+    }
+    else {
+        r = ramp->accel_steps;              // cruising
+        speeding_up = false;
+    }
+    if (r < P_RAMP_TABLE_SIZE) {
+        period = (uint32_t)ramp->table[r] << 16;
+    }
+    else if (speeding_up) {
+        // add the acceleration of step r
+        if (r < half_steps) {
+            ramp->speed_sq_step += ramp->speed_sq_jerk;
+        }
+        else if ((r > half_steps) || (ramp->accel_steps & 1)) {
+            ramp->speed_sq_step -= ramp->speed_sq_jerk;
+        }
+        ramp->speed_sq += ramp->speed_sq_step;
+        uint32_t q = pRampFactor(ramp, period, r);
+        uint32_t pq = pMulHigh32(period, q);
+        period = pRampNewton(ramp, period - pq + pMulHigh32(pq, q + (q >> 1)));
+    }
+    else if (r + 1 < ramp->accel_steps) {
+        // take off the acceleration of step r + 1, the first step down 
+        // keeps the cruise period
+        ramp->speed_sq -= ramp->speed_sq_step;
+        if (r + 1 < half_steps) {
+            ramp->speed_sq_step -= ramp->speed_sq_jerk;
+        }
+        else if ((r + 1 > half_steps) || (ramp->accel_steps & 1)) {
+            ramp->speed_sq_step += ramp->speed_sq_jerk;
+        }
+        uint32_t q = pRampFactor(ramp, period, r + 1);
+        uint32_t pq = pMulHigh32(period, q);
+        period = pRampNewton(ramp, period + pq + pMulHigh32(pq, q + (q >> 1)));
+    }
+    ramp->period = period;
+    ramp->step = n + 1;
+    // carry the fraction on so the whole ramp keeps exact time
+    uint32_t counts = (period >> 16) + 
+                        (((uint32_t)(uint16_t)period + ramp->period_carry) >> 16);
+    ramp->period_carry += (uint16_t)period;
+    timer_control->period_counts = (counts > 0xFFFF) ? 0xFFFF : counts;
+}
+#endif
+
+#ifdef P_USE_SEGMENTS
+static volatile psegmentqueue_t p_segments[NUMBER_OF_16BIT_TIMERS];
+
+static inline bool pNextSegment(timers16bit_t timer)
+{
+    // make the next queued segment live from the next period on, false
+    // when there is none
+    volatile psegmentqueue_t *queue = &p_segments[timer];
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    uint8_t tail = queue->tail;
+    if (tail == queue->head) {
+        if ((queue->segments_done > 0) && !queue->end) {
+            queue->underruns++;
+        }
+        return false;
+    }
+    volatile psegment_t *segment = &queue->segments[tail & (P_SEGMENT_QUEUE_SIZE - 1)];
+    timer_control->pulse_counts = segment->pulse_counts;
+    timer_control->period_counts = segment->period_counts;
+    timer_control->period_num_limit = segment->period_num_limit;
+    timer_control->number_of_periods = 0;
+    queue->segments_done++;
+    queue->tail = tail + 1;                 // hand the slot back
+    return true;
+}
+#endif
+
+#ifdef P_USE_BAM
+static volatile pbam_t p_bams[NUMBER_OF_16BIT_TIMERS];
+#endif
+
+#ifdef P_USE_PROGRAM
+static volatile pprogram_t p_programs[NUMBER_OF_16BIT_TIMERS];
+
+// Writes a waveform program as the initializer of a uint8_t array, e.g.
+//  const uint8_t blink[] PROGMEM = { P_PROGRAM_PULSE_US(100, 1000, 8), 
+//                                    P_PROGRAM_PERIODS(50), P_PROGRAM_END() };
+#define P_PROGRAM_U16(_v)           (uint8_t)(_v), (uint8_t)((_v) >> 8)
+#define P_PROGRAM_U32(_v)           (uint8_t)(_v), (uint8_t)((_v) >> 8), \
+                                    (uint8_t)((_v) >> 16), (uint8_t)((_v) >> 24)
+#define P_PROGRAM_END()             POP_END
+#define P_PROGRAM_PULSE(_pulse,_period) \
+                                    POP_PULSE, P_PROGRAM_U32(_pulse), P_PROGRAM_U32(_period)
+#define P_PROGRAM_PULSE_US(_pulse,_period,_scale) \
+                                    P_PROGRAM_PULSE(US_TO_COUNTS(_pulse, _scale), \
+                                                    US_TO_COUNTS(_period, _scale))
+#define P_PROGRAM_PERIODS(_n)       POP_PERIODS, P_PROGRAM_U32(_n)
+#define P_PROGRAM_DELAY(_counts)    POP_DELAY, P_PROGRAM_U32(_counts)
+#define P_PROGRAM_DELAY_US(_us,_scale)  P_PROGRAM_DELAY(US_TO_COUNTS(_us, _scale))
+#define P_PROGRAM_WAIT(_pin,_level) POP_WAIT, (_pin), (_level)
+#define P_PROGRAM_UNTIL(_pin,_level)    POP_UNTIL, (_pin), (_level)
+#define P_PROGRAM_LOOP(_n)          POP_LOOP, P_PROGRAM_U16(_n)
+#define P_PROGRAM_NEXT()            POP_NEXT
+#define P_PROGRAM_JUMP(_address)    POP_JUMP, P_PROGRAM_U16(_address)
+#define P_PROGRAM_PINS(_mask)       POP_PINS, P_PROGRAM_U32(_mask)
+
+// bytes taken by each program_ops instruction
+static const uint8_t p_program_sizes[NUMBER_OF_POPS] = { 1, 9, 5, 5, 3, 3, 3, 1, 3, 5 };
+
+static inline uint8_t pProgramRead(const uint8_t *code, bool progmem, uint16_t pc)
+{
+    return progmem ? pgm_read_byte(code + pc) : code[pc];
+}
+
+static inline uint32_t pProgramFetch(volatile pprogram_t *program, uint8_t bytes)
+{
+    // the next little endian argument of the running instruction
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < bytes; i++) {
+        value |= (uint32_t)pProgramRead(program->code, program->progmem, program->pc++) << (8 * i);
+    }
+    return value;
+}
+#endif
 
 // Interrupt Functions
 ////////////////////////
@@ -197,429 +985,3467 @@ static void pEnableISR(timers16bit_t timer)
     }
 }
 
+static boolean pIsTimerActive(timers16bit_t timer);
+
+// prescale values by the CSn2:0 bits
+static const uint16_t p_prescales[6] = { 0, 1, 8, 64, 256, 1024 };
+
+static inline uint16_t pGetTimerPrescale(timers16bit_t timer) {
+    uint8_t bit_prescale = timer_array[timer].bit_prescale;
+    return (bit_prescale < 6) ? p_prescales[bit_prescale] : 0;
+}
+
 bool pIsAtLimit(timers16bit_t timer) {
     volatile timer16control_t *timer_control = &timer_array[timer];
     return (digitalRead(timer_control->limit_pin) == timer_control->limit_state);
 }
 
 bool pIsLimitUsed(timers16bit_t timer) {
+#ifdef P_USE_LIMIT_INTERRUPTS
+    if (timer_array[timer].use_limit_interrupt) {
+        return true;
+    }
+#endif
     return timer_array[timer].use_limit;
 }
 
-static inline void pHandleInterrupts(   timers16bit_t timer, 
-                                        volatile uint16_t *TCNTn, 
-                                        volatile uint16_t* OCRnA)
+static inline void pWriteTimerPins(volatile timer16control_t *timer_control, 
+                                    uint8_t value)
 {
-    uint8_t out_pin;
-    ptrain_t *out_ptrain;
-    volatile timer16control_t *timer_control = &timer_array[timer];
-    uint8_t num_ptrains = timer_control->number_of_ptrains;
-    volatile uint8_t *ptrain_idxs = timer_control->ptrain_idxs;
-    switch (timer_control->pulsed_state) {
-        case PPULSE_LO:
-            *TCNTn = 0x0000;                        // clear timer
-            for (int i = 0; i < num_ptrains; i++)
-            {
-                out_pin = ptrains[ptrain_idxs[i]].pin;
-                digitalWrite( out_pin, HIGH);
-            }
-            timer_control->pulsed_state = PPULSE_HI;   // set status to pulsed
-            timer_control->number_of_periods += 1;  // increment pulse count
-            *OCRnA = timer_control->pulse_counts;
-            break;
-        case PPULSE_HI:
-            for (int i = 0; i < num_ptrains; i++)
-            {
-                out_ptrain = &ptrains[ptrain_idxs[i]];
-                out_pin = out_ptrain->pin;
-                digitalWrite( out_pin, LOW);
-            }
-            timer_control->pulsed_state = PPULSE_LO;
-            if (timer_control->number_of_periods >= timer_control->period_num_limit) {
-                pStopTimer(timer);
-            }
-            *OCRnA = timer_control->period_counts;
-            if (timer_control->use_limit) {
-                if (digitalRead(timer_control->limit_pin) == timer_control->limit_state) {
-                    timer_control->limit_state = P_LIMIT_HIT; // limit hit
-                    timer_control->use_limit = false;  // must explicity attach the limit each time
-                    pStopTimer(timer);
-                    //break;
-                }
-            }
-            break;
-        default:
-        case PDC_INIT:
-            *TCNTn = 0x0000;                          // clear timer
-            for (int i = 0; i < num_ptrains; i++)
-            {
-                out_pin = ptrains[ptrain_idxs[i]].pin;
-                digitalWrite( out_pin, HIGH);
-            }
-            timer_control->pulsed_state = PDC_RUNNING;
-            *OCRnA = timer_control->pulse_counts;
-            break;
-        case PDC_RUNNING:
-            *TCNTn = 0x0000;                        // clear timer
-            timer_control->number_of_periods += 1;  // increment pulse count
-            if (timer_control->number_of_periods >= timer_control->period_num_limit) {
-                for (int i = 0; i < num_ptrains; i++)
-                {
-                     out_ptrain = &ptrains[ptrain_idxs[i]];
-                     out_pin = out_ptrain->pin;
-                     digitalWrite( out_pin, LOW);
-                }
-                pStopTimer(timer);
-                pClearTimerOfPTrains(timer);
-            }
-    } // end switch
+    // drive every pin on a timer with one read-modify-write per port 
+    // so all the edges land together no matter how many pins are attached
+    uint8_t num_groups = timer_control->number_of_port_groups;
+    volatile pportgroup_t *groups = timer_control->port_groups;
+    if (value == HIGH) {
+        for (uint8_t i = 0; i < num_groups; i++) {
+            P_SIM_COST(P_SIM_GROUP_CYCLES);
+            P_PORT_SET(groups[i].port, groups[i].mask);
+        }
+    }
+    else {
+        for (uint8_t i = 0; i < num_groups; i++) {
+            P_SIM_COST(P_SIM_GROUP_CYCLES);
+            P_PORT_CLR(groups[i].port, groups[i].mask);
+        }
+    }
 }
 
-// Interrupt handlers for Arduino
-/////////////////////////////////
-#ifdef P_USE_TIMER1
-ISR (TIMER1_COMPA_vect) 
-{ 
-    pHandleInterrupts(PTIMER1, &TCNT1, &OCR1A); 
-}
+static void pTripLimit(timers16bit_t timer, uint8_t cause)
+{
+    // latch the trip and stop a running timer with its pins LOW, even
+    // in the middle of a pulse
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    timer_control->progress_seq += 1;       // limit_hit changes even when stopped
+    timer_control->limit_state = P_LIMIT_HIT; // limit hit
+    timer_control->use_limit = false;  // must explicity attach the limit each time
+#ifdef P_USE_LIMIT_INTERRUPTS
+    timer_control->use_limit_interrupt = false;
 #endif
+    timer_control->limit_cause = cause;
+    if (pIsTimerActive(timer)) {
+        pFinishTimer(timer, PEVENT_LIMIT);
+        pWriteTimerPins(timer_control, LOW);
+    }
+}
 
-#ifdef P_USE_TIMER3
-ISR (TIMER3_COMPA_vect) 
+#ifdef P_USE_LIMIT_INTERRUPTS
+static volatile plimitinput_t p_limit_inputs[P_LIMIT_INTERRUPTS];
+
+static void pHandleLimitInterrupt(uint8_t interrupt)
+{
+    // a limit pin changed, stop every running timer it is now tripped for.
+    // A level that doesn't last debounce_us is a glitch and ignored
+    volatile plimitinput_t *input = &p_limit_inputs[interrupt];
+    uint8_t level = (*input->port & input->mask) ? HIGH : LOW;
+    for (uint8_t us = 0; us < input->debounce_us; us++) {
+        delayMicroseconds(1);
+        if (((*input->port & input->mask) ? HIGH : LOW) != level) {
+            return;
+        }
+    }
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        volatile timer16control_t *timer_control = &timer_array[timer];
+        if ((input->timers & _BV(timer)) && timer_control->use_limit_interrupt &&
+                (timer_control->limit_state == level) && 
+                pIsTimerActive((timers16bit_t)timer)) {
+            pTripLimit((timers16bit_t)timer, PLIMIT_INTERRUPT);
+        }
+    }
+}
+
+// attachInterrupt handlers take no arguments
+static void pLimitInterrupt0(void) { pHandleLimitInterrupt(0); }
+static void pLimitInterrupt1(void) { pHandleLimitInterrupt(1); }
+static void pLimitInterrupt2(void) { pHandleLimitInterrupt(2); }
+static void pLimitInterrupt3(void) { pHandleLimitInterrupt(3); }
+static void pLimitInterrupt4(void) { pHandleLimitInterrupt(4); }
+static void pLimitInterrupt5(void) { pHandleLimitInterrupt(5); }
+
+static void (* const p_limit_handlers[P_LIMIT_INTERRUPTS])(void) = {
+    pLimitInterrupt0, pLimitInterrupt1, pLimitInterrupt2,
+    pLimitInterrupt3, pLimitInterrupt4, pLimitInterrupt5 };
+#endif
+
+static inline bool pIsCompareMissed(   timers16bit_t timer, bool free_running,
+                                        uint16_t count, uint16_t next_compare)
+{
+    // true when the counter is already at or past the next compare so
+    // that edge only comes after the counter wraps
+    return pIsTimerActive(timer) && (timer_array[timer].compare_wraps == 0) &&
+            (free_running ? ((int16_t)(next_compare - count) <= 0) : 
+                            (count >= next_compare));
+}
+
+#ifdef P_USE_TIMER_STATS
+static inline void pRecordTimerStats(   timers16bit_t timer, uint16_t latency,
+                                        uint16_t start_count, bool free_running,
+                                        volatile uint16_t *TCNTn, 
+                                        volatile uint16_t *OCRnA)
+{
+    // update the health counters of a timer at the end of its ISR
+    volatile ptimerstats_t *stats = &p_timer_stats[timer];
+    uint16_t exit_count = *TCNTn;
+    uint16_t isr_counts = exit_count - start_count;
+    uint8_t bucket = 0;
+    stats->isr_count++;
+    if (latency > stats->max_latency) {
+        stats->max_latency = latency;
+    }
+    while ((latency != 0) && (bucket < P_LATENCY_BUCKETS - 1)) {
+        latency >>= 1;                      // log2 buckets
+        bucket++;
+    }
+    if (stats->latency[bucket] != 0xFFFF) {
+        stats->latency[bucket]++;
+    }
+    if (isr_counts > stats->max_isr_counts) {
+        stats->max_isr_counts = isr_counts;
+    }
+    if (pIsCompareMissed(timer, free_running, exit_count, *OCRnA)) {
+        if (stats->missed_compares != 0xFFFF) {
+            stats->missed_compares++;
+        }
+    }
+}
+#endif
+
+static inline void pCommitUpdate(volatile timer16control_t *timer_control)
+{
+    // make the shadow copies from pReloadToTimer live in one go
+    timer_control->pulse_counts = timer_control->next_pulse_counts;
+    timer_control->period_counts = timer_control->next_period_counts;
+    timer_control->period_num_limit = timer_control->next_period_num_limit;
+    timer_control->bit_prescale = timer_control->next_bit_prescale;
+    timer_control->update_period = timer_control->number_of_periods;
+    timer_control->update_pending = false;
+}
+
+static inline void pWriteTimerPrescale(timers16bit_t timer, uint8_t bit_prescale)
+{
+    // change the clock of a running timer
+    switch (timer) {
+        case PTIMER1:
+            TCCR1B = (TCCR1B & 0xF8) | bit_prescale;
+            break;
+        case PTIMER3:
+            TCCR3B = (TCCR3B & 0xF8) | bit_prescale;
+            break;
+        case PTIMER4:
+            TCCR4B = (TCCR4B & 0xF8) | bit_prescale;
+            break;
+        case PTIMER5:
+            TCCR5B = (TCCR5B & 0xF8) | bit_prescale;
+            break;
+        default:
+            break;
+    }
+}
+
+static inline void pApplyUpdate(timers16bit_t timer, 
+                                volatile timer16control_t *timer_control)
+{
+    // called at a period boundary when an update is pending
+    uint8_t bit_prescale = timer_control->bit_prescale;
+    pCommitUpdate(timer_control);
+    if (timer_control->bit_prescale != bit_prescale) {
+        pWriteTimerPrescale(timer, timer_control->bit_prescale);
+    }
+}
+
+static inline void pMoveCompare(   volatile timer16control_t *timer_control, 
+                                    volatile uint16_t *OCRnA, uint16_t base, 
+                                    uint32_t interval)
+{
+    // aim the compare interval counts past base.  An interval longer than
+    // the counter lets the compare match (interval - 1) >> 16 times first
+    P_SIM_COST(P_SIM_COMPARE_CYCLES);
+    *OCRnA = base + (uint16_t)interval;
+    timer_control->compare_wraps = (interval == 0) ? 0 : (uint16_t)((interval - 1) >> 16);
+}
+
+#ifdef P_USE_SCHEDULER
+static inline bool pScheduleBefore(uint8_t ptrain_a, uint8_t ptrain_b)
+{
+    // true when ptrain_a has its next edge before ptrain_b, the scheduler
+    // time wraps so compare the difference
+    return (int32_t)(ptrains[ptrain_a].next_edge - ptrains[ptrain_b].next_edge) < 0;
+}
+
+static void pScheduleSiftDown(volatile timer16control_t *timer_control)
+{
+    // restore the heap after the ptrain at the top moved to a later edge
+    volatile uint8_t *heap = timer_control->schedule;
+    uint8_t size = timer_control->schedule_size;
+    uint8_t top = heap[0];
+    uint8_t pos = 0;
+    while (true) {
+        uint8_t child = 2 * pos + 1;
+        if (child >= size) {
+            break;
+        }
+        if ((child + 1 < size) && pScheduleBefore(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!pScheduleBefore(heap[child], top)) {
+            break;
+        }
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = top;
+}
+
+static inline void pHandleSchedule(    timers16bit_t timer, 
+                                        volatile uint16_t *TCNTn, 
+                                        volatile uint16_t *OCRnA)
+{
+    // output every edge due at this compare in one write per port, then 
+    // aim OCRnA at the earliest edge still pending.  Edges that became due
+    // while we were busy are handled straight away rather than after the 
+    // counter wraps, edges further off than the counter take compare_wraps
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile uint8_t *heap = timer_control->schedule;
+    volatile uint8_t *ports[P_PORT_GROUPS];
+    uint8_t set_masks[P_PORT_GROUPS];
+    uint8_t clear_masks[P_PORT_GROUPS];
+    bool due;
+    do {
+        uint32_t now = ptrains[heap[0]].next_edge;
+        uint8_t num_ports = 0;
+        while ((timer_control->schedule_size > 0) && 
+                (ptrains[heap[0]].next_edge == now)) {
+            ptrain_t *ptrain = &ptrains[heap[0]];
+            uint8_t mask = ptrain->pin_mask;
+            uint8_t i;
+            for (i = 0; i < num_ports; i++) {
+                if (ports[i] == ptrain->port) {
+                    break;
+                }
+            }
+            if ((i == num_ports) && (ptrain->port != NULL)) {
+                ports[i] = ptrain->port;
+                set_masks[i] = 0;
+                clear_masks[i] = 0;
+                num_ports++;
+            }
+            if (ptrain->port == NULL) {
+                mask = 0;
+                i = 0;
+            }
+            if (ptrain->schedule_state == PPULSE_LO) {
+                if (num_ports != 0) {
+                    set_masks[i] |= mask;
+                    clear_masks[i] &= ~mask;
+                }
+                if (ptrain->schedule_period == 0) {
+                    // DC, one pulse of pulse counts for every period
+                    ptrain->periods_done = ptrain->schedule_limit;
+                    ptrain->schedule_state = PDC_RUNNING;
+                    ptrain->next_edge = now + 
+                            (uint32_t)ptrain->schedule_pulse * ptrain->schedule_limit;
+                }
+                else {
+                    ptrain->periods_done++;
+                    ptrain->schedule_state = PPULSE_HI;
+                    ptrain->next_edge = now + ptrain->schedule_pulse;
+                }
+            }
+            else {
+                if (num_ports != 0) {
+                    clear_masks[i] |= mask;
+                    set_masks[i] &= ~mask;
+                }
+                if (ptrain->periods_done >= ptrain->schedule_limit) {
+                    // this ptrain is done, drop it from the heap
+                    ptrain->schedule_state = POFF;
+                    timer_control->schedule_size--;
+                    heap[0] = heap[timer_control->schedule_size];
+                }
+                else {
+                    ptrain->schedule_state = PPULSE_LO;
+                    ptrain->next_edge = now + 
+                            (ptrain->schedule_period - ptrain->schedule_pulse);
+                }
+            }
+            pScheduleSiftDown(timer_control);
+        }
+        for (uint8_t i = 0; i < num_ports; i++) {
+            if (set_masks[i]) {
+                P_PORT_SET(ports[i], set_masks[i]);
+            }
+            if (clear_masks[i]) {
+                P_PORT_CLR(ports[i], clear_masks[i]);
+            }
+        }
+        if (timer_control->schedule_size == 0) {
+            pFinishTimer(timer, PEVENT_DONE);
+            return;
+        }
+        // the counter is a little past now, the first match is first counts
+        // on from now (a whole wrap for 0).  When the counter is already
+        // past that the edge is due, or it uses up one of the wraps
+        uint32_t gap = ptrains[heap[0]].next_edge - now;
+        uint16_t first = (uint16_t)gap;
+        pMoveCompare(timer_control, OCRnA, (uint16_t)now, gap);
+        due = (first != 0) && ((uint16_t)(*TCNTn - (uint16_t)now) >= first);
+        if (due && (timer_control->compare_wraps != 0)) {
+            timer_control->compare_wraps -= 1;
+            due = false;
+        }
+    } while (due);
+}
+#endif
+
+#ifdef P_USE_BAM
+static inline void pHandleBAM( timers16bit_t timer, volatile uint16_t *OCRnA)
+{
+    // start the next slot of a PMODE_BAM frame.  Slot n lasts pulse_counts
+    // << n and has the pins whose duty has bit n set HIGH, so each slot 
+    // costs one write per port whatever the number of ptrains.  Frames are
+    // counted as periods and a new duty table only goes live between frames
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile pbam_t *bam = &p_bams[timer];
+    uint8_t bit = bam->bit;
+    if (bit == 0) {
+        if (timer_control->use_limit &&
+                (digitalRead(timer_control->limit_pin) == timer_control->limit_state)) {
+            pTripLimit(timer, PLIMIT_POLLED);
+            return;
+        }
+        if (timer_control->number_of_periods >= timer_control->period_num_limit) {
+            pWriteTimerPins(timer_control, LOW);
+            pFinishTimer(timer, PEVENT_DONE);
+            return;
+        }
+        if (bam->pending) {
+            bam->live ^= 1;
+            bam->pending = false;
+        }
+        timer_control->number_of_periods += 1;
+    }
+    volatile uint8_t *bits = bam->masks[bam->live][bit];
+    volatile pportgroup_t *groups = timer_control->port_groups;
+    uint8_t num_groups = timer_control->number_of_port_groups;
+    for (uint8_t i = 0; i < num_groups; i++) {
+        P_SIM_COST(P_SIM_GROUP_CYCLES);
+        P_PORT_WRITE(groups[i].port, groups[i].mask, bits[i]);
+    }
+    pMoveCompare(timer_control, OCRnA, *OCRnA, timer_control->pulse_counts << bit);
+    bam->bit = (bit == P_BAM_BITS - 1) ? 0 : (bit + 1);
+}
+#endif
+
+#ifdef P_USE_PROGRAM
+static void pSetProgramPins(timers16bit_t timer, uint32_t ptrain_mask)
+{
+    // POP_PINS, the port group bits of the chosen attached ptrains
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile pprogram_t *program = &p_programs[timer];
+    uint8_t num_groups = timer_control->number_of_port_groups;
+    for (uint8_t j = 0; j < num_groups; j++) {
+        program->masks[j] = 0;
+    }
+    for (uint8_t i = 0; i < timer_control->number_of_ptrains; i++) {
+        if (!(ptrain_mask & ((uint32_t)1 << i))) {
+            continue;
+        }
+        ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+        for (uint8_t j = 0; j < num_groups; j++) {
+            if (timer_control->port_groups[j].port == ptrain->port) {
+                program->masks[j] |= ptrain->pin_mask;
+                break;
+            }
+        }
+    }
+}
+
+static inline void pSetProgramInput(volatile pprogram_t *program)
+{
+    // the pin and level arguments of POP_WAIT and POP_UNTIL, looked up 
+    // once so each check is one register read
+    uint8_t pin = pProgramFetch(program, 1);
+    uint8_t level = pProgramFetch(program, 1);
+    program->input = portInputRegister(digitalPinToPort(pin));
+    program->input_mask = digitalPinToBitMask(pin);
+    program->input_level = (level == LOW) ? 0 : program->input_mask;
+}
+
+static inline bool pIsProgramInputSet(volatile pprogram_t *program)
+{
+    return (*program->input & program->input_mask) == program->input_level;
+}
+
+static inline void pHandleProgram(timers16bit_t timer, volatile uint16_t *OCRnA)
+{
+    // step a PMODE_PROGRAM timer.  The end of a pulse only lowers the pins,
+    // at the end of a period the untimed instructions run until one says
+    // what the next interval is.  The compare moves on from where the last
+    // edge was due, so instructions take no time out of the waveform
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile pprogram_t *program = &p_programs[timer];
+    volatile pportgroup_t *groups = timer_control->port_groups;
+    uint8_t num_groups = timer_control->number_of_port_groups;
+    if (timer_control->pulsed_state == PPULSE_HI) {
+        for (uint8_t i = 0; i < num_groups; i++) {
+            P_SIM_COST(P_SIM_GROUP_CYCLES);
+            if (program->masks[i]) {
+                P_PORT_CLR(groups[i].port, program->masks[i]);
+            }
+        }
+        timer_control->pulsed_state = PPULSE_LO;
+        pMoveCompare(timer_control, OCRnA, *OCRnA, 
+                        timer_control->period_counts - timer_control->pulse_counts);
+        if (timer_control->use_limit &&
+                (digitalRead(timer_control->limit_pin) == timer_control->limit_state)) {
+            pTripLimit(timer, PLIMIT_POLLED);
+        }
+        return;
+    }
+    for (uint8_t ops = 0; ; ops++) {
+        if (program->op == POP_UNTIL) {
+            if (pIsProgramInputSet(program)) {
+                program->op = POP_END;
+                continue;
+            }
+        }
+        else if (program->op == POP_PERIODS) {
+            if (program->remaining == 0) {
+                program->op = POP_END;
+                continue;
+            }
+            program->remaining -= 1;
+        }
+        if (program->op != POP_END) {
+            // one period of the current pulse
+            for (uint8_t i = 0; i < num_groups; i++) {
+                P_SIM_COST(P_SIM_GROUP_CYCLES);
+                if (program->masks[i]) {
+                    P_PORT_SET(groups[i].port, program->masks[i]);
+                }
+            }
+            timer_control->pulsed_state = PPULSE_HI;
+            timer_control->number_of_periods += 1;
+            P_STEP_POSITION(timer_control);
+            pMoveCompare(timer_control, OCRnA, *OCRnA, timer_control->pulse_counts);
+            return;
+        }
+        if (ops >= P_PROGRAM_OPS_PER_ISR) {
+            // a loop with nothing timed in it, give the main loop a period
+            pMoveCompare(timer_control, OCRnA, *OCRnA, timer_control->period_counts);
+            return;
+        }
+        uint8_t op = pProgramFetch(program, 1);
+        switch (op) {
+            case POP_PULSE:
+                timer_control->pulse_counts = pProgramFetch(program, 4);
+                timer_control->period_counts = pProgramFetch(program, 4);
+                break;
+            case POP_PERIODS:
+                program->remaining = pProgramFetch(program, 4);
+                program->op = POP_PERIODS;
+                break;
+            case POP_DELAY:
+                pMoveCompare(timer_control, OCRnA, *OCRnA, pProgramFetch(program, 4));
+                return;
+            case POP_WAIT:
+                pSetProgramInput(program);
+                if (!pIsProgramInputSet(program)) {
+                    program->pc -= 3;       // look again a period from now
+                    pMoveCompare(timer_control, OCRnA, *OCRnA, timer_control->period_counts);
+                    return;
+                }
+                break;
+            case POP_UNTIL:
+                pSetProgramInput(program);
+                program->op = POP_UNTIL;
+                break;
+            case POP_LOOP:
+                if (program->depth == P_PROGRAM_LOOP_DEPTH) {
+                    pFinishTimer(timer, PEVENT_DONE);   // jumped out of loops once too often
+                    return;
+                }
+                program->loop_count[program->depth] = pProgramFetch(program, 2);
+                program->loop_start[program->depth] = program->pc;
+                program->depth += 1;
+                break;
+            case POP_NEXT: {
+                if (program->depth == 0) {
+                    break;                  // jumped into a loop, run the body once
+                }
+                uint8_t top = program->depth - 1;
+                if (program->loop_count[top] > 1) {
+                    program->loop_count[top] -= 1;
+                    program->pc = program->loop_start[top];
+                }
+                else {
+                    program->depth = top;
+                }
+                break;
+            }
+            case POP_JUMP:
+                program->pc = pProgramFetch(program, 2);
+                break;
+            case POP_PINS:
+                pSetProgramPins(timer, pProgramFetch(program, 4));
+                break;
+            case POP_END:
+            default:
+                pFinishTimer(timer, PEVENT_DONE);
+                return;
+        }
+    }
+}
+#endif
+
+#ifdef P_USE_DDA
+static inline void pStepDDA(volatile timer16control_t *timer_control)
+{
+    // the rising edge of a PMODE_DDA period: every axis adds its steps to
+    // its accumulator and steps when that passes the length of the move,
+    // which is period_num_limit.  The axes that step are raised together
+    uint8_t set_masks[P_PORT_GROUPS];
+    uint8_t num_groups = timer_control->number_of_port_groups;
+    uint32_t length = timer_control->period_num_limit;
+    for (uint8_t i = 0; i < num_groups; i++) {
+        set_masks[i] = 0;
+    }
+    for (uint8_t i = 0; i < timer_control->number_of_ptrains; i++) {
+        ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+        ptrain->dda_error += ptrain->dda_steps;
+        if (ptrain->dda_error >= length) {
+            ptrain->dda_error -= length;
+            set_masks[ptrain->dda_group] |= ptrain->pin_mask;
+        }
+    }
+    for (uint8_t i = 0; i < num_groups; i++) {
+        P_SIM_COST(P_SIM_GROUP_CYCLES);
+        if (set_masks[i]) {
+            P_PORT_SET(timer_control->port_groups[i].port, set_masks[i]);
+        }
+    }
+}
+#endif
+
+static inline void pHandleInterrupts(   timers16bit_t timer, 
+                                        volatile uint16_t *TCNTn, 
+                                        volatile uint16_t* OCRnA)
+{
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    if (timer_control->compare_wraps != 0) {
+        timer_control->compare_wraps -= 1;  // a long interval rolling over
+        return;
+    }
+    timer_control->progress_seq += 1;       // pGetProgress reads again
+#if defined(P_USE_TRACE) || defined(P_USE_TIMER_STATS)
+    uint16_t trace_count = *TCNTn;          // counter before any clear
+#endif
+    // free running timers never clear the counter, they move the compare
+    // on from where the last edge was due instead
+    bool free_running = (timer_control->timer_mode != PMODE_CLEAR);
+#ifdef P_USE_TRACE
+    uint8_t cleared = free_running ? 0 : P_TRACE_CLEARED;
+#endif
+#ifdef P_USE_TIMER_STATS
+    uint16_t stats_latency = trace_count - *OCRnA;
+    // every state but PPULSE_HI clears the counter straight away
+    uint16_t stats_start = (free_running || (timer_control->pulsed_state == PPULSE_HI)) ? 
+                                trace_count : 0;
+#endif
+#ifdef P_USE_SCHEDULER
+    if (timer_control->timer_mode == PMODE_SCHEDULE) {
+        pHandleSchedule(timer, TCNTn, OCRnA);
+    }
+    else
+#endif
+#ifdef P_USE_BAM
+    if (timer_control->timer_mode == PMODE_BAM) {
+        pHandleBAM(timer, OCRnA);
+    }
+    else
+#endif
+#ifdef P_USE_PROGRAM
+    if (timer_control->timer_mode == PMODE_PROGRAM) {
+        pHandleProgram(timer, OCRnA);
+    }
+    else
+#endif
+    switch (timer_control->pulsed_state) {
+        case PPULSE_LO:
+            // a DC update has to wait for a restart
+            if (timer_control->update_pending && (timer_control->next_period_counts != 0)) {
+                pApplyUpdate(timer, timer_control);
+            }
+            if (!free_running) {
+                // aim the compare before the clear, at prescale 1 the counter
+                // would pass the stale one first and raise a false match
+                pMoveCompare(timer_control, OCRnA, 0, timer_control->pulse_counts);
+                P_TRACE_CLEAR(trace_count, TCNTn);
+                *TCNTn = 0x0000;                    // clear timer
+            }
+#ifdef P_USE_DDA
+            if (timer_control->timer_mode == PMODE_DDA) {
+                pStepDDA(timer_control);
+            }
+            else
+#endif
+            pWriteTimerPins(timer_control, HIGH);
+            timer_control->pulsed_state = PPULSE_HI;   // set status to pulsed
+            timer_control->number_of_periods += 1;  // increment pulse count
+            P_SIM_COST(P_SIM_PERIOD_CYCLES);
+            P_STEP_POSITION(timer_control);
+            P_TRACE_EDGE(timer, HIGH | cleared, trace_count, 
+                            timer_control->number_of_periods);
+            if (free_running) {
+                pMoveCompare(timer_control, OCRnA, *OCRnA, timer_control->pulse_counts);
+            }
+            break;
+        case PPULSE_HI:
+            pWriteTimerPins(timer_control, LOW);
+            P_TRACE_EDGE(timer, LOW, trace_count, timer_control->number_of_periods);
+            timer_control->pulsed_state = PPULSE_LO;
+            // in PMODE_CLEAR the compare holds pulse_counts, so this is
+            // period_counts from the clear
+            pMoveCompare(timer_control, OCRnA, *OCRnA, 
+                            timer_control->period_counts - timer_control->pulse_counts);
+            P_SIM_COST(P_SIM_PERIOD_CYCLES);
+            if (timer_control->number_of_periods >= timer_control->period_num_limit) {
+#ifdef P_USE_SEGMENTS
+                if (pNextSegment(timer)) {
+                    P_POST_EVENT(timer, PEVENT_SEGMENT, p_segments[timer].segments_done);
+                }
+                else {
+                    volatile psegmentqueue_t *queue = &p_segments[timer];
+                    pFinishTimer(timer, ((queue->segments_done > 0) && !queue->end) ? 
+                                            PEVENT_UNDERRUN : PEVENT_DONE);
+                }
+#else
+                pFinishTimer(timer, PEVENT_DONE);
+#endif
+            }
+#ifdef P_USE_RAMP
+            else if (p_ramps[timer].active) {
+                pNextRampPeriod(timer_control, &p_ramps[timer]);
+            }
+#endif
+            if (timer_control->use_limit) {
+                if (digitalRead(timer_control->limit_pin) == timer_control->limit_state) {
+                    pTripLimit(timer, PLIMIT_POLLED);
+                    //break;
+                }
+            }
+            break;
+        default:
+        case PDC_INIT:
+            if (!free_running) {
+                // aim the compare before the clear as in PPULSE_LO
+                pMoveCompare(timer_control, OCRnA, 0, timer_control->pulse_counts);
+                P_TRACE_CLEAR(trace_count, TCNTn);
+                *TCNTn = 0x0000;                      // clear timer
+            }
+            pWriteTimerPins(timer_control, HIGH);
+            P_TRACE_EDGE(timer, HIGH | cleared | P_TRACE_DC, trace_count, 
+                            timer_control->number_of_periods);
+            timer_control->pulsed_state = PDC_RUNNING;
+            if (free_running) {
+                pMoveCompare(timer_control, OCRnA, *OCRnA, timer_control->pulse_counts);
+            }
+            break;
+        case PDC_RUNNING:
+            // a pulsed update has to wait for a restart
+            if (timer_control->update_pending && (timer_control->next_period_counts == 0)) {
+                pApplyUpdate(timer, timer_control);
+            }
+            if (!free_running) {
+                // aim the compare before the clear as in PPULSE_LO
+                pMoveCompare(timer_control, OCRnA, 0, timer_control->pulse_counts);
+                P_TRACE_CLEAR(trace_count, TCNTn);
+                *TCNTn = 0x0000;                    // clear timer
+            }
+            else {
+                pMoveCompare(timer_control, OCRnA, *OCRnA, timer_control->pulse_counts);
+            }
+            timer_control->number_of_periods += 1;  // increment pulse count
+            P_SIM_COST(2 * P_SIM_PERIOD_CYCLES);    // and its check
+            if (timer_control->number_of_periods >= timer_control->period_num_limit) {
+                pWriteTimerPins(timer_control, LOW);
+                P_TRACE_EDGE(timer, LOW | cleared | P_TRACE_DC, trace_count, 
+                                timer_control->number_of_periods);
+                pFinishTimer(timer, PEVENT_DONE);
+                pClearTimerOfPTrains(timer);
+            }
+    } // end switch
+#ifdef P_USE_TIMER_STATS
+    pRecordTimerStats(timer, stats_latency, stats_start, free_running, TCNTn, OCRnA);
+#endif
+#ifdef P_USE_EVENTS
+    if (pIsCompareMissed(timer, free_running, *TCNTn, *OCRnA)) {
+        P_POST_EVENT(timer, PEVENT_OVERRUN, timer_control->number_of_periods);
+    }
+#endif
+}
+
+#ifdef P_USE_HARDWARE_PWM
+// the OCnA, OCnB and OCnC pins of each timer on the Mega
+static const uint8_t p_oc_pins[NUMBER_OF_16BIT_TIMERS][3] = {
+    { 11, 12, 13 }, { 5, 2, 3 }, { 6, 7, 8 }, { 46, 45, 44 } };
+
+// Writes the mode 14 start sequence for timer n, see pEnableHardware
+#define P_HARDWARE_START(n)                                                 \
+    TCCR##n##B = 0x00;                  /* stop the timer */                \
+    TCCR##n##A = 0x00;                  /* normal mode to force outputs */  \
+    OCR##n##A = ocr[0];                                                     \
+    OCR##n##B = ocr[1];                                                     \
+    OCR##n##C = ocr[2];                                                     \
+    ICR##n = timer_control->period_counts - 1;                              \
+    TCCR##n##A = com | (com >> 1);      /* set on match */                  \
+    TCCR##n##C = force;                 /* first pulse starts now */        \
+    TCCR##n##A = com | (last ? 0 : _BV(WGM##n##1));                         \
+    TCNT##n = 0x0000;                                                       \
+    TIFR##n |= _BV(TOV##n) | _BV(ICF##n);                                   \
+    TIMSK##n = last ? _BV(ICIE##n) : _BV(TOIE##n);                          \
+    TCCR##n##B = _BV(WGM##n##3) | _BV(WGM##n##2) | timer_control->bit_prescale;
+
+// Switches timer n from mode 14 to CTC mode 12 for its last period
+#define P_HARDWARE_LAST(n)                                                  \
+    TCCR##n##A &= ~_BV(WGM##n##1);      /* no more sets at BOTTOM */        \
+    TIFR##n |= _BV(ICF##n);                                                 \
+    TIMSK##n = _BV(ICIE##n);            /* stop at TOP */
+
+static void pEnableHardware(timers16bit_t timer)
+{
+    // let the OCnx units make the pulses of every attached ptrain:
+    // 1. stop the timer and load each pulse into the OCRnx of its pin
+    // 2. force the pins HIGH to start the first period
+    // 3. fast PWM mode 14 with ICRn as TOP sets them at BOTTOM and clears
+    //    them pulse_counts later
+    // 4. the overflow interrupt counts periods, only the last period
+    //    runs in CTC mode 12 and the capture interrupt stops it at TOP
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    uint16_t ocr[3] = { 0, 0, 0 };
+    uint8_t com = 0;                    // COMnx1 of every channel in use
+    uint8_t force = 0;                  // FOCnx of every channel in use
+    for (uint8_t i = 0; i < timer_control->number_of_ptrains; i++) {
+        ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+        uint8_t channel = ptrain->oc_channel - 1;
+        ocr[channel] = ptrain->pulse_counts - 1;
+        com |= _BV(7 - 2 * channel);
+        force |= _BV(7 - channel);
+    }
+    timer_control->number_of_periods = 1;
+    P_STEP_POSITION(timer_control);
+    bool last = (timer_control->period_num_limit <= 1);
+    switch (timer) {
+        case PTIMER1:
+            P_HARDWARE_START(1)
+            break;
+        case PTIMER3:
+            P_HARDWARE_START(3)
+            break;
+        case PTIMER4:
+            P_HARDWARE_START(4)
+            break;
+        case PTIMER5:
+            P_HARDWARE_START(5)
+            break;
+        default:
+            break;
+    }
+}
+
+static inline void pHandleOverflow(timers16bit_t timer)
+{
+    // a new period has just started on the pins, make it the last one
+    // when the limit is reached
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    timer_control->progress_seq += 1;
+    timer_control->number_of_periods += 1;
+    P_STEP_POSITION(timer_control);
+    bool last = (timer_control->number_of_periods >= timer_control->period_num_limit);
+    if (timer_control->use_limit) {
+        if (digitalRead(timer_control->limit_pin) == timer_control->limit_state) {
+            timer_control->limit_state = P_LIMIT_HIT; // limit hit
+            timer_control->use_limit = false;  // must explicity attach the limit each time
+            timer_control->limit_cause = PLIMIT_POLLED;
+            last = true;                    // this period still comes out whole
+        }
+    }
+    if (last) {
+        switch (timer) {
+            case PTIMER1:
+                P_HARDWARE_LAST(1)
+                break;
+            case PTIMER3:
+                P_HARDWARE_LAST(3)
+                break;
+            case PTIMER4:
+                P_HARDWARE_LAST(4)
+                break;
+            case PTIMER5:
+                P_HARDWARE_LAST(5)
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static inline void pHandleCapture(timers16bit_t timer)
+{
+    // the last period is out, it came early if the limit pin cut the run
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    pFinishTimer(timer, (timer_control->number_of_periods < timer_control->period_num_limit) ?
+                            PEVENT_LIMIT : PEVENT_DONE);
+}
+#endif
+
+// Interrupt handlers for Arduino
+/////////////////////////////////
+#ifdef P_USE_TIMER1
+ISR (TIMER1_COMPA_vect) 
 { 
-    pHandleInterrupts(PTIMER3, &TCNT3, &OCR3A); 
+    pHandleInterrupts(PTIMER1, &TCNT1, &OCR1A); 
+}
+#endif
+
+#if defined(P_USE_TIMER1) && defined(P_USE_HARDWARE_PWM)
+ISR (TIMER1_OVF_vect)
+{
+    pHandleOverflow(PTIMER1);
+}
+
+ISR (TIMER1_CAPT_vect)
+{
+    pHandleCapture(PTIMER1);            // TOP of the last period
+}
+#endif
+
+#ifdef P_USE_TIMER3
+ISR (TIMER3_COMPA_vect) 
+{ 
+    pHandleInterrupts(PTIMER3, &TCNT3, &OCR3A); 
+}
+#endif
+
+#if defined(P_USE_TIMER3) && defined(P_USE_HARDWARE_PWM)
+ISR (TIMER3_OVF_vect)
+{
+    pHandleOverflow(PTIMER3);
+}
+
+ISR (TIMER3_CAPT_vect)
+{
+    pHandleCapture(PTIMER3);            // TOP of the last period
+}
+#endif
+
+#ifdef P_USE_TIMER4
+ISR (TIMER4_COMPA_vect) 
+{
+    pHandleInterrupts(PTIMER4, &TCNT4, &OCR4A); 
+}
+#endif
+
+#if defined(P_USE_TIMER4) && defined(P_USE_HARDWARE_PWM)
+ISR (TIMER4_OVF_vect)
+{
+    pHandleOverflow(PTIMER4);
+}
+
+ISR (TIMER4_CAPT_vect)
+{
+    pHandleCapture(PTIMER4);            // TOP of the last period
+}
+#endif
+
+#ifdef P_USE_TIMER5
+ISR (TIMER5_COMPA_vect) 
+{
+    pHandleInterrupts(PTIMER5, &TCNT5, &OCR5A); 
+}
+#endif
+
+#if defined(P_USE_TIMER5) && defined(P_USE_HARDWARE_PWM)
+ISR (TIMER5_OVF_vect)
+{
+    pHandleOverflow(PTIMER5);
+}
+
+ISR (TIMER5_CAPT_vect)
+{
+    pHandleCapture(PTIMER5);            // TOP of the last period
+}
+#endif
+
+static boolean pIsTimerActive(timers16bit_t timer)
+{
+    // returns true if this timer is on
+    // mask out the top five bits to get a that prescaler registers
+    // in the lower 3 bits.  When those are all zero, the timer is off
+    switch (timer){
+        case PTIMER1:
+            return ((TCCR1B & 0x07) == 0x00) ? false : true;
+        case PTIMER3:
+            return ((TCCR3B & 0x07) == 0x00) ? false : true;
+        case PTIMER4:
+            return ((TCCR4B & 0x07) == 0x00) ? false : true;
+        case PTIMER5:
+            return ((TCCR5B & 0x07) == 0x00) ? false : true;
+        default:
+            return false;
+    }
+}
+
+// Control Functions
+////////////////////
+
+uint8_t pNewPTrain(void) {
+    // returns the ptrain_index, the last one released if there is one
+    uint8_t temp = ptrain_count;
+    if (p_free_ptrains != ERROR_PTRAIN_IDX) {
+        temp = p_free_ptrains;
+        p_free_ptrains = ptrains[temp].timer_index;
+        memset(&ptrains[temp], 0, sizeof(ptrain_t));
+        ptrains[temp].prescale = DEFAULT_PTRAIN_PRESCALE;
+        return temp;
+    }
+    if( ptrain_count < NUMBER_OF_PTRAINS) {
+        ptrains[ptrain_count].prescale = DEFAULT_PTRAIN_PRESCALE;
+        ptrains[ptrain_count].auto_prescale = false;
+        ptrain_count++;
+        return temp;
+    }
+    else {
+        return ERROR_PTRAIN_IDX ;  // too many PTRAINS 
+    }
+}
+
+boolean pIsValidPTrain(uint8_t test) {
+    return ((test < ptrain_count) && 
+            (ptrains[test].timer_number != NUMBER_OF_16BIT_TIMERS)) ? true: false;
+}
+
+static bool pIsAttached(uint8_t ptrain_idx) {
+    // the ptrain is in the ptrain_idxs of its timer at its timer_index, it
+    // drops out when pRemoveFromTimer takes it or a DC run clears the timer
+    ptrain_t *ptrain = &ptrains[ptrain_idx];
+    if (ptrain->timer_number >= NUMBER_OF_16BIT_TIMERS) {
+        return false;
+    }
+    volatile timer16control_t *timer_control = &timer_array[ptrain->timer_number];
+    return (ptrain->timer_index < timer_control->number_of_ptrains) &&
+            (timer_control->ptrain_idxs[ptrain->timer_index] == ptrain_idx);
+}
+
+uint8_t pReleasePTrain(uint8_t ptrain_idx) {
+    // Detach a ptrain from its timer and hand it back for pNewPTrain to
+    // reuse.  ERROR_TIMER_RUNNING when its timer can't lose a pin now, see
+    // pRemoveFromTimer
+    if (!pIsValidPTrain(ptrain_idx)) {
+        return ERROR_PTRAIN_IDX;
+    }
+    ptrain_t *ptrain = &ptrains[ptrain_idx];
+    if (pRemoveFromTimer(ptrain->timer_number, ptrain_idx) == ERROR_TIMER_RUNNING) {
+        return ERROR_TIMER_RUNNING;
+    }
+    ptrain->timer_number = NUMBER_OF_16BIT_TIMERS;     // on the free list
+    ptrain->timer_index = p_free_ptrains;
+    p_free_ptrains = ptrain_idx;
+    return 0;
+}
+
+void pStartPTrain(uint8_t ptrain_idx) {
+        ptrain_t *ptrain_control = &ptrains[ptrain_idx];
+        pStartTimer(ptrain_control->timer_number);    
+}
+
+uint8_t pAttach(uint8_t ptrain_index, int pin, timers16bit_t timer) {
+    if (pIsValidPTrain(ptrain_index)) {
+        ptrain_t *ptrain = &ptrains[ptrain_index];
+        // move a ptrain attached before off its old timer
+        if ((ptrain->timer_number != timer) &&
+                (pRemoveFromTimer(ptrain->timer_number, ptrain_index) == ERROR_TIMER_RUNNING)) {
+            return ERROR_TIMER_RUNNING;
+        }
+        uint8_t port = digitalPinToPort(pin);
+        pinMode( pin, OUTPUT);                      // set ptrain pin to output
+        digitalWrite( pin, LOW);                    // also turns off any PWM on the pin
+        ptrain->pin = pin;
+        // cache the port so the timer can drive the pin directly
+        ptrain->port = (port == NOT_A_PIN) ? NULL : portOutputRegister(port);
+        ptrain->pin_mask = digitalPinToBitMask(pin);
+#ifdef P_USE_HARDWARE_PWM
+        // remember if the timer can drive the pin itself
+        ptrain->oc_channel = 0;
+        for (uint8_t channel = 0; channel < 3; channel++) {
+            if ((timer < NUMBER_OF_16BIT_TIMERS) && (p_oc_pins[timer][channel] == pin)) {
+                ptrain->oc_channel = channel + 1;
+            }
+        }
+#endif
+        // initialize the timer if it has not already been initialized 
+        uint8_t error = pAddToTimer(timer, ptrain_index);
+        if ((error == ERROR_PTRAIN_IDX) || (error == ERROR_TIMER_COUNT)) {
+            return error;
+        }
+        return ptrain_index;
+    }
+    else {
+        return ERROR_PTRAIN_IDX ;  // too many PTRAINS 
+    }
+}
+
+uint8_t pReAttach(uint8_t ptrain_index) {
+    if (pIsValidPTrain(ptrain_index)) {
+        ptrain_t *ptrain = &ptrains[ptrain_index];
+        // initialize the timer if it has not already been initialized 
+        uint8_t error = pAddToTimer(ptrain->timer_number, ptrain_index);
+        if ((error == ERROR_PTRAIN_IDX) || (error == ERROR_TIMER_COUNT)) {
+            return error;
+        }
+        return ptrain_index;
+    }
+    else {
+        return ERROR_PTRAIN_IDX ;  // too many PTRAINS 
+    }
+}
+
+static uint8_t pTimeToCounts(  uint32_t time, uint32_t cycles_per_unit,
+                                uint16_t prescale, uint32_t *counts) {
+    // time * cycles_per_unit / prescale rounded down like US_TO_COUNTS,
+    // ERROR_OUT_OF_RANGE when that needs more than 32 bits
+    uint32_t whole = time / prescale;
+    uint32_t part = (time % prescale) * cycles_per_unit / prescale;
+    if (whole > (0xFFFFFFFFUL - part) / cycles_per_unit) {
+        return ERROR_OUT_OF_RANGE;
+    }
+    *counts = whole * cycles_per_unit + part;
+    return 0;
+}
+
+static uint8_t pSetPulse(   uint8_t ptrain_index, uint32_t period,
+                            uint32_t pulse_width, uint32_t period_num_limit,
+                            uint16_t prescale, uint32_t cycles_per_unit) {
+    // set period and pulsewidth in units of cycles_per_unit CPU cycles
+    if (!pIsValidPTrain(ptrain_index)) {
+        return ERROR_PTRAIN_IDX ;  // never handed out or released
+    }
+    if ((pulse_width >= period) && (period != 0)) {
+        return ERROR_TIMER_COUNT;
+    }
+    ptrain_t *ptrain = &ptrains[ptrain_index];
+    uint32_t period_counts = 0;
+    uint32_t pulse_counts = 0;
+    switch (prescale) {
+        case 1024:
+        case 256:
+        case 64:
+        case 8:
+        case 1:
+        case P_PRESCALE_AUTO:
+            break;
+        default:
+            prescale = DEFAULT_PTRAIN_PRESCALE;
+    }
+    if (prescale == P_PRESCALE_AUTO) {
+        // the finest prescale that fits the counter, past that the finest
+        // one that fits at all with the ISR counting compare rollovers
+        uint16_t fallback = 0;
+        for (uint8_t i = 1; i < 6; i++) {
+            uint32_t period_i, pulse_i;
+            if ((pTimeToCounts(period, cycles_per_unit, p_prescales[i], &period_i) != 0) ||
+                    (pTimeToCounts(pulse_width, cycles_per_unit, p_prescales[i], &pulse_i) != 0)) {
+                continue;
+            }
+            if (fallback == 0) {
+                fallback = p_prescales[i];
+            }
+            if ((period_i <= 0xFFFF) && (pulse_i <= 0xFFFF)) {
+                prescale = p_prescales[i];
+                break;
+            }
+        }
+        if (prescale == P_PRESCALE_AUTO) {
+            prescale = fallback;
+        }
+        if (prescale == 0) {
+            return ERROR_OUT_OF_RANGE;
+        }
+    }
+    if ((pTimeToCounts(period, cycles_per_unit, prescale, &period_counts) != 0) ||
+            (pTimeToCounts(pulse_width, cycles_per_unit, prescale, &pulse_counts) != 0)) {
+        return ERROR_OUT_OF_RANGE;
+    }
+    ptrain->prescale = prescale;
+    ptrain->period_counts = period_counts;
+    ptrain->pulse_counts = pulse_counts;
+    ptrain->period_num_limit = period_num_limit;
+    return 0;
+}
+
+uint8_t _pSetPulseUS(   uint8_t ptrain_index, uint32_t period,
+                        uint32_t pulse_width, uint32_t period_num_limit,
+                        uint16_t prescale) {
+    // set period and pulsewidth in microseconds, P_PRESCALE_AUTO picks the
+    // prescale now and on every later pSetPulseUS
+    uint8_t error = pSetPulse(ptrain_index, period, pulse_width, period_num_limit,
+                                prescale, CLOCKCYCLESPERMICROSECOND);
+    if (error == 0) {
+        ptrains[ptrain_index].auto_prescale = (prescale == P_PRESCALE_AUTO);
+    }
+    return error;
+}
+
+uint8_t pSetPulseUS(uint8_t ptrain_index, uint32_t period,
+                    uint32_t pulse_width, uint32_t period_num_limit) {
+    // for use when you don't want to set the prescaler or it's already set
+    if (!pIsValidPTrain(ptrain_index)) {
+        return ERROR_PTRAIN_IDX ;  // never handed out or released
+    }
+    ptrain_t *ptrain = &ptrains[ptrain_index];
+    return _pSetPulseUS(ptrain_index, period, pulse_width, period_num_limit,
+                        ptrain->auto_prescale ? P_PRESCALE_AUTO : ptrain->prescale);
+}
+
+uint8_t _pSetPulseMS(   uint8_t ptrain_index, uint32_t period,
+                        uint32_t pulse_width, uint32_t period_num_limit,
+                        uint16_t prescale) {
+    // set period and pulsewidth in milliseconds, for periods past the 71
+    // minutes that fit in a uint32_t of microseconds
+    uint8_t error = pSetPulse(ptrain_index, period, pulse_width, period_num_limit,
+                                prescale, F_CPU / 1000L);
+    if (error == 0) {
+        ptrains[ptrain_index].auto_prescale = (prescale == P_PRESCALE_AUTO);
+    }
+    return error;
+}
+
+uint8_t pSetPulseMS(uint8_t ptrain_index, uint32_t period,
+                    uint32_t pulse_width, uint32_t period_num_limit) {
+    if (!pIsValidPTrain(ptrain_index)) {
+        return ERROR_PTRAIN_IDX ;  // never handed out or released
+    }
+    ptrain_t *ptrain = &ptrains[ptrain_index];
+    return _pSetPulseMS(ptrain_index, period, pulse_width, period_num_limit,
+                        ptrain->auto_prescale ? P_PRESCALE_AUTO : ptrain->prescale);
+}
+
+uint8_t pSetPulseOnlyUS(uint8_t ptrain_index, uint32_t pulse_width) {
+    // keeps the prescale of the ptrain
+    if (!pIsValidPTrain(ptrain_index)) {
+        return ERROR_PTRAIN_IDX;
+    }
+    ptrain_t *ptrain = &ptrains[ptrain_index];
+    uint32_t pulse_counts;
+    if (pTimeToCounts(pulse_width, CLOCKCYCLESPERMICROSECOND, ptrain->prescale,
+                        &pulse_counts) != 0) {
+        return ERROR_OUT_OF_RANGE;
+    }
+    ptrain->pulse_counts = pulse_counts;
+    return 0;
+}
+uint8_t pSetPeriodOnlyUS(uint8_t ptrain_index, uint32_t period) {
+    // keeps the prescale of the ptrain
+    if (!pIsValidPTrain(ptrain_index)) {
+        return ERROR_PTRAIN_IDX;
+    }
+    ptrain_t *ptrain = &ptrains[ptrain_index];
+    uint32_t period_counts;
+    if (pTimeToCounts(period, CLOCKCYCLESPERMICROSECOND, ptrain->prescale,
+                        &period_counts) != 0) {
+        return ERROR_OUT_OF_RANGE;
+    }
+    ptrain->period_counts = period_counts;
+    return 0;
+}
+uint8_t pSetPeriodNumberOnly(uint8_t ptrain_index, uint32_t period_num_limit) {
+    if (!pIsValidPTrain(ptrain_index)) {
+        return ERROR_PTRAIN_IDX;
+    }
+    ptrain_t *ptrain = &ptrains[ptrain_index];
+    ptrain->period_num_limit = period_num_limit;
+    return 0;
+    
+}
+
+uint32_t pGetPulseCounts(uint8_t ptrain_index) {
+    // 0 for a ptrain that isn't allocated
+    if (!pIsValidPTrain(ptrain_index)) {
+        return 0;
+    }
+    return ptrains[ptrain_index].pulse_counts;
+}
+
+uint32_t pGetPeriodCounts(uint8_t ptrain_index) {
+    if (!pIsValidPTrain(ptrain_index)) {
+        return 0;
+    }
+    return ptrains[ptrain_index].period_counts;
+}
+
+uint32_t pGetPeriodNumber(uint8_t ptrain_index) {
+    if (!pIsValidPTrain(ptrain_index)) {
+        return 0;
+    }
+    return ptrains[ptrain_index].period_num_limit;
+}
+
+uint8_t pStop(uint8_t ptrain_index) {   
+    // 1. remove ptrain from it's timer16control
+    ptrain_t *ptrain = &ptrains[ptrain_index];
+    pStopTimer(ptrain->timer_number);
+    // ptrain->timer_index = pRemoveFromTimer(ptrain->timer_number, ptrain_index);
+    return ptrain->timer_index;
+}
+
+static uint8_t pGetPrescaleBits(uint16_t prescale) {
+    uint8_t bit_prescale;
+    switch(prescale) {
+        case 1024:
+            bit_prescale = 0x05;
+            break;
+        case 256:
+            bit_prescale = 0x04;
+            break;
+        case 64:
+            bit_prescale = 0x03;
+            break;
+        case 8:
+            bit_prescale = 0x02;
+            break;
+        default:
+            bit_prescale = 0x01;
+    }
+    return bit_prescale;
+}
+
+uint8_t pSetTimerPrescale(timers16bit_t timer, uint16_t prescale) {
+    timer_array[timer].bit_prescale = pGetPrescaleBits(prescale);
+    return 0;
+}
+
+static void pBuildPortGroups(timers16bit_t timer) {
+    // merge the pins attached to a timer into one (port, mask) entry per 
+    // output port.  The table is built aside and swapped in with interrupts
+    // off so a running ISR never sees a half built table
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    pportgroup_t groups[P_PORT_GROUPS];
+    uint8_t num_groups = 0;
+    uint8_t i, j;
+    for (i = 0; i < timer_control->number_of_ptrains; i++) {
+        ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+        if (ptrain->port == NULL) {
+            continue;                               // not a digital pin
+        }
+        for (j = 0; j < num_groups; j++) {
+            if (groups[j].port == ptrain->port) {
+                break;
+            }
+        }
+        if (j == num_groups) {
+            if (num_groups == P_PORT_GROUPS) {
+                continue;                           // no room for another port
+            }
+            groups[j].port = ptrain->port;
+            groups[j].mask = 0;
+            num_groups++;
+        }
+        groups[j].mask |= ptrain->pin_mask;
+    }
+    uint8_t oldSREG = SREG;
+    cli();
+    for (j = 0; j < num_groups; j++) {
+        timer_control->port_groups[j].port = groups[j].port;
+        timer_control->port_groups[j].mask = groups[j].mask;
+    }
+    timer_control->number_of_port_groups = num_groups;
+    SREG = oldSREG;
+}
+
+static bool pIsTimerModeBuilt(uint8_t mode) {
+    // the timer_modes value is one the flags defined compile in
+    switch (mode) {
+        case PMODE_CLEAR:
+        case PMODE_FREERUN:
+#ifdef P_USE_SCHEDULER
+        case PMODE_SCHEDULE:
+#endif
+#ifdef P_USE_BAM
+        case PMODE_BAM:
+#endif
+#ifdef P_USE_DDA
+        case PMODE_DDA:
+#endif
+#ifdef P_USE_PROGRAM
+        case PMODE_PROGRAM:
+#endif
+            return true;
+        default:
+            return false;
+    }
+}
+
+uint8_t pSetTimerMode(timers16bit_t timer, uint8_t mode) {
+    // choose how a stopped timer schedules its edges, see timer_modes
+    if (pIsTimerActive(timer)) {
+        return ERROR_TIMER_RUNNING;
+    }
+    if (!pIsTimerModeBuilt(mode)) {
+        return ERROR_TIMER_COUNT;
+    }
+    timer_array[timer].timer_mode = mode;
+    return 0;
+}
+
+uint8_t pAddToTimer(timers16bit_t timer, uint8_t ptrain_idx) {
+    // Add a ptrain to the end of a timer, moving it off the timer it was
+    // on, or just reload it if it is already there
+    if (!pIsValidPTrain(ptrain_idx)) {
+        return ERROR_PTRAIN_IDX;            // never handed out or released
+    }
+    if (timer >= NUMBER_OF_16BIT_TIMERS) {
+        return ERROR_TIMER_COUNT;
+    }
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile uint8_t *ptrain_idxs = timer_control->ptrain_idxs;
+    ptrain_t *ptrain = &ptrains[ptrain_idx];
+    if (!pIsAttached(ptrain_idx) || (ptrain->timer_number != timer)) {
+        if (timer_control->number_of_ptrains >= PTRAINS_PER_TIMER) {
+            return ERROR_PTRAIN_IDX;        // the timer is full
+        }
+        if (pRemoveFromTimer(ptrain->timer_number, ptrain_idx) == ERROR_TIMER_RUNNING) {
+            return ERROR_TIMER_RUNNING;
+        }
+        uint8_t oldSREG = SREG;
+        cli();
+        ptrain->timer_number = timer;
+        ptrain->timer_index = timer_control->number_of_ptrains;
+        ptrain_idxs[ptrain->timer_index] = ptrain_idx;
+        timer_control->number_of_ptrains++;               //increment ptrain count
+        SREG = oldSREG;
+    }
+    pBuildPortGroups(timer);                // also for a new pin on the same timer
+    // transfer values
+    return pReloadToTimer(ptrain_idx);
+}
+
+static uint8_t pCanReload(timers16bit_t timer) {
+    // ERROR_TIMER_RUNNING when the timer is running in a way that can't
+    // take new values from pReloadToTimer until it stops
+    if (!pIsTimerActive(timer)) {
+        return 0;
+    }
+#ifdef P_USE_SCHEDULER
+    if (timer_array[timer].timer_mode == PMODE_SCHEDULE) {
+        return ERROR_TIMER_RUNNING;         // the schedule is fixed at start
+    }
+#endif
+#ifdef P_USE_BAM
+    if (timer_array[timer].timer_mode == PMODE_BAM) {
+        return ERROR_TIMER_RUNNING;         // the slot is fixed at start, use pCommitBAM
+    }
+#endif
+#ifdef P_USE_DDA
+    if (timer_array[timer].timer_mode == PMODE_DDA) {
+        return ERROR_TIMER_RUNNING;         // the move is fixed at start
+    }
+#endif
+#ifdef P_USE_PROGRAM
+    if (timer_array[timer].timer_mode == PMODE_PROGRAM) {
+        return ERROR_TIMER_RUNNING;         // the program sets the pulse
+    }
+#endif
+#ifdef P_USE_RAMP
+    if (p_ramps[timer].active) {
+        return ERROR_TIMER_RUNNING;         // the ramp owns the period
+    }
+#endif
+#ifdef P_USE_HARDWARE_PWM
+    if (timer_array[timer].hardware) {
+        return ERROR_TIMER_RUNNING;         // OCRnx are loaded at start
+    }
+#endif
+    return 0;
+}
+
+uint8_t pReloadToTimer(uint8_t ptrain_idx) {
+    // Load the values of a ptrain into its timer.  A running timer gets them
+    // at the start of its next period so no period mixes old and new values,
+    // check pIsUpdatePending to see when that happened
+    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
+    timers16bit_t timer = ptrain_control->timer_number;
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    uint8_t oldSREG = SREG;
+    cli();
+    if (pIsTimerActive(timer)) {
+        if (pCanReload(timer) != 0) {
+            SREG = oldSREG;
+            return ERROR_TIMER_RUNNING;
+        }
+        timer_control->next_pulse_counts = ptrain_control->pulse_counts;
+        timer_control->next_period_counts = ptrain_control->period_counts;
+        timer_control->next_period_num_limit = ptrain_control->period_num_limit;
+        timer_control->next_bit_prescale = pGetPrescaleBits(ptrain_control->prescale);
+        timer_control->update_pending = true;
+    }
+    else {
+        // transfer values
+        timer_control->pulse_counts = ptrain_control->pulse_counts;
+        timer_control->period_counts = ptrain_control->period_counts;
+        timer_control->period_num_limit = ptrain_control->period_num_limit;
+        pSetTimerPrescale(timer, ptrain_control->prescale);
+        timer_control->update_pending = false;
+#ifdef P_USE_RAMP
+        p_ramps[timer].active = false;      // back to the fixed period
+#endif
+    }
+    SREG = oldSREG;
+    return timer_control->number_of_ptrains;
+}
+
+bool pIsUpdatePending(timers16bit_t timer) {
+    // true until the ISR has made the last pReloadToTimer values live,
+    // or on a PMODE_BAM timer the last pCommitBAM duties
+#ifdef P_USE_BAM
+    if (timer_array[timer].timer_mode == PMODE_BAM) {
+        return p_bams[timer].pending;
+    }
+#endif
+    return timer_array[timer].update_pending;
+}
+
+uint32_t pGetUpdatePeriod(timers16bit_t timer) {
+    // the number of periods output with the old values before the last
+    // update went live
+    uint8_t oldSREG = SREG;
+    cli();
+    uint32_t update_period = timer_array[timer].update_period;
+    SREG = oldSREG;
+    return update_period;
+}
+
+uint8_t pGetProgress(timers16bit_t timer, pprogress_t *progress) {
+    // Copy the progress of a timer without holding off its interrupts.  An
+    // ISR that changes it moves progress_seq on, so a copy an ISR broke 
+    // into is just taken again.  The main loop can't interrupt an ISR, so 
+    // progress_seq never needs to mark a change as under way
+    if (timer >= NUMBER_OF_16BIT_TIMERS) {
+        return ERROR_TIMER_COUNT;
+    }
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    uint8_t seq;
+    do {
+        seq = timer_control->progress_seq;
+        progress->periods = timer_control->number_of_periods;
+        progress->limit = timer_control->period_num_limit;
+#ifdef P_USE_POSITION
+        progress->position = timer_control->position;
+#endif
+        progress->state = timer_control->pulsed_state;
+        progress->limit_hit = (timer_control->limit_state == P_LIMIT_HIT);
+        progress->active = pIsTimerActive(timer);
+    } while (seq != timer_control->progress_seq);
+    return 0;
+}
+
+#ifdef P_USE_HARDWARE_PWM
+bool pIsTimerHardware(timers16bit_t timer) {
+    // true when the last pStartTimer left the pins to the OCnx units
+    return timer_array[timer].hardware;
+}
+#endif
+
+uint8_t pRemoveFromTimer(timers16bit_t timer, uint8_t ptrain_idx) {
+    // Remove a ptrain from a timer.  The last ptrain of the timer moves into
+    // its slot, so only that one changes timer_index.  A running timer can
+    // lose a pin in PMODE_CLEAR and PMODE_FREERUN, otherwise 
+    // ERROR_TIMER_RUNNING.  ERROR_PTRAIN_REMOVED when it isn't on the timer
+    if ((timer >= NUMBER_OF_16BIT_TIMERS) || !pIsAttached(ptrain_idx) ||
+            (ptrains[ptrain_idx].timer_number != timer)) {
+        return ERROR_PTRAIN_REMOVED;
+    }
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile uint8_t *ptrain_idxs = timer_control->ptrain_idxs;
+    uint8_t timer_index = ptrains[ptrain_idx].timer_index;
+    uint8_t oldSREG = SREG;
+    cli();
+    if (pCanReload(timer) != 0) {
+        SREG = oldSREG;
+        return ERROR_TIMER_RUNNING;
+    }
+    if (pIsTimerActive(timer) && (ptrains[ptrain_idx].port != NULL)) {
+        // the ISR won't write the pin again, so don't leave it HIGH
+        P_PORT_CLR(ptrains[ptrain_idx].port, ptrains[ptrain_idx].pin_mask);
+    }
+    uint8_t last = ptrain_idxs[timer_control->number_of_ptrains - 1];
+    ptrain_idxs[timer_index] = last;
+    ptrains[last].timer_index = timer_index;
+    timer_control->number_of_ptrains--;  // decrement ptrain count
+    pBuildPortGroups(timer);
+    SREG = oldSREG;
+    return PTRAIN_REMOVED;
+}
+
+void pClearTimerOfPTrains(timers16bit_t timer) {
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    timer_control->number_of_ptrains = 0;
+    timer_control->number_of_port_groups = 0;
+}
+
+void pClearPTrainsTimer(uint8_t ptrain_idx) {
+    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
+    pClearTimerOfPTrains(ptrain_control->timer_number);
+}
+
+bool pIsPTrainActive(uint8_t ptrain_idx) {
+    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
+    if (pIsAttached(ptrain_idx) && 
+        (pIsTimerActive(ptrain_control->timer_number)) ) {
+            return true;
+        }
+    else {
+        return false;
+    }
+}
+
+timers16bit_t pGetTimer(uint8_t ptrain_idx) {
+    // NUMBER_OF_16BIT_TIMERS for a ptrain that isn't allocated
+    if (!pIsValidPTrain(ptrain_idx)) {
+        return (timers16bit_t)NUMBER_OF_16BIT_TIMERS;
+    }
+    return ptrains[ptrain_idx].timer_number; 
+}
+
+bool pWasTimerLimitHit(timers16bit_t timer) {
+    return (timer_array[timer].limit_state == P_LIMIT_HIT); 
+}
+
+
+bool pIsPTrainTimerActive(uint8_t ptrain_idx) {
+    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
+    return pIsTimerActive(ptrain_control->timer_number);
+}
+
+#ifdef P_USE_TRACE
+uint8_t pTraceRead(ptrace_t *records, uint8_t max_records) {
+    // drain up to max_records edge records in the order they were made,
+    // returns the number copied.  Safe to call with the timers running
+    uint8_t n = 0;
+    uint8_t tail = p_trace_tail;
+    while ((n < max_records) && (tail != p_trace_head)) {
+        volatile ptrace_t *record = &p_trace[tail & (P_TRACE_SIZE - 1)];
+        records[n].timer = record->timer;
+        records[n].state = record->state;
+        records[n].count = record->count;
+        records[n].period = record->period;
+        n++;
+        tail++;
+    }
+    p_trace_tail = tail;                    // hand the slots back to the ISRs
+    return n;
+}
+
+uint16_t pTraceDropped() {
+    // number of edges lost because the trace was not drained fast enough
+    uint8_t oldSREG = SREG;
+    cli();
+    uint16_t dropped = p_trace_dropped;
+    SREG = oldSREG;
+    return dropped;
+}
+#endif
+
+#ifdef P_USE_EVENTS
+uint8_t pEventRead(pevent_t *events, uint8_t max_events) {
+    // drain up to max_events events in the order they happened, returns
+    // the number copied.  Safe to call with the timers running
+    uint8_t n = 0;
+    uint8_t tail = p_event_tail;
+    while ((n < max_events) && (tail != p_event_head)) {
+        volatile pevent_t *event = &p_events[tail & (P_EVENT_QUEUE_SIZE - 1)];
+        events[n].type = event->type;
+        events[n].timer = event->timer;
+        events[n].data = event->data;
+        n++;
+        tail++;
+    }
+    p_event_tail = tail;                    // hand the slots back to the ISRs
+    return n;
+}
+
+uint8_t pDispatchEvents(peventhandler_t handler) {
+    // call handler for every event waiting, oldest first, and return how
+    // many there were.  Call it once per loop(), the handler can start the
+    // next run straight away.  Events that come in meanwhile are left for
+    // the next call so a busy timer can't hold loop() here
+    uint8_t n = 0;
+    uint8_t head = p_event_head;
+    pevent_t event;
+    while (p_event_tail != head) {
+        pEventRead(&event, 1);
+        if (handler != NULL) {
+            handler(&event);
+        }
+        n++;
+    }
+    return n;
+}
+
+uint16_t pEventsDropped() {
+    // number of events lost because they were not drained fast enough
+    uint8_t oldSREG = SREG;
+    cli();
+    uint16_t dropped = p_events_dropped;
+    SREG = oldSREG;
+    return dropped;
+}
+#endif
+
+#ifdef P_USE_TIMER_STATS
+uint8_t pGetTimerStats(timers16bit_t timer, ptimerstats_t *stats) {
+    // copy out a consistent set of the ISR health counters of a timer
+    // latencies and durations are in counts of the timer's prescale
+    volatile ptimerstats_t *timer_stats = &p_timer_stats[timer];
+    uint8_t oldSREG = SREG;
+    cli();
+    stats->isr_count = timer_stats->isr_count;
+    for (uint8_t i = 0; i < P_LATENCY_BUCKETS; i++) {
+        stats->latency[i] = timer_stats->latency[i];
+    }
+    stats->max_latency = timer_stats->max_latency;
+    stats->max_isr_counts = timer_stats->max_isr_counts;
+    stats->missed_compares = timer_stats->missed_compares;
+    SREG = oldSREG;
+    return 0;
+}
+
+void pResetTimerStats(timers16bit_t timer) {
+    volatile ptimerstats_t *timer_stats = &p_timer_stats[timer];
+    uint8_t oldSREG = SREG;
+    cli();
+    timer_stats->isr_count = 0;
+    for (uint8_t i = 0; i < P_LATENCY_BUCKETS; i++) {
+        timer_stats->latency[i] = 0;
+    }
+    timer_stats->max_latency = 0;
+    timer_stats->max_isr_counts = 0;
+    timer_stats->missed_compares = 0;
+    SREG = oldSREG;
+}
+#endif
+
+#ifdef P_USE_SEGMENTS
+uint8_t pQueueSegment(timers16bit_t timer, uint16_t pulse_counts, 
+                        uint16_t period_counts, uint32_t period_num_limit) {
+    // queue a (pulse, period, count) segment to follow on from the one 
+    // running without a gap.  Segments use the prescale of the timer and
+    // can't be DC.  Safe to call with the timer running
+    volatile psegmentqueue_t *queue = &p_segments[timer];
+    uint8_t head = queue->head;
+    if ((pulse_counts == 0) || (pulse_counts >= period_counts) || 
+            (period_num_limit == 0)) {
+        return ERROR_SEGMENT;
+    }
+    if ((uint8_t)(head - queue->tail) >= P_SEGMENT_QUEUE_SIZE) {
+        return ERROR_QUEUE_FULL;
+    }
+    volatile psegment_t *segment = &queue->segments[head & (P_SEGMENT_QUEUE_SIZE - 1)];
+    segment->pulse_counts = pulse_counts;
+    segment->period_counts = period_counts;
+    segment->period_num_limit = period_num_limit;
+    queue->head = head + 1;                 // publish the segment
+    return 0;
+}
+
+uint8_t pQueueSegmentUS(timers16bit_t timer, uint32_t period, 
+                        uint32_t pulse_width, uint32_t period_num_limit) {
+    uint16_t prescale = pGetTimerPrescale(timer);
+    uint32_t pulse_counts, period_counts;
+    if (prescale == 0) {
+        return ERROR_SEGMENT;
+    }
+    if ((pTimeToCounts(pulse_width, CLOCKCYCLESPERMICROSECOND, prescale, &pulse_counts) != 0) ||
+            (pTimeToCounts(period, CLOCKCYCLESPERMICROSECOND, prescale, &period_counts) != 0) ||
+            (period_counts > 0xFFFF)) {
+        return ERROR_OUT_OF_RANGE;          // segments stay within the counter
+    }
+    return pQueueSegment(timer, pulse_counts, period_counts, period_num_limit);
+}
+
+uint8_t pSegmentsFree(timers16bit_t timer) {
+    // number of segments that can be queued right now
+    volatile psegmentqueue_t *queue = &p_segments[timer];
+    return P_SEGMENT_QUEUE_SIZE - (uint8_t)(queue->head - queue->tail);
+}
+
+void pEndSegments(timers16bit_t timer) {
+    // the last segment is queued, running out of segments is now the
+    // expected end of the run rather than an underrun
+    p_segments[timer].end = true;
+}
+
+void pClearSegments(timers16bit_t timer) {
+    // drop the queued segments and start a new stream
+    volatile psegmentqueue_t *queue = &p_segments[timer];
+    uint8_t oldSREG = SREG;
+    cli();
+    queue->tail = queue->head;
+    queue->end = false;
+    queue->segments_done = 0;
+    queue->underruns = 0;
+    SREG = oldSREG;
+}
+
+uint16_t pGetSegmentsDone(timers16bit_t timer) {
+    // segments started since the timer was started
+    uint8_t oldSREG = SREG;
+    cli();
+    uint16_t segments_done = p_segments[timer].segments_done;
+    SREG = oldSREG;
+    return segments_done;
+}
+
+uint16_t pGetSegmentUnderruns(timers16bit_t timer) {
+    // runs that stopped because the queue was empty before pEndSegments
+    uint8_t oldSREG = SREG;
+    cli();
+    uint16_t underruns = p_segments[timer].underruns;
+    SREG = oldSREG;
+    return underruns;
+}
+#endif
+
+#ifdef P_USE_RAMP
+uint8_t pSetRamp(timers16bit_t timer, uint32_t speed, uint32_t accel, 
+                    uint32_t total_steps, uint8_t profile) {
+    // Ramp the steps of a stopped timer up to speed (steps/s) at accel 
+    // (steps/s^2), cruise and ramp down again to stop after total_steps.
+    // The pulse width and prescale stay those of the attached ptrains.
+    // PRAMP_SCURVE reaches speed over the same steps with an acceleration 
+    // that starts and ends at nothing and peaks at twice accel.
+    // The set up uses floating point, the ISR only multiplies.
+    // pReloadToTimer goes back to the fixed period of the ptrain
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile pramp_t *ramp = &p_ramps[timer];
+    uint16_t prescale = pGetTimerPrescale(timer);
+    if (pIsTimerActive(timer)) {
+        return ERROR_TIMER_RUNNING;
+    }
+    if ((prescale == 0) || (speed == 0) || (accel == 0) || (total_steps == 0) || 
+            (profile > PRAMP_SCURVE)) {
+        return ERROR_RAMP;
+    }
+    ramp->active = false;
+    double frequency = (double)F_CPU / prescale;  // counts per second
+    double accel_steps = ((double)speed * speed) / (2.0 * accel);
+    if (accel_steps > total_steps / 2) {
+        accel_steps = total_steps / 2;      // no room to cruise
+    }
+    if (accel_steps > 0xFFFF) {
+        return ERROR_RAMP;                  // only the cruise can be longer
+    }
+    uint16_t steps = (accel_steps < 1.0) ? 1 : (uint16_t)accel_steps;
+    uint16_t half_steps = 0;
+    uint16_t max_weight = 1;
+    double weights = steps;
+    if (profile == PRAMP_SCURVE) {
+        half_steps = (steps + 1) / 2;
+        max_weight = half_steps;
+        weights = (double)half_steps * (half_steps + 1) / 2.0 + 
+                    (double)(steps - half_steps) * (steps - half_steps + 1) / 2.0;
+    }
+    // acceleration per unit weight in steps/count^2, the same total for both
+    double accel_unit = (double)accel * steps / weights / (frequency * frequency);
+    int exponent;
+    frexp(accel_unit * max_weight, &exponent);
+    // scale so the largest factor fills 32 bits, pRampFactor undoes it
+    ramp->shift = exponent + 32;
+    ramp->accel_unit = (uint32_t)ldexp(accel_unit, 64 - ramp->shift);
+    // the first steps come from a table, 1/p^2 grows by 2*a each step
+    double speed_sq = 0.0;
+    for (uint16_t n = 0; n < P_RAMP_TABLE_SIZE; n++) {
+        if (n < steps) {
+            uint16_t weight = 1;
+            if (half_steps != 0) {
+                weight = (n < half_steps) ? (n + 1) : (steps - n);
+            }
+            speed_sq += 2.0 * accel_unit * weight;
+        }
+        double period = 1.0 / sqrt(speed_sq);
+        if (period > 65535.0) {
+            if ((n == P_RAMP_TABLE_SIZE - 1) && (steps > P_RAMP_TABLE_SIZE)) {
+                return ERROR_RAMP;          // too slow for this prescale after the table
+            }
+            period = 65535.0;               // start a little faster
+        }
+        ramp->table[n] = (uint16_t)(period + 0.5);
+    }
+    // the fastest step has to leave room for the pulse and the ISR
+    double cruise_speed_sq = 2.0 * accel_unit * weights;
+    if (1.0 / sqrt(cruise_speed_sq) < timer_control->pulse_counts + SMALL_COUNT) {
+        return ERROR_RAMP;
+    }
+    // 1/p^2 is kept as a 64 bit integer with the top bit free at cruise
+    frexp(cruise_speed_sq, &exponent);
+    ramp->newton_shift = 94 - (63 - exponent);
+    uint64_t speed_sq_unit = (uint64_t)ldexp(2.0 * accel_unit, 63 - exponent);
+    ramp->speed_sq_jerk = (half_steps != 0) ? speed_sq_unit : 0;
+    // sum up the weights of the table steps as pNextRampPeriod goes on
+    uint64_t table_weights = 0;
+    uint16_t weight = 1;
+    for (uint16_t n = 0; (n < P_RAMP_TABLE_SIZE) && (n < steps); n++) {
+        if (half_steps != 0) {
+            weight = (n < half_steps) ? (n + 1) : (steps - n);
+        }
+        table_weights += weight;
+    }
+    ramp->table_speed_sq = speed_sq_unit * table_weights;
+    ramp->table_speed_sq_step = speed_sq_unit * weight;
+    ramp->accel_steps = steps;
+    ramp->half_steps = half_steps;
+    ramp->total_steps = total_steps;
+    ramp->decel_start = total_steps - steps;
+    ramp->cruise_period = (uint16_t)(1.0 / sqrt(cruise_speed_sq));
+    ramp->active = true;
+    return 0;
+}
+#endif
+
+uint8_t pAttachLimitTimer(timers16bit_t timer, uint8_t limit_pin, uint8_t limit_state) {
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    timer_control->limit_pin = limit_pin;
+    timer_control->limit_state = limit_state;
+#ifdef P_USE_LIMIT_INTERRUPTS
+    // a pin with an external interrupt stops the timer the moment it 
+    // trips, any other pin is read at the end of every period
+    int interrupt = digitalPinToInterrupt(limit_pin);
+    uint8_t oldSREG = SREG;
+    cli();
+    for (uint8_t i = 0; i < P_LIMIT_INTERRUPTS; i++) {
+        p_limit_inputs[i].timers &= ~_BV(timer);
+    }
+    timer_control->use_limit_interrupt = (interrupt != NOT_AN_INTERRUPT) && 
+                                            (interrupt < P_LIMIT_INTERRUPTS);
+    if (timer_control->use_limit_interrupt) {
+        volatile plimitinput_t *input = &p_limit_inputs[interrupt];
+        input->port = portInputRegister(digitalPinToPort(limit_pin));
+        input->mask = digitalPinToBitMask(limit_pin);
+        input->timers |= _BV(timer);
+        timer_control->use_limit = false;
+        SREG = oldSREG;
+        attachInterrupt(interrupt, p_limit_handlers[interrupt], CHANGE);
+        return 0;
+    }
+    SREG = oldSREG;
+#endif
+    timer_control->use_limit = true;
+    return 0;
+}
+
+uint8_t pGetLimitCause(timers16bit_t timer) {
+    // the limit_causes value of the last trip since pClearLimitCause
+    return timer_array[timer].limit_cause;
+}
+
+void pClearLimitCause(timers16bit_t timer) {
+    timer_array[timer].limit_cause = PLIMIT_NONE;
+}
+
+#ifdef P_USE_LIMIT_INTERRUPTS
+uint8_t pSetLimitDebounceUS(uint8_t limit_pin, uint8_t debounce_us) {
+    // ignore trips on an interrupt limit pin shorter than debounce_us.  The
+    // limit interrupt waits that long before it stops anything, so keep
+    // it to a few microseconds
+    int interrupt = digitalPinToInterrupt(limit_pin);
+    if ((interrupt == NOT_AN_INTERRUPT) || (interrupt >= P_LIMIT_INTERRUPTS)) {
+        return ERROR_LIMIT;                 // polled pins have no debounce
+    }
+    p_limit_inputs[interrupt].debounce_us = debounce_us;
+    return 0;
+}
+#endif
+
+uint8_t pAttachLimit(uint8_t ptrain_idx, uint8_t limit_pin, uint8_t limit_state) {
+    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
+    return pAttachLimitTimer(ptrain_control->timer_number, limit_pin, limit_state);
+}
+
+#ifdef P_USE_POSITION
+uint8_t pAttachDirectionTimer(timers16bit_t timer, int direction_pin, uint8_t forward_state) {
+    // count each period of the timer as a step, forward while the sketch 
+    // drives direction_pin to forward_state and back otherwise.  A pin of
+    // -1 stops counting
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    if (pIsTimerActive(timer)) {
+        return ERROR_TIMER_RUNNING;
+    }
+    uint8_t port = (direction_pin < 0) ? NOT_A_PIN : digitalPinToPort(direction_pin);
+    if (port == NOT_A_PIN) {
+        timer_control->direction_port = NULL;
+        return 0;
+    }
+    timer_control->direction_port = portOutputRegister(port);
+    timer_control->direction_mask = digitalPinToBitMask(direction_pin);
+    timer_control->direction_forward = (forward_state == HIGH) ? timer_control->direction_mask : 0;
+    return 0;
+}
+
+uint8_t pSetPosition(timers16bit_t timer, int32_t position) {
+    // the position kept across runs, zero it at a home switch
+    if (pIsTimerActive(timer)) {
+        return ERROR_TIMER_RUNNING;
+    }
+    timer_array[timer].position = position;
+    return 0;
+}
+#endif
+
+#ifdef P_USE_SCHEDULER
+static uint16_t pGcd(uint16_t a, uint16_t b) {
+    while (b != 0) {
+        uint16_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+static uint16_t pEdgeSpacing(uint16_t a, uint16_t b, uint16_t modulus) {
+    // closest distinct approach of the edge times a + k*P and b + m*Q where 
+    // modulus is gcd(P, Q), edges that coincide are handled as one batch
+    uint16_t r = (uint16_t)(((uint32_t)(a % modulus) + modulus - (b % modulus)) % modulus);
+    if (r == 0) {
+        return modulus;
+    }
+    return (r < modulus - r) ? r : (modulus - r);
+}
+
+static bool pIsScheduleFeasible(timers16bit_t timer, uint16_t isr_counts) {
+    // every pair of distinct edges on the timer must be at least isr_counts 
+    // apart or the ISR can't keep up.  All ptrains start together so the 
+    // edges of two ptrains can only meet on multiples of gcd(periods)
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    uint8_t num_ptrains = timer_control->number_of_ptrains;
+    for (uint8_t i = 0; i < num_ptrains; i++) {
+        ptrain_t *ptrain_i = &ptrains[timer_control->ptrain_idxs[i]];
+        uint16_t period_i = ptrain_i->period_counts;
+        uint16_t edges_i[2] = { 0, (uint16_t)ptrain_i->pulse_counts };
+        if (period_i == 0) {
+            if ((ptrain_i->pulse_counts != 0) && 
+                    (ptrain_i->period_num_limit > 0x7FFFFFFFUL / ptrain_i->pulse_counts)) {
+                return false;               // longer than the scheduler time can span
+            }
+            continue;
+        }
+        if ((ptrain_i->pulse_counts < isr_counts) || 
+                (period_i - ptrain_i->pulse_counts < isr_counts)) {
+            return false;
+        }
+        for (uint8_t j = i + 1; j < num_ptrains; j++) {
+            ptrain_t *ptrain_j = &ptrains[timer_control->ptrain_idxs[j]];
+            if (ptrain_j->period_counts == 0) {
+                continue;
+            }
+            uint16_t modulus = pGcd(period_i, ptrain_j->period_counts);
+            uint16_t edges_j[2] = { 0, (uint16_t)ptrain_j->pulse_counts };
+            for (uint8_t a = 0; a < 2; a++) {
+                for (uint8_t b = 0; b < 2; b++) {
+                    if (pEdgeSpacing(edges_i[a], edges_j[b], modulus) < isr_counts) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static uint8_t pStartSchedule(timers16bit_t timer) {
+    // check the schedule of a PMODE_SCHEDULE timer and load its heap, all
+    // the ptrains get their first rising edge on the first compare
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    uint8_t num_ptrains = timer_control->number_of_ptrains;
+    uint16_t prescale = pGetTimerPrescale(timer);
+    if (prescale == 0) {
+        return ERROR_SCHEDULE;
+    }
+    for (uint8_t i = 0; i < num_ptrains; i++) {
+        ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+        if (ptrain->prescale != prescale) {
+            return ERROR_SCHEDULE;          // all ptrains share the timer clock
+        }
+        if ((ptrain->pulse_counts > 0xFFFF) || (ptrain->period_counts > 0xFFFF)) {
+            return ERROR_OUT_OF_RANGE;      // 16 bit schedule_pulse and schedule_period
+        }
+    }
+    if (!pIsScheduleFeasible(timer, (P_SCHEDULE_ISR_CYCLES + prescale - 1) / prescale)) {
+        return ERROR_SCHEDULE;
+    }
+    for (uint8_t i = 0; i < num_ptrains; i++) {
+        uint8_t ptrain_idx = timer_control->ptrain_idxs[i];
+        ptrain_t *ptrain = &ptrains[ptrain_idx];
+        ptrain->schedule_pulse = ptrain->pulse_counts;
+        ptrain->schedule_period = ptrain->period_counts;
+        ptrain->schedule_limit = ptrain->period_num_limit;
+        ptrain->periods_done = 0;
+        ptrain->schedule_state = PPULSE_LO;
+        ptrain->next_edge = SMALL_COUNT;    // where pEnableISR puts the first compare
+        timer_control->schedule[i] = ptrain_idx;    // equal keys already make a heap
+    }
+    timer_control->schedule_size = num_ptrains;
+    return 0;
+}
+#endif
+
+#ifdef P_USE_BAM
+static void pBuildBAM(timers16bit_t timer, uint8_t buffer)
+{
+    // turn the duties of the ptrains on a timer into the per slot port
+    // bits of one buffer, laid out like the port groups of the timer
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile uint8_t (*masks)[P_PORT_GROUPS] = p_bams[timer].masks[buffer];
+    uint8_t num_groups = timer_control->number_of_port_groups;
+    for (uint8_t bit = 0; bit < P_BAM_BITS; bit++) {
+        for (uint8_t j = 0; j < num_groups; j++) {
+            masks[bit][j] = 0;
+        }
+    }
+    for (uint8_t i = 0; i < timer_control->number_of_ptrains; i++) {
+        ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+        uint8_t j;
+        for (j = 0; j < num_groups; j++) {
+            if (timer_control->port_groups[j].port == ptrain->port) {
+                break;
+            }
+        }
+        if (j == num_groups) {
+            continue;                       // not a digital pin
+        }
+        for (uint8_t bit = 0; bit < P_BAM_BITS; bit++) {
+            if (ptrain->bam_duty & _BV(bit)) {
+                masks[bit][j] |= ptrain->pin_mask;
+            }
+        }
+    }
+}
+
+static uint8_t pStartBAM(timers16bit_t timer) {
+    // check the slot of a PMODE_BAM timer and load the duties, the
+    // first frame starts on the first compare
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile pbam_t *bam = &p_bams[timer];
+    uint16_t prescale = pGetTimerPrescale(timer);
+    if ((prescale == 0) || (timer_control->pulse_counts == 0) ||
+            (timer_control->pulse_counts < 
+                (uint16_t)((P_BAM_ISR_CYCLES + prescale - 1) / prescale))) {
+        return ERROR_SCHEDULE;              // the ISR can't keep up with the shortest slot
+    }
+    if (timer_control->pulse_counts > (0xFFFFFFFFUL >> (P_BAM_BITS - 1))) {
+        return ERROR_OUT_OF_RANGE;
+    }
+    bam->pending = false;
+    pBuildBAM(timer, bam->live);
+    bam->bit = 0;
+    return 0;
+}
+#endif
+
+#ifdef P_USE_DDA
+static uint8_t pStartDDA(timers16bit_t timer) {
+    // make a PMODE_DDA move as many periods long as its longest axis, or
+    // as the ramp when one is set, and centre the accumulators so each 
+    // axis spreads its steps evenly and puts out all of them
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    uint8_t num_ptrains = timer_control->number_of_ptrains;
+    uint32_t length = 0;
+    for (uint8_t i = 0; i < num_ptrains; i++) {
+        ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+        if (ptrain->dda_steps > length) {
+            length = ptrain->dda_steps;
+        }
+    }
+    if ((length == 0) || (timer_control->period_counts == 0)) {
+        return ERROR_OUT_OF_RANGE;          // nothing to move, or DC
+    }
+#ifdef P_USE_RAMP
+    if (p_ramps[timer].active && (p_ramps[timer].total_steps != length)) {
+        return ERROR_RAMP;                  // the ramp has to cover the longest axis
+    }
+#endif
+    for (uint8_t i = 0; i < num_ptrains; i++) {
+        ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+        uint8_t j;
+        for (j = 0; j < timer_control->number_of_port_groups; j++) {
+            if (timer_control->port_groups[j].port == ptrain->port) {
+                break;
+            }
+        }
+        if (j == timer_control->number_of_port_groups) {
+            ptrain->dda_steps = 0;          // not a digital pin
+            j = 0;
+        }
+        ptrain->dda_group = j;
+        ptrain->dda_error = length / 2;
+    }
+    timer_control->period_num_limit = length;
+    return 0;
+}
+#endif
+
+#ifdef P_USE_PROGRAM
+static uint8_t pStartProgram(timers16bit_t timer) {
+    // run the loaded program from the top with every attached pin chosen,
+    // the first instruction runs on the first compare
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    volatile pprogram_t *program = &p_programs[timer];
+    if (program->code == NULL) {
+        return ERROR_PROGRAM;
+    }
+    program->pc = 0;
+    program->op = POP_END;
+    program->remaining = 0;
+    program->depth = 0;
+    for (uint8_t j = 0; j < timer_control->number_of_port_groups; j++) {
+        program->masks[j] = timer_control->port_groups[j].mask;
+    }
+    timer_control->pulsed_state = PPULSE_LO;
+    return 0;
+}
+#endif
+
+#ifdef P_USE_HARDWARE_PWM
+static bool pCanUseHardware(timers16bit_t timer)
+{
+    // true when every attached ptrain is on its own OCnx pin of this timer
+    // and the waveform is one the OCnx units can make without help
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    uint8_t channels = 0;
+    if (p_sync_start) {
+        return false;                       // the forced first edge can't wait for the release
+    }
+    if ((timer_control->timer_mode == PMODE_SCHEDULE) || 
+            (timer_control->timer_mode == PMODE_BAM) ||
+            (timer_control->timer_mode == PMODE_DDA) ||
+            (timer_control->timer_mode == PMODE_PROGRAM) ||
+            (timer_control->period_counts == 0) ||
+            (timer_control->period_counts > 0x10000UL)) {
+        return false;                       // ICRn holds period_counts - 1
+    }
+#ifdef P_USE_RAMP
+    if (p_ramps[timer].active) {
+        return false;
+    }
+#endif
+#ifdef P_USE_SEGMENTS
+    if (p_segments[timer].segments_done != 0) {
+        return false;
+    }
+#endif
+    for (uint8_t i = 0; i < timer_control->number_of_ptrains; i++) {
+        ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+        if ((ptrain->oc_channel == 0) || (channels & _BV(ptrain->oc_channel)) ||
+                (ptrain->pulse_counts == 0) ||
+                (ptrain->pulse_counts >= timer_control->period_counts) ||
+                (ptrain->period_counts != timer_control->period_counts) ||
+                (pGetPrescaleBits(ptrain->prescale) != timer_control->bit_prescale)) {
+            return false;
+        }
+        channels |= _BV(ptrain->oc_channel);
+    }
+    return true;
+}
+#endif
+
+static uint32_t pScaleLoad(uint32_t value, uint32_t scale, uint32_t unit)
+{
+    // value * scale / unit in 32 bits, saturating.  A value too wide to
+    // take the scale is shifted down with the unit, which costs the low
+    // bits of both and leaves the ratio good to a part in a hundred
+    while ((value > 0xFFFFFFFFUL / scale) && (unit > 1)) {
+        value >>= 1;
+        unit >>= 1;
+    }
+    if (value > 0xFFFFFFFFUL / scale) {
+        return 0xFFFFFFFFUL;
+    }
+    return value * scale / unit;
 }
-#endif
 
-#ifdef P_USE_TIMER4
-ISR (TIMER4_COMPA_vect) 
+static void pAddLoad(ptimerload_t *load, uint32_t *busy, uint16_t prescale,
+                        uint32_t unit_counts, uint32_t isrs, uint32_t cycles)
 {
-    pHandleInterrupts(PTIMER4, &TCNT4, &OCR4A); 
+    // isrs interrupts costing cycles in all, every unit_counts of the timer.
+    // busy is the CPU share in 1/65536ths, so it sums without a 64 bit
+    // divide while pStartTimer has interrupts off
+    uint32_t unit = unit_counts * prescale;
+    if ((unit == 0) || (unit / prescale != unit_counts)) {
+        unit = (unit_counts == 0) ? 1 : 0xFFFFFFFFUL;
+    }
+    uint32_t rate = pScaleLoad(isrs, F_CPU, unit);
+    uint32_t share = pScaleLoad(cycles, 65536UL, unit);
+    load->isr_per_second = (rate > 0xFFFFFFFFUL - load->isr_per_second) ? 
+                                0xFFFFFFFFUL : load->isr_per_second + rate;
+    *busy = (share > 0xFFFFFFFFUL - *busy) ? 0xFFFFFFFFUL : *busy + share;
+}
+
+static uint16_t pLoadPermille(uint32_t busy)
+{
+    // a 1/65536ths CPU share in permille, 0xFFFF at 65.5 CPUs and up
+    if (busy >= 4294967UL) {
+        return 0xFFFF;
+    }
+    return (busy * 125) >> 13;
+}
+
+static inline uint32_t pWrapISRs(uint32_t interval)
+{
+    // the compare rollovers pMoveCompare lets pass in an interval
+    return (interval == 0) ? 0 : ((interval - 1) >> 16);
+}
+
+static void pAddPulseLoad(  ptimerload_t *load, uint32_t *busy, uint16_t prescale,
+                            uint32_t pulse, uint32_t period, uint32_t edge_cycles, 
+                            uint32_t fall_cycles)
+{
+    // a rising and a falling edge every period, or a DC run that moves
+    // the compare and counts and checks a period every pulse
+    uint32_t interval;
+    if (period == 0) {
+        pAddLoad(load, busy, prescale, pulse, 1 + pWrapISRs(pulse), 
+                    P_LOAD_ISR_CYCLES * (1 + pWrapISRs(pulse)) + 
+                    P_LOAD_COMPARE_CYCLES + 2 * P_LOAD_PERIOD_CYCLES);
+        interval = pulse;
+    }
+    else {
+        uint32_t wraps = pWrapISRs(pulse) + pWrapISRs(period - pulse);
+        pAddLoad(load, busy, prescale, period, 2 + wraps, 
+                    edge_cycles + fall_cycles + P_LOAD_ISR_CYCLES * wraps);
+        interval = (pulse < period - pulse) ? pulse : (period - pulse);
+    }
+    if (fall_cycles > load->isr_cycles) {
+        load->isr_cycles = fall_cycles;
+    }
+    if (edge_cycles > load->isr_cycles) {
+        load->isr_cycles = edge_cycles;
+    }
+    interval *= prescale;
+    if ((load->min_interval == 0) || (interval < load->min_interval)) {
+        load->min_interval = interval;
+    }
+}
+
+static void pClearLoad(ptimerload_t *load)
+{
+    load->isr_per_second = 0;
+    load->isr_cycles = 0;
+    load->min_interval = 0;
+    load->load_permille = 0;
+    load->feasible = true;
+}
+
+static uint32_t pTimerLoad(timers16bit_t timer, ptimerload_t *load)
+{
+    // fill in load for a timer as configured, or as running, and return
+    // the CPU share its ISRs take in 1/65536ths.  The ISR costs are those of
+    // the P_LOAD_ cost model, the intervals those of the ptrains, ramps 
+    // at cruise and programs at their shortest period
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    uint16_t prescale = pGetTimerPrescale(timer);
+    uint32_t busy = 0;
+    pClearLoad(load);
+    if ((prescale == 0) || (timer_control->number_of_ptrains == 0)) {
+        return 0;
+    }
+    // each edge moves the compare, counts or checks the period and
+    // writes every port group
+    uint32_t writes = (P_LOAD_GROUP_CYCLES + P_LOAD_PORT_CYCLES) * 
+                        timer_control->number_of_port_groups;
+    uint32_t edge_cycles = P_LOAD_ISR_CYCLES + P_LOAD_COMPARE_CYCLES + 
+                            P_LOAD_PERIOD_CYCLES + writes;
+    uint32_t fall_cycles = edge_cycles + (timer_control->use_limit ? P_LOAD_READ_CYCLES : 0);
+    uint32_t pulse = timer_control->pulse_counts;
+    uint32_t period = timer_control->period_counts;
+#ifdef P_USE_RAMP
+    if (p_ramps[timer].active) {
+        period = p_ramps[timer].cruise_period;
+    }
+#endif
+#ifdef P_USE_HARDWARE_PWM
+    bool hardware = pIsTimerActive(timer) ? timer_control->hardware : pCanUseHardware(timer);
+    if (hardware) {
+        // only the overflow at the start of each period
+        pAddLoad(load, &busy, prescale, period, 1, fall_cycles - writes);
+        load->isr_cycles = fall_cycles - writes;
+        load->min_interval = period * prescale;
+    }
+    else
+#endif
+    switch (timer_control->timer_mode) {
+#ifdef P_USE_SCHEDULER
+        case PMODE_SCHEDULE:
+            // one batch per edge at worst, each writing one port
+            for (uint8_t i = 0; i < timer_control->number_of_ptrains; i++) {
+                ptrain_t *ptrain = &ptrains[timer_control->ptrain_idxs[i]];
+                uint32_t batch_cycles = P_LOAD_ISR_CYCLES + P_LOAD_COMPARE_CYCLES + 
+                                        P_LOAD_PORT_CYCLES;
+                pAddPulseLoad(load, &busy, prescale, ptrain->pulse_counts, 
+                                ptrain->period_counts, batch_cycles, batch_cycles);
+            }
+            break;
+#endif
+#ifdef P_USE_BAM
+        case PMODE_BAM: {
+            // P_BAM_BITS slots a frame, each writing every port
+            uint32_t wraps = 0;
+            for (uint8_t bit = 0; bit < P_BAM_BITS; bit++) {
+                wraps += pWrapISRs(pulse << bit);
+            }
+            pAddLoad(load, &busy, prescale, pulse * ((1UL << P_BAM_BITS) - 1), 
+                        P_BAM_BITS + wraps, P_BAM_BITS * edge_cycles + P_LOAD_ISR_CYCLES * wraps);
+            load->isr_cycles = edge_cycles;
+            load->min_interval = pulse * prescale;
+            break;
+        }
+#endif
+#ifdef P_USE_PROGRAM
+        case PMODE_PROGRAM: {
+            volatile pprogram_t *program = &p_programs[timer];
+            uint16_t pc = 0;
+            uint32_t shortest = 0;
+            while ((program->code != NULL) && (pc < program->length)) {
+                uint8_t op = pProgramRead(program->code, program->progmem, pc);
+                if (op == POP_PULSE) {
+                    uint32_t values[2] = { 0, 0 };
+                    for (uint8_t i = 0; i < 8; i++) {
+                        values[i / 4] |= (uint32_t)pProgramRead(program->code, program->progmem,
+                                                    pc + 1 + i) << (8 * (i % 4));
+                    }
+                    uint32_t interval = (values[0] < values[1] - values[0]) ? 
+                                            values[0] : (values[1] - values[0]);
+                    if ((shortest == 0) || (interval < shortest)) {
+                        shortest = interval;
+                        pulse = values[0];
+                        period = values[1];
+                    }
+                }
+                pc += p_program_sizes[op];
+            }
+            pAddPulseLoad(load, &busy, prescale, pulse, period, edge_cycles, fall_cycles);
+            break;
+        }
+#endif
+        default:
+            pAddPulseLoad(load, &busy, prescale, pulse, period, edge_cycles, fall_cycles);
+            break;
+    }
+    load->load_permille = pLoadPermille(busy);
+    load->feasible = (load->isr_cycles <= load->min_interval);
+    return busy;
+}
+
+uint8_t pAnalyzeLoad(uint8_t timer_mask, pload_t *load) {
+    // estimate the interrupt rate and CPU share of the timers with 
+    // _BV(timer) set in timer_mask, running or not, and of all of them
+    // together.  Returns ERROR_LOAD when a timer can't keep up with its
+    // edges or they take more than P_LOAD_MAX_PERMILLE of the CPU
+    uint32_t busy = 0;
+    load->feasible = true;
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        ptimerload_t *timer_load = &load->timers[timer];
+        if (timer_mask & _BV(timer)) {
+            uint32_t share = pTimerLoad((timers16bit_t)timer, timer_load);
+            busy = (share > 0xFFFFFFFFUL - busy) ? 0xFFFFFFFFUL : busy + share;
+            load->feasible = load->feasible && timer_load->feasible;
+        }
+        else {
+            pClearLoad(timer_load);
+        }
+    }
+    load->load_permille = pLoadPermille(busy);
+    if (load->load_permille > P_LOAD_MAX_PERMILLE) {
+        load->feasible = false;
+    }
+    return load->feasible ? 0 : ERROR_LOAD;
 }
+
+// what pStartTimer makes live before its checks, put back when one of them
+// refuses the start so the timer and its queue are as they were
+typedef struct {
+    uint32_t    pulse_counts;
+    uint32_t    period_counts;
+    uint32_t    period_num_limit;
+    uint32_t    update_period;
+#ifdef P_USE_SEGMENTS
+    uint16_t    segments_done;
+    uint16_t    underruns;
+    uint8_t     segment_tail;
 #endif
+    uint8_t     bit_prescale;
+    bool        update_pending;
+} pstartundo_t;
 
-#ifdef P_USE_TIMER5
-ISR (TIMER5_COMPA_vect) 
+static void pSaveStart(timers16bit_t timer, pstartundo_t *undo)
 {
-    pHandleInterrupts(PTIMER5, &TCNT5, &OCR5A); 
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    undo->pulse_counts = timer_control->pulse_counts;
+    undo->period_counts = timer_control->period_counts;
+    undo->period_num_limit = timer_control->period_num_limit;
+    undo->update_period = timer_control->update_period;
+    undo->bit_prescale = timer_control->bit_prescale;
+    undo->update_pending = timer_control->update_pending;
+#ifdef P_USE_SEGMENTS
+    undo->segments_done = p_segments[timer].segments_done;
+    undo->underruns = p_segments[timer].underruns;
+    undo->segment_tail = p_segments[timer].tail;
+#endif
 }
+
+static void pUndoStart(timers16bit_t timer, const pstartundo_t *undo)
+{
+    // the timer is stopped, nothing else moves these
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    timer_control->pulse_counts = undo->pulse_counts;
+    timer_control->period_counts = undo->period_counts;
+    timer_control->period_num_limit = undo->period_num_limit;
+    timer_control->update_period = undo->update_period;
+    timer_control->bit_prescale = undo->bit_prescale;
+    timer_control->update_pending = undo->update_pending;
+#ifdef P_USE_SEGMENTS
+    p_segments[timer].segments_done = undo->segments_done;
+    p_segments[timer].underruns = undo->underruns;
+    p_segments[timer].tail = undo->segment_tail;   // the first segment is queued again
 #endif
+}
 
-static boolean pIsTimerActive(timers16bit_t timer)
+static uint8_t pCheckStart(timers16bit_t timer)
 {
-    // returns true if this timer is on
-    // mask out the top five bits to get a that prescaler registers
-    // in the lower 3 bits.  When those are all zero, the timer is off
-    switch (timer){
+    // the checks of every mode on the run as it will start, 0 when it can
+    (void)timer;                            // without the modes there are none
+    uint8_t error = 0;
+#ifdef P_USE_SCHEDULER
+    if (timer_array[timer].timer_mode == PMODE_SCHEDULE) {
+        error = pStartSchedule(timer);
+    }
+#endif
+#ifdef P_USE_BAM
+    if (timer_array[timer].timer_mode == PMODE_BAM) {
+        error = pStartBAM(timer);
+    }
+#endif
+#ifdef P_USE_DDA
+    if (timer_array[timer].timer_mode == PMODE_DDA) {
+        error = pStartDDA(timer);
+    }
+#endif
+#ifdef P_USE_PROGRAM
+    if (timer_array[timer].timer_mode == PMODE_PROGRAM) {
+        error = pStartProgram(timer);
+    }
+#endif
+    if (error != 0) {
+        return error;
+    }
+#ifdef P_USE_HARDWARE_PWM
+    timer_array[timer].hardware = pCanUseHardware(timer);
+#endif
+#ifdef P_USE_LOAD_CHECK
+    // this timer and the ones running have to fit together
+    uint8_t timer_mask = _BV(timer);
+    for (uint8_t other = 0; other < NUMBER_OF_16BIT_TIMERS; other++) {
+        if (pIsTimerActive((timers16bit_t)other)) {
+            timer_mask |= _BV(other);
+        }
+    }
+    pload_t load;
+    if (pAnalyzeLoad(timer_mask, &load) != 0) {
+#ifdef P_USE_HARDWARE_PWM
+        timer_array[timer].hardware = false;
+#endif
+        return ERROR_LOAD;
+    }
+#endif
+    return 0;
+}
+
+uint8_t pStartTimer(timers16bit_t timer) {
+    // Start a Timer and reset its count
+    volatile timer16control_t *timer_control = &timer_array[timer];
+
+    // set up parameters
+    if ((pIsTimerActive(timer) == false) &&
+            (timer_control->number_of_ptrains > 0)) {
+#ifdef P_USE_LIMIT_INTERRUPTS
+        if (timer_control->use_limit_interrupt && pIsAtLimit(timer)) {
+            // no edge will come to stop it
+            pTripLimit(timer, PLIMIT_AT_START);
+            return ERROR_LIMIT;
+        }
+#endif
+        // the pending update, the first segment and the ramp go live first
+        // so the checks see the run as it will start
+        pstartundo_t undo;
+        pSaveStart(timer, &undo);
+        if (timer_control->update_pending) {
+            pCommitUpdate(timer_control);   // the run it was meant for ended first
+        }
+#ifdef P_USE_RAMP
+        if (p_ramps[timer].active) {
+            timer_control->period_counts = p_ramps[timer].table[0];
+            timer_control->period_num_limit = p_ramps[timer].total_steps;
+        }
+#endif
+#ifdef P_USE_SEGMENTS
+        // a queued segment takes the place of the ptrain values
+        p_segments[timer].segments_done = 0;
+        pNextSegment(timer);
+#endif
+        if (timer_control->period_counts == 0) {
+            timer_control->pulsed_state = PDC_INIT; // DC opertion
+        }
+        else {
+            timer_control->pulsed_state = PPULSE_LO; // variable
+        }
+        uint8_t error = pCheckStart(timer);
+        if (error != 0) {
+            pUndoStart(timer, &undo);
+            return error;
+        }
+        timer_control->number_of_periods = 0;       // clear the period counter
+        timer_control->compare_wraps = 0;
+#ifdef P_USE_RAMP
+        if (p_ramps[timer].active) {
+            // every run goes through the whole ramp
+            volatile pramp_t *ramp = &p_ramps[timer];
+            ramp->step = 1;
+            ramp->period_carry = 0;
+            ramp->period = (uint32_t)ramp->table[0] << 16;
+            ramp->speed_sq = ramp->table_speed_sq;
+            ramp->speed_sq_step = ramp->table_speed_sq_step;
+        }
+#endif
+#ifdef P_USE_HARDWARE_PWM
+        if (timer_control->hardware) {
+            pEnableHardware(timer);
+            return 0;
+        }
+#endif
+        pEnableISR(timer);
+        return 0;
+    }
+    else {
+        return ERROR_TIMER_RUNNING;
+    }
+}
+
+#ifdef P_USE_BAM
+uint8_t pSetBAMDuty(uint8_t ptrain_idx, uint16_t duty) {
+    // set how many of the (1 << P_BAM_BITS) - 1 slot units of each frame the
+    // ptrain is HIGH.  Takes effect at pCommitBAM, so set every duty first
+    if (!pIsValidPTrain(ptrain_idx)) {
+        return ERROR_PTRAIN_IDX;
+    }
+    if (duty >= (1UL << P_BAM_BITS)) {
+        return ERROR_OUT_OF_RANGE;
+    }
+    ptrains[ptrain_idx].bam_duty = duty;
+    return 0;
+}
+
+uint8_t pCommitBAM(timers16bit_t timer) {
+    // publish the duties of every ptrain on a PMODE_BAM timer together.  A
+    // running timer outputs the new duties from the start of its next frame
+    // so no frame mixes old and new ones, pIsUpdatePending says when
+    volatile pbam_t *bam = &p_bams[timer];
+    if (!pIsTimerActive(timer)) {
+        bam->pending = false;
+        pBuildBAM(timer, bam->live);
+        return 0;
+    }
+    // the ISR only swaps while pending is set, so with it cleared the
+    // spare buffer is ours until it is set again
+    bam->pending = false;
+    pBuildBAM(timer, bam->live ^ 1);
+    bam->pending = true;
+    return 0;
+}
+#endif
+
+#ifdef P_USE_DDA
+uint8_t pSetDDASteps(uint8_t ptrain_idx, uint32_t steps) {
+    // steps the ptrain makes in the next PMODE_DDA move of its timer, the
+    // pulse width and timer period come from the timer as usual
+    if (!pIsValidPTrain(ptrain_idx)) {
+        return ERROR_PTRAIN_IDX;
+    }
+    if (pIsTimerActive(ptrains[ptrain_idx].timer_number) &&
+            (timer_array[ptrains[ptrain_idx].timer_number].timer_mode == PMODE_DDA)) {
+        return ERROR_TIMER_RUNNING;
+    }
+    ptrains[ptrain_idx].dda_steps = steps;
+    return 0;
+}
+#endif
+
+#ifdef P_USE_PROGRAM
+uint8_t pLoadProgram(timers16bit_t timer, const uint8_t *code, uint16_t length, bool progmem) {
+    // give a stopped PMODE_PROGRAM timer a program to run, in flash when 
+    // progmem is set.  The code has to stay put while the timer runs.  It
+    // is checked here so the ISR can trust it: every opcode known and whole,
+    // jumps to the start of an instruction, loops closed and nested no
+    // deeper than P_PROGRAM_LOOP_DEPTH, pulses shorter than their period,
+    // inputs on real pins and no running off the end.  Returns 
+    // ERROR_PROGRAM otherwise
+    if (pIsTimerActive(timer)) {
+        return ERROR_TIMER_RUNNING;
+    }
+    uint16_t pc = 0;
+    uint8_t depth = 0;
+    bool ended = false;
+    while (pc < length) {
+        uint8_t op = pProgramRead(code, progmem, pc);
+        if ((op >= NUMBER_OF_POPS) || (pc + p_program_sizes[op] > length)) {
+            return ERROR_PROGRAM;
+        }
+        if (op == POP_LOOP) {
+            if (++depth > P_PROGRAM_LOOP_DEPTH) {
+                return ERROR_PROGRAM;
+            }
+        }
+        else if (op == POP_NEXT) {
+            if (depth-- == 0) {
+                return ERROR_PROGRAM;
+            }
+        }
+        else if (op == POP_PULSE) {
+            uint32_t pulse = 0;
+            uint32_t period = 0;
+            for (uint8_t i = 0; i < 4; i++) {
+                pulse |= (uint32_t)pProgramRead(code, progmem, pc + 1 + i) << (8 * i);
+                period |= (uint32_t)pProgramRead(code, progmem, pc + 5 + i) << (8 * i);
+            }
+            if ((pulse == 0) || (pulse >= period)) {
+                return ERROR_PROGRAM;       // no DC in a program
+            }
+        }
+        else if ((op == POP_WAIT) || (op == POP_UNTIL)) {
+            if (digitalPinToPort(pProgramRead(code, progmem, pc + 1)) == NOT_A_PIN) {
+                return ERROR_PROGRAM;
+            }
+        }
+        else if (op == POP_JUMP) {
+            // the target has to be an instruction we meet on this pass
+            uint16_t target = pProgramRead(code, progmem, pc + 1) | 
+                                ((uint16_t)pProgramRead(code, progmem, pc + 2) << 8);
+            uint16_t at = 0;
+            while (at < target) {
+                uint8_t target_op = pProgramRead(code, progmem, at);
+                if (target_op >= NUMBER_OF_POPS) {
+                    return ERROR_PROGRAM;
+                }
+                at += p_program_sizes[target_op];
+            }
+            if ((at != target) || (target >= length)) {
+                return ERROR_PROGRAM;
+            }
+        }
+        ended = (op == POP_END) || (op == POP_JUMP);
+        pc += p_program_sizes[op];
+    }
+    if (!ended || (depth != 0)) {
+        return ERROR_PROGRAM;
+    }
+    volatile pprogram_t *program = &p_programs[timer];
+    program->code = code;
+    program->length = length;
+    program->progmem = progmem;
+    program->pc = 0;
+    return 0;
+}
+
+uint16_t pGetProgramCounter(timers16bit_t timer) {
+    // byte of the instruction a PMODE_PROGRAM timer runs next
+    uint8_t oldSREG = SREG;
+    cli();
+    uint16_t pc = p_programs[timer].pc;
+    SREG = oldSREG;
+    return pc;
+}
+#endif
+
+static void pSetTimerCount(timers16bit_t timer, uint16_t count) {
+    switch (timer) {
         case PTIMER1:
-            return ((TCCR1B & 0x07) == 0x00) ? false : true;
+            TCNT1 = count;
+            break;
         case PTIMER3:
-            return ((TCCR3B & 0x07) == 0x00) ? false : true;
+            TCNT3 = count;
+            break;
         case PTIMER4:
-            return ((TCCR4B & 0x07) == 0x00) ? false : true;
+            TCNT4 = count;
+            break;
         case PTIMER5:
-            return ((TCCR5B & 0x07) == 0x00) ? false : true;
+            TCNT5 = count;
+            break;
         default:
-            return false;
+            break;
     }
 }
 
-// Control Functions
-////////////////////
+static void pHoldTimer(timers16bit_t timer, uint16_t count) {
+    // stop the clock of a timer pStartTimers started, preload its counter
+    // and drop a compare match it made while running
+    switch (timer) {
+        case PTIMER1:
+            TCCR1B &= 0xF8;
+            TCNT1 = count;
+            TIFR1 |= _BV(OCF1A);
+            break;
+        case PTIMER3:
+            TCCR3B &= 0xF8;
+            TCNT3 = count;
+            TIFR3 |= _BV(OCF3A);
+            break;
+        case PTIMER4:
+            TCCR4B &= 0xF8;
+            TCNT4 = count;
+            TIFR4 |= _BV(OCF4A);
+            break;
+        case PTIMER5:
+            TCCR5B &= 0xF8;
+            TCNT5 = count;
+            TIFR5 |= _BV(OCF5A);
+            break;
+        default:
+            break;
+    }
+}
 
-uint8_t pNewPTrain(void) {
-    // returns the ptrain_index
-    uint8_t temp = ptrain_count;
-    if( ptrain_count < NUMBER_OF_PTRAINS) {
-        ptrains[ptrain_count].prescale = DEFAULT_PTRAIN_PRESCALE;
-        ptrain_count++;
-        return temp;
+static inline uint16_t pSyncLead(uint8_t timer) {
+    // counts a prescale 1 timer makes between its TCCRnB store and the
+    // release, one sts for each later timer and the out to GTCCR
+    if (timer_array[timer].bit_prescale != 0x01) {
+        return 0;
     }
-    else {
-        return ERROR_PTRAIN_IDX ;  // too many PTRAINS 
+    return (NUMBER_OF_16BIT_TIMERS - 1 - timer) * P_SYNC_STORE_CYCLES + P_SYNC_RELEASE_CYCLES;
+}
+
+uint8_t pStartTimers(uint8_t timer_mask, const uint16_t *offsets) {
+    // Start the timers with bit _BV(timer) set in timer_mask on the same
+    // clock edge.  offsets, indexed by timer or NULL for none, delays the
+    // first edge of each timer by that many of its counts:
+    // 1. hold the shared prescaler in reset with GTCCR TSM and PSRSYNC
+    // 2. start each timer as pStartTimer does, its counter can't move
+    // 3. preload each counter offset counts before its first compare
+    // 4. release the prescaler, every timer takes its first count together
+    // Timers at prescale 1 bypass the prescaler, so they are held stopped
+    // and restarted by back to back stores just before the release, each
+    // preloaded the counts it makes ahead of it.  The hardware output 
+    // compare mode is not used
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        if (!(timer_mask & _BV(timer))) {
+            continue;
+        }
+        if (pIsTimerActive((timers16bit_t)timer) || 
+                (timer_array[timer].number_of_ptrains == 0)) {
+            return ERROR_TIMER_RUNNING;
+        }
+        if ((offsets != NULL) && 
+                (offsets[timer] > 0xFFFF - SMALL_COUNT - pSyncLead(timer))) {
+            return ERROR_OUT_OF_RANGE;
+        }
+    }
+    uint8_t oldSREG = SREG;
+    cli();
+    GTCCR = _BV(TSM) | _BV(PSRSYNC);
+    p_sync_start = true;
+    uint8_t error = 0;
+    uint8_t held_mask = 0;                  // prescale 1 timers to restart
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        if (!(timer_mask & _BV(timer))) {
+            continue;
+        }
+        error = pStartTimer((timers16bit_t)timer);
+        if (error != 0) {
+            break;
+        }
+        uint16_t count = (offsets != NULL) ? -offsets[timer] : 0;
+        if (timer_array[timer].bit_prescale == 0x01) {
+            pHoldTimer((timers16bit_t)timer, count - pSyncLead(timer));
+            held_mask |= _BV(timer);
+        }
+        else if (offsets != NULL) {
+            pSetTimerCount((timers16bit_t)timer, count);
+        }
+    }
+    if (error != 0) {
+        for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+            if (timer_mask & _BV(timer)) {
+                pStopTimer((timers16bit_t)timer);
+            }
+        }
+    }
+    else if (held_mask != 0) {
+        // a fixed run of stores, so the lead of each timer is known
+        uint8_t tccr1b = TCCR1B | ((held_mask & _BV(PTIMER1)) ? 0x01 : 0x00);
+        uint8_t tccr3b = TCCR3B | ((held_mask & _BV(PTIMER3)) ? 0x01 : 0x00);
+        uint8_t tccr4b = TCCR4B | ((held_mask & _BV(PTIMER4)) ? 0x01 : 0x00);
+        uint8_t tccr5b = TCCR5B | ((held_mask & _BV(PTIMER5)) ? 0x01 : 0x00);
+        TCCR1B = tccr1b;
+        TCCR3B = tccr3b;
+        TCCR4B = tccr4b;
+        TCCR5B = tccr5b;
+    }
+    p_sync_start = false;
+    GTCCR = 0x00;                           // all count from here
+    SREG = oldSREG;
+    return error;
+}
+
+uint8_t pStopTimer(timers16bit_t timer) {
+    // Timers are stopped by setting the prescaler bits to zero
+    // and clearing the interrupt mask
+    // This does not remove ptrains from the Timer so you can just restart
+    switch (timer) {
+        case PTIMER1:
+            TCCR1B &= 0xF8;         // clear the prescale to stop timer
+            TIMSK1 &=  ~_BV(OCIE1A);// disable the output compare interrupt
+            break;
+        case PTIMER3:
+            TCCR3B &= 0xF8;         // clear the prescale to stop timer
+            TIMSK3 &=  ~_BV(OCIE3A);// disable the output compare interrupt
+            break;
+        case PTIMER4:
+            TCCR4B &= 0xF8;         // clear the prescale to stop timer
+            TIMSK4 &=  ~_BV(OCIE4A); // disable the output compare interrupt
+            break;
+        case PTIMER5:
+            TCCR5B &= 0xF8;         // clear the prescale to stop timer
+            TIMSK5 &=  ~_BV(OCIE5A);// disable the output compare interrupt
+            break;
+        default:
+            break;
+    }
+#ifdef P_USE_HARDWARE_PWM
+    // hand the OCnx pins back to their PORT bits, which are LOW
+    switch (timer) {
+        case PTIMER1:
+            TCCR1A = 0x00;
+            TIMSK1 &= ~(_BV(TOIE1) | _BV(ICIE1));
+            break;
+        case PTIMER3:
+            TCCR3A = 0x00;
+            TIMSK3 &= ~(_BV(TOIE3) | _BV(ICIE3));
+            break;
+        case PTIMER4:
+            TCCR4A = 0x00;
+            TIMSK4 &= ~(_BV(TOIE4) | _BV(ICIE4));
+            break;
+        case PTIMER5:
+            TCCR5A = 0x00;
+            TIMSK5 &= ~(_BV(TOIE5) | _BV(ICIE5));
+            break;
+        default:
+            break;
     }
+#endif
+    return 0;
 }
 
-void pStartPTrain(uint8_t ptrain_idx) {
-        ptrain_t *ptrain_control = &ptrains[ptrain_idx];
-        pStartTimer(ptrain_control->timer_number);    
+uint16_t pCRC16(uint16_t crc, const uint8_t *data, uint16_t length) {
+    // CRC-16 with the reflected CCITT polynomial 0x8408, start from 0xFFFF.
+    // The same sum as _crc_ccitt_update of avr-libc
+    for (uint16_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : (crc >> 1);
+        }
+    }
+    return crc;
 }
 
-boolean pIsValidPTrain(uint8_t test) {
-    return (test < ptrain_count ) ? true: false;
+static inline uint32_t pReadLE32(const uint8_t *bytes) {
+    // the little endian uint32_t of the batch and config formats
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+            ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
 }
 
-uint8_t pAttach(uint8_t ptrain_index, int pin, timers16bit_t timer) {
-    if(ptrain_index < NUMBER_OF_PTRAINS ) {
-        ptrain_t *ptrain = &ptrains[ptrain_index];
-        pinMode( pin, OUTPUT);                      // set ptrain pin to output
-        ptrain->pin = pin;
-        // initialize the timer if it has not already been initialized 
-        ptrain->timer_number = timer;
-        ptrain->timer_index = pAddToTimer(timer, ptrain_index);
-        return ptrain_index;
-    }
-    else {
-        return ERROR_PTRAIN_IDX ;  // too many PTRAINS 
+static inline void pWriteLE32(uint8_t *bytes, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++) {
+        bytes[i] = value >> (8 * i);
     }
 }
 
-uint8_t pReAttach(uint8_t ptrain_index) {
-    if(ptrain_index < NUMBER_OF_PTRAINS ) {
-        ptrain_t *ptrain = &ptrains[ptrain_index];
-        // initialize the timer if it has not already been initialized 
-        ptrain->timer_index = pAddToTimer(ptrain->timer_number, ptrain_index);
-        return ptrain_index;
+#ifdef P_USE_BATCH
+// Batch Commands
+/////////////////
+// A batch frame sets and starts or stops many ptrains at once, little
+// endian like the AVR so it can be sent over a socket or serial port as is:
+//   P_BATCH_MAGIC, P_BATCH_VERSION, sequence, record count
+//   per record: ptrain, flags, pulse us (4), period us (4), count (4)
+//   pCRC16 of all of the above (2)
+// and is answered with a P_BATCH_ACK_SIZE ack:
+//   P_BATCH_ACK_MAGIC, sequence, status, record, pCRC16 of those 4 (2)
+static void pBatchRecord(const uint8_t *frame, uint8_t i, pbatchrecord_t *record) {
+    const uint8_t *bytes = &frame[P_BATCH_HEADER_SIZE + i * P_BATCH_RECORD_SIZE];
+    record->ptrain = bytes[0];
+    record->flags = bytes[1];
+    record->pulse = pReadLE32(&bytes[2]);
+    record->period = pReadLE32(&bytes[6]);
+    record->count = pReadLE32(&bytes[10]);
+}
+
+static uint8_t pBatchCounts(const pbatchrecord_t *record, uint32_t *pulse_counts,
+                            uint32_t *period_counts) {
+    // the counts the record leaves its ptrain with, at the prescale the
+    // ptrain already has like pSetPulseOnlyUS
+    ptrain_t *ptrain = &ptrains[record->ptrain];
+    *pulse_counts = ptrain->pulse_counts;
+    *period_counts = ptrain->period_counts;
+    if ((record->flags & P_BATCH_PULSE) &&
+            (pTimeToCounts(record->pulse, CLOCKCYCLESPERMICROSECOND, ptrain->prescale,
+                            pulse_counts) != 0)) {
+        return ERROR_OUT_OF_RANGE;
     }
-    else {
-        return ERROR_PTRAIN_IDX ;  // too many PTRAINS 
+    if ((record->flags & P_BATCH_PERIOD) &&
+            (pTimeToCounts(record->period, CLOCKCYCLESPERMICROSECOND, ptrain->prescale,
+                            period_counts) != 0)) {
+        return ERROR_OUT_OF_RANGE;
     }
+    if ((*pulse_counts >= *period_counts) && (*period_counts != 0)) {
+        return ERROR_TIMER_COUNT;
+    }
+    return 0;
 }
 
-uint8_t _pSetPulseUS(   uint8_t ptrain_index, uint32_t period, 
-                        uint32_t pulse_width, uint16_t period_num_limit, 
-                        uint16_t prescale) {
-    // set period and pulsewidth in microseconds
-    if(ptrain_index < NUMBER_OF_PTRAINS ) {
-        ptrain_t *ptrain = &ptrains[ptrain_index];
-        if ( (pulse_width < period) || (period == 0) ) {
-            switch (prescale) {
-                case 1024:
-                case 256:
-                case 64:
-                case 8:
-                case 1:
-                    ptrain->prescale = prescale;
-                    break;
-                default:
-                    ptrain->prescale = DEFAULT_PTRAIN_PRESCALE;
+static uint8_t pCheckBatch( const uint8_t *frame, uint16_t length, uint8_t *stop_mask,
+                            uint8_t *start_mask, uint8_t *bad_record) {
+    // everything pRunBatch can refuse, so a frame goes in whole or not at all
+    const uint8_t values = P_BATCH_PULSE | P_BATCH_PERIOD | P_BATCH_COUNT;
+    if ((length < P_BATCH_HEADER_SIZE) || (pBatchFrameSize(frame) != length)) {
+        return ERROR_FRAME;
+    }
+    if (pCRC16(0xFFFF, frame, length - 2) != (frame[length - 2] | (frame[length - 1] << 8))) {
+        return ERROR_FRAME;
+    }
+    uint8_t n = frame[3];
+    pbatchrecord_t record;
+    uint32_t pulse_counts, period_counts;
+    *stop_mask = 0;
+    *start_mask = 0;
+    for (uint8_t i = 0; i < n; i++) {
+        pBatchRecord(frame, i, &record);
+        *bad_record = i;
+        if ((record.flags & ~(values | P_BATCH_START | P_BATCH_STOP)) ||
+                ((record.flags & P_BATCH_START) && (record.flags & P_BATCH_STOP))) {
+            return ERROR_FRAME;
+        }
+        if (!pIsValidPTrain(record.ptrain)) {
+            return ERROR_PTRAIN_IDX;
+        }
+        for (uint8_t j = 0; j < i; j++) {
+            if (frame[P_BATCH_HEADER_SIZE + j * P_BATCH_RECORD_SIZE] == record.ptrain) {
+                return ERROR_FRAME;         // one record per ptrain
             }
-            ptrain->period_counts = US_TO_COUNTS(period,ptrain->prescale);
-            ptrain->pulse_counts = US_TO_COUNTS(pulse_width,ptrain->prescale);
-            ptrain->period_num_limit = period_num_limit;
-            return 0;
         }
-        else {
+        timers16bit_t timer = ptrains[record.ptrain].timer_number;
+        if ((timer >= NUMBER_OF_16BIT_TIMERS) || (timer_array[timer].number_of_ptrains == 0)) {
             return ERROR_TIMER_COUNT;
         }
-
+        uint8_t error = pBatchCounts(&record, &pulse_counts, &period_counts);
+        if (error != 0) {
+            return error;
+        }
+        if (record.flags & P_BATCH_STOP) {
+            *stop_mask |= _BV(timer);
+        }
+        if (record.flags & P_BATCH_START) {
+            *start_mask |= _BV(timer);
+        }
     }
-    else {
-        return ERROR_PTRAIN_IDX ;  // too many PTRAINS  
+    // a timer the frame stops first can take any values and start again
+    for (uint8_t i = 0; i < n; i++) {
+        pBatchRecord(frame, i, &record);
+        *bad_record = i;
+        timers16bit_t timer = ptrains[record.ptrain].timer_number;
+        if (*stop_mask & _BV(timer)) {
+            continue;
+        }
+        if (((record.flags & values) && (pCanReload(timer) != 0)) ||
+                ((record.flags & P_BATCH_START) && pIsTimerActive(timer))) {
+            return ERROR_TIMER_RUNNING;
+        }
     }
-}       
-
-uint8_t pSetPulseUS(uint8_t ptrain_index, uint32_t period, 
-                    uint32_t pulse_width, uint16_t period_num_limit) {
-    // for use when you don't want to set the prescaler or it's already set
-    return _pSetPulseUS(ptrain_index, period, pulse_width, 
-                                period_num_limit, ptrains[ptrain_index].prescale); 
-}
-
-uint8_t pSetPulseOnlyUS(uint8_t ptrain_index, uint32_t pulse_width) {
-    ptrain_t *ptrain = &ptrains[ptrain_index];
-    ptrain->pulse_counts = US_TO_COUNTS(pulse_width,ptrain->prescale);
-    return 0;
-}
-uint8_t pSetPeriodOnlyUS(uint8_t ptrain_index, uint32_t period) {
-    ptrain_t *ptrain = &ptrains[ptrain_index];
-    ptrain->period_counts = US_TO_COUNTS(period,ptrain->prescale);
-    return 0;
-}
-uint8_t pSetPeriodNumberOnly(uint8_t ptrain_index, uint16_t period_num_limit) {
-    ptrain_t *ptrain = &ptrains[ptrain_index];
-    ptrain->period_num_limit = period_num_limit;
+    *bad_record = P_BATCH_NO_RECORD;
     return 0;
-    
-}
-
-uint16_t pGetPulseCounts(uint8_t ptrain_index) {
-    return ptrains[ptrain_index].pulse_counts;
-}
-
-uint16_t pGetPeriodCounts(uint8_t ptrain_index) {
-    return ptrains[ptrain_index].period_counts;
 }
 
-uint16_t pGetPeriodNumber(uint8_t ptrain_index) {
-    return ptrains[ptrain_index].period_num_limit;
+static uint8_t pRunBatch(const uint8_t *frame, uint8_t stop_mask, uint8_t start_mask) {
+    // The ptrains take their new values with the interrupts on, the ISRs
+    // don't read them.  All the timers then stop, reload and start in one
+    // critical section: the running ones take their values together at the
+    // end of their current periods and the started ones share a clock edge
+    const uint8_t values = P_BATCH_PULSE | P_BATCH_PERIOD | P_BATCH_COUNT;
+    uint8_t n = frame[3];
+    pbatchrecord_t record;
+    for (uint8_t i = 0; i < n; i++) {
+        pBatchRecord(frame, i, &record);
+        ptrain_t *ptrain = &ptrains[record.ptrain];
+        uint32_t pulse_counts, period_counts;
+        pBatchCounts(&record, &pulse_counts, &period_counts);
+        ptrain->pulse_counts = pulse_counts;
+        ptrain->period_counts = period_counts;
+        if (record.flags & P_BATCH_COUNT) {
+            ptrain->period_num_limit = record.count;
+        }
+    }
+    uint8_t error = 0;
+    uint8_t oldSREG = SREG;
+    cli();
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        if (stop_mask & _BV(timer)) {
+            pStopTimer((timers16bit_t)timer);
+        }
+    }
+    for (uint8_t i = 0; i < n; i++) {
+        pBatchRecord(frame, i, &record);
+        if (record.flags & values) {
+            pReloadToTimer(record.ptrain);
+        }
+    }
+    if (start_mask != 0) {
+        error = pStartTimers(start_mask, NULL);
+    }
+    SREG = oldSREG;
+    return error;
 }
 
-uint8_t pStop(uint8_t ptrain_index) {   
-    // 1. remove ptrain from it's timer16control
-    ptrain_t *ptrain = &ptrains[ptrain_index];
-    pStopTimer(ptrain->timer_number);
-    // ptrain->timer_index = pRemoveFromTimer(ptrain->timer_number, ptrain_index);
-    return ptrain->timer_index;
+uint16_t pBatchFrameSize(const uint8_t *header) {
+    // the size of the whole frame from its first P_BATCH_HEADER_SIZE bytes,
+    // 0 when they can't start a frame so a stream reader drops a byte and
+    // looks again
+    if ((header[0] != P_BATCH_MAGIC) || (header[1] != P_BATCH_VERSION) ||
+            (header[3] > P_BATCH_MAX_RECORDS)) {
+        return 0;
+    }
+    return P_BATCH_FRAME_SIZE(header[3]);
 }
 
-uint8_t pSetTimerPrescale(timers16bit_t timer, uint8_t prescale) {
-    uint8_t bit_prescale;
-    volatile timer16control_t *timer_control = &timer_array[timer];
-    switch(prescale) {
-        case 1024:
-            bit_prescale = 0x05;
-            break;
-        case 256:
-            bit_prescale = 0x04;
-            break;
-        case 64:
-            bit_prescale = 0x03;
-            break;
-        case 8:
-            bit_prescale = 0x02;
-            break;
-        default:
-            bit_prescale = 0x01;
+uint16_t pPackBatch(uint8_t *frame, uint8_t seq, const pbatchrecord_t *records, uint8_t n) {
+    // write a frame of n records for pApplyBatch, returns its size or 0
+    // when there are too many records.  frame needs P_BATCH_FRAME_SIZE(n)
+    if (n > P_BATCH_MAX_RECORDS) {
+        return 0;
     }
-    timer_control->bit_prescale = bit_prescale;
-    return 0;
+    frame[0] = P_BATCH_MAGIC;
+    frame[1] = P_BATCH_VERSION;
+    frame[2] = seq;
+    frame[3] = n;
+    for (uint8_t i = 0; i < n; i++) {
+        uint8_t *bytes = &frame[P_BATCH_HEADER_SIZE + i * P_BATCH_RECORD_SIZE];
+        bytes[0] = records[i].ptrain;
+        bytes[1] = records[i].flags;
+        pWriteLE32(&bytes[2], records[i].pulse);
+        pWriteLE32(&bytes[6], records[i].period);
+        pWriteLE32(&bytes[10], records[i].count);
+    }
+    uint16_t length = P_BATCH_FRAME_SIZE(n);
+    uint16_t crc = pCRC16(0xFFFF, frame, length - 2);
+    frame[length - 2] = crc;
+    frame[length - 1] = crc >> 8;
+    return length;
 }
 
-uint8_t pAddToTimer(timers16bit_t timer, uint8_t ptrain_idx) {
-    // Add a ptrain to a timer
-    volatile timer16control_t *timer_control = &timer_array[timer];
-    volatile uint8_t *ptrain_idxs = timer_control->ptrain_idxs;
-    ptrain_idxs[timer_control->number_of_ptrains] = ptrain_idx; // slide over ptrains
-    
-    timer_control->number_of_ptrains++;                   //increment ptrain count
-    // transfer values
-    return pReloadToTimer(ptrain_idx);
+uint8_t pApplyBatch(const uint8_t *frame, uint16_t length, uint8_t *ack) {
+    // Check a whole frame and only then apply every record of it, see
+    // pRunBatch.  The ack gets the status returned and the record it is
+    // about, ERROR_FRAME for a frame that is malformed, fails its CRC or
+    // has two records for one ptrain.  An error from pStartTimers leaves
+    // the new values in but the timers of the frame stopped
+    uint8_t bad_record = P_BATCH_NO_RECORD;
+    uint8_t stop_mask, start_mask;
+    uint8_t error = pCheckBatch(frame, length, &stop_mask, &start_mask, &bad_record);
+    if (error == 0) {
+        error = pRunBatch(frame, stop_mask, start_mask);
+    }
+    ack[0] = P_BATCH_ACK_MAGIC;
+    ack[1] = (length > 2) ? frame[2] : 0;
+    ack[2] = error;
+    ack[3] = bad_record;
+    uint16_t crc = pCRC16(0xFFFF, ack, 4);
+    ack[4] = crc;
+    ack[5] = crc >> 8;
+    return error;
 }
+#endif
 
-uint8_t pReloadToTimer(uint8_t ptrain_idx) {
-    // Add a ptrain to a timer
-    
-    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
-    volatile timer16control_t *timer_control = &timer_array[ptrain_control->timer_number];
-    
-    // transfer values
-    timer_control->pulse_counts = ptrain_control->pulse_counts;
-    timer_control->period_counts = ptrain_control->period_counts;
-    timer_control->period_num_limit = ptrain_control->period_num_limit;
-    pSetTimerPrescale(ptrain_control->timer_number, ptrain_control->prescale);
-    
-    return timer_control->number_of_ptrains;
+#ifdef P_USE_CONFIG
+// Configuration Snapshots
+//////////////////////////
+// A snapshot holds the ptrains and timers as pSaveConfig found them, with
+// the counts, prescale bits, ports and masks already worked out, so that
+// pRestoreConfig only copies them back.  Little endian throughout:
+//   'P', P_CONFIG_MAGIC, P_CONFIG_VERSION, ptrain_count, first released
+//   ptrain, NUMBER_OF_16BIT_TIMERS
+//   per timer: ptrains, mode, prescale bits, P_CONFIG_LIMIT_ flags, limit
+//   pin, limit state, pulse (4), period (4), periods (4), direction port,
+//   direction mask, direction forward
+//   per ptrain: timer, index or P_CONFIG_DETACHED, pin, port, pin mask,
+//   auto prescale, prescale (2), pulse (4), period (4), periods (4), OC
+//   channel, BAM duty (2), DDA steps (4)
+//   pCRC16 of all of the above (2)
+// Fields of features that aren't compiled in are 0.  Ramps, queued
+// segments, loaded programs and positions are not kept
+static void pConfigPut(pconfigio_t *io, const uint8_t *bytes, uint8_t n) {
+    if (io->dest != NULL) {
+        memcpy(&io->dest[io->address], bytes, n);
+    }
+    else {
+        // only writes the bytes that changed, which spares EEPROM wear
+        eeprom_update_block(bytes, (void *)(uintptr_t)io->address, n);
+    }
+    io->address += n;
+    io->crc = pCRC16(io->crc, bytes, n);
 }
 
-uint8_t pRemoveFromTimer(timers16bit_t timer, uint8_t ptrain_idx) {
-    // Remove a ptrain from a timer
-    volatile timer16control_t *timer_control = &timer_array[timer];
-    volatile uint8_t *ptrain_idxs = timer_control->ptrain_idxs;
-    uint8_t timer_index = ptrains[ptrain_idx].timer_index;
-    
-    if (timer_control->number_of_ptrains > 0) { 
-        for (int i = timer_index+1; i < timer_control->number_of_ptrains; i++)
-        {
-            ptrain_idxs[i-1] = ptrain_idxs[i]; // slide over ptrains
-        }
-        timer_control->number_of_ptrains--;  // decrement ptrain count
-        return PTRAIN_REMOVED;
+static void pConfigGet(pconfigio_t *io, uint8_t *bytes, uint8_t n) {
+    if (io->source != NULL) {
+        memcpy(bytes, &io->source[io->address], n);
     }
     else {
-        return ERROR_PTRAIN_REMOVED;
+        eeprom_read_block(bytes, (const void *)(uintptr_t)io->address, n);
     }
+    io->address += n;
+    io->crc = pCRC16(io->crc, bytes, n);
 }
 
-void pClearTimerOfPTrains(timers16bit_t timer) {
-    volatile timer16control_t *timer_control = &timer_array[timer];
-    timer_control->number_of_ptrains = 0;
+static uint8_t pPortNumber(volatile uint8_t *port) {
+    // the Arduino port number of an output register, 0 for none
+    for (uint8_t i = 1; (port != NULL) && (i < P_CONFIG_PORTS); i++) {
+        if (portOutputRegister(i) == port) {
+            return i;
+        }
+    }
+    return 0;
 }
 
-void pClearPTrainsTimer(uint8_t ptrain_idx) {
-    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
-    pClearTimerOfPTrains(ptrain_control->timer_number);
+static uint16_t pConfigSize(const uint8_t *header) {
+    // the size of a whole snapshot from its header, 0 when it isn't one
+    // this build can restore
+    if ((header[0] != 'P') || (header[1] != P_CONFIG_MAGIC) || 
+            (header[2] != P_CONFIG_VERSION) || (header[3] > NUMBER_OF_PTRAINS) ||
+            (header[5] != NUMBER_OF_16BIT_TIMERS)) {
+        return 0;
+    }
+    return P_CONFIG_SIZE(header[3]);
 }
 
-bool pIsPTrainActive(uint8_t ptrain_idx) {
-    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
-    volatile timer16control_t *timer_control = &timer_array[ptrain_control->timer_number];
-    if ((ptrain_idx == timer_control->ptrain_idxs[ptrain_control->timer_index]) && 
-        (pIsTimerActive(ptrain_control->timer_number)) ) {
-            return true;
+static void pWriteConfig(pconfigio_t *io) {
+    uint8_t bytes[P_CONFIG_PTRAIN_SIZE];
+    bytes[0] = 'P';
+    bytes[1] = P_CONFIG_MAGIC;
+    bytes[2] = P_CONFIG_VERSION;
+    bytes[3] = ptrain_count;
+    bytes[4] = p_free_ptrains;
+    bytes[5] = NUMBER_OF_16BIT_TIMERS;
+    pConfigPut(io, bytes, P_CONFIG_HEADER_SIZE);
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        volatile timer16control_t *timer_control = &timer_array[timer];
+        memset(bytes, 0, P_CONFIG_TIMER_SIZE);
+        bytes[0] = timer_control->number_of_ptrains;
+        bytes[1] = timer_control->timer_mode;
+        bytes[2] = timer_control->bit_prescale;
+        bytes[3] = timer_control->use_limit ? P_CONFIG_LIMIT_POLLED : 0;
+#ifdef P_USE_LIMIT_INTERRUPTS
+        bytes[3] |= timer_control->use_limit_interrupt ? P_CONFIG_LIMIT_INTERRUPT : 0;
+#endif
+        bytes[4] = timer_control->limit_pin;
+        bytes[5] = timer_control->limit_state;
+        pWriteLE32(&bytes[6], timer_control->pulse_counts);
+        pWriteLE32(&bytes[10], timer_control->period_counts);
+        pWriteLE32(&bytes[14], timer_control->period_num_limit);
+#ifdef P_USE_POSITION
+        bytes[18] = pPortNumber(timer_control->direction_port);
+        bytes[19] = timer_control->direction_mask;
+        bytes[20] = timer_control->direction_forward;
+#endif
+        pConfigPut(io, bytes, P_CONFIG_TIMER_SIZE);
+    }
+    for (uint8_t i = 0; i < ptrain_count; i++) {
+        ptrain_t *ptrain = &ptrains[i];
+        memset(bytes, 0, P_CONFIG_PTRAIN_SIZE);
+        bytes[0] = ptrain->timer_number;
+        if ((ptrain->timer_number == NUMBER_OF_16BIT_TIMERS) || pIsAttached(i)) {
+            bytes[1] = ptrain->timer_index;     // a released one links the free list
         }
-    else {
-        return false;
+        else {
+            bytes[1] = P_CONFIG_DETACHED;
+        }
+        bytes[2] = ptrain->pin;
+        bytes[3] = pPortNumber(ptrain->port);
+        bytes[4] = ptrain->pin_mask;
+        bytes[5] = ptrain->auto_prescale;
+        bytes[6] = ptrain->prescale;
+        bytes[7] = ptrain->prescale >> 8;
+        pWriteLE32(&bytes[8], ptrain->pulse_counts);
+        pWriteLE32(&bytes[12], ptrain->period_counts);
+        pWriteLE32(&bytes[16], ptrain->period_num_limit);
+#ifdef P_USE_HARDWARE_PWM
+        bytes[20] = ptrain->oc_channel;
+#endif
+#ifdef P_USE_BAM
+        bytes[21] = ptrain->bam_duty;
+        bytes[22] = ptrain->bam_duty >> 8;
+#endif
+#ifdef P_USE_DDA
+        pWriteLE32(&bytes[23], ptrain->dda_steps);
+#endif
+        pConfigPut(io, bytes, P_CONFIG_PTRAIN_SIZE);
     }
+    uint16_t crc = io->crc;
+    bytes[0] = crc;
+    bytes[1] = crc >> 8;
+    pConfigPut(io, bytes, 2);
 }
 
-timers16bit_t pGetTimer(uint8_t ptrain_idx) {
-    return ptrains[ptrain_idx].timer_number; 
+static uint8_t pCheckConfig(pconfigio_t *io) {
+    // everything pApplyConfig relies on, so a snapshot goes in whole or not
+    // at all: every slot of a timer taken by exactly one ptrain, the free
+    // list ending after the released ptrains and the CRC
+    uint8_t bytes[P_CONFIG_PTRAIN_SIZE];
+    uint8_t slots[NUMBER_OF_16BIT_TIMERS];
+    uint8_t taken[NUMBER_OF_16BIT_TIMERS][(PTRAINS_PER_TIMER + 7) / 8];
+    uint8_t next_free[NUMBER_OF_PTRAINS];
+    uint8_t is_free[(NUMBER_OF_PTRAINS + 7) / 8];
+    uint16_t slots_left = 0;
+    uint8_t num_free = 0;
+    memset(taken, 0, sizeof(taken));
+    memset(is_free, 0, sizeof(is_free));
+    pConfigGet(io, bytes, P_CONFIG_HEADER_SIZE);
+    uint8_t count = bytes[3];
+    uint8_t first_free = bytes[4];
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        pConfigGet(io, bytes, P_CONFIG_TIMER_SIZE);
+        if (pIsTimerActive((timers16bit_t)timer)) {
+            return ERROR_TIMER_RUNNING;
+        }
+        if ((bytes[0] > PTRAINS_PER_TIMER) || !pIsTimerModeBuilt(bytes[1]) ||
+                (bytes[18] >= P_CONFIG_PORTS)) {
+            return ERROR_CONFIG;
+        }
+        slots[timer] = bytes[0];
+        slots_left += bytes[0];
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        pConfigGet(io, bytes, P_CONFIG_PTRAIN_SIZE);
+        uint8_t timer = bytes[0];
+        uint8_t index = bytes[1];
+        if ((timer > NUMBER_OF_16BIT_TIMERS) || (bytes[3] >= P_CONFIG_PORTS)) {
+            return ERROR_CONFIG;
+        }
+        if (timer == NUMBER_OF_16BIT_TIMERS) {
+            is_free[i >> 3] |= _BV(i & 7);
+            next_free[i] = index;
+            num_free++;
+        }
+        else if (index != P_CONFIG_DETACHED) {
+            if ((index >= slots[timer]) || (taken[timer][index >> 3] & _BV(index & 7))) {
+                return ERROR_CONFIG;
+            }
+            taken[timer][index >> 3] |= _BV(index & 7);
+            slots_left--;
+        }
+    }
+    if (slots_left != 0) {
+        return ERROR_CONFIG;
+    }
+    for (uint8_t i = 0; i < num_free; i++) {
+        if ((first_free >= count) || !(is_free[first_free >> 3] & _BV(first_free & 7))) {
+            return ERROR_CONFIG;
+        }
+        first_free = next_free[first_free];
+    }
+    if (first_free != ERROR_PTRAIN_IDX) {
+        return ERROR_CONFIG;
+    }
+    uint16_t crc = io->crc;
+    pConfigGet(io, bytes, 2);
+    if (crc != (bytes[0] | (bytes[1] << 8))) {
+        return ERROR_CONFIG;
+    }
+    return 0;
 }
 
-bool pWasTimerLimitHit(timers16bit_t timer) {
-    return (timer_array[timer].limit_state == P_LIMIT_HIT); 
+static void pApplyConfig(pconfigio_t *io) {
+    // copy a checked snapshot back, no divisions and no pinMode
+    uint8_t bytes[P_CONFIG_PTRAIN_SIZE];
+    uint8_t limits[NUMBER_OF_16BIT_TIMERS];
+    pConfigGet(io, bytes, P_CONFIG_HEADER_SIZE);
+    uint8_t oldSREG = SREG;
+    cli();
+    ptrain_count = bytes[3];
+    p_free_ptrains = bytes[4];
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        volatile timer16control_t *timer_control = &timer_array[timer];
+        pConfigGet(io, bytes, P_CONFIG_TIMER_SIZE);
+        timer_control->number_of_ptrains = bytes[0];
+        timer_control->timer_mode = bytes[1];
+        timer_control->bit_prescale = bytes[2];
+        limits[timer] = bytes[3];
+        timer_control->use_limit = (bytes[3] & P_CONFIG_LIMIT_POLLED) != 0;
+        timer_control->limit_pin = bytes[4];
+        timer_control->limit_state = bytes[5];
+        timer_control->pulse_counts = pReadLE32(&bytes[6]);
+        timer_control->period_counts = pReadLE32(&bytes[10]);
+        timer_control->period_num_limit = pReadLE32(&bytes[14]);
+        timer_control->update_pending = false;
+        timer_control->pulsed_state = POFF;
+#ifdef P_USE_POSITION
+        timer_control->direction_port = bytes[18] ? portOutputRegister(bytes[18]) : NULL;
+        timer_control->direction_mask = bytes[19];
+        timer_control->direction_forward = bytes[20];
+#endif
+#ifdef P_USE_RAMP
+        p_ramps[timer].active = false;
+#endif
+    }
+    for (uint8_t i = 0; i < ptrain_count; i++) {
+        ptrain_t *ptrain = &ptrains[i];
+        pConfigGet(io, bytes, P_CONFIG_PTRAIN_SIZE);
+        ptrain->timer_number = (timers16bit_t)bytes[0];
+        ptrain->timer_index = bytes[1];
+        ptrain->pin = bytes[2];
+        ptrain->port = bytes[3] ? portOutputRegister(bytes[3]) : NULL;
+        ptrain->pin_mask = bytes[4];
+        ptrain->auto_prescale = bytes[5];
+        ptrain->prescale = bytes[6] | (bytes[7] << 8);
+        ptrain->pulse_counts = pReadLE32(&bytes[8]);
+        ptrain->period_counts = pReadLE32(&bytes[12]);
+        ptrain->period_num_limit = pReadLE32(&bytes[16]);
+#ifdef P_USE_HARDWARE_PWM
+        ptrain->oc_channel = bytes[20];
+#endif
+#ifdef P_USE_BAM
+        ptrain->bam_duty = bytes[21] | (bytes[22] << 8);
+#endif
+#ifdef P_USE_DDA
+        ptrain->dda_steps = pReadLE32(&bytes[23]);
+#endif
+        if ((bytes[0] < NUMBER_OF_16BIT_TIMERS) && (bytes[1] != P_CONFIG_DETACHED)) {
+            timer_array[bytes[0]].ptrain_idxs[bytes[1]] = i;
+            if (ptrain->port != NULL) {
+                // what pAttach does with pinMode and digitalWrite
+                *portModeRegister(bytes[3]) |= ptrain->pin_mask;
+                *ptrain->port &= ~ptrain->pin_mask;
+            }
+        }
+    }
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        pBuildPortGroups((timers16bit_t)timer);
+#ifdef P_USE_LIMIT_INTERRUPTS
+        for (uint8_t i = 0; i < P_LIMIT_INTERRUPTS; i++) {
+            p_limit_inputs[i].timers &= ~_BV(timer);
+        }
+        timer_array[timer].use_limit_interrupt = false;
+#endif
+    }
+    SREG = oldSREG;
+    // attachInterrupt takes its own critical section, so the interrupt
+    // limits go back once the snapshot is in
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        if (limits[timer] & P_CONFIG_LIMIT_INTERRUPT) {
+            pAttachLimitTimer((timers16bit_t)timer, timer_array[timer].limit_pin,
+                                timer_array[timer].limit_state);
+        }
+    }
 }
 
-
-bool pIsPTrainTimerActive(uint8_t ptrain_idx) {
-    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
-    volatile timer16control_t *timer_control = &timer_array[ptrain_control->timer_number];
-    return pIsTimerActive(ptrain_control->timer_number);
+uint16_t pSaveConfig(uint8_t *blob, uint16_t max_size) {
+    // write a snapshot of every ptrain and timer to blob, returns its size
+    // or 0 when that is more than max_size, see P_CONFIG_SIZE.  Save with
+    // the timers stopped to keep the values a running update would change
+    uint16_t size = P_CONFIG_SIZE(ptrain_count);
+    if (size > max_size) {
+        return 0;
+    }
+    pconfigio_t io = { NULL, blob, 0, 0xFFFF };
+    pWriteConfig(&io);
+    return size;
 }
 
-uint8_t pAttachLimitTimer(timers16bit_t timer, uint8_t limit_pin, uint8_t limit_state) {
-    volatile timer16control_t *timer_control = &timer_array[timer];
-    timer_control->limit_pin = limit_pin;
-    timer_control->limit_state = limit_state;
-    timer_control->use_limit = true;
+uint8_t pRestoreConfig(const uint8_t *blob, uint16_t size) {
+    // Bring every ptrain and timer back from a pSaveConfig snapshot, ready
+    // for pStartTimer.  The whole snapshot is checked first and nothing
+    // changes on an error: ERROR_CONFIG when it is damaged or from a build
+    // with other NUMBER_OF_PTRAINS, PTRAINS_PER_TIMER or timer modes, 
+    // ERROR_TIMER_RUNNING when a timer is running
+    if ((size < P_CONFIG_HEADER_SIZE) || (pConfigSize(blob) != size)) {
+        return ERROR_CONFIG;
+    }
+    pconfigio_t io = { blob, NULL, 0, 0xFFFF };
+    uint8_t error = pCheckConfig(&io);
+    if (error != 0) {
+        return error;
+    }
+    io.address = 0;
+    io.crc = 0xFFFF;
+    pApplyConfig(&io);
     return 0;
 }
 
-uint8_t pAttachLimit(uint8_t ptrain_idx, uint8_t limit_pin, uint8_t limit_state) {
-    ptrain_t *ptrain_control = &ptrains[ptrain_idx];
-    return pAttachLimitTimer(ptrain_control->timer_number, limit_pin, limit_state);
-}
-
-uint8_t pStartTimer(timers16bit_t timer) {
-    // Start a Timer and reset its count
-    volatile timer16control_t *timer_control = &timer_array[timer];
-    
-    // set up parameters
-    if ((pIsTimerActive(timer) == false) && 
-            (timer_control->number_of_ptrains > 0)) {
-        // initialize timer state
-        timer_control->number_of_periods = 0;       // clear the period counter
-        if (timer_control->period_counts == 0) {    
-            timer_control->pulsed_state = PDC_INIT; // DC opertion
-        }
-        else {
-            timer_control->pulsed_state = PPULSE_LO; // variable
-        }
-        pEnableISR(timer);
+uint16_t pSaveConfigEEPROM(uint16_t address) {
+    // pSaveConfig to the EEPROM from address on, 0 when it doesn't fit.
+    // Takes 3.3 ms for every byte that changed
+    uint16_t size = P_CONFIG_SIZE(ptrain_count);
+    if ((uint32_t)address + size > (uint32_t)E2END + 1) {
         return 0;
     }
-    else {
-        return ERROR_TIMER_RUNNING;
-    }
+    pconfigio_t io = { NULL, NULL, address, 0xFFFF };
+    pWriteConfig(&io);
+    return size;
 }
 
-uint8_t pStopTimer(timers16bit_t timer) {
-    // Timers are stopped by setting the prescaler bits to zero
-    // and clearing the interrupt mask
-    // This does not remove ptrains from the Timer so you can just restart
-    switch (timer) {
-        case PTIMER1:
-            TCCR1B &= 0xF8;         // clear the prescale to stop timer
-            TIMSK1 &=  ~_BV(OCIE1A);// disable the output compare interrupt
-            break;
-        case PTIMER3:
-            TCCR3B &= 0xF8;         // clear the prescale to stop timer
-            TIMSK3 &=  ~_BV(OCIE3A);// disable the output compare interrupt
-            break;
-        case PTIMER4:
-            TCCR4B &= 0xF8;         // clear the prescale to stop timer
-            TIMSK4 &=  ~_BV(OCIE4A); // disable the output compare interrupt
-            break;
-        case PTIMER5:
-            TCCR5B &= 0xF8;         // clear the prescale to stop timer
-            TIMSK5 &=  ~_BV(OCIE5A);// disable the output compare interrupt
-            break;
-        default:
-            break;
+uint8_t pRestoreConfigEEPROM(uint16_t address) {
+    // pRestoreConfig from the EEPROM, which is read twice: once to check
+    // it and once to copy it
+    uint8_t header[P_CONFIG_HEADER_SIZE];
+    if ((uint32_t)address + P_CONFIG_HEADER_SIZE > (uint32_t)E2END + 1) {
+        return ERROR_CONFIG;
+    }
+    eeprom_read_block(header, (const void *)(uintptr_t)address, P_CONFIG_HEADER_SIZE);
+    uint16_t size = pConfigSize(header);
+    if ((size == 0) || ((uint32_t)address + size > (uint32_t)E2END + 1)) {
+        return ERROR_CONFIG;
     }
+    pconfigio_t io = { NULL, NULL, address, 0xFFFF };
+    uint8_t error = pCheckConfig(&io);
+    if (error != 0) {
+        return error;
+    }
+    io.address = address;
+    io.crc = 0xFFFF;
+    pApplyConfig(&io);
     return 0;
 }
+#endif
 
 uint8_t pSetupTimers() {
     // ensure timer state is where we want it
@@ -646,4 +4472,42 @@ uint8_t pSetupTimers() {
     return 0;
 }
 
+// RAM Footprint
+////////////////
+// bytes of RAM the ptrains, the timers and the features in use hold, to
+// weigh NUMBER_OF_PTRAINS, PTRAINS_PER_TIMER and the queue sizes against
+// the network buffers of a sketch.  Define P_RAM_BUDGET to make going over
+// it a compile error
+static const uint16_t p_ram_footprint = sizeof(ptrains) + sizeof(timer_array)
+#ifdef P_USE_TRACE
+                                        + sizeof(p_trace)
+#endif
+#ifdef P_USE_EVENTS
+                                        + sizeof(p_events)
+#endif
+#ifdef P_USE_TIMER_STATS
+                                        + sizeof(p_timer_stats)
+#endif
+#ifdef P_USE_RAMP
+                                        + sizeof(p_ramps)
+#endif
+#ifdef P_USE_SEGMENTS
+                                        + sizeof(p_segments)
+#endif
+#ifdef P_USE_BAM
+                                        + sizeof(p_bams)
+#endif
+#ifdef P_USE_PROGRAM
+                                        + sizeof(p_programs)
+#endif
+#ifdef P_USE_LIMIT_INTERRUPTS
+                                        + sizeof(p_limit_inputs)
+#endif
+                                        ;
+
+#ifdef P_RAM_BUDGET
+static_assert(p_ram_footprint <= P_RAM_BUDGET,
+                "PulseTrain needs more than P_RAM_BUDGET, lower NUMBER_OF_PTRAINS or PTRAINS_PER_TIMER");
+#endif
+
 #endif
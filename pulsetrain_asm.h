@@ -0,0 +1,350 @@
+// Copyright (c) 2012 Wyss Institute at Harvard University
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// http://www.opensource.org/licenses/mit-license.php
+
+// pulsetrain_asm.h - Host side assembler of PMODE_PROGRAM waveform
+// programs.  Include it after pulsetrain.h with P_USE_PROGRAM defined.
+//
+// pAsmProgram turns text such as
+//
+//          pulse 100us 1ms     ; pulse and period for what follows
+//          pins 0x1            ; first attached ptrain only
+//          periods 50
+//          delay 200ms
+//  again:  pins 0x2
+//          until 7 high        ; until pin 7 reads HIGH
+//          jump again
+//
+// into the bytes pLoadProgram takes, one instruction per line with an
+// optional label in front.  Times are counts of the timer, or us, ms or s
+// turned into counts at the prescale given, rounded down like US_TO_COUNTS.
+// Levels are high, low, 1 or 0, numbers can be decimal or 0x hex, and
+// jumps take a label or a byte offset.  ';' and '#' start a comment.
+// pAsmWriteArray writes the bytes as a PROGMEM array for a sketch, or they
+// can be loaded straight into the simulation.
+
+#ifndef PULSETRAIN_ASM_H
+#define PULSETRAIN_ASM_H
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Definitions
+//////////////
+#define P_ASM_LINE_SIZE         128
+#define P_ASM_LABELS            32
+#define P_ASM_LABEL_SIZE        24
+#define P_ASM_TOKENS            4
+
+// Custom Structs
+/////////////////
+typedef struct {
+    char        names[P_ASM_LABELS][P_ASM_LABEL_SIZE];
+    uint16_t    addresses[P_ASM_LABELS];
+    uint8_t     count;
+} pasmlabels_t;
+
+// Helpers
+//////////
+static const char * const p_asm_names[NUMBER_OF_POPS] = { "end", "pulse", "periods",
+        "delay", "wait", "until", "loop", "next", "jump", "pins" };
+
+static bool pAsmNumber(const char *token, uint64_t *value, const char **suffix)
+{
+    // a decimal or 0x hex number, suffix points past it
+    char *end;
+    if (!isdigit((unsigned char)token[0])) {
+        return false;
+    }
+    *value = strtoull(token, &end, 0);
+    *suffix = end;
+    return true;
+}
+
+static bool pAsmTime(const char *token, uint16_t prescale, uint32_t *counts)
+{
+    // counts, or a time in us, ms or s at the prescale
+    uint64_t value;
+    const char *suffix;
+    if (!pAsmNumber(token, &value, &suffix)) {
+        return false;
+    }
+    uint64_t us_scale;
+    if (*suffix == '\0') {
+        if (value > 0xFFFFFFFFULL) {
+            return false;
+        }
+        *counts = value;
+        return true;
+    }
+    else if (strcmp(suffix, "us") == 0) {
+        us_scale = 1;
+    }
+    else if (strcmp(suffix, "ms") == 0) {
+        us_scale = 1000;
+    }
+    else if (strcmp(suffix, "s") == 0) {
+        us_scale = 1000000;
+    }
+    else {
+        return false;
+    }
+    if (value > 0xFFFFFFFFULL) {
+        return false;
+    }
+    uint64_t result = value * us_scale * CLOCKCYCLESPERMICROSECOND / prescale;
+    if (result > 0xFFFFFFFFULL) {
+        return false;
+    }
+    *counts = result;
+    return true;
+}
+
+static bool pAsmLevel(const char *token, uint8_t *level)
+{
+    if ((strcmp(token, "high") == 0) || (strcmp(token, "1") == 0)) {
+        *level = HIGH;
+    }
+    else if ((strcmp(token, "low") == 0) || (strcmp(token, "0") == 0)) {
+        *level = LOW;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+static void pAsmEmit(uint8_t *code, uint16_t max_length, uint16_t *pc,
+                        uint32_t value, uint8_t bytes)
+{
+    // little endian, bytes past max_length are counted but not written
+    for (uint8_t i = 0; i < bytes; i++) {
+        if (*pc < max_length) {
+            code[*pc] = (uint8_t)(value >> (8 * i));
+        }
+        *pc += 1;
+    }
+}
+
+static uint8_t pAsmSplit(char *line, char *tokens[P_ASM_TOKENS + 1])
+{
+    // cut the comment and split on spaces and commas, lower case
+    uint8_t count = 0;
+    char *comment = strpbrk(line, ";#");
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+    for (char *c = line; *c != '\0'; c++) {
+        *c = tolower((unsigned char)*c);
+    }
+    char *token = strtok(line, " \t\r\n,");
+    while ((token != NULL) && (count <= P_ASM_TOKENS)) {
+        tokens[count++] = token;
+        token = strtok(NULL, " \t\r\n,");
+    }
+    return count;
+}
+
+static int pAsmPass(const char *source, uint16_t prescale, uint8_t *code,
+                    uint16_t max_length, pasmlabels_t *labels, bool resolve,
+                    char *error, size_t error_size)
+{
+    // one pass over the source, the first collects the labels and the
+    // second, with resolve set, writes the code
+    uint16_t pc = 0;
+    unsigned line_number = 0;
+    const char *line_start = source;
+    while (*line_start != '\0') {
+        char line[P_ASM_LINE_SIZE];
+        const char *line_end = strchr(line_start, '\n');
+        size_t line_length = (line_end != NULL) ? (size_t)(line_end - line_start) :
+                                                    strlen(line_start);
+        line_number++;
+        if (line_length >= sizeof(line)) {
+            snprintf(error, error_size, "line %u: too long", line_number);
+            return -1;
+        }
+        memcpy(line, line_start, line_length);
+        line[line_length] = '\0';
+        line_start += line_length + ((line_end != NULL) ? 1 : 0);
+
+        char *tokens[P_ASM_TOKENS + 1];
+        uint8_t count = pAsmSplit(line, tokens);
+        uint8_t first = 0;
+        if ((count > 0) && (tokens[0][strlen(tokens[0]) - 1] == ':')) {
+            tokens[0][strlen(tokens[0]) - 1] = '\0';
+            if (!resolve) {
+                if ((labels->count == P_ASM_LABELS) ||
+                        (strlen(tokens[0]) >= P_ASM_LABEL_SIZE)) {
+                    snprintf(error, error_size, "line %u: too many or too long labels",
+                                line_number);
+                    return -1;
+                }
+                for (uint8_t i = 0; i < labels->count; i++) {
+                    if (strcmp(labels->names[i], tokens[0]) == 0) {
+                        snprintf(error, error_size, "line %u: label %s used twice",
+                                    line_number, tokens[0]);
+                        return -1;
+                    }
+                }
+                strcpy(labels->names[labels->count], tokens[0]);
+                labels->addresses[labels->count++] = pc;
+            }
+            first = 1;
+        }
+        if (first == count) {
+            continue;
+        }
+        uint8_t op;
+        for (op = 0; op < NUMBER_OF_POPS; op++) {
+            if (strcmp(tokens[first], p_asm_names[op]) == 0) {
+                break;
+            }
+        }
+        if (op == NUMBER_OF_POPS) {
+            snprintf(error, error_size, "line %u: unknown instruction %s",
+                        line_number, tokens[first]);
+            return -1;
+        }
+        static const uint8_t arguments[NUMBER_OF_POPS] = { 0, 2, 1, 1, 2, 2, 1, 0, 1, 1 };
+        if (count - first - 1 != arguments[op]) {
+            snprintf(error, error_size, "line %u: %s takes %u arguments",
+                        line_number, p_asm_names[op], arguments[op]);
+            return -1;
+        }
+        char **args = &tokens[first + 1];
+        uint64_t number;
+        const char *suffix;
+        uint32_t values[2] = { 0, 0 };
+        uint8_t level = LOW;
+        bool good = true;
+        switch (op) {
+            case POP_PULSE:
+                good = pAsmTime(args[0], prescale, &values[0]) &&
+                        pAsmTime(args[1], prescale, &values[1]) && 
+                        (values[0] != 0) && (values[0] < values[1]);
+                break;
+            case POP_DELAY:
+                good = pAsmTime(args[0], prescale, &values[0]);
+                break;
+            case POP_PERIODS:
+            case POP_PINS:
+                good = pAsmNumber(args[0], &number, &suffix) && (*suffix == '\0') &&
+                        (number <= 0xFFFFFFFFULL);
+                values[0] = number;
+                break;
+            case POP_LOOP:
+                good = pAsmNumber(args[0], &number, &suffix) && (*suffix == '\0') &&
+                        (number >= 1) && (number <= 0xFFFF);
+                values[0] = number;
+                break;
+            case POP_WAIT:
+            case POP_UNTIL:
+                good = pAsmNumber(args[0], &number, &suffix) && (*suffix == '\0') &&
+                        (number < 0x100) && pAsmLevel(args[1], &level);
+                values[0] = number;
+                values[1] = level;
+                break;
+            case POP_JUMP:
+                if (pAsmNumber(args[0], &number, &suffix)) {
+                    good = (*suffix == '\0') && (number <= 0xFFFF);
+                    values[0] = number;
+                }
+                else if (resolve) {
+                    uint8_t i;
+                    for (i = 0; i < labels->count; i++) {
+                        if (strcmp(labels->names[i], args[0]) == 0) {
+                            break;
+                        }
+                    }
+                    good = (i < labels->count);
+                    values[0] = good ? labels->addresses[i] : 0;
+                }
+                break;
+            default:
+                break;
+        }
+        if (!good) {
+            snprintf(error, error_size, "line %u: bad arguments to %s",
+                        line_number, p_asm_names[op]);
+            return -1;
+        }
+        pAsmEmit(code, max_length, &pc, op, 1);
+        switch (op) {
+            case POP_PULSE:
+                pAsmEmit(code, max_length, &pc, values[0], 4);
+                pAsmEmit(code, max_length, &pc, values[1], 4);
+                break;
+            case POP_PERIODS:
+            case POP_DELAY:
+            case POP_PINS:
+                pAsmEmit(code, max_length, &pc, values[0], 4);
+                break;
+            case POP_WAIT:
+            case POP_UNTIL:
+                pAsmEmit(code, max_length, &pc, values[0], 1);
+                pAsmEmit(code, max_length, &pc, values[1], 1);
+                break;
+            case POP_LOOP:
+            case POP_JUMP:
+                pAsmEmit(code, max_length, &pc, values[0], 2);
+                break;
+            default:
+                break;
+        }
+    }
+    if (pc > max_length) {
+        snprintf(error, error_size, "program is %u bytes, only room for %u",
+                    pc, max_length);
+        return -1;
+    }
+    return pc;
+}
+
+int pAsmProgram(const char *source, uint16_t prescale, uint8_t *code,
+                uint16_t max_length, char *error, size_t error_size)
+{
+    // assemble source into code for a timer at prescale.  Returns the
+    // number of bytes, or -1 with a message naming the line in error
+    pasmlabels_t labels;
+    labels.count = 0;
+    if (pAsmPass(source, prescale, code, max_length, &labels, false,
+                    error, error_size) < 0) {
+        return -1;
+    }
+    return pAsmPass(source, prescale, code, max_length, &labels, true,
+                        error, error_size);
+}
+
+void pAsmWriteArray(FILE *out, const char *name, const uint8_t *code, int length)
+{
+    // write code as a PROGMEM array to paste into a sketch
+    fprintf(out, "const uint8_t %s[%d] PROGMEM = {", name, length);
+    for (int i = 0; i < length; i++) {
+        fprintf(out, "%s0x%02X%s", (i % 12 == 0) ? "\n    " : "", code[i],
+                    (i + 1 < length) ? ", " : "");
+    }
+    fprintf(out, "\n};\n");
+}
+
+#endif
@@ -0,0 +1,391 @@
+// Copyright (c) 2012 Wyss Institute at Harvard University
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// http://www.opensource.org/licenses/mit-license.php
+
+// pulsetrain_bench.h - Host side benchmarks of the pulse generation hot
+// path.  Define P_SIMULATE and P_USE_TIMER1 and include it after
+// pulsetrain.h.
+//
+// pBenchRun measures on PTIMER1 with 1, 8 and 32 pins attached:
+// - the mean and longest ISR in estimated CPU cycles for each pulse state the ISR
+//   was entered in, PPULSE_LO, PPULSE_HI, PDC_INIT and PDC_RUNNING
+// - the highest pulse frequency the timer keeps up with at prescale 1
+// - the host time of pSetPulseUS, pAttach, pReloadToTimer and pStartTimer
+//
+// With pulsetrain_template.h included first, pBenchRunTemplate<Train>
+// measures the ISR of a PulseTrain the same way, pulsed and DC, so the
+// two front ends can be compared pin for pin.
+//
+// ISR cycles come from the cost model of pulsetrain_sim.h, not from a
+// board or a cycle accurate AVR simulator, so they and the frequencies
+// worked out from them are written as est_cycles and est_Hz.  They move
+// when an ISR makes more or fewer port writes, digitalReads, digitalWrites,
+// port group walks, compare moves or period counts, not when other C around
+// them changes.  Host times depend on the machine and are written out but
+// never compared.
+//
+// pBenchWrite writes the results one per line as "name value unit" and
+// pBenchCompare reads such a file back as the baseline and counts the
+// results that got worse, so a host program can fail on a regression:
+//
+//     pbenchresult_t results[P_BENCH_MAX_RESULTS];
+//     uint8_t n = pBenchRun(results, P_BENCH_MAX_RESULTS);
+//     pBenchWrite(stdout, results, n);
+//     return pBenchCompare(baseline, results, n, 0, stderr) ? 1 : 0;
+
+#ifndef PULSETRAIN_BENCH_H
+#define PULSETRAIN_BENCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Definitions
+//////////////
+#define P_BENCH_MAX_RESULTS     96
+#define P_BENCH_NAME_SIZE       40
+#define P_BENCH_PERIODS         50      // periods of each measured run
+#define P_BENCH_CALLS           10000   // calls averaged for a host time
+#define P_BENCH_FIRST_PIN       22      // pins 22 to 53 are 32 plain digital pins
+
+enum bench_units { P_BENCH_EST_CYCLES, P_BENCH_EST_HZ, P_BENCH_NS };
+
+// Custom Structs
+/////////////////
+typedef struct {
+    char        name[P_BENCH_NAME_SIZE];
+    uint32_t    value;
+    uint8_t     unit;           // bench_units, fewer cycles and ns and more Hz are better
+} pbenchresult_t;
+
+typedef struct {
+    pbenchresult_t *results;
+    uint8_t     count;
+    uint8_t     max_results;
+} pbenchtable_t;
+
+// Helpers
+//////////
+static const char * const p_bench_units[] = { "est_cycles", "est_Hz", "ns" };
+static const char * const p_bench_states[] = { "PPULSE_LO", "PPULSE_HI", "PDC_INIT",
+                                                "PDC_RUNNING" };
+
+// ISRs of the measured timer by the state they were entered in
+static uint32_t p_bench_isrs[POFF];
+static uint64_t p_bench_cycles[POFF];
+static uint32_t p_bench_max_cycles[POFF];
+static uint8_t p_bench_state = POFF;
+static uint8_t p_bench_vector = TIMER1_COMPA_vect_num;
+
+static uint8_t pBenchPTimer1State(void)
+{
+    return timer_array[PTIMER1].pulsed_state;
+}
+
+static uint8_t (*p_bench_get_state)(void) = pBenchPTimer1State;
+
+static void pBenchISR(uint8_t vector, uint32_t cycles)
+{
+    if ((vector == p_bench_vector) && (p_bench_state < POFF)) {
+        p_bench_isrs[p_bench_state]++;
+        p_bench_cycles[p_bench_state] += cycles;
+        if (cycles > p_bench_max_cycles[p_bench_state]) {
+            p_bench_max_cycles[p_bench_state] = cycles;
+        }
+    }
+    p_bench_state = p_bench_get_state();
+}
+
+static void pBenchClearStates(void)
+{
+    memset(p_bench_isrs, 0, sizeof(p_bench_isrs));
+    memset(p_bench_cycles, 0, sizeof(p_bench_cycles));
+    memset(p_bench_max_cycles, 0, sizeof(p_bench_max_cycles));
+    p_bench_state = p_bench_get_state();
+}
+
+// rising edges of the first pin, for the frequency sweep
+static uint32_t p_bench_rises = 0;
+static uint64_t p_bench_first_rise = 0;
+static uint64_t p_bench_last_rise = 0;
+
+static void pBenchEdge(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if ((pin != P_BENCH_FIRST_PIN) || (level != HIGH)) {
+        return;
+    }
+    if (p_bench_rises == 0) {
+        p_bench_first_rise = cycle;
+    }
+    p_bench_last_rise = cycle;
+    p_bench_rises++;
+}
+
+static void pBenchAdd(pbenchtable_t *table, const char *name, uint8_t pins,
+                        const char *detail, uint32_t value, uint8_t unit)
+{
+    if (table->count >= table->max_results) {
+        return;
+    }
+    pbenchresult_t *result = &table->results[table->count++];
+    snprintf(result->name, P_BENCH_NAME_SIZE, "%s_pins%u%s%s", name, pins,
+                detail[0] ? "_" : "", detail);
+    result->value = value;
+    result->unit = unit;
+}
+
+static void pBenchSetup(uint8_t *ptrain_idxs, uint8_t pins, uint32_t period,
+                            uint32_t pulse_width, uint32_t period_num_limit)
+{
+    // a fresh simulation with pins ptrains on PTIMER1, all doing the same
+    pSimReset();
+    pSetupTimers();
+    for (uint8_t i = 0; i < pins; i++) {
+        ptrain_idxs[i] = pNewPTrain();
+        pSetPulseUS(ptrain_idxs[i], period, pulse_width, period_num_limit);
+        pAttach(ptrain_idxs[i], P_BENCH_FIRST_PIN + i, PTIMER1);
+    }
+}
+
+static void pBenchTeardown(uint8_t *ptrain_idxs, uint8_t pins)
+{
+    pStopTimer(PTIMER1);
+    for (uint8_t i = 0; i < pins; i++) {
+        pReleasePTrain(ptrain_idxs[i]);
+    }
+}
+
+static void pBenchAddStates(pbenchtable_t *table, const char *name, uint8_t pins)
+{
+    // the mean and longest ISR of each state measured
+    for (uint8_t state = 0; state < POFF; state++) {
+        if (p_bench_isrs[state] == 0) {
+            continue;
+        }
+        char detail[24];
+        snprintf(detail, sizeof(detail), "%s_mean", p_bench_states[state]);
+        pBenchAdd(table, name, pins, detail,
+                    (p_bench_cycles[state] + p_bench_isrs[state] / 2) / p_bench_isrs[state],
+                    P_BENCH_EST_CYCLES);
+        snprintf(detail, sizeof(detail), "%s_max", p_bench_states[state]);
+        pBenchAdd(table, name, pins, detail, p_bench_max_cycles[state], P_BENCH_EST_CYCLES);
+    }
+}
+
+static void pBenchStates(pbenchtable_t *table, uint8_t pins, uint32_t period)
+{
+    // one run and the ISRs of the states it goes through
+    uint8_t ptrain_idxs[PTRAINS_PER_TIMER];
+    pBenchSetup(ptrain_idxs, pins, period, 100, P_BENCH_PERIODS);
+    p_bench_vector = TIMER1_COMPA_vect_num;
+    p_bench_get_state = pBenchPTimer1State;
+    p_sim_isr_hook = pBenchISR;
+    pStartTimer(PTIMER1);
+    pBenchClearStates();
+    pSimRunUntilIdle((uint64_t)F_CPU * 10);
+    p_sim_isr_hook = NULL;
+    pBenchTeardown(ptrain_idxs, pins);
+    pBenchAddStates(table, "isr", pins);
+}
+
+static uint32_t pBenchFrequency(uint8_t pins, uint16_t period_counts)
+{
+    // the frequency PTIMER1 puts out when asked for period_counts at
+    // prescale 1, 0 when it drops periods or stalls
+    uint8_t ptrain_idxs[PTRAINS_PER_TIMER];
+    pBenchSetup(ptrain_idxs, pins, 1000, 500, P_BENCH_PERIODS);
+    for (uint8_t i = 0; i < pins; i++) {
+        ptrain_t *ptrain = &ptrains[ptrain_idxs[i]];
+        ptrain->auto_prescale = false;
+        ptrain->prescale = 1;
+        ptrain->period_counts = period_counts;
+        ptrain->pulse_counts = period_counts / 2;
+        pReloadToTimer(ptrain_idxs[i]);
+    }
+    p_bench_rises = 0;
+    p_sim_edge_hook = pBenchEdge;
+    pStartTimer(PTIMER1);
+    pSimRunUntilIdle((uint64_t)P_BENCH_PERIODS * period_counts * 4);
+    p_sim_edge_hook = NULL;
+    bool idle = pSimIsIdle();
+    pBenchTeardown(ptrain_idxs, pins);
+    if (!idle || (p_bench_rises != P_BENCH_PERIODS)) {
+        return 0;
+    }
+    uint64_t span = p_bench_last_rise - p_bench_first_rise;
+    return (uint32_t)(((uint64_t)F_CPU * (P_BENCH_PERIODS - 1) + span / 2) / span);
+}
+
+static void pBenchMaxFrequency(pbenchtable_t *table, uint8_t pins)
+{
+    // sweep the period down and keep the best frequency that came out
+    uint32_t best = 0;
+    for (uint16_t period_counts = 8000; period_counts >= 16;
+            period_counts -= (period_counts >> 5) + 1) {
+        uint32_t frequency = pBenchFrequency(pins, period_counts);
+        if (frequency > best) {
+            best = frequency;
+        }
+    }
+    pBenchAdd(table, "max_frequency", pins, "", best, P_BENCH_EST_HZ);
+}
+
+static uint64_t pBenchNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void pBenchCalls(pbenchtable_t *table, uint8_t pins)
+{
+    // host nanoseconds per call with pins ptrains on the timer
+    uint8_t ptrain_idxs[PTRAINS_PER_TIMER];
+    pBenchSetup(ptrain_idxs, pins, 1000, 100, P_BENCH_PERIODS);
+    uint8_t last = ptrain_idxs[pins - 1];
+    uint64_t start = pBenchNow();
+    for (uint16_t i = 0; i < P_BENCH_CALLS; i++) {
+        pSetPulseUS(last, 1000 + (i & 0xFF), 100, P_BENCH_PERIODS);
+    }
+    pBenchAdd(table, "call_pSetPulseUS", pins, "",
+                (pBenchNow() - start) / P_BENCH_CALLS, P_BENCH_NS);
+    start = pBenchNow();
+    for (uint16_t i = 0; i < P_BENCH_CALLS; i++) {
+        pAttach(last, P_BENCH_FIRST_PIN + pins - 1, PTIMER1);
+    }
+    pBenchAdd(table, "call_pAttach", pins, "",
+                (pBenchNow() - start) / P_BENCH_CALLS, P_BENCH_NS);
+    start = pBenchNow();
+    for (uint16_t i = 0; i < P_BENCH_CALLS; i++) {
+        pReloadToTimer(last);
+    }
+    pBenchAdd(table, "call_pReloadToTimer", pins, "",
+                (pBenchNow() - start) / P_BENCH_CALLS, P_BENCH_NS);
+    uint64_t total = 0;
+    for (uint16_t i = 0; i < P_BENCH_CALLS; i++) {
+        start = pBenchNow();
+        pStartTimer(PTIMER1);
+        total += pBenchNow() - start;
+        pStopTimer(PTIMER1);
+    }
+    pBenchAdd(table, "call_pStartTimer", pins, "", total / P_BENCH_CALLS, P_BENCH_NS);
+    pBenchTeardown(ptrain_idxs, pins);
+}
+
+// Benchmarks
+/////////////
+uint8_t pBenchRun(pbenchresult_t *results, uint8_t max_results)
+{
+    // run every benchmark, returns the number of results.  This resets
+    // the simulation and leaves every ptrain released
+    static const uint8_t pin_counts[] = { 1, 8, 32 };
+    pbenchtable_t table = { results, 0, max_results };
+    for (uint8_t i = 0; i < sizeof(pin_counts); i++) {
+        uint8_t pins = pin_counts[i];
+        if (pins > PTRAINS_PER_TIMER) {
+            continue;
+        }
+        pBenchStates(&table, pins, 1000);       // pulsed
+        pBenchStates(&table, pins, 0);          // DC
+        pBenchMaxFrequency(&table, pins);
+        pBenchCalls(&table, pins);
+    }
+    return table.count;
+}
+
+void pBenchWrite(FILE *out, const pbenchresult_t *results, uint8_t n)
+{
+    // one "name value unit" line per result
+    for (uint8_t i = 0; i < n; i++) {
+        fprintf(out, "%s %lu %s\n", results[i].name, (unsigned long)results[i].value,
+                    p_bench_units[results[i].unit]);
+    }
+}
+
+uint8_t pBenchCompare(FILE *baseline, const pbenchresult_t *results, uint8_t n,
+                        uint16_t tolerance_permille, FILE *report)
+{
+    // count the cycle and Hz results that are worse than the pBenchWrite
+    // baseline by more than tolerance_permille, each one is written to
+    // report when it isn't NULL.  Results the baseline doesn't have pass
+    char name[P_BENCH_NAME_SIZE];
+    char unit[12];
+    unsigned long base;
+    uint8_t regressions = 0;
+    while (fscanf(baseline, "%39s %lu %11s", name, &base, unit) == 3) {
+        for (uint8_t i = 0; i < n; i++) {
+            const pbenchresult_t *result = &results[i];
+            if ((strcmp(result->name, name) != 0) || (result->unit == P_BENCH_NS)) {
+                continue;
+            }
+            uint64_t slack = ((uint64_t)base * tolerance_permille) / 1000;
+            bool worse = (result->unit == P_BENCH_EST_HZ) ?
+                            (result->value + slack < base) :
+                            (result->value > base + slack);
+            if (worse) {
+                regressions++;
+                if (report != NULL) {
+                    fprintf(report, "%s %lu %s, baseline %lu\n", name,
+                                (unsigned long)result->value, unit, base);
+                }
+            }
+        }
+    }
+    return regressions;
+}
+
+#ifdef PULSETRAIN_TEMPLATE_H
+// PulseTrain benchmarks
+////////////////////////
+template <class Train> void pBenchTemplateStates(pbenchtable_t *table, uint8_t pins,
+                                                    bool pulsed)
+{
+    // one run of the same waveform as pBenchStates and the ISRs of its states
+    pSimReset();
+    Train::begin();
+    Train::set(Train::template CountsUS<100>::value,
+                pulsed ? Train::template CountsUS<1000>::value : 0, P_BENCH_PERIODS);
+    p_bench_vector = p_sim_timers[Train::timer].compa_vect;
+    p_bench_get_state = Train::getState;
+    p_sim_isr_hook = pBenchISR;
+    Train::start();
+    pBenchClearStates();
+    pSimRunUntilIdle((uint64_t)F_CPU * 10);
+    p_sim_isr_hook = NULL;
+    Train::stop();
+    pBenchAddStates(table, "template_isr", pins);
+}
+
+// The ISR of a PulseTrain whose P_PULSETRAIN_ISR is defined, pulsed and DC
+// as in pBenchRun, as "template_isr_pins..." results.  pins is the number
+// of pins in its PPins and only names the results.  Returns the number of
+// results
+template <class Train> uint8_t pBenchRunTemplate(pbenchresult_t *results,
+                                                    uint8_t max_results, uint8_t pins)
+{
+    pbenchtable_t table = { results, 0, max_results };
+    pBenchTemplateStates<Train>(&table, pins, true);
+    pBenchTemplateStates<Train>(&table, pins, false);
+    return table.count;
+}
+#endif
+
+#endif
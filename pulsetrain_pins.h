@@ -0,0 +1,54 @@
+// Copyright (c) 2012 Wyss Institute at Harvard University
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// http://www.opensource.org/licenses/mit-license.php
+
+// pulsetrain_pins.h - The Arduino Mega 2560 digital pin to port and bit
+// mapping as constexpr tables, the one copy pulsetrain_template.h works
+// its masks out from at compile time and pulsetrain_sim.h routes pins
+// with.  PA to PL come from the Arduino core on a board and from
+// pulsetrain_sim.h on the host, so include it after either.  Needs C++11.
+
+#ifndef PULSETRAIN_PINS_H
+#define PULSETRAIN_PINS_H
+
+// Arduino Mega 2560 pin mapping
+////////////////////////////////
+#define P_MEGA_NUMBER_OF_PINS   70
+
+constexpr uint8_t p_mega_pin_port[P_MEGA_NUMBER_OF_PINS] = {
+    PE, PE, PE, PE, PG, PE, PH, PH, PH, PH,     // 0 - 9
+    PB, PB, PB, PB, PJ, PJ, PH, PH, PD, PD,     // 10 - 19
+    PD, PD, PA, PA, PA, PA, PA, PA, PA, PA,     // 20 - 29
+    PC, PC, PC, PC, PC, PC, PC, PC, PD, PG,     // 30 - 39
+    PG, PG, PL, PL, PL, PL, PL, PL, PL, PL,     // 40 - 49
+    PB, PB, PB, PB, PF, PF, PF, PF, PF, PF,     // 50 - 59
+    PF, PF, PK, PK, PK, PK, PK, PK, PK, PK };   // 60 - 69
+
+constexpr uint8_t p_mega_pin_bit[P_MEGA_NUMBER_OF_PINS] = {
+    0, 1, 4, 5, 5, 3, 3, 4, 5, 6,
+    4, 5, 6, 7, 1, 0, 1, 0, 3, 2,
+    1, 0, 0, 1, 2, 3, 4, 5, 6, 7,
+    7, 6, 5, 4, 3, 2, 1, 0, 7, 2,
+    1, 0, 7, 6, 5, 4, 3, 2, 1, 0,
+    3, 2, 1, 0, 0, 1, 2, 3, 4, 5,
+    6, 7, 0, 1, 2, 3, 4, 5, 6, 7 };
+
+#endif
@@ -0,0 +1,1054 @@
+// Copyright (c) 2012 Wyss Institute at Harvard University
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// http://www.opensource.org/licenses/mit-license.php
+
+// pulsetrain_sim.h - Host simulation of the ATmega2560 pieces used by
+// pulsetrain.h so that it can be built and run on a normal Linux box.
+// Define P_SIMULATE before including pulsetrain.h to use it.
+//
+// What is modelled:
+// - the registers of the 16 bit timers 1, 3, 4 and 5 and GTCCR
+// - the shared synchronous prescaler, including TSM/PSRSYNC halting, which
+//   holds every timer but those clocked straight from the CPU at prescale 1
+// - normal, CTC (mode 12) and fast PWM (mode 14) counting with ICRn as
+//   TOP, with the compare A, overflow and input capture flags
+// - the OCnA/OCnB/OCnC output compare pins, including FOCnx strobes
+// - ports A to L with the Arduino Mega pin mapping, pinMode, digitalWrite
+//   and digitalRead
+// - attachInterrupt on the external interrupt pins 2, 3, 18, 19, 20 and 21
+//   for CHANGE, RISING and FALLING edges made with pSimSetInput
+// - interrupt dispatch in vector priority order honoring the I bit in SREG
+// - the 4 KB EEPROM through the avr-libc eeprom_read_block and
+//   eeprom_update_block, which pSimReset leaves alone like the real one
+//
+// Time moves inside pSimRun.  Code outside an ISR takes no simulated time
+// but for the stores to TCCRnB and GTCCR, an sts and an out, so that
+// timers started one after the other are apart as on the chip.  Inside an
+// ISR the clock moves as each costed operation is made, so TCNTn reads see
+// the time the ISR has spent so far.  The simulation
+// skips directly from one compare match to the next so long runs cost a
+// few operations per edge.
+//
+// Compare flags are raised as the counter reaches OCRnx.  The OCnx pins
+// change one count later, when the counter leaves OCRnx, so that the pulses
+// come out OCRnx + 1 counts long as the datasheet gives for fast PWM.  The
+// OCRnx double buffering of the PWM modes is not modelled, write them while
+// the timer is stopped.
+//
+// ISR durations come from a cost model, not from executing AVR instructions:
+// each ISR is charged the entry, body and exit costs below plus the cost of
+// every digitalWrite, digitalRead and port write it makes.  pulsetrain.h
+// adds the work its branches do around them with P_SIM_COST: every port
+// group walked from a timer's table, every compare moved and every period
+// counted or checked, so each state path and each pin layout costs what
+// it does.  The numbers are approximations of what avr-gcc -Os produces
+// for the Arduino core.
+
+#ifndef PULSETRAIN_SIM_H
+#define PULSETRAIN_SIM_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+// Definitions
+//////////////
+#ifndef F_CPU
+#define F_CPU                       16000000L
+#endif
+
+#ifndef P_SIM_ISR_ENTRY_CYCLES
+// REDEFINE these, the cycle costs charged to simulated ISRs
+#define P_SIM_ISR_ENTRY_CYCLES      40  // response, vector jump and prologue
+#endif
+
+#ifndef P_SIM_ISR_BODY_CYCLES
+#define P_SIM_ISR_BODY_CYCLES       30  // state machine bookkeeping
+#endif
+
+#ifndef P_SIM_ISR_EXIT_CYCLES
+#define P_SIM_ISR_EXIT_CYCLES       35  // epilogue and reti
+#endif
+
+#ifndef P_SIM_DIGITALWRITE_CYCLES
+#define P_SIM_DIGITALWRITE_CYCLES   60
+#endif
+
+#ifndef P_SIM_DIGITALREAD_CYCLES
+#define P_SIM_DIGITALREAD_CYCLES    52
+#endif
+
+#ifndef P_SIM_PORT_WRITE_CYCLES
+#define P_SIM_PORT_WRITE_CYCLES     10  // one read-modify-write of a PORTx
+#endif
+
+#ifndef P_SIM_STORE_CYCLES
+#define P_SIM_STORE_CYCLES          2   // one sts to TCCRnB, which is past the I/O space
+#endif
+
+#ifndef P_SIM_IO_STORE_CYCLES
+#define P_SIM_IO_STORE_CYCLES       1   // one out to GTCCR, which is in the I/O space
+#endif
+
+#ifndef P_SIM_GROUP_CYCLES
+#define P_SIM_GROUP_CYCLES          8   // one port group loaded from a timer's table
+#endif
+
+#ifndef P_SIM_COMPARE_CYCLES
+#define P_SIM_COMPARE_CYCLES        12  // a 32 bit interval onto OCRnA and its wraps
+#endif
+
+#ifndef P_SIM_PERIOD_CYCLES
+#define P_SIM_PERIOD_CYCLES         10  // a 32 bit period count stepped or checked
+#endif
+
+#define P_SIM_NUMBER_OF_TIMERS      4
+#define P_SIM_NUMBER_OF_PORTS       13  // Arduino port numbers 1 (A) to 12 (L)
+#define P_SIM_NUMBER_OF_PINS        P_MEGA_NUMBER_OF_PINS
+#define P_SIM_NUMBER_OF_EXTERNAL    6   // INT0 to INT5
+
+// Arduino definitions
+//////////////////////
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH            0x1
+#define LOW             0x0
+#define INPUT           0x0
+#define OUTPUT          0x1
+#define INPUT_PULLUP    0x2
+#define NOT_A_PIN       0
+#define NOT_A_PORT      0
+#define CHANGE          1
+#define FALLING         2
+#define RISING          3
+#define NOT_AN_INTERRUPT    -1
+
+#define _BV(bit)        (1 << (bit))
+
+// flash and RAM are one address space on the host
+#define PROGMEM
+#define pgm_read_byte(_address) (*(const uint8_t *)(_address))
+
+// EEPROM addresses are passed as pointers, as in avr/eeprom.h
+#define E2END           0x0FFF
+uint8_t p_sim_eeprom[E2END + 1];
+
+void eeprom_read_block(void *dest, const void *source, size_t n)
+{
+    memcpy(dest, &p_sim_eeprom[(uintptr_t)source], n);
+}
+
+void eeprom_update_block(const void *source, void *dest, size_t n)
+{
+    memcpy(&p_sim_eeprom[(uintptr_t)dest], source, n);
+}
+
+// Registers
+////////////
+static void pSimOutputsChanged(uint8_t timer, uint8_t old_control);
+static void pSimForceCompare(uint8_t timer, uint8_t bits);
+static void pSimResetPrescaler(void);
+static void pSimStore(uint8_t cycles);
+
+enum { PSRSYNC = 0, PSRASY = 1, TSM = 7 };
+
+// the timer interrupt flag registers are cleared by writing a one
+struct PSimFlagRegister {
+    volatile uint8_t value;
+    PSimFlagRegister &operator|=(uint8_t bits) { value &= ~bits; return *this; }
+    PSimFlagRegister &operator=(uint8_t bits) { value &= ~bits; return *this; }
+    operator uint8_t() const { return value; }
+};
+
+// TCCRnA connects and disconnects the OCnx pins as it is written
+struct PSimControlRegister {
+    volatile uint8_t value;
+    uint8_t timer;
+    PSimControlRegister &operator=(uint8_t bits) { return write(bits); }
+    PSimControlRegister &operator|=(uint8_t bits) { return write(value | bits); }
+    PSimControlRegister &operator&=(uint8_t bits) { return write(value & bits); }
+    PSimControlRegister &write(uint8_t bits) {
+        uint8_t old_control = value;
+        value = bits;
+        pSimOutputsChanged(timer, old_control);
+        return *this;
+    }
+    operator uint8_t() const { return value; }
+};
+
+// the FOCnx bits of TCCRnC are strobes that always read as zero
+struct PSimForceRegister {
+    uint8_t timer;
+    PSimForceRegister &operator=(uint8_t bits) { pSimForceCompare(timer, bits); return *this; }
+    PSimForceRegister &operator|=(uint8_t bits) { return *this = bits; }
+    operator uint8_t() const { return 0; }
+};
+
+// TCCRnB starts and stops the counter, a store to it outside an ISR
+// takes the time of an sts
+struct PSimClockRegister {
+    volatile uint8_t value;
+    PSimClockRegister &operator=(uint8_t bits) { return write(bits); }
+    PSimClockRegister &operator|=(uint8_t bits) { return write(value | bits); }
+    PSimClockRegister &operator&=(uint8_t bits) { return write(value & bits); }
+    PSimClockRegister &write(uint8_t bits) {
+        pSimStore(P_SIM_STORE_CYCLES);
+        value = bits;
+        return *this;
+    }
+    operator uint8_t() const { return value; }
+};
+
+// writing PSRSYNC resets the shared prescaler, it reads back as zero
+// unless TSM holds it set.  GTCCR is an I/O register, so a store to it
+// is an out and quicker than one to TCCRnB
+struct PSimSyncRegister {
+    volatile uint8_t value;
+    PSimSyncRegister &operator=(uint8_t bits) { return write(bits); }
+    PSimSyncRegister &operator|=(uint8_t bits) { return write(value | bits); }
+    PSimSyncRegister &operator&=(uint8_t bits) { return write(value & bits); }
+    PSimSyncRegister &write(uint8_t bits) {
+        pSimStore(P_SIM_IO_STORE_CYCLES);
+        if (bits & _BV(PSRSYNC)) {
+            pSimResetPrescaler();
+        }
+        if (!(bits & _BV(TSM))) {
+            bits &= ~(_BV(PSRSYNC) | _BV(PSRASY));
+        }
+        value = bits;
+        return *this;
+    }
+    operator uint8_t() const { return value; }
+};
+
+#define P_SIM_TIMER_REGISTERS(n, i)                                         \
+    PSimControlRegister TCCR##n##A = { 0, i };                              \
+    PSimForceRegister   TCCR##n##C = { i };                                 \
+    PSimClockRegister   TCCR##n##B;                                         \
+    volatile uint8_t    TIMSK##n;                                           \
+    volatile uint16_t   TCNT##n, OCR##n##A, OCR##n##B, OCR##n##C, ICR##n;   \
+    PSimFlagRegister    TIFR##n;
+
+P_SIM_TIMER_REGISTERS(1, 0)
+P_SIM_TIMER_REGISTERS(3, 1)
+P_SIM_TIMER_REGISTERS(4, 2)
+P_SIM_TIMER_REGISTERS(5, 3)
+
+volatile uint8_t SREG;
+PSimSyncRegister GTCCR;
+
+volatile uint8_t PORTA, PORTB, PORTC, PORTD, PORTE, PORTF, PORTG, PORTH,
+                    PORTJ, PORTK, PORTL;
+volatile uint8_t DDRA, DDRB, DDRC, DDRD, DDRE, DDRF, DDRG, DDRH,
+                    DDRJ, DDRK, DDRL;
+volatile uint8_t PINA, PINB, PINC, PIND, PINE, PINF, PING, PINH,
+                    PINJ, PINK, PINL;
+
+// register bits, the same for all four 16 bit timers
+#define P_SIM_TIMER_BITS(n)                                                 \
+    enum {  TOIE##n = 0, OCIE##n##A = 1, OCIE##n##B = 2, OCIE##n##C = 3,    \
+            ICIE##n = 5,                                                    \
+            TOV##n = 0, OCF##n##A = 1, OCF##n##B = 2, OCF##n##C = 3,        \
+            ICF##n = 5,                                                     \
+            WGM##n##0 = 0, WGM##n##1 = 1, COM##n##C0 = 2, COM##n##C1 = 3,   \
+            COM##n##B0 = 4, COM##n##B1 = 5, COM##n##A0 = 6, COM##n##A1 = 7, \
+            CS##n##0 = 0, CS##n##1 = 1, CS##n##2 = 2,                       \
+            WGM##n##2 = 3, WGM##n##3 = 4,                                   \
+            FOC##n##C = 5, FOC##n##B = 6, FOC##n##A = 7 };
+
+P_SIM_TIMER_BITS(1)
+P_SIM_TIMER_BITS(3)
+P_SIM_TIMER_BITS(4)
+P_SIM_TIMER_BITS(5)
+
+#define SREG_I          7
+
+#define cli()           (SREG &= ~_BV(SREG_I))
+#define sei()           (SREG |= _BV(SREG_I))
+#define noInterrupts()  cli()
+#define interrupts()    sei()
+
+// Interrupt vectors
+////////////////////
+enum {  TIMER1_CAPT_vect_num, TIMER3_CAPT_vect_num,
+        TIMER4_CAPT_vect_num, TIMER5_CAPT_vect_num,
+        TIMER1_COMPA_vect_num, TIMER3_COMPA_vect_num,
+        TIMER4_COMPA_vect_num, TIMER5_COMPA_vect_num,
+        TIMER1_OVF_vect_num, TIMER3_OVF_vect_num,
+        TIMER4_OVF_vect_num, TIMER5_OVF_vect_num,
+        P_SIM_NUMBER_OF_VECTORS };
+
+typedef void (*psimvector_t)(void);
+psimvector_t p_sim_vectors[P_SIM_NUMBER_OF_VECTORS];
+
+struct PSimVector {
+    PSimVector(uint8_t vector, psimvector_t handler) {
+        p_sim_vectors[vector] = handler;
+    }
+};
+
+// an ISR registers itself in the vector table before main runs
+#define ISR(vect)                                                           \
+    static void vect(void);                                                 \
+    static PSimVector vect##_registration(vect##_num, vect);                \
+    static void vect(void)
+
+// Custom Structs
+/////////////////
+typedef struct {
+    PSimControlRegister *TCCRnA;
+    PSimClockRegister   *TCCRnB;
+    volatile uint8_t    *TIMSKn;
+    PSimFlagRegister    *TIFRn;
+    volatile uint16_t   *TCNTn;
+    volatile uint16_t   *OCRnx[3];      // A, B, C
+    volatile uint16_t   *ICRn;
+    uint8_t             capt_vect;
+    uint8_t             compa_vect;
+    uint8_t             ovf_vect;
+    uint8_t             oc_pins[3];     // Arduino pins of OCnA, OCnB, OCnC
+    uint8_t             oc_level;       // one bit per output compare unit
+} psimtimer_t;
+
+// listed in interrupt priority order
+static psimtimer_t p_sim_timers[P_SIM_NUMBER_OF_TIMERS] = {
+    { &TCCR1A, &TCCR1B, &TIMSK1, &TIFR1, &TCNT1, { &OCR1A, &OCR1B, &OCR1C }, &ICR1,
+        TIMER1_CAPT_vect_num, TIMER1_COMPA_vect_num, TIMER1_OVF_vect_num,
+        { 11, 12, 13 }, 0 },
+    { &TCCR3A, &TCCR3B, &TIMSK3, &TIFR3, &TCNT3, { &OCR3A, &OCR3B, &OCR3C }, &ICR3,
+        TIMER3_CAPT_vect_num, TIMER3_COMPA_vect_num, TIMER3_OVF_vect_num,
+        { 5, 2, 3 }, 0 },
+    { &TCCR4A, &TCCR4B, &TIMSK4, &TIFR4, &TCNT4, { &OCR4A, &OCR4B, &OCR4C }, &ICR4,
+        TIMER4_CAPT_vect_num, TIMER4_COMPA_vect_num, TIMER4_OVF_vect_num,
+        { 6, 7, 8 }, 0 },
+    { &TCCR5A, &TCCR5B, &TIMSK5, &TIFR5, &TCNT5, { &OCR5A, &OCR5B, &OCR5C }, &ICR5,
+        TIMER5_CAPT_vect_num, TIMER5_COMPA_vect_num, TIMER5_OVF_vect_num,
+        { 46, 45, 44 }, 0 }
+};
+
+// Simulation state
+///////////////////
+uint64_t p_sim_clock = 0;           // CPU cycles since pSimReset
+uint64_t p_sim_prescaler = 0;       // cycles seen by the shared prescaler
+uint32_t p_sim_isr_charge = 0;      // cycles charged to the running ISR so far
+bool     p_sim_in_isr = false;
+uint32_t p_sim_isr_count = 0;       // number of ISRs dispatched
+uint32_t p_sim_last_isr_cycles = 0; // total cost of the last ISR
+uint64_t p_sim_isr_cycles = 0;      // total cost of every ISR since pSimReset
+
+// attachInterrupt handlers and modes of INT0 to INT5, raised edges wait in
+// p_sim_external_pending
+psimvector_t p_sim_external[P_SIM_NUMBER_OF_EXTERNAL];
+uint8_t p_sim_external_mode[P_SIM_NUMBER_OF_EXTERNAL];
+uint8_t p_sim_external_pending = 0;
+uint32_t p_sim_attach_in_cli = 0;       // attachInterrupt calls made with interrupts off
+
+// called on every change of an output pin
+void (*p_sim_edge_hook)(uint8_t pin, uint8_t level, uint64_t cycle) = NULL;
+
+// called after every ISR with its cycles, vector is a _vect_num or
+// P_SIM_NUMBER_OF_VECTORS + n for INTn
+void (*p_sim_isr_hook)(uint8_t vector, uint32_t cycles) = NULL;
+
+// Arduino Mega 2560 pin mapping
+////////////////////////////////
+static volatile uint8_t * const p_sim_port_output[P_SIM_NUMBER_OF_PORTS] = {
+    NULL, &PORTA, &PORTB, &PORTC, &PORTD, &PORTE, &PORTF, &PORTG, &PORTH,
+    NULL, &PORTJ, &PORTK, &PORTL };
+static volatile uint8_t * const p_sim_port_mode[P_SIM_NUMBER_OF_PORTS] = {
+    NULL, &DDRA, &DDRB, &DDRC, &DDRD, &DDRE, &DDRF, &DDRG, &DDRH,
+    NULL, &DDRJ, &DDRK, &DDRL };
+static volatile uint8_t * const p_sim_port_input[P_SIM_NUMBER_OF_PORTS] = {
+    NULL, &PINA, &PINB, &PINC, &PIND, &PINE, &PINF, &PING, &PINH,
+    NULL, &PINJ, &PINK, &PINL };
+
+enum { PA = 1, PB, PC, PD, PE, PF, PG, PH, PJ = 10, PK, PL };
+
+// the pin mapping is shared with pulsetrain_template.h
+#include "pulsetrain_pins.h"
+
+#define digitalPinToPort(P)     \
+    ((uint8_t)(P) < P_SIM_NUMBER_OF_PINS ? p_mega_pin_port[(uint8_t)(P)] : NOT_A_PIN)
+#define digitalPinToBitMask(P)  \
+    ((uint8_t)(P) < P_SIM_NUMBER_OF_PINS ? _BV(p_mega_pin_bit[(uint8_t)(P)]) : 0)
+#define portOutputRegister(P)   (p_sim_port_output[(P)])
+#define portModeRegister(P)     (p_sim_port_mode[(P)])
+#define portInputRegister(P)    (p_sim_port_input[(P)])
+#define digitalPinToInterrupt(P) ((P) == 2 ? 0 : ((P) == 3 ? 1 :            \
+                                ((P) >= 18 && (P) <= 21 ? 23 - (P) : NOT_AN_INTERRUPT)))
+
+// Output compare pins
+//////////////////////
+static inline uint8_t pSimCompareMode(uint8_t control, uint8_t channel)
+{
+    // the COMnx1:0 bits of a channel
+    return (control >> (6 - 2 * channel)) & 0x03;
+}
+
+static int8_t pSimCompareDrive(uint8_t pin)
+{
+    // the level an output compare unit forces on a pin, -1 when the pin
+    // is left to its PORT bit
+    for (uint8_t i = 0; i < P_SIM_NUMBER_OF_TIMERS; i++) {
+        psimtimer_t *sim_timer = &p_sim_timers[i];
+        for (uint8_t channel = 0; channel < 3; channel++) {
+            if ((sim_timer->oc_pins[channel] == pin) &&
+                    pSimCompareMode(sim_timer->TCCRnA->value, channel)) {
+                return (sim_timer->oc_level >> channel) & 0x01;
+            }
+        }
+    }
+    return -1;
+}
+
+static inline uint8_t pSimPortLevel(uint8_t pin)
+{
+    return (*p_sim_port_output[p_mega_pin_port[pin]] & _BV(p_mega_pin_bit[pin])) ? HIGH : LOW;
+}
+
+static void pSimSetCompareOutput(psimtimer_t *sim_timer, uint8_t channel,
+                                    uint8_t action, uint64_t cycle)
+{
+    // apply a COMnx action (1 toggle, 2 clear, 3 set) to an OCnx output
+    uint8_t mask = _BV(channel);
+    uint8_t old_level = sim_timer->oc_level;
+    if (action == 1) {
+        sim_timer->oc_level ^= mask;
+    }
+    else if (action == 2) {
+        sim_timer->oc_level &= ~mask;
+    }
+    else if (action == 3) {
+        sim_timer->oc_level |= mask;
+    }
+    if ((old_level != sim_timer->oc_level) && (p_sim_edge_hook != NULL) &&
+            pSimCompareMode(sim_timer->TCCRnA->value, channel)) {
+        p_sim_edge_hook(sim_timer->oc_pins[channel],
+                            (sim_timer->oc_level & mask) ? HIGH : LOW, cycle);
+    }
+}
+
+static void pSimOutputsChanged(uint8_t timer, uint8_t old_control)
+{
+    // report the pins that moved when OCnx was connected or disconnected
+    psimtimer_t *sim_timer = &p_sim_timers[timer];
+    for (uint8_t channel = 0; channel < 3; channel++) {
+        bool was_connected = pSimCompareMode(old_control, channel) != 0;
+        bool connected = pSimCompareMode(sim_timer->TCCRnA->value, channel) != 0;
+        if ((was_connected == connected) || (p_sim_edge_hook == NULL)) {
+            continue;
+        }
+        uint8_t pin = sim_timer->oc_pins[channel];
+        uint8_t oc_level = (sim_timer->oc_level >> channel) & 0x01;
+        if (oc_level != pSimPortLevel(pin)) {
+            p_sim_edge_hook(pin, connected ? oc_level : pSimPortLevel(pin), p_sim_clock);
+        }
+    }
+}
+
+// Port writes
+//////////////
+static void pSimPortWrite(volatile uint8_t *port, uint8_t value)
+{
+    // write an output register and report every pin that changed
+    uint8_t changed = *port ^ value;
+    *port = value;
+    if ((changed == 0) || (p_sim_edge_hook == NULL)) {
+        return;
+    }
+    uint64_t cycle = p_sim_clock;
+    for (uint8_t pin = 0; pin < P_SIM_NUMBER_OF_PINS; pin++) {
+        uint8_t mask = _BV(p_mega_pin_bit[pin]);
+        if ((p_sim_port_output[p_mega_pin_port[pin]] == port) && (changed & mask) &&
+                (pSimCompareDrive(pin) < 0)) {
+            p_sim_edge_hook(pin, (value & mask) ? HIGH : LOW, cycle);
+        }
+    }
+}
+
+static void pSimAdvance(uint64_t cycles);
+
+static inline void pSimCharge(uint32_t cycles)
+{
+    // account for work done in an ISR, code outside ISRs takes no time
+    if (p_sim_in_isr) {
+        p_sim_isr_charge += cycles;
+        pSimAdvance(cycles);
+    }
+}
+
+static void pSimStore(uint8_t cycles)
+{
+    // the clock control stores are the main line code whose time matters,
+    // timers started one store apart are that many cycles apart
+    if (!p_sim_in_isr) {
+        pSimAdvance(cycles);
+    }
+}
+
+static inline void pSimPortSet(volatile uint8_t *port, uint8_t mask)
+{
+    pSimPortWrite(port, *port | mask);
+    pSimCharge(P_SIM_PORT_WRITE_CYCLES);
+}
+
+static inline void pSimPortClear(volatile uint8_t *port, uint8_t mask)
+{
+    pSimPortWrite(port, *port & ~mask);
+    pSimCharge(P_SIM_PORT_WRITE_CYCLES);
+}
+
+static inline void pSimPortMaskedWrite(volatile uint8_t *port, uint8_t mask, uint8_t bits)
+{
+    pSimPortWrite(port, (*port & ~mask) | bits);
+    pSimCharge(P_SIM_PORT_WRITE_CYCLES);
+}
+
+// pulsetrain.h drives its pins through these
+#define P_PORT_SET(_port,_mask)     pSimPortSet((_port), (_mask))
+#define P_PORT_CLR(_port,_mask)     pSimPortClear((_port), (_mask))
+#define P_PORT_WRITE(_port,_mask,_bits) pSimPortMaskedWrite((_port), (_mask), (_bits))
+#define P_SIM_COST(_cycles)         pSimCharge(_cycles)
+
+// Arduino pin functions
+////////////////////////
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    uint8_t port = digitalPinToPort(pin);
+    if (port == NOT_A_PIN) {
+        return;
+    }
+    uint8_t mask = digitalPinToBitMask(pin);
+    if (mode == OUTPUT) {
+        *portModeRegister(port) |= mask;
+    }
+    else {
+        *portModeRegister(port) &= ~mask;
+        if (mode == INPUT_PULLUP) {
+            pSimPortWrite(portOutputRegister(port), *portOutputRegister(port) | mask);
+        }
+    }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    uint8_t port = digitalPinToPort(pin);
+    if (port != NOT_A_PIN) {
+        volatile uint8_t *out = portOutputRegister(port);
+        uint8_t mask = digitalPinToBitMask(pin);
+        pSimPortWrite(out, (value == LOW) ? (*out & ~mask) : (*out | mask));
+    }
+    pSimCharge(P_SIM_DIGITALWRITE_CYCLES);
+}
+
+int digitalRead(uint8_t pin)
+{
+    uint8_t port = digitalPinToPort(pin);
+    pSimCharge(P_SIM_DIGITALREAD_CYCLES);
+    if (port == NOT_A_PIN) {
+        return LOW;
+    }
+    uint8_t mask = digitalPinToBitMask(pin);
+    if (*portModeRegister(port) & mask) {
+        return (*portOutputRegister(port) & mask) ? HIGH : LOW;
+    }
+    return (*portInputRegister(port) & mask) ? HIGH : LOW;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    // only takes time inside an ISR, like everything else
+    pSimCharge((uint32_t)us * (F_CPU / 1000000L));
+}
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int mode)
+{
+    if (!(SREG & _BV(SREG_I))) {
+        p_sim_attach_in_cli++;              // a slow call for a critical section
+    }
+    if (interrupt < P_SIM_NUMBER_OF_EXTERNAL) {
+        p_sim_external[interrupt] = handler;
+        p_sim_external_mode[interrupt] = mode;
+        p_sim_external_pending &= ~_BV(interrupt);
+    }
+}
+
+void detachInterrupt(uint8_t interrupt)
+{
+    if (interrupt < P_SIM_NUMBER_OF_EXTERNAL) {
+        p_sim_external[interrupt] = NULL;
+        p_sim_external_pending &= ~_BV(interrupt);
+    }
+}
+
+unsigned long micros(void)
+{
+    return (unsigned long)(p_sim_clock / (F_CPU / 1000000L));
+}
+
+unsigned long millis(void)
+{
+    return (unsigned long)(p_sim_clock / (F_CPU / 1000L));
+}
+
+// Timer model
+//////////////
+static uint16_t pSimPrescale(const psimtimer_t *sim_timer)
+{
+    // the clock divider selected by the CSn2:0 bits, 0 when stopped
+    switch (*sim_timer->TCCRnB & 0x07) {
+        case 0x01:
+            return 1;
+        case 0x02:
+            return 8;
+        case 0x03:
+            return 64;
+        case 0x04:
+            return 256;
+        case 0x05:
+            return 1024;
+        default:                    // stopped or external clock
+            return 0;
+    }
+}
+
+static inline bool pSimPrescalerHeld(void)
+{
+    return (GTCCR & _BV(TSM)) && (GTCCR & (_BV(PSRSYNC)));
+}
+
+static uint8_t pSimWaveform(const psimtimer_t *sim_timer)
+{
+    // the WGMn3:0 bits
+    return ((*sim_timer->TCCRnB >> 1) & 0x0C) | (sim_timer->TCCRnA->value & 0x03);
+}
+
+static uint16_t pSimTop(const psimtimer_t *sim_timer)
+{
+    // the value the counter wraps after, modes other than 12 and 14 count
+    // like normal mode
+    uint8_t waveform = pSimWaveform(sim_timer);
+    if ((waveform == 12) || (waveform == 14)) {
+        // past TOP, after a TCNTn write, the counter runs on to MAX
+        if (*sim_timer->TCNTn <= *sim_timer->ICRn) {
+            return *sim_timer->ICRn;
+        }
+    }
+    return 0xFFFF;
+}
+
+static uint32_t pSimTicksTo(const psimtimer_t *sim_timer, uint16_t target)
+{
+    // counts until TCNTn next becomes target, 0 if it never does
+    uint16_t count = *sim_timer->TCNTn;
+    uint16_t top = pSimTop(sim_timer);
+    if ((target > count) && (target <= top)) {
+        return target - count;
+    }
+    uint32_t to_wrap = (uint32_t)top - count + 1;
+    uint8_t waveform = pSimWaveform(sim_timer);
+    if (((waveform != 12) && (waveform != 14)) || (target <= *sim_timer->ICRn)) {
+        return to_wrap + target;
+    }
+    return 0;
+}
+
+static void pSimCount(psimtimer_t *sim_timer, uint64_t tick, uint64_t end,
+                        uint16_t prescale, uint64_t clock_base)
+{
+    // count from prescaler tick to end, stopping at every wrap and every
+    // compare match to raise flags and drive the OCnx pins on time
+    uint8_t waveform = pSimWaveform(sim_timer);
+    bool pwm = (waveform == 14);
+    while (tick < end) {
+        uint16_t count = *sim_timer->TCNTn;
+        uint16_t top = pSimTop(sim_timer);
+        uint32_t step = (uint32_t)top - count + 1;
+        for (uint8_t channel = 0; channel < 3; channel++) {
+            uint16_t ocr = *sim_timer->OCRnx[channel];
+            // reaching OCRnx raises the flag, leaving it moves the pin
+            if ((ocr > count) && ((uint32_t)(ocr - count) < step)) {
+                step = ocr - count;
+            }
+            if ((ocr >= count) && (ocr < top) && (ocr - count + 1UL < step)) {
+                step = ocr - count + 1;
+            }
+        }
+        if (step > end - tick) {
+            *sim_timer->TCNTn = (uint16_t)(count + (end - tick));
+            return;
+        }
+        tick += step;
+        uint64_t cycle = clock_base + tick * prescale;
+        uint16_t last = (uint16_t)(count + step - 1);   // value before the last count
+        bool wrapped = (last == top);
+        *sim_timer->TCNTn = wrapped ? 0 : (uint16_t)(count + step);
+        if (wrapped) {
+            if ((top == 0xFFFF) || pwm) {
+                sim_timer->TIFRn->value |= _BV(TOV1);
+            }
+            if (((waveform == 12) || pwm) && (top == *sim_timer->ICRn)) {
+                sim_timer->TIFRn->value |= _BV(ICF1);
+            }
+        }
+        for (uint8_t channel = 0; channel < 3; channel++) {
+            uint16_t ocr = *sim_timer->OCRnx[channel];
+            uint8_t action = pSimCompareMode(sim_timer->TCCRnA->value, channel);
+            if (*sim_timer->TCNTn == ocr) {
+                sim_timer->TIFRn->value |= _BV(OCF1A + channel);
+            }
+            if (pwm) {
+                // non-inverting (2) sets at BOTTOM and clears after the
+                // match, inverting (3) the other way around
+                if ((action >= 2) && wrapped) {
+                    pSimSetCompareOutput(sim_timer, channel, 5 - action, cycle);
+                }
+                else if ((action >= 2) && (last == ocr)) {
+                    pSimSetCompareOutput(sim_timer, channel, action, cycle);
+                }
+            }
+            else if (action && (last == ocr)) {
+                pSimSetCompareOutput(sim_timer, channel, action, cycle);
+            }
+        }
+    }
+}
+
+static void pSimResetPrescaler(void)
+{
+    // the next prescaled tick of every timer comes a whole prescale away
+    p_sim_prescaler = 0;
+}
+
+static void pSimAdvance(uint64_t cycles)
+{
+    // move the clock and every running counter forward, raising flags for
+    // each compare match and overflow passed on the way
+    if (pSimPrescalerHeld()) {
+        // only the timers on the undivided clock keep counting
+        uint64_t clock_base = p_sim_clock;
+        p_sim_prescaler = 0;
+        p_sim_clock += cycles;
+        for (uint8_t i = 0; i < P_SIM_NUMBER_OF_TIMERS; i++) {
+            psimtimer_t *sim_timer = &p_sim_timers[i];
+            if (pSimPrescale(sim_timer) == 1) {
+                pSimCount(sim_timer, 0, cycles, 1, clock_base);
+            }
+        }
+        return;
+    }
+    uint64_t start = p_sim_prescaler;
+    uint64_t clock_base = p_sim_clock - start;
+    p_sim_prescaler += cycles;
+    p_sim_clock += cycles;
+    for (uint8_t i = 0; i < P_SIM_NUMBER_OF_TIMERS; i++) {
+        psimtimer_t *sim_timer = &p_sim_timers[i];
+        uint16_t prescale = pSimPrescale(sim_timer);
+        if (prescale == 0) {
+            continue;
+        }
+        pSimCount(sim_timer, start / prescale, p_sim_prescaler / prescale,
+                    prescale, clock_base);
+    }
+}
+
+static void pSimForceCompare(uint8_t timer, uint8_t bits)
+{
+    // a FOCnx strobe applies the COMnx action without raising a flag, it
+    // is ignored in the PWM modes
+    psimtimer_t *sim_timer = &p_sim_timers[timer];
+    if (pSimWaveform(sim_timer) == 14) {
+        return;
+    }
+    for (uint8_t channel = 0; channel < 3; channel++) {
+        if (bits & _BV(FOC1A - channel)) {
+            pSimSetCompareOutput(sim_timer, channel,
+                    pSimCompareMode(sim_timer->TCCRnA->value, channel), p_sim_clock);
+        }
+    }
+}
+
+static uint64_t pSimTicksToCycles(const psimtimer_t *sim_timer, uint32_t ticks)
+{
+    // cycles until a running timer has counted ticks more times, 0 if the
+    // timer is stopped or ticks is 0
+    uint16_t prescale = pSimPrescale(sim_timer);
+    if ((prescale == 0) || (ticks == 0) || (pSimPrescalerHeld() && (prescale != 1))) {
+        return 0;
+    }
+    uint64_t ticks_done = p_sim_prescaler / prescale;
+    return (ticks_done + ticks) * prescale - p_sim_prescaler;
+}
+
+static uint64_t pSimCyclesToMatch(const psimtimer_t *sim_timer)
+{
+    // cycles until the next compare match of a running timer, 0 if none
+    return pSimTicksToCycles(sim_timer, pSimTicksTo(sim_timer, *sim_timer->OCRnx[0]));
+}
+
+static uint64_t pSimCyclesToOverflow(const psimtimer_t *sim_timer)
+{
+    uint16_t top = pSimTop(sim_timer);
+    if ((top != 0xFFFF) && (pSimWaveform(sim_timer) != 14)) {
+        return 0;                       // CTC mode never reaches MAX
+    }
+    return pSimTicksToCycles(sim_timer, (uint32_t)top - *sim_timer->TCNTn + 1);
+}
+
+static uint64_t pSimCyclesToCapture(const psimtimer_t *sim_timer)
+{
+    // ICFn is set at TOP when ICRn is the TOP value
+    uint8_t waveform = pSimWaveform(sim_timer);
+    if (((waveform != 12) && (waveform != 14)) ||
+            (*sim_timer->TCNTn > *sim_timer->ICRn)) {
+        return 0;
+    }
+    return pSimTicksToCycles(sim_timer, (uint32_t)*sim_timer->ICRn - *sim_timer->TCNTn + 1);
+}
+
+static uint64_t pSimCyclesToEvent(const psimtimer_t *sim_timer)
+{
+    // cycles until the next enabled interrupt of a timer, 0 if none
+    uint64_t to_event = 0;
+    uint64_t to_events[3] = { 0, 0, 0 };
+    if (*sim_timer->TIMSKn & _BV(OCIE1A)) {
+        to_events[0] = pSimCyclesToMatch(sim_timer);
+    }
+    if (*sim_timer->TIMSKn & _BV(TOIE1)) {
+        to_events[1] = pSimCyclesToOverflow(sim_timer);
+    }
+    if (*sim_timer->TIMSKn & _BV(ICIE1)) {
+        to_events[2] = pSimCyclesToCapture(sim_timer);
+    }
+    for (uint8_t i = 0; i < 3; i++) {
+        if ((to_events[i] != 0) && ((to_event == 0) || (to_events[i] < to_event))) {
+            to_event = to_events[i];
+        }
+    }
+    return to_event;
+}
+
+static void pSimRunISR(uint8_t vector, psimvector_t handler)
+{
+    // run one interrupt handler, charging its entry and exit
+    p_sim_in_isr = true;
+    SREG &= ~_BV(SREG_I);
+    p_sim_isr_charge = 0;
+    pSimCharge(P_SIM_ISR_ENTRY_CYCLES + P_SIM_ISR_BODY_CYCLES);
+    handler();
+    pSimCharge(P_SIM_ISR_EXIT_CYCLES);
+    SREG |= _BV(SREG_I);
+    p_sim_in_isr = false;
+    p_sim_isr_count++;
+    p_sim_last_isr_cycles = p_sim_isr_charge;
+    p_sim_isr_cycles += p_sim_isr_charge;
+    if (p_sim_isr_hook != NULL) {
+        p_sim_isr_hook(vector, p_sim_isr_charge);
+    }
+}
+
+static bool pSimDispatch(void)
+{
+    // run the highest priority pending and enabled interrupt, if any
+    if (!(SREG & _BV(SREG_I)) || p_sim_in_isr) {
+        return false;
+    }
+    for (uint8_t i = 0; i < P_SIM_NUMBER_OF_EXTERNAL; i++) {
+        // INT0 to INT5 come before every timer vector
+        if (p_sim_external_pending & _BV(i)) {
+            p_sim_external_pending &= ~_BV(i);
+            pSimRunISR(P_SIM_NUMBER_OF_VECTORS + i, p_sim_external[i]);
+            return true;
+        }
+    }
+    for (uint8_t i = 0; i < P_SIM_NUMBER_OF_TIMERS; i++) {
+        psimtimer_t *sim_timer = &p_sim_timers[i];
+        uint8_t pending = sim_timer->TIFRn->value & *sim_timer->TIMSKn;
+        uint8_t vector;
+        if (pending & _BV(ICF1)) {
+            sim_timer->TIFRn->value &= ~_BV(ICF1);
+            vector = sim_timer->capt_vect;
+        }
+        else if (pending & _BV(OCF1A)) {
+            sim_timer->TIFRn->value &= ~_BV(OCF1A);
+            vector = sim_timer->compa_vect;
+        }
+        else if (pending & _BV(TOV1)) {
+            sim_timer->TIFRn->value &= ~_BV(TOV1);
+            vector = sim_timer->ovf_vect;
+        }
+        else {
+            continue;
+        }
+        if (p_sim_vectors[vector] == NULL) {
+            continue;                   // would be a reset on the real chip
+        }
+        pSimRunISR(vector, p_sim_vectors[vector]);
+        return true;
+    }
+    return false;
+}
+
+// Simulation control
+/////////////////////
+void pSimReset(void)
+{
+    // power on state: registers cleared, interrupts on, time at zero
+    for (uint8_t i = 0; i < P_SIM_NUMBER_OF_TIMERS; i++) {
+        psimtimer_t *sim_timer = &p_sim_timers[i];
+        sim_timer->TCCRnB->value = 0;
+        *sim_timer->TIMSKn = 0;
+        sim_timer->TIFRn->value = 0;
+        *sim_timer->TCNTn = 0;
+        for (uint8_t channel = 0; channel < 3; channel++) {
+            *sim_timer->OCRnx[channel] = 0;
+        }
+        *sim_timer->ICRn = 0;
+        sim_timer->TCCRnA->value = 0;
+        sim_timer->oc_level = 0;
+    }
+    for (uint8_t port = 0; port < P_SIM_NUMBER_OF_PORTS; port++) {
+        if (p_sim_port_output[port] != NULL) {
+            *p_sim_port_output[port] = 0;
+            *p_sim_port_mode[port] = 0;
+            *p_sim_port_input[port] = 0;
+        }
+    }
+    for (uint8_t i = 0; i < P_SIM_NUMBER_OF_EXTERNAL; i++) {
+        p_sim_external[i] = NULL;
+    }
+    p_sim_external_pending = 0;
+    p_sim_attach_in_cli = 0;
+    GTCCR.value = 0;
+    SREG = _BV(SREG_I);
+    p_sim_clock = 0;
+    p_sim_prescaler = 0;
+    p_sim_isr_charge = 0;
+    p_sim_isr_count = 0;
+    p_sim_last_isr_cycles = 0;
+    p_sim_isr_cycles = 0;
+}
+
+uint64_t pSimCycles(void)
+{
+    return p_sim_clock;
+}
+
+bool pSimIsIdle(void)
+{
+    // true when no timer interrupt can fire anymore
+    for (uint8_t i = 0; i < P_SIM_NUMBER_OF_TIMERS; i++) {
+        psimtimer_t *sim_timer = &p_sim_timers[i];
+        if ((pSimPrescale(sim_timer) != 0) &&
+                (*sim_timer->TIMSKn & (_BV(OCIE1A) | _BV(TOIE1) | _BV(ICIE1)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t pSimRun(uint64_t cycles)
+{
+    // run the simulation for a number of CPU cycles, returns the clock.
+    // An ISR that straddles the end is finished, so the clock can end up
+    // slightly past the requested time
+    uint64_t end = p_sim_clock + cycles;
+    while (true) {
+        while (pSimDispatch()) {
+        }
+        if (p_sim_clock >= end) {
+            break;
+        }
+        uint64_t step = end - p_sim_clock;
+        for (uint8_t i = 0; i < P_SIM_NUMBER_OF_TIMERS; i++) {
+            uint64_t to_event = pSimCyclesToEvent(&p_sim_timers[i]);
+            if ((to_event != 0) && (to_event < step)) {
+                step = to_event;
+            }
+        }
+        pSimAdvance(step);
+    }
+    return p_sim_clock;
+}
+
+uint64_t pSimRunUntilIdle(uint64_t max_cycles)
+{
+    // run until every timer has stopped or max_cycles have passed
+    uint64_t end = p_sim_clock + max_cycles;
+    while (!pSimIsIdle() && (p_sim_clock < end)) {
+        uint64_t step = 0;
+        for (uint8_t i = 0; i < P_SIM_NUMBER_OF_TIMERS; i++) {
+            uint64_t to_event = pSimCyclesToEvent(&p_sim_timers[i]);
+            if ((to_event != 0) && ((step == 0) || (to_event < step))) {
+                step = to_event;
+            }
+        }
+        if ((step == 0) || (step > end - p_sim_clock)) {
+            step = end - p_sim_clock;
+        }
+        pSimRun(step);
+    }
+    return p_sim_clock;
+}
+
+void pSimSetInput(uint8_t pin, uint8_t level)
+{
+    // drive an input pin from outside the chip
+    uint8_t port = digitalPinToPort(pin);
+    if (port == NOT_A_PIN) {
+        return;
+    }
+    uint8_t mask = digitalPinToBitMask(pin);
+    uint8_t old_level = (*portInputRegister(port) & mask) ? HIGH : LOW;
+    if (level == LOW) {
+        *portInputRegister(port) &= ~mask;
+    }
+    else {
+        *portInputRegister(port) |= mask;
+        level = HIGH;
+    }
+    int interrupt = digitalPinToInterrupt(pin);
+    if ((interrupt != NOT_AN_INTERRUPT) && (p_sim_external[interrupt] != NULL) &&
+            (level != old_level)) {
+        uint8_t mode = p_sim_external_mode[interrupt];
+        if ((mode == CHANGE) || ((mode == RISING) && (level == HIGH)) ||
+                ((mode == FALLING) && (level == LOW))) {
+            p_sim_external_pending |= _BV(interrupt);   // runs on the next pSimRun
+        }
+    }
+}
+
+uint8_t pSimReadPin(uint8_t pin)
+{
+    // the level an output pin is driving
+    uint8_t port = digitalPinToPort(pin);
+    if (port == NOT_A_PIN) {
+        return LOW;
+    }
+    int8_t drive = pSimCompareDrive(pin);
+    if (drive >= 0) {
+        return drive;
+    }
+    return (*portOutputRegister(port) & digitalPinToBitMask(pin)) ? HIGH : LOW;
+}
+
+#endif
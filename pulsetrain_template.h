@@ -0,0 +1,298 @@
+// Copyright (c) 2012 Wyss Institute at Harvard University
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// http://www.opensource.org/licenses/mit-license.php
+
+// pulsetrain_template.h - Compile time PulseTrain for a fixed timer, set of
+// pins and prescale.  Needs C++11 (Arduino 1.6.6 and later).
+//
+//     typedef PulseTrain<PTimer4, PPins<3, 5, 6>, PPrescale<8> > Valves;
+//     P_PULSETRAIN_ISR(4, Valves)
+//
+//     Valves::begin();
+//     Valves::setPulseUS<1000, 250>(100);     // period, pulse, periods
+//     Valves::start();
+//
+// The ports, pin masks, timer registers and microsecond conversions are
+// all worked out by the compiler, so the ISR is straight line code: one
+// read-modify-write per port the pins are on and no ptrain or port group
+// tables to walk.  It runs like a PMODE_CLEAR timer of pulsetrain.h with
+// every pin doing the same thing.
+//
+// The p* functions of pulsetrain.h keep working on the other timers.  Leave
+// P_USE_TIMERn undefined for the timer a PulseTrain owns, that ISR belongs
+// to P_PULSETRAIN_ISR, and never attach ptrains to it.
+
+#ifndef PULSETRAIN_TEMPLATE_H
+#define PULSETRAIN_TEMPLATE_H
+
+#include "pulsetrain.h"
+#include "pulsetrain_pins.h"
+
+// the output register of each port, inlined to a fixed address
+template <uint8_t port> struct PPortRegister;
+
+#define P_TEMPLATE_PORT(_port, _reg)                                        \
+    template <> struct PPortRegister<_port> {                               \
+        static inline volatile uint8_t *out() { return &_reg; }             \
+    };
+
+P_TEMPLATE_PORT(PA, PORTA)
+P_TEMPLATE_PORT(PB, PORTB)
+P_TEMPLATE_PORT(PC, PORTC)
+P_TEMPLATE_PORT(PD, PORTD)
+P_TEMPLATE_PORT(PE, PORTE)
+P_TEMPLATE_PORT(PF, PORTF)
+P_TEMPLATE_PORT(PG, PORTG)
+P_TEMPLATE_PORT(PH, PORTH)
+P_TEMPLATE_PORT(PJ, PORTJ)
+P_TEMPLATE_PORT(PK, PORTK)
+P_TEMPLATE_PORT(PL, PORTL)
+
+// Timers
+/////////
+// the same register writes as pEnableISR and pStopTimer for one timer
+#define P_TEMPLATE_TIMER(_n)                                                \
+    struct PTimer##_n {                                                     \
+        static constexpr timers16bit_t number = PTIMER##_n;                 \
+        static inline volatile uint16_t &count() { return TCNT##_n; }       \
+        static inline volatile uint16_t &compare() { return OCR##_n##A; }   \
+        static inline void enable(uint8_t bit_prescale) {                   \
+            TCCR##_n##A = 0x00;                                             \
+            OCR##_n##A = SMALL_COUNT;                                       \
+            TIFR##_n |= _BV(OCF##_n##A);                                    \
+            TCCR##_n##B = bit_prescale;                                     \
+            TCNT##_n = 0x0000;                                              \
+            TIMSK##_n = _BV(OCIE##_n##A);                                   \
+        }                                                                   \
+        static inline void disable() {                                      \
+            TCCR##_n##B &= 0xF8;                                            \
+            TIMSK##_n &= ~_BV(OCIE##_n##A);                                 \
+        }                                                                   \
+        static inline bool isActive() { return (TCCR##_n##B & 0x07) != 0; }\
+    };
+
+P_TEMPLATE_TIMER(1)
+P_TEMPLATE_TIMER(3)
+P_TEMPLATE_TIMER(4)
+P_TEMPLATE_TIMER(5)
+
+// the compare A vector of timer n calls the handler of a PulseTrain
+// typedef, the typedef keeps the template commas out of the macro
+#define P_PULSETRAIN_ISR(_n, _train)                                        \
+    ISR (TIMER##_n##_COMPA_vect)                                            \
+    {                                                                       \
+        _train::handleInterrupt();                                          \
+    }
+
+// Prescale
+///////////
+template <uint16_t prescale> struct PPrescale {
+    static constexpr uint16_t value = prescale;
+    // the CSn2:0 bits, the same as pGetPrescaleBits
+    static constexpr uint8_t bits = (prescale == 1) ? 0x01 : (prescale == 8) ? 0x02 :
+                                    (prescale == 64) ? 0x03 : (prescale == 256) ? 0x04 :
+                                    (prescale == 1024) ? 0x05 : 0x00;
+    static_assert(bits != 0x00, "prescale must be 1, 8, 64, 256 or 1024");
+};
+
+// Pins
+///////
+template <uint8_t pin> constexpr uint8_t pTemplatePinMask(uint8_t port) {
+    return (p_mega_pin_port[pin] == port) ? _BV(p_mega_pin_bit[pin]) : 0;
+}
+
+template <uint8_t pin, uint8_t next, uint8_t... rest>
+constexpr uint8_t pTemplatePinMask(uint8_t port) {
+    return pTemplatePinMask<pin>(port) | pTemplatePinMask<next, rest...>(port);
+}
+
+template <uint8_t pin> constexpr bool pTemplatePinsValid() {
+    return pin < P_MEGA_NUMBER_OF_PINS;
+}
+
+template <uint8_t pin, uint8_t next, uint8_t... rest> constexpr bool pTemplatePinsValid() {
+    return pTemplatePinsValid<pin>() && pTemplatePinsValid<next, rest...>();
+}
+
+template <uint8_t... pins> struct PPins {
+    static_assert(sizeof...(pins) > 0, "a PulseTrain needs at least one pin");
+    static_assert(pTemplatePinsValid<pins...>(), "the Mega has pins 0 to 69");
+
+    // the bits of one port driven by these pins
+    static constexpr uint8_t mask(uint8_t port) { return pTemplatePinMask<pins...>(port); }
+
+    static void begin() {
+        // outputs driven LOW, one pinMode and digitalWrite per pin
+        uint8_t unused[] = { (pinMode(pins, OUTPUT), digitalWrite(pins, LOW), (uint8_t)0)... };
+        (void)unused;
+    }
+};
+
+// PulseTrain
+/////////////
+template <class Timer, class Pins, class Scale = PPrescale<DEFAULT_PTRAIN_PRESCALE> >
+class PulseTrain {
+public:
+    static constexpr timers16bit_t timer = Timer::number;
+    static constexpr uint16_t prescale = Scale::value;
+
+    // counts of a number of microseconds, checked to fit 16 bits
+    template <uint32_t us> struct CountsUS {
+        static constexpr uint32_t counts = US_TO_COUNTS(us, (uint32_t)prescale);
+        static_assert(counts <= 0xFFFF, "too long for this prescale");
+        static constexpr uint16_t value = counts;
+    };
+
+    static void begin() {
+        Pins::begin();
+        Timer::disable();
+        s_state = POFF;
+    }
+
+    static void set(uint16_t pulse_counts, uint16_t period_counts, uint32_t period_num_limit) {
+        // change the waveform of a stopped timer, a period of 0 is DC
+        s_pulse_counts = pulse_counts;
+        s_period_counts = period_counts;
+        s_period_num_limit = period_num_limit;
+    }
+
+    template <uint32_t period_us, uint32_t pulse_us>
+    static void setPulseUS(uint32_t period_num_limit) {
+        set(CountsUS<pulse_us>::value, CountsUS<period_us>::value, period_num_limit);
+    }
+
+    static uint8_t start() {
+        if (Timer::isActive()) {
+            return ERROR_TIMER_RUNNING;
+        }
+        s_number_of_periods = 0;
+        s_state = (s_period_counts == 0) ? PDC_INIT : PPULSE_LO;
+        Timer::enable(Scale::bits);
+        return 0;
+    }
+
+    static void stop() {
+        Timer::disable();
+    }
+
+    static bool isActive() {
+        return Timer::isActive();
+    }
+
+    static uint32_t getPeriodNumber() {
+        uint8_t oldSREG = SREG;
+        cli();
+        uint32_t periods = s_number_of_periods;
+        SREG = oldSREG;
+        return periods;
+    }
+
+    static uint8_t getState() {
+        // the pulse_states value the next ISR starts from
+        return s_state;
+    }
+
+    static inline void handleInterrupt() {
+        // the PMODE_CLEAR state machine of pHandleInterrupts
+        switch (s_state) {
+            case PPULSE_LO:
+                // compare first, at Prescale<1> the counter would pass the
+                // stale one before it was moved
+                Timer::compare() = s_pulse_counts;
+                Timer::count() = 0x0000;
+                writePins(HIGH);
+                s_state = PPULSE_HI;
+                s_number_of_periods += 1;
+                P_SIM_COST(P_SIM_PERIOD_CYCLES);
+                break;
+            case PPULSE_HI:
+                writePins(LOW);
+                s_state = PPULSE_LO;
+                Timer::compare() = s_period_counts;
+                P_SIM_COST(P_SIM_PERIOD_CYCLES);
+                if (s_number_of_periods >= s_period_num_limit) {
+                    Timer::disable();
+                }
+                break;
+            default:
+            case PDC_INIT:
+                Timer::compare() = s_pulse_counts;
+                Timer::count() = 0x0000;
+                writePins(HIGH);
+                s_state = PDC_RUNNING;
+                break;
+            case PDC_RUNNING:
+                Timer::count() = 0x0000;
+                s_number_of_periods += 1;
+                P_SIM_COST(2 * P_SIM_PERIOD_CYCLES);    // and its check
+                if (s_number_of_periods >= s_period_num_limit) {
+                    writePins(LOW);
+                    Timer::disable();
+                }
+        }
+    }
+
+private:
+    template <uint8_t port> static inline void writePort(uint8_t value) {
+        // folds away for ports without pins
+        if (Pins::mask(port) != 0) {
+            if (value == HIGH) {
+                P_PORT_SET(PPortRegister<port>::out(), Pins::mask(port));
+            }
+            else {
+                P_PORT_CLR(PPortRegister<port>::out(), Pins::mask(port));
+            }
+        }
+    }
+
+    static inline void writePins(uint8_t value) {
+        writePort<PA>(value);
+        writePort<PB>(value);
+        writePort<PC>(value);
+        writePort<PD>(value);
+        writePort<PE>(value);
+        writePort<PF>(value);
+        writePort<PG>(value);
+        writePort<PH>(value);
+        writePort<PJ>(value);
+        writePort<PK>(value);
+        writePort<PL>(value);
+    }
+
+    static volatile uint8_t     s_state;                // a pulse_states value
+    static volatile uint32_t    s_number_of_periods;
+    static uint32_t             s_period_num_limit;
+    static uint16_t             s_pulse_counts;
+    static uint16_t             s_period_counts;
+};
+
+template <class Timer, class Pins, class Scale>
+volatile uint8_t PulseTrain<Timer, Pins, Scale>::s_state = POFF;
+template <class Timer, class Pins, class Scale>
+volatile uint32_t PulseTrain<Timer, Pins, Scale>::s_number_of_periods = 0;
+template <class Timer, class Pins, class Scale>
+uint32_t PulseTrain<Timer, Pins, Scale>::s_period_num_limit = 0;
+template <class Timer, class Pins, class Scale>
+uint16_t PulseTrain<Timer, Pins, Scale>::s_pulse_counts = 0;
+template <class Timer, class Pins, class Scale>
+uint16_t PulseTrain<Timer, Pins, Scale>::s_period_counts = 0;
+
+#endif
@@ -0,0 +1,213 @@
+// Copyright (c) 2012 Wyss Institute at Harvard University
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// http://www.opensource.org/licenses/mit-license.php
+
+// pulsetrain_vcd.h - Host side writer of Value Change Dump files for
+// waveform viewers such as GTKWave.  Include it after pulsetrain.h.
+//
+// pVCDWriteTrace turns ptrace_t records drained from a board with
+// pTraceRead into one signal per timer.  The records are 6 bytes each and
+// have the same little endian layout on the AVR and on x86/ARM hosts, so a
+// sketch can just write them out of the serial port and the host can fread
+// them back.  Edge times are rebuilt from the TCNTn snapshots in the
+// records.  That gives exact spacing within a run, but the idle time
+// between two runs of the same timer is not recorded, so runs are drawn
+// back to back.  Intervals only come out right when they are shorter than
+// 65536 counts, as the records don't say how often the counter wrapped.
+//
+// With P_SIMULATE, pVCDBeginSim hooks the simulation so that every edge of
+// the chosen pins is written as it happens.
+
+#ifndef PULSETRAIN_VCD_H
+#define PULSETRAIN_VCD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Definitions
+//////////////
+#define P_VCD_PS_PER_CYCLE      (1000000000000ULL / F_CPU)
+
+// Custom Structs
+/////////////////
+typedef struct {
+    uint64_t    time;           // picoseconds
+    uint32_t    order;          // position in the trace, breaks ties
+    uint8_t     signal;
+    uint8_t     level;
+} pvcdevent_t;
+
+// Helpers
+//////////
+static void pVCDHeader(FILE *out, const char * const names[], uint8_t count)
+{
+    fprintf(out, "$timescale 1ps $end\n");
+    fprintf(out, "$scope module pulsetrain $end\n");
+    for (uint8_t i = 0; i < count; i++) {
+        fprintf(out, "$var wire 1 %c %s $end\n", '!' + i, names[i]);
+    }
+    fprintf(out, "$upscope $end\n$enddefinitions $end\n");
+    fprintf(out, "#0\n$dumpvars\n");
+    for (uint8_t i = 0; i < count; i++) {
+        fprintf(out, "0%c\n", '!' + i);
+    }
+    fprintf(out, "$end\n");
+}
+
+static int pVCDCompare(const void *a, const void *b)
+{
+    const pvcdevent_t *event_a = (const pvcdevent_t *)a;
+    const pvcdevent_t *event_b = (const pvcdevent_t *)b;
+    if (event_a->time != event_b->time) {
+        return (event_a->time < event_b->time) ? -1 : 1;
+    }
+    return (event_a->order < event_b->order) ? -1 : 1;
+}
+
+#ifdef P_USE_TRACE
+int pVCDWriteTrace(FILE *out, const ptrace_t *records, uint32_t n,
+                    const uint16_t prescale[NUMBER_OF_16BIT_TIMERS])
+{
+    // write a complete VCD file with one signal per timer from a drained
+    // trace, prescale holds the prescale each timer ran at.
+    // Returns 0 or -1 when out of memory
+    static const char * const names[NUMBER_OF_16BIT_TIMERS] =
+                                    { "PTIMER1", "PTIMER3", "PTIMER4", "PTIMER5" };
+    uint64_t base[NUMBER_OF_16BIT_TIMERS] = { 0 };  // counts at the last clear
+    uint64_t since[NUMBER_OF_16BIT_TIMERS] = { 0 }; // counts from base to last record
+    uint16_t last_count[NUMBER_OF_16BIT_TIMERS] = { 0 };
+    uint16_t last_period[NUMBER_OF_16BIT_TIMERS] = { 0 };
+    pvcdevent_t *events = (pvcdevent_t *)malloc((n ? n : 1) * sizeof(pvcdevent_t));
+    uint32_t num_events = 0;
+    if (events == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        const ptrace_t *record = &records[i];
+        uint8_t timer = record->timer;
+        if (timer >= NUMBER_OF_16BIT_TIMERS) {
+            continue;
+        }
+        uint64_t time;
+        if ((record->period < last_period[timer]) ||
+                ((record->state & P_TRACE_LEVEL) && (record->period == 1) &&
+                    (last_period[timer] != 0))) {
+            // the timer was restarted from zero, begin a new run right
+            // after the last edge we know about
+            base[timer] += since[timer];
+            since[timer] = 0;
+            last_count[timer] = 0;
+        }
+        if ((record->state & P_TRACE_DC) && (record->state & P_TRACE_CLEARED) &&
+                !(record->state & P_TRACE_LEVEL)) {
+            // the counter was cleared every pulse_counts through the DC run
+            time = base[timer] + (uint64_t)record->count * record->period;
+        }
+        else {
+            since[timer] += (uint16_t)(record->count - last_count[timer]);
+            time = base[timer] + since[timer];
+        }
+        if (record->state & P_TRACE_CLEARED) {
+            base[timer] = time;
+            since[timer] = 0;
+            last_count[timer] = 0;
+        }
+        else {
+            since[timer] = time - base[timer];
+            last_count[timer] = record->count;
+        }
+        last_period[timer] = record->period;
+        events[num_events].time = time * prescale[timer] * P_VCD_PS_PER_CYCLE;
+        events[num_events].order = i;
+        events[num_events].signal = timer;
+        events[num_events].level = record->state & P_TRACE_LEVEL;
+        num_events++;
+    }
+    qsort(events, num_events, sizeof(pvcdevent_t), pVCDCompare);
+    pVCDHeader(out, names, NUMBER_OF_16BIT_TIMERS);
+    for (uint32_t i = 0; i < num_events; i++) {
+        if ((i == 0) || (events[i].time != events[i - 1].time)) {
+            fprintf(out, "#%llu\n", (unsigned long long)events[i].time);
+        }
+        fprintf(out, "%u%c\n", events[i].level, '!' + events[i].signal);
+    }
+    free(events);
+    return 0;
+}
+#endif
+
+#ifdef P_SIMULATE
+// Simulation capture
+/////////////////////
+static FILE *p_vcd_out = NULL;
+static uint8_t p_vcd_signal[P_SIM_NUMBER_OF_PINS];     // signal + 1, 0 if not traced
+static uint64_t p_vcd_last_time = 0;
+
+static void pVCDSimEdge(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if ((p_vcd_out == NULL) || (p_vcd_signal[pin] == 0)) {
+        return;
+    }
+    uint64_t time = cycle * P_VCD_PS_PER_CYCLE;
+    if (time != p_vcd_last_time) {
+        fprintf(p_vcd_out, "#%llu\n", (unsigned long long)time);
+        p_vcd_last_time = time;
+    }
+    fprintf(p_vcd_out, "%u%c\n", level, '!' + p_vcd_signal[pin] - 1);
+}
+
+void pVCDBeginSim(FILE *out, const uint8_t *pins, uint8_t count)
+{
+    // start writing every edge of the given pins from now on
+    static char labels[P_SIM_NUMBER_OF_PINS][8];
+    const char *names[P_SIM_NUMBER_OF_PINS];
+    memset(p_vcd_signal, 0, sizeof(p_vcd_signal));
+    if (count > P_SIM_NUMBER_OF_PINS) {
+        count = P_SIM_NUMBER_OF_PINS;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        snprintf(labels[i], sizeof(labels[i]), "pin%u", pins[i]);
+        names[i] = labels[i];
+        if (pins[i] < P_SIM_NUMBER_OF_PINS) {
+            p_vcd_signal[pins[i]] = i + 1;
+        }
+    }
+    p_vcd_out = out;
+    p_vcd_last_time = 0;
+    pVCDHeader(out, names, count);
+    p_sim_edge_hook = pVCDSimEdge;
+}
+
+void pVCDEndSim(void)
+{
+    // mark the end of the capture at the current time and unhook
+    if (p_vcd_out != NULL) {
+        fprintf(p_vcd_out, "#%llu\n", (unsigned long long)(pSimCycles() * P_VCD_PS_PER_CYCLE));
+        fflush(p_vcd_out);
+    }
+    p_vcd_out = NULL;
+    if (p_sim_edge_hook == pVCDSimEdge) {
+        p_sim_edge_hook = NULL;
+    }
+}
+#endif
+
+#endif
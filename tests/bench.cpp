@@ -0,0 +1,45 @@
+// bench.cpp - the ISR benchmarks of pulsetrain_bench.h for the p* functions
+// on timer 1 and for PulseTrain templates with the same pins on timers 3,
+// 4 and 5, checked against bench_estimate_baseline.txt when it is given.
+// Exits 1 when an estimated cycle count or frequency got worse than the
+// baseline
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#include "pulsetrain_template.h"
+#include "pulsetrain_bench.h"
+
+// pins 22 to 53 as pBenchRun attaches them
+typedef PulseTrain<PTimer3, PPins<22> > OnePin;
+typedef PulseTrain<PTimer4, PPins<22, 23, 24, 25, 26, 27, 28, 29> > EightPins;
+typedef PulseTrain<PTimer5, PPins<22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35,
+                                    36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48,
+                                    49, 50, 51, 52, 53> > ThirtyTwoPins;
+P_PULSETRAIN_ISR(3, OnePin)
+P_PULSETRAIN_ISR(4, EightPins)
+P_PULSETRAIN_ISR(5, ThirtyTwoPins)
+
+int main(int argc, char **argv)
+{
+    pbenchresult_t results[P_BENCH_MAX_RESULTS];
+    uint8_t n = pBenchRun(results, P_BENCH_MAX_RESULTS);
+    n += pBenchRunTemplate<OnePin>(&results[n], P_BENCH_MAX_RESULTS - n, 1);
+    n += pBenchRunTemplate<EightPins>(&results[n], P_BENCH_MAX_RESULTS - n, 8);
+    n += pBenchRunTemplate<ThirtyTwoPins>(&results[n], P_BENCH_MAX_RESULTS - n, 32);
+    pBenchWrite(stdout, results, n);
+    if (argc < 2) {
+        return 0;
+    }
+    FILE *baseline = fopen(argv[1], "r");
+    if (baseline == NULL) {
+        fprintf(stderr, "no baseline %s\n", argv[1]);
+        return 1;
+    }
+    uint8_t regressions = pBenchCompare(baseline, results, n, 0, stderr);
+    fclose(baseline);
+    if (regressions != 0) {
+        fprintf(stderr, "%u results worse than %s\n", regressions, argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+// ptest.h - Checks shared by the host tests.  Include it after pulsetrain.h
+// with P_SIMULATE defined.  A test counts its failed checks and returns
+// pTestResult from main, so make check stops at the first test that fails.
+
+#ifndef PTEST_H
+#define PTEST_H
+
+#include <stdio.h>
+
+static int p_test_failures = 0;
+
+#define P_CHECK(_cond)                                                      \
+    do {                                                                    \
+        if (!(_cond)) {                                                     \
+            printf("%s:%d: failed %s\n", __FILE__, __LINE__, #_cond);       \
+            p_test_failures++;                                              \
+        }                                                                   \
+    } while (0)
+
+#define P_CHECK_EQUAL(_a, _b)                                               \
+    do {                                                                    \
+        long long _va = (long long)(_a);                                    \
+        long long _vb = (long long)(_b);                                    \
+        if (_va != _vb) {                                                   \
+            printf("%s:%d: %s is %lld, expected %s = %lld\n", __FILE__,     \
+                    __LINE__, #_a, _va, #_b, _vb);                          \
+            p_test_failures++;                                              \
+        }                                                                   \
+    } while (0)
+
+static int pTestResult(const char *name)
+{
+    printf("%s: %s\n", name, p_test_failures ? "FAILED" : "ok");
+    return p_test_failures ? 1 : 0;
+}
+
+#endif
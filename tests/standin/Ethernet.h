@@ -0,0 +1,64 @@
+// Ethernet.h - host stand-in for the Arduino Ethernet library, enough to
+// build the example sketches against the P_SIMULATE backend.  Clients
+// never connect and Serial never has input.  What a server writes to its
+// clients goes to ethernet_write_hook along with the port it serves
+
+#ifndef ETHERNET_STANDIN_H
+#define ETHERNET_STANDIN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Print {
+    virtual ~Print() {}
+    virtual size_t write(uint8_t byte) { return write(&byte, 1); }
+    virtual size_t write(const uint8_t *bytes, size_t n) { (void)bytes; return n; }
+    size_t print(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+    size_t print(long value) { char text[16]; snprintf(text, 16, "%ld", value); return print(text); }
+    size_t print(unsigned long value) { char text[16]; snprintf(text, 16, "%lu", value); return print(text); }
+    size_t print(int value) { return print((long)value); }
+    size_t print(unsigned int value) { return print((unsigned long)value); }
+    size_t print(uint8_t value) { return print((unsigned long)value); }
+};
+
+struct Stream : Print {
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+};
+
+struct HardwareSerial : Stream {
+    void begin(long baud) { (void)baud; }
+};
+
+static HardwareSerial Serial;
+
+struct EthernetClient : Stream {
+    operator bool() { return false; }
+};
+
+static void (*ethernet_write_hook)(uint16_t port, const uint8_t *bytes, size_t n) = NULL;
+
+struct EthernetServer : Print {
+    uint16_t port;
+    EthernetServer(uint16_t server_port) : port(server_port) {}
+    void begin() {}
+    EthernetClient available() { return EthernetClient(); }
+    size_t write(uint8_t byte) { return write(&byte, 1); }
+    size_t write(const uint8_t *bytes, size_t n) {
+        // one call for every client connected
+        if (ethernet_write_hook != NULL) {
+            ethernet_write_hook(port, bytes, n);
+        }
+        return n;
+    }
+};
+
+struct EthernetClass {
+    void begin(uint8_t *mac, uint8_t *ip) { (void)mac; (void)ip; }
+};
+
+static EthernetClass Ethernet;
+
+#endif
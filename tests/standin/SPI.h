@@ -0,0 +1 @@
+// SPI.h - host stand-in, the Ethernet stand-in needs no bus
@@ -0,0 +1,54 @@
+// WebServer.h - host stand-in for Webduino, which never sees a request,
+// and the Arduino core calls the example sketches make of it
+
+#ifndef WEBSERVER_STANDIN_H
+#define WEBSERVER_STANDIN_H
+
+#include <stdio.h>
+
+#define P(name) static const char name[]
+
+enum URLPARAM_RESULT { URLPARAM_OK, URLPARAM_NAME_OFLO, URLPARAM_VALUE_OFLO,
+                        URLPARAM_BOTH_OFLO, URLPARAM_EOS };
+
+struct WebServer : Print {
+    enum ConnectionType { INVALID, GET, HEAD, POST, PUT, DELETE, PATCH };
+    typedef void Command(WebServer &server, ConnectionType type, char *url_tail,
+                            bool tail_complete);
+    WebServer(const char *prefix, int port) { (void)prefix; (void)port; }
+    void begin() {}
+    void processConnection(char *buffer, int *length) { (void)buffer; (void)length; }
+    void setDefaultCommand(Command *command) { (void)command; }
+    void addCommand(const char *verb, Command *command) { (void)verb; (void)command; }
+    void httpSuccess(const char *content_type = "text/html") { (void)content_type; }
+    void httpFail() {}
+    void httpSeeOther(const char *url) { (void)url; }
+    void printP(const char *text) { print(text); }
+    void radioButton(const char *name, const char *value, const char *label, bool selected) {
+        (void)name; (void)value; (void)label; (void)selected;
+    }
+    bool readPOSTparam(char *name, int name_length, char *value, int value_length) {
+        (void)name; (void)name_length; (void)value; (void)value_length;
+        return false;
+    }
+    URLPARAM_RESULT nextURLparam(char **tail, char *name, int name_length, char *value,
+                                    int value_length) {
+        (void)tail; (void)name; (void)name_length; (void)value; (void)value_length;
+        return URLPARAM_EOS;
+    }
+};
+
+static inline int analogRead(int pin)
+{
+    (void)pin;
+    return 0;
+}
+
+static inline char *itoa(int value, char *text, int base)
+{
+    (void)base;
+    sprintf(text, "%d", value);
+    return text;
+}
+
+#endif
@@ -0,0 +1,2 @@
+// avr/pgmspace.h - host stand-in, pulsetrain_sim.h defines PROGMEM and
+// pgm_read_byte for the one address space of the host
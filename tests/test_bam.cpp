@@ -0,0 +1,126 @@
+// test_bam.cpp - a PMODE_BAM timer keeps each channel HIGH for its duty in
+// slot units every frame, on pins in two ports, counts frames as periods and
+// ends with every pin LOW.  Duties committed mid frame go live together at
+// the start of the next one, and a slot too short for the ISR refuses the
+// start
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_BAM
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define FRAMES      6
+#define PRESCALE    8
+#define SLOT        100             // counts
+#define CHANNELS    5
+#define MAX_EDGES   64
+
+// pin 22 has duty 1, so it rises at the start of every frame
+static const uint8_t p_bam_pins[CHANNELS] = { 22, 23, 24, 25, 30 };
+static const uint16_t p_old_duties[CHANNELS] = { 1, 0, 128, 255, 77 };
+static const uint16_t p_new_duties[CHANNELS] = { 1, 0, 10, 255, 200 };
+static uint64_t p_pin_times[CHANNELS][MAX_EDGES];
+static uint8_t p_pin_levels[CHANNELS][MAX_EDGES];
+static uint8_t p_pin_edges[CHANNELS];
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    for (uint8_t i = 0; i < CHANNELS; i++) {
+        if ((pin == p_bam_pins[i]) && (p_pin_edges[i] < MAX_EDGES)) {
+            p_pin_times[i][p_pin_edges[i]] = cycle;
+            p_pin_levels[i][p_pin_edges[i]] = level;
+            p_pin_edges[i]++;
+        }
+    }
+}
+
+static uint64_t highBetween(uint8_t channel, uint64_t start, uint64_t end)
+{
+    // cycles the channel was HIGH from start to end
+    uint64_t high = 0;
+    uint64_t rise = 0;
+    bool is_high = false;
+    for (uint8_t j = 0; j < p_pin_edges[channel]; j++) {
+        uint64_t t = p_pin_times[channel][j];
+        t = (t < start) ? start : ((t > end) ? end : t);
+        if (p_pin_levels[channel][j] == HIGH) {
+            rise = t;
+            is_high = true;
+        }
+        else if (is_high) {
+            high += t - rise;
+            is_high = false;
+        }
+    }
+    return high;
+}
+
+int main()
+{
+    pSimReset();
+    pSetupTimers();
+    p_sim_edge_hook = edgeHook;
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_BAM), 0);
+    uint8_t pts[CHANNELS];
+    for (uint8_t i = 0; i < CHANNELS; i++) {
+        pts[i] = pNewPTrain();
+        P_CHECK_EQUAL(pSetPulse(pts[i], 0, SLOT, FRAMES, PRESCALE, PRESCALE), 0);
+        P_CHECK_EQUAL(pAttach(pts[i], p_bam_pins[i], PTIMER1), pts[i]);
+        P_CHECK_EQUAL(pSetBAMDuty(pts[i], p_old_duties[i]), 0);
+    }
+    P_CHECK_EQUAL(pSetBAMDuty(pts[0], 1 << P_BAM_BITS), ERROR_OUT_OF_RANGE);
+    P_CHECK_EQUAL(pCommitBAM(PTIMER1), 0);
+    P_CHECK(!pIsUpdatePending(PTIMER1));
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+
+    // new duties half way through the third frame
+    const uint64_t frame_cycles = (uint64_t)((1 << P_BAM_BITS) - 1) * SLOT * PRESCALE;
+    pSimRun(2 * frame_cycles + frame_cycles / 2);
+    for (uint8_t i = 0; i < CHANNELS; i++) {
+        P_CHECK_EQUAL(pSetBAMDuty(pts[i], p_new_duties[i]), 0);
+    }
+    P_CHECK_EQUAL(pCommitBAM(PTIMER1), 0);
+    P_CHECK(pIsUpdatePending(PTIMER1));
+    pSimRun(frame_cycles / 4);
+    P_CHECK(pIsUpdatePending(PTIMER1));
+    pSimRun(frame_cycles / 2);
+    P_CHECK(!pIsUpdatePending(PTIMER1));
+    pSimRunUntilIdle((FRAMES + 1) * frame_cycles);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(pGetPeriodNumber(pts[0]), FRAMES);
+
+    // each frame from one rise of pin 22 to the next, the last to the end
+    P_CHECK_EQUAL(p_pin_edges[0], 2 * FRAMES);
+    uint64_t end = 0;
+    for (uint8_t i = 0; i < CHANNELS; i++) {
+        P_CHECK_EQUAL(pSimReadPin(p_bam_pins[i]), LOW);
+        if ((p_pin_edges[i] > 0) && (p_pin_times[i][p_pin_edges[i] - 1] > end)) {
+            end = p_pin_times[i][p_pin_edges[i] - 1];
+        }
+    }
+    uint8_t off = 0;
+    for (uint8_t k = 0; k < FRAMES; k++) {
+        uint64_t start = p_pin_times[0][2 * k];
+        uint64_t stop = (k + 1 < FRAMES) ? p_pin_times[0][2 * k + 2] : end;
+        for (uint8_t i = 0; i < CHANNELS; i++) {
+            // the first slot of a frame checks the limit and the swap before
+            // its writes, which puts the edges there a few cycles late
+            uint16_t duty = (k < 3) ? p_old_duties[i] : p_new_duties[i];
+            uint64_t expected = (uint64_t)duty * SLOT * PRESCALE;
+            uint64_t high = highBetween(i, start, stop);
+            if ((high + 2 * P_SIM_PERIOD_CYCLES < expected) ||
+                    (high > expected + 2 * P_SIM_PERIOD_CYCLES)) {
+                off++;
+            }
+        }
+    }
+    P_CHECK_EQUAL(off, 0);
+    printf("%u channels in 2 ports, %u frames: %u duties off\n", CHANNELS, FRAMES, off);
+
+    // a slot shorter than P_BAM_ISR_CYCLES
+    pSetTimerPrescale(PTIMER1, 1);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), ERROR_SCHEDULE);
+    P_CHECK(!pIsTimerActive(PTIMER1));
+    return pTestResult("test_bam");
+}
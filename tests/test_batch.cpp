@@ -0,0 +1,172 @@
+// test_batch.cpp - pApplyBatch applies a frame whole or not at all: the
+// timers it starts share a clock edge and put out the values of its
+// records, a running timer takes new values at the end of a period, one
+// frame can stop a timer and start another, and a bad frame or record
+// changes nothing and is named in the ack
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_TIMER3
+#define P_USE_BATCH
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define PRESCALE    8
+#define MAX_EDGES   64
+
+static uint64_t p_pin_times[2][MAX_EDGES];
+static uint8_t p_pin_edges[2];
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    (void)level;
+    if (((pin == 22) || (pin == 23)) && (p_pin_edges[pin - 22] < MAX_EDGES)) {
+        p_pin_times[pin - 22][p_pin_edges[pin - 22]++] = cycle;
+    }
+}
+
+static uint8_t apply(uint8_t seq, const pbatchrecord_t *records, uint8_t n, uint8_t *ack)
+{
+    uint8_t frame[P_BATCH_FRAME_SIZE(P_BATCH_MAX_RECORDS)];
+    uint16_t length = pPackBatch(frame, seq, records, n);
+    P_CHECK_EQUAL(length, P_BATCH_FRAME_SIZE(n));
+    P_CHECK_EQUAL(pBatchFrameSize(frame), length);
+    return pApplyBatch(frame, length, ack);
+}
+
+static void checkAck(const uint8_t *ack, uint8_t seq, uint8_t status, uint8_t record)
+{
+    P_CHECK_EQUAL(ack[0], P_BATCH_ACK_MAGIC);
+    P_CHECK_EQUAL(ack[1], seq);
+    P_CHECK_EQUAL(ack[2], status);
+    P_CHECK_EQUAL(ack[3], record);
+    P_CHECK_EQUAL(pCRC16(0xFFFF, ack, 4), ack[4] | (ack[5] << 8));
+}
+
+static void checkPulses(uint8_t pin_index, uint8_t first, uint8_t last, uint32_t pulse_us,
+                            uint32_t period_us)
+{
+    // the rises from first to last are period_us apart, each pulse_us long
+    uint8_t off = 0;
+    for (uint8_t i = first; i + 1 <= last; i += 2) {
+        if ((p_pin_times[pin_index][i + 1] - p_pin_times[pin_index][i] !=
+                    pulse_us * CLOCKCYCLESPERMICROSECOND) ||
+                ((i + 2 <= last) && (p_pin_times[pin_index][i + 2] - p_pin_times[pin_index][i] !=
+                    period_us * CLOCKCYCLESPERMICROSECOND))) {
+            off++;
+        }
+    }
+    P_CHECK_EQUAL(off, 0);
+}
+
+int main()
+{
+    pSimReset();
+    pSetupTimers();
+    p_sim_edge_hook = edgeHook;
+    uint8_t pts[2];
+    static const timers16bit_t timers[2] = { PTIMER1, PTIMER3 };
+    for (uint8_t i = 0; i < 2; i++) {
+        pts[i] = pNewPTrain();
+        P_CHECK_EQUAL(pSetPulse(pts[i], 1000, 300, 1, PRESCALE, PRESCALE), 0);
+        P_CHECK_EQUAL(pAttach(pts[i], 22 + i, timers[i]), pts[i]);
+        P_CHECK_EQUAL(pSetTimerMode(timers[i], PMODE_FREERUN), 0);
+    }
+    uint8_t ack[P_BATCH_ACK_SIZE];
+    const uint8_t values = P_BATCH_PULSE | P_BATCH_PERIOD | P_BATCH_COUNT;
+
+    // two timers started by one frame count from the same clock edge
+    pbatchrecord_t records[3] = {
+        { pts[0], values | P_BATCH_START, 50, 200, 10 },
+        { pts[1], values | P_BATCH_START, 100, 400, 5 },
+    };
+    P_CHECK_EQUAL(apply(1, records, 2, ack), 0);
+    checkAck(ack, 1, 0, P_BATCH_NO_RECORD);
+    P_CHECK(pIsTimerActive(PTIMER1));
+    P_CHECK(pIsTimerActive(PTIMER3));
+    P_CHECK_EQUAL(TCNT1, TCNT3);
+    pSimRunUntilIdle((uint64_t)20 * 400 * CLOCKCYCLESPERMICROSECOND);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(p_pin_edges[0], 2 * 10);
+    P_CHECK_EQUAL(p_pin_edges[1], 2 * 5);
+    checkPulses(0, 0, 2 * 10 - 1, 50, 200);
+    // the rises of PTIMER3 come with those of PTIMER1, whose ISR goes first,
+    // so only its falls are on time
+    uint8_t off = 0;
+    for (uint8_t i = 3; i < 2 * 5; i += 2) {
+        if ((p_pin_times[1][i] - p_pin_times[1][i - 2] != 400 * CLOCKCYCLESPERMICROSECOND) ||
+                (p_pin_times[1][i] - p_pin_times[1][i - 1] > 100 * CLOCKCYCLESPERMICROSECOND)) {
+            off++;
+        }
+    }
+    P_CHECK_EQUAL(off, 0);
+
+    // a bad record anywhere leaves every ptrain as it was
+    uint32_t pulse_counts = ptrains[pts[0]].pulse_counts;
+    records[0].pulse = 20;
+    records[1].flags = values;
+    records[1].pulse = 400;                 // as long as its period
+    P_CHECK_EQUAL(apply(2, records, 2, ack), ERROR_TIMER_COUNT);
+    checkAck(ack, 2, ERROR_TIMER_COUNT, 1);
+    records[1] = (pbatchrecord_t){ ERROR_PTRAIN_IDX, values, 100, 400, 5 };
+    P_CHECK_EQUAL(apply(3, records, 2, ack), ERROR_PTRAIN_IDX);
+    checkAck(ack, 3, ERROR_PTRAIN_IDX, 1);
+    records[1] = (pbatchrecord_t){ pts[0], values, 100, 400, 5 };
+    P_CHECK_EQUAL(apply(4, records, 2, ack), ERROR_FRAME);
+    checkAck(ack, 4, ERROR_FRAME, 1);       // two records for one ptrain
+    records[1] = (pbatchrecord_t){ pts[1], P_BATCH_START | P_BATCH_STOP, 0, 0, 0 };
+    P_CHECK_EQUAL(apply(5, records, 2, ack), ERROR_FRAME);
+    checkAck(ack, 5, ERROR_FRAME, 1);
+    P_CHECK_EQUAL(ptrains[pts[0]].pulse_counts, pulse_counts);
+    P_CHECK(pSimIsIdle());
+
+    // a frame damaged on the way
+    uint8_t frame[P_BATCH_FRAME_SIZE(1)];
+    records[0] = (pbatchrecord_t){ pts[0], values | P_BATCH_START, 50, 200, 20 };
+    uint16_t length = pPackBatch(frame, 6, records, 1);
+    frame[P_BATCH_HEADER_SIZE + 3] ^= 0x01;
+    P_CHECK_EQUAL(pApplyBatch(frame, length, ack), ERROR_FRAME);
+    checkAck(ack, 6, ERROR_FRAME, P_BATCH_NO_RECORD);
+    P_CHECK_EQUAL(pApplyBatch(frame, length - 1, ack), ERROR_FRAME);
+    frame[0] = 'X';
+    P_CHECK_EQUAL(pBatchFrameSize(frame), 0);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(pPackBatch(frame, 7, records, P_BATCH_MAX_RECORDS + 1), 0);
+
+    // a running timer takes new values at the end of its period, and can't
+    // be started again unless the frame stops it first
+    p_pin_edges[0] = 0;
+    P_CHECK_EQUAL(apply(8, records, 1, ack), 0);
+    pSimRun((uint64_t)5 * 200 * CLOCKCYCLESPERMICROSECOND + 20 * CLOCKCYCLESPERMICROSECOND);
+    uint8_t before = p_pin_edges[0];
+    P_CHECK_EQUAL(before % 2, 1);           // in the pulse of the sixth period
+    records[0] = (pbatchrecord_t){ pts[0], P_BATCH_PULSE | P_BATCH_PERIOD, 100, 500, 0 };
+    P_CHECK_EQUAL(apply(9, records, 1, ack), 0);
+    checkAck(ack, 9, 0, P_BATCH_NO_RECORD);
+    P_CHECK(pIsUpdatePending(PTIMER1));
+    records[0].flags |= P_BATCH_START;
+    P_CHECK_EQUAL(apply(10, records, 1, ack), ERROR_TIMER_RUNNING);
+    checkAck(ack, 10, ERROR_TIMER_RUNNING, 0);
+    pSimRunUntilIdle((uint64_t)20 * 500 * CLOCKCYCLESPERMICROSECOND);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(p_pin_edges[0], 2 * 20);
+    checkPulses(0, 0, before, 50, 200);
+    checkPulses(0, before + 1, 2 * 20 - 1, 100, 500);
+
+    // a stop and a start in one frame
+    records[0] = (pbatchrecord_t){ pts[0], values | P_BATCH_START, 50, 200, 20 };
+    P_CHECK_EQUAL(apply(11, records, 1, ack), 0);
+    pSimRun((uint64_t)3 * 200 * CLOCKCYCLESPERMICROSECOND);
+    p_pin_edges[0] = 0;
+    p_pin_edges[1] = 0;
+    records[0] = (pbatchrecord_t){ pts[0], P_BATCH_STOP, 0, 0, 0 };
+    records[1] = (pbatchrecord_t){ pts[1], values | P_BATCH_START, 100, 400, 3 };
+    P_CHECK_EQUAL(apply(12, records, 2, ack), 0);
+    P_CHECK(!pIsTimerActive(PTIMER1));
+    P_CHECK(pIsTimerActive(PTIMER3));
+    pSimRunUntilIdle((uint64_t)4 * 400 * CLOCKCYCLESPERMICROSECOND);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(p_pin_edges[0], 0);
+    P_CHECK_EQUAL(p_pin_edges[1], 2 * 3);
+    return pTestResult("test_batch");
+}
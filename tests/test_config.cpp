@@ -0,0 +1,161 @@
+// test_config.cpp - a configuration snapshot brings back the same
+// waveforms after a reset, through RAM and through the EEPROM, and a
+// damaged snapshot or a running timer changes nothing
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_TIMER3
+#define P_USE_TIMER4
+#define P_USE_CONFIG
+#define P_USE_POSITION
+#define P_USE_LIMIT_INTERRUPTS
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define RUN_CYCLES      (F_CPU / 5)
+#define EEPROM_ADDRESS  100
+
+typedef struct {
+    uint32_t    edges[P_SIM_NUMBER_OF_PINS];
+    uint64_t    hashes[P_SIM_NUMBER_OF_PINS];   // of the cycle and level of each edge
+} pwaveforms_t;
+
+static pwaveforms_t *p_waveforms;
+static uint64_t p_run_start;
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    p_waveforms->edges[pin]++;
+    p_waveforms->hashes[pin] = p_waveforms->hashes[pin] * 1000003ULL + 
+                                (cycle - p_run_start) * 2 + level;
+}
+
+static void powerUp(void)
+{
+    // the chip comes out of reset, the library keeps what it had in RAM
+    pSimReset();
+    pSetupTimers();
+}
+
+static void run(pwaveforms_t *waveforms)
+{
+    memset(waveforms, 0, sizeof(pwaveforms_t));
+    p_waveforms = waveforms;
+    p_sim_edge_hook = edgeHook;
+    GTCCR = _BV(PSRSYNC);               // the same prescaler phase every run
+    p_run_start = pSimCycles();
+    for (uint8_t timer = PTIMER1; timer <= PTIMER4; timer++) {
+        P_CHECK_EQUAL(pStartTimer((timers16bit_t)timer), 0);
+    }
+    // the interrupt limit of timer 3 stops it half way
+    pSimRun(RUN_CYCLES / 2);
+    pSimSetInput(2, HIGH);
+    pSimRun(RUN_CYCLES / 2);
+    pSimSetInput(2, LOW);
+    p_sim_edge_hook = NULL;
+    for (uint8_t timer = PTIMER1; timer <= PTIMER4; timer++) {
+        pStopTimer((timers16bit_t)timer);
+    }
+}
+
+static void build(void)
+{
+    // ptrains on three timers, a detached one, two on the free list, limits
+    // polled and on an interrupt, and a direction pin
+    uint8_t p[10];
+    for (uint8_t i = 0; i < 10; i++) {
+        p[i] = pNewPTrain();
+    }
+    pSetPulseUS(p[0], 1000, 100, 5000);
+    pAttach(p[0], 22, PTIMER1);
+    pSetPulseUS(p[1], 1000, 100, 5000);
+    pAttach(p[1], 23, PTIMER1);
+    pSetPulseUS(p[2], 1000, 100, 5000);
+    pAttach(p[2], 40, PTIMER1);
+    pSetPulseUS(p[3], 50000, 2500, 7);
+    pAttach(p[3], 30, PTIMER3);
+    pSetTimerMode(PTIMER3, PMODE_FREERUN);
+    for (uint8_t i = 4; i < 7; i++) {
+        pSetPulseUS(p[i], 700, 300, 4000);
+        pAttach(p[i], 27 + i, PTIMER4);
+    }
+    pRemoveFromTimer(PTIMER4, p[4]);
+    pReleasePTrain(p[7]);
+    pReleasePTrain(p[9]);
+    pAttachLimitTimer(PTIMER3, 2, HIGH);
+    pAttachLimitTimer(PTIMER4, 24, HIGH);
+    pAttachDirectionTimer(PTIMER1, 41, HIGH);
+}
+
+static void scramble(void)
+{
+    // leave the library far from the snapshot
+    for (uint8_t i = 0; i < ptrain_count; i++) {
+        if (pIsValidPTrain(i)) {
+            pReleasePTrain(i);
+        }
+    }
+    uint8_t pt = pNewPTrain();
+    pSetPulseUS(pt, 300, 30, 10);
+    pAttach(pt, 53, PTIMER1);
+    pSetTimerMode(PTIMER1, PMODE_FREERUN);
+}
+
+static void checkSame(const pwaveforms_t *restored, const pwaveforms_t *saved)
+{
+    uint8_t pins = 0;
+    for (uint8_t pin = 0; pin < P_SIM_NUMBER_OF_PINS; pin++) {
+        P_CHECK_EQUAL(restored->edges[pin], saved->edges[pin]);
+        P_CHECK(restored->hashes[pin] == saved->hashes[pin]);
+        pins += (saved->edges[pin] != 0);
+    }
+    P_CHECK_EQUAL(pins, 6);
+    P_CHECK(saved->edges[30] < 2 * 4);
+}
+
+int main()
+{
+    static uint8_t blob[1024];
+    static pwaveforms_t saved, restored;
+    powerUp();
+    build();
+    uint16_t size = pSaveConfig(blob, sizeof(blob));
+    P_CHECK_EQUAL(size, P_CONFIG_SIZE(ptrain_count));
+    P_CHECK_EQUAL(pSaveConfig(blob, size - 1), 0);
+    P_CHECK_EQUAL(pSaveConfigEEPROM(EEPROM_ADDRESS), size);
+    P_CHECK_EQUAL(pSaveConfigEEPROM(E2END - 10), 0);
+    uint8_t count = ptrain_count;
+    uint8_t next = pNewPTrain();
+    pReleasePTrain(next);
+    run(&saved);
+
+    // from RAM, damaged snapshots first
+    powerUp();
+    scramble();
+    P_CHECK_EQUAL(pRestoreConfig(blob, size - 1), ERROR_CONFIG);
+    blob[size / 2] ^= 0x01;
+    P_CHECK_EQUAL(pRestoreConfig(blob, size), ERROR_CONFIG);
+    blob[size / 2] ^= 0x01;
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK_EQUAL(pRestoreConfig(blob, size), ERROR_TIMER_RUNNING);
+    P_CHECK_EQUAL(timer_array[PTIMER1].timer_mode, PMODE_FREERUN);
+    pStopTimer(PTIMER1);
+    P_CHECK_EQUAL(pRestoreConfig(blob, size), 0);
+    P_CHECK_EQUAL(p_sim_attach_in_cli, 0);  // the limits go back after the critical section
+    P_CHECK_EQUAL(ptrain_count, count);
+    P_CHECK_EQUAL(pNewPTrain(), next);
+    pReleasePTrain(next);
+    run(&restored);
+    checkSame(&restored, &saved);
+
+    // from the EEPROM, which a reset leaves alone
+    powerUp();
+    scramble();
+    P_CHECK_EQUAL(pRestoreConfigEEPROM(EEPROM_ADDRESS + 1), ERROR_CONFIG);
+    P_CHECK_EQUAL(pRestoreConfigEEPROM(EEPROM_ADDRESS), 0);
+    P_CHECK_EQUAL(p_sim_attach_in_cli, 0);
+    P_CHECK_EQUAL(ptrain_count, count);
+    run(&restored);
+    checkSame(&restored, &saved);
+    return pTestResult("test_config");
+}
@@ -0,0 +1,109 @@
+// test_dda.cpp - a PMODE_DDA move is as many periods long as its longest
+// axis, every axis puts out exactly its steps, each one on a period start
+// and spread as evenly as the periods allow, on pins in two ports.  The
+// steps of a running move are fixed, a move with no steps or a ramp of the
+// wrong length refuses the start
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_DDA
+#define P_USE_RAMP
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define PRESCALE    8
+#define PULSE       40              // counts, longer than the ISR
+#define PERIOD      100             // counts
+#define AXES        4
+#define MAX_STEPS   1000
+
+// pin 22 is the longest axis, so it steps every period
+static const uint8_t p_axis_pins[AXES] = { 22, 23, 30, 31 };
+static const uint32_t p_axis_steps[AXES] = { MAX_STEPS, 377, 0, 1 };
+static uint64_t p_rise_times[AXES][MAX_STEPS];
+static uint64_t p_last_fall[AXES];
+static uint32_t p_rises[AXES];
+static uint8_t p_narrow;
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    for (uint8_t i = 0; i < AXES; i++) {
+        if (pin != p_axis_pins[i]) {
+            continue;
+        }
+        if ((level == HIGH) && (p_rises[i] < MAX_STEPS)) {
+            p_rise_times[i][p_rises[i]] = cycle;
+            p_rises[i]++;
+        }
+        else if (level == LOW) {
+            if ((p_rises[i] == 0) || (cycle - p_rise_times[i][p_rises[i] - 1] != PULSE * PRESCALE)) {
+                p_narrow++;
+            }
+            p_last_fall[i] = cycle;
+        }
+    }
+}
+
+int main()
+{
+    pSimReset();
+    pSetupTimers();
+    p_sim_edge_hook = edgeHook;
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_DDA), 0);
+    uint8_t pts[AXES];
+    for (uint8_t i = 0; i < AXES; i++) {
+        pts[i] = pNewPTrain();
+        P_CHECK_EQUAL(pSetPulse(pts[i], PERIOD, PULSE, 1, PRESCALE, PRESCALE), 0);
+        P_CHECK_EQUAL(pAttach(pts[i], p_axis_pins[i], PTIMER1), pts[i]);
+        P_CHECK_EQUAL(pSetDDASteps(pts[i], 0), 0);
+    }
+    P_CHECK_EQUAL(pSetDDASteps(ERROR_PTRAIN_IDX, 10), ERROR_PTRAIN_IDX);
+
+    // nothing to move
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), ERROR_OUT_OF_RANGE);
+    for (uint8_t i = 0; i < AXES; i++) {
+        P_CHECK_EQUAL(pSetDDASteps(pts[i], p_axis_steps[i]), 0);
+    }
+
+    // a ramp has to be as long as the longest axis
+    P_CHECK_EQUAL(pSetRamp(PTIMER1, 5000, 20000, MAX_STEPS - 1, PRAMP_TRAPEZOID), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), ERROR_RAMP);
+    P_CHECK_EQUAL(pReloadToTimer(pts[0]), AXES);     // back to the fixed period
+
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK_EQUAL(pSetDDASteps(pts[1], 5), ERROR_TIMER_RUNNING);
+    pSimRunUntilIdle((uint64_t)(MAX_STEPS + 2) * PERIOD * PRESCALE);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(timer_array[PTIMER1].number_of_periods, MAX_STEPS);
+    P_CHECK_EQUAL(p_narrow, 0);
+
+    uint8_t uneven = 0;
+    for (uint8_t i = 0; i < AXES; i++) {
+        P_CHECK_EQUAL(p_rises[i], p_axis_steps[i]);
+        P_CHECK_EQUAL(pSimReadPin(p_axis_pins[i]), LOW);
+        if (p_rises[i] == 0) {
+            continue;
+        }
+        // every step starts with a period, the second port a group write
+        // after the first, and none comes after the last period
+        P_CHECK(p_last_fall[i] <= p_last_fall[0]);
+        uint32_t shortest = MAX_STEPS / p_axis_steps[i];
+        uint32_t longest = (MAX_STEPS + p_axis_steps[i] - 1) / p_axis_steps[i];
+        uint64_t last_period = 0;
+        for (uint32_t k = 0; k < p_rises[i]; k++) {
+            uint64_t since = p_rise_times[i][k] - p_rise_times[0][0];
+            uint64_t period = since / (PERIOD * PRESCALE);
+            if (since - period * PERIOD * PRESCALE > P_SIM_GROUP_CYCLES + P_SIM_PORT_WRITE_CYCLES) {
+                uneven++;
+            }
+            if ((k > 0) && ((period - last_period < shortest) || (period - last_period > longest))) {
+                uneven++;
+            }
+            last_period = period;
+        }
+    }
+    P_CHECK_EQUAL(uneven, 0);
+    printf("%u axes, %u periods: %lu and %lu steps, %u uneven\n", AXES, MAX_STEPS,
+            (unsigned long)p_rises[1], (unsigned long)p_rises[3], uneven);
+    return pTestResult("test_dda");
+}
@@ -0,0 +1,132 @@
+// test_events.cpp - the ISRs post one PEVENT_DONE, PEVENT_LIMIT or
+// PEVENT_UNDERRUN for every run they end, PEVENT_SEGMENT as each queued
+// segment goes live and PEVENT_OVERRUN for a late edge.  pDispatchEvents
+// hands them over oldest first and its handler can start the next run, a
+// full ring counts what it drops and pStopTimer posts nothing
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_EVENTS
+#define P_USE_SEGMENTS
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define PERIODS     10
+#define PRESCALE    8
+
+static uint8_t p_restarts = 0;
+
+static void start(uint8_t pt, uint32_t pulse_counts, uint32_t period_counts, uint16_t prescale)
+{
+    P_CHECK_EQUAL(pSetPulse(pt, period_counts, pulse_counts, PERIODS, prescale, prescale), 0);
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_FREERUN), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+}
+
+static uint8_t runAndRead(pevent_t *events, uint8_t max_events)
+{
+    pSimRunUntilIdle((uint64_t)F_CPU);
+    P_CHECK(pSimIsIdle());
+    uint8_t n = pEventRead(events, max_events);
+    pClearTimerOfPTrains(PTIMER1);
+    return n;
+}
+
+static void checkEvent(const pevent_t *event, uint8_t type, uint32_t data)
+{
+    P_CHECK_EQUAL(event->type, type);
+    P_CHECK_EQUAL(event->timer, PTIMER1);
+    P_CHECK_EQUAL(event->data, data);
+}
+
+static void onEvent(const pevent_t *event)
+{
+    // run twice more, from the handler
+    if ((event->type == PEVENT_DONE) && (p_restarts < 2)) {
+        P_CHECK_EQUAL(pStartTimer((timers16bit_t)event->timer), 0);
+        p_restarts++;
+    }
+}
+
+int main()
+{
+    pSimReset();
+    pSetupTimers();
+    uint8_t pt = pNewPTrain();
+    pevent_t events[P_EVENT_QUEUE_SIZE];
+
+    // a run that outputs all its periods
+    start(pt, 300, 1000, PRESCALE);
+    P_CHECK_EQUAL(runAndRead(events, P_EVENT_QUEUE_SIZE), 1);
+    checkEvent(&events[0], PEVENT_DONE, PERIODS);
+
+    // a polled limit set in the pulse of the fourth period, read at its end
+    P_CHECK_EQUAL(pAttachLimitTimer(PTIMER1, 30, HIGH), 0);
+    start(pt, 300, 1000, PRESCALE);
+    pSimRun((uint64_t)3 * 1000 * PRESCALE + 100 * PRESCALE);
+    pSimSetInput(30, HIGH);
+    P_CHECK_EQUAL(runAndRead(events, P_EVENT_QUEUE_SIZE), 1);
+    checkEvent(&events[0], PEVENT_LIMIT, 4);
+    pSimSetInput(30, LOW);
+
+    // a segment event as each queued segment after the first goes live,
+    // with the segments done, then the end of the run with the periods of
+    // the last one
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pQueueSegment(PTIMER1, 100, 400, 3), 0);
+    P_CHECK_EQUAL(pQueueSegment(PTIMER1, 100, 500, 4), 0);
+    P_CHECK_EQUAL(pQueueSegment(PTIMER1, 100, 600, 5), 0);
+    pEndSegments(PTIMER1);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK_EQUAL(runAndRead(events, P_EVENT_QUEUE_SIZE), 3);
+    checkEvent(&events[0], PEVENT_SEGMENT, 2);
+    checkEvent(&events[1], PEVENT_SEGMENT, 3);
+    checkEvent(&events[2], PEVENT_DONE, 5);
+
+    // the queue running dry before pEndSegments
+    pClearSegments(PTIMER1);
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pQueueSegment(PTIMER1, 100, 400, 3), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK_EQUAL(runAndRead(events, P_EVENT_QUEUE_SIZE), 1);
+    checkEvent(&events[0], PEVENT_UNDERRUN, 3);
+    pClearSegments(PTIMER1);
+
+    // a pulse shorter than the ISR makes every falling edge late
+    start(pt, 50, 1000, 1);
+    P_CHECK_EQUAL(runAndRead(events, P_EVENT_QUEUE_SIZE), PERIODS + 1);
+    for (uint8_t i = 0; i < PERIODS; i++) {
+        checkEvent(&events[i], PEVENT_OVERRUN, i + 1);
+    }
+    checkEvent(&events[PERIODS], PEVENT_DONE, PERIODS);
+    P_CHECK_EQUAL(pEventsDropped(), 0);
+
+    // the handler starts the next run, each one is dispatched on its own call
+    start(pt, 300, 1000, PRESCALE);
+    uint8_t dispatched = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+        pSimRunUntilIdle((uint64_t)F_CPU);
+        dispatched += pDispatchEvents(onEvent);
+    }
+    P_CHECK_EQUAL(p_restarts, 2);
+    P_CHECK_EQUAL(dispatched, 3);
+    P_CHECK_EQUAL(pEventRead(events, P_EVENT_QUEUE_SIZE), 0);
+    pClearTimerOfPTrains(PTIMER1);
+
+    // pStopTimer posts nothing
+    start(pt, 300, 1000, PRESCALE);
+    pSimRun((uint64_t)2 * 1000 * PRESCALE);
+    P_CHECK_EQUAL(pStopTimer(PTIMER1), 0);
+    P_CHECK_EQUAL(runAndRead(events, P_EVENT_QUEUE_SIZE), 0);
+
+    // runs left undrained fill the ring, the rest are counted
+    for (uint8_t i = 0; i < P_EVENT_QUEUE_SIZE + 3; i++) {
+        start(pt, 300, 1000, PRESCALE);
+        pSimRunUntilIdle((uint64_t)F_CPU);
+    }
+    P_CHECK_EQUAL(pEventsDropped(), 3);
+    P_CHECK_EQUAL(pEventRead(events, P_EVENT_QUEUE_SIZE), P_EVENT_QUEUE_SIZE);
+    P_CHECK_EQUAL(pEventRead(events, P_EVENT_QUEUE_SIZE), 0);
+    return pTestResult("test_events");
+}
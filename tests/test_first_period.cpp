@@ -0,0 +1,91 @@
+// test_first_period.cpp - the first pulse and period of a run come out as
+// long as the rest.  At prescale 1 the counter used to pass the token
+// compare pEnableISR leaves before the ISR aimed the real one, which cut
+// the first pulse short or used up a compare rollover of a long one
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define MAX_EDGES   16
+
+static uint64_t p_rises[MAX_EDGES];
+static uint64_t p_falls[MAX_EDGES];
+static uint8_t p_num_rises = 0;
+static uint8_t p_num_falls = 0;
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if (pin != 3) {
+        return;
+    }
+    if ((level == HIGH) && (p_num_rises < MAX_EDGES)) {
+        p_rises[p_num_rises++] = cycle;
+    }
+    else if ((level == LOW) && (p_num_falls < MAX_EDGES)) {
+        p_falls[p_num_falls++] = cycle;
+    }
+}
+
+static uint8_t startRun(uint32_t period, uint32_t pulse_width, uint32_t periods,
+                            uint16_t prescale, uint8_t mode)
+{
+    pSimReset();
+    pSetupTimers();
+    p_num_rises = 0;
+    p_num_falls = 0;
+    p_sim_edge_hook = edgeHook;
+    uint8_t pt = pNewPTrain();
+    P_CHECK_EQUAL(_pSetPulseUS(pt, period, pulse_width, periods, prescale), 0);
+    P_CHECK_EQUAL(pAttach(pt, 3, PTIMER1), pt);
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, mode), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    return pt;
+}
+
+static uint8_t checkPulses(uint32_t period, uint32_t pulse_width, uint32_t periods,
+                            uint16_t prescale, uint8_t mode)
+{
+    // every pulse the same and within an ISR of the one asked for, and
+    // every period the same
+    uint8_t pt = startRun(period, pulse_width, periods, prescale, mode);
+    pSimRunUntilIdle((uint64_t)period * CLOCKCYCLESPERMICROSECOND * (periods + 1));
+    P_CHECK_EQUAL(p_num_rises, periods);
+    P_CHECK_EQUAL(p_num_falls, periods);
+    int64_t pulse_cycles = (int64_t)pulse_width * CLOCKCYCLESPERMICROSECOND;
+    int64_t first_pulse = p_falls[0] - p_rises[0];
+    P_CHECK((first_pulse > pulse_cycles - 200) && (first_pulse < pulse_cycles + 200));
+    for (uint8_t i = 1; i < p_num_falls; i++) {
+        P_CHECK_EQUAL(p_falls[i] - p_rises[i], first_pulse);
+    }
+    for (uint8_t i = 2; i < p_num_rises; i++) {
+        P_CHECK_EQUAL(p_rises[i] - p_rises[i - 1], p_rises[1] - p_rises[0]);
+    }
+    printf("%lu us pulse at prescale %u, mode %u: first pulse %lld cycles\n",
+            (unsigned long)pulse_width, ptrains[pt].prescale, mode, (long long)first_pulse);
+    return pt;
+}
+
+int main()
+{
+    // the README example, prescale 1 picked automatically
+    uint8_t pt = checkPulses(2000, 100, 10, P_PRESCALE_AUTO, PMODE_CLEAR);
+    P_CHECK_EQUAL(ptrains[pt].prescale, 1);
+    checkPulses(2000, 100, 10, P_PRESCALE_AUTO, PMODE_FREERUN);
+    checkPulses(20000, 1500, 5, 8, PMODE_CLEAR);
+
+    // a 2.5 s pulse at prescale 1 rolls the compare over 610 times
+    checkPulses(5000000, 2500000, 2, 1, PMODE_CLEAR);
+    checkPulses(5000000, 2500000, 2, 1, PMODE_FREERUN);
+
+    // a DC run is high for all its periods
+    startRun(0, 100, 10, 1, PMODE_CLEAR);
+    pSimRunUntilIdle(F_CPU);
+    P_CHECK_EQUAL(p_num_rises, 1);
+    P_CHECK_EQUAL(p_num_falls, 1);
+    int64_t high = p_falls[0] - p_rises[0];
+    P_CHECK((high > 10 * 100 * CLOCKCYCLESPERMICROSECOND) &&
+                (high < 10 * (100 * CLOCKCYCLESPERMICROSECOND + 200)));
+    return pTestResult("test_first_period");
+}
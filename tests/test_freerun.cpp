@@ -0,0 +1,80 @@
+// test_freerun.cpp - a PMODE_FREERUN run never drifts: over a million
+// periods every rise is exactly on its count, so the run takes exactly
+// period_num_limit * period_counts, and long periods that wrap the
+// compare keep the same accuracy
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#include "pulsetrain.h"
+#include "ptest.h"
+
+static uint64_t p_first_rise;
+static uint64_t p_last_rise;
+static uint64_t p_last_fall;
+static uint64_t p_period_cycles;
+static uint32_t p_rises;
+static uint32_t p_falls;
+static uint32_t p_off_count;           // rises not a whole number of periods after the first
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if (pin != 22) {
+        return;
+    }
+    if (level == HIGH) {
+        if (p_rises == 0) {
+            p_first_rise = cycle;
+        }
+        else if (cycle - p_last_rise != p_period_cycles) {
+            p_off_count++;
+        }
+        p_last_rise = cycle;
+        p_rises++;
+    }
+    else {
+        p_last_fall = cycle;
+        p_falls++;
+    }
+}
+
+static void checkRun(uint32_t pulse_counts, uint32_t period_counts, uint32_t periods,
+                        uint16_t prescale)
+{
+    pSimReset();
+    pSetupTimers();
+    p_rises = 0;
+    p_falls = 0;
+    p_off_count = 0;
+    p_period_cycles = (uint64_t)period_counts * prescale;
+    p_sim_edge_hook = edgeHook;
+    uint8_t pt = pNewPTrain();
+    // in units of one count
+    P_CHECK_EQUAL(pSetPulse(pt, period_counts, pulse_counts, periods, prescale, prescale), 0);
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_FREERUN), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRunUntilIdle((uint64_t)(periods + 1) * p_period_cycles);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(p_rises, periods);
+    P_CHECK_EQUAL(p_falls, periods);
+    P_CHECK_EQUAL(p_off_count, 0);
+    P_CHECK_EQUAL(pGetPeriodNumber(pt), periods);
+
+    // the run ends one period after its last rise, where the next would be
+    uint64_t elapsed = p_last_rise + p_period_cycles - p_first_rise;
+    P_CHECK_EQUAL(elapsed, (uint64_t)periods * period_counts * prescale);
+    P_CHECK_EQUAL(p_last_fall - p_last_rise, (uint64_t)pulse_counts * prescale);
+    printf("%lu periods of %lu counts at prescale %u: %llu cycles, %lu off\n",
+            (unsigned long)periods, (unsigned long)period_counts, prescale,
+            (unsigned long long)elapsed, (unsigned long)p_off_count);
+}
+
+int main()
+{
+    checkRun(50, 200, 1000000UL, 8);
+    checkRun(1000, 3001, 1000000UL, 1);
+
+    // periods past 16 bits move the compare over several wraps
+    checkRun(70000, 250001, 2000, 1);
+    return pTestResult("test_freerun");
+}
@@ -0,0 +1,141 @@
+// test_hardware.cpp - with P_USE_HARDWARE_PWM a timer whose ptrains are all
+// on its own OCnx pins runs on the compare units: each pin has its own pulse
+// at the shared period, with no latency, the run ends after the limit and
+// only one interrupt is left per period.  A polled limit still lets the
+// period it is read in come out whole, and anything the units can't make
+// falls back to the ISR
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_HARDWARE_PWM
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define PERIODS     10
+#define PRESCALE    8
+#define MAX_EDGES   32
+
+static const uint8_t p_oc_test_pins[3] = { 11, 12, 13 };
+static const uint32_t p_pulses[3] = { 100, 250, 400 };
+static uint64_t p_pin_times[3][MAX_EDGES];
+static uint8_t p_pin_levels[3][MAX_EDGES];
+static uint8_t p_pin_edges[3];
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    for (uint8_t i = 0; i < 3; i++) {
+        if ((pin == p_oc_test_pins[i]) && (p_pin_edges[i] < MAX_EDGES)) {
+            p_pin_times[i][p_pin_edges[i]] = cycle;
+            p_pin_levels[i][p_pin_edges[i]] = level;
+            p_pin_edges[i]++;
+        }
+    }
+}
+
+static void setup(uint8_t *pts, uint32_t period_counts)
+{
+    pSimReset();
+    pSetupTimers();
+    p_sim_edge_hook = edgeHook;
+    for (uint8_t i = 0; i < 3; i++) {
+        p_pin_edges[i] = 0;
+        pts[i] = pNewPTrain();
+        P_CHECK_EQUAL(pSetPulse(pts[i], period_counts, p_pulses[i], PERIODS, PRESCALE, PRESCALE), 0);
+        P_CHECK_EQUAL(pAttach(pts[i], p_oc_test_pins[i], PTIMER1), pts[i]);
+    }
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_FREERUN), 0);
+}
+
+static void release(uint8_t *pts)
+{
+    pClearTimerOfPTrains(PTIMER1);
+    for (uint8_t i = 0; i < 3; i++) {
+        pReleasePTrain(pts[i]);
+    }
+}
+
+static uint8_t checkPins(uint8_t periods)
+{
+    // every pin has its pulse every period, all rising together.  The
+    // first rise is forced before the clock starts and the prescaler is
+    // shared, so the first pulse and period may be short by a count
+    uint8_t off = 0;
+    for (uint8_t i = 0; i < 3; i++) {
+        P_CHECK_EQUAL(p_pin_edges[i], 2 * periods);
+        P_CHECK(p_pin_times[i][1] - p_pin_times[i][0] <= p_pulses[i] * PRESCALE);
+        P_CHECK(p_pin_times[i][1] - p_pin_times[i][0] + PRESCALE > p_pulses[i] * PRESCALE);
+        P_CHECK(p_pin_times[i][2] - p_pin_times[i][0] + PRESCALE > 1000 * PRESCALE);
+        for (uint8_t j = 2; j + 1 < p_pin_edges[i]; j += 2) {
+            P_CHECK_EQUAL(p_pin_levels[i][j], HIGH);
+            P_CHECK_EQUAL(p_pin_levels[i][j + 1], LOW);
+            if ((p_pin_times[i][j + 1] - p_pin_times[i][j] != p_pulses[i] * PRESCALE) ||
+                    (p_pin_times[i][j] != p_pin_times[0][j]) ||
+                    ((j > 2) && (p_pin_times[i][j] - p_pin_times[i][j - 2] != 1000 * PRESCALE))) {
+                off++;
+            }
+        }
+        P_CHECK_EQUAL(pSimReadPin(p_oc_test_pins[i]), LOW);
+    }
+    return off;
+}
+
+int main()
+{
+    uint8_t pts[3];
+
+    // three duties on the OC1A to OC1C pins
+    setup(pts, 1000);
+    pload_t load;
+    P_CHECK_EQUAL(pAnalyzeLoad(_BV(PTIMER1), &load), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK(pIsTimerHardware(PTIMER1));
+    pSimRunUntilIdle((uint64_t)(PERIODS + 2) * 1000 * PRESCALE);
+    P_CHECK(pSimIsIdle());
+    uint8_t off = checkPins(PERIODS);
+    P_CHECK_EQUAL(off, 0);
+    // an overflow a period after the first, and the capture ending the last
+    P_CHECK_EQUAL(p_sim_isr_count, PERIODS);
+    P_CHECK_EQUAL(pGetPeriodNumber(pts[0]), PERIODS);
+    printf("%u pins on the compare units: %lu ISRs for %u periods, %u edges off\n",
+            3, (unsigned long)p_sim_isr_count, PERIODS, off);
+    release(pts);
+
+    // a polled limit read in the fourth period ends the run after it
+    setup(pts, 1000);
+    P_CHECK_EQUAL(pAttachLimitTimer(PTIMER1, 30, HIGH), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK(pIsTimerHardware(PTIMER1));
+    pSimRun((uint64_t)2 * 1000 * PRESCALE + 500 * PRESCALE);
+    pSimSetInput(30, HIGH);
+    pSimRunUntilIdle((uint64_t)(PERIODS + 2) * 1000 * PRESCALE);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(checkPins(4), 0);
+    P_CHECK_EQUAL(pGetLimitCause(PTIMER1), PLIMIT_POLLED);
+    pSimSetInput(30, LOW);
+    release(pts);
+
+    // a period longer than ICRn holds, a pin without a compare unit and a
+    // DC run go to the ISR
+    setup(pts, 0x10001);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK(!pIsTimerHardware(PTIMER1));
+    pStopTimer(PTIMER1);
+    release(pts);
+
+    setup(pts, 1000);
+    uint8_t extra = pNewPTrain();
+    P_CHECK_EQUAL(pSetPulse(extra, 1000, 100, PERIODS, PRESCALE, PRESCALE), 0);
+    P_CHECK_EQUAL(pAttach(extra, 22, PTIMER1), extra);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK(!pIsTimerHardware(PTIMER1));
+    pStopTimer(PTIMER1);
+    release(pts);
+    pReleasePTrain(extra);
+
+    setup(pts, 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK(!pIsTimerHardware(PTIMER1));
+    pStopTimer(PTIMER1);
+    release(pts);
+    return pTestResult("test_hardware");
+}
@@ -0,0 +1,142 @@
+// test_limits.cpp - with P_USE_LIMIT_INTERRUPTS a limit pin with an external
+// interrupt stops its timers the moment it trips, in the middle of a pulse,
+// with the pins LOW and a PEVENT_LIMIT event.  The debounce delays the stop
+// by its length, a level gone by the time the interrupt runs is ignored,
+// one switch can stop several timers and a tripped pin refuses the start
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_TIMER3
+#define P_USE_LIMIT_INTERRUPTS
+#define P_USE_EVENTS
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define PERIODS     10
+#define PRESCALE    8
+#define LIMIT_PIN   2
+
+static uint64_t p_fall_times[2];
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if (((pin == 22) || (pin == 23)) && (level == LOW)) {
+        p_fall_times[pin - 22] = cycle;
+    }
+}
+
+static void setup(uint8_t *pts, uint8_t num_timers)
+{
+    // 5000 count pulses every 10000 counts, on pin 22 and on pin 23
+    static const timers16bit_t timers[2] = { PTIMER1, PTIMER3 };
+    pSimReset();
+    pSetupTimers();
+    p_sim_edge_hook = edgeHook;
+    for (uint8_t i = 0; i < num_timers; i++) {
+        pts[i] = pNewPTrain();
+        P_CHECK_EQUAL(pSetPulse(pts[i], 10000, 5000, PERIODS, PRESCALE, PRESCALE), 0);
+        P_CHECK_EQUAL(pAttach(pts[i], 22 + i, timers[i]), pts[i]);
+        P_CHECK_EQUAL(pSetTimerMode(timers[i], PMODE_FREERUN), 0);
+        P_CHECK_EQUAL(pAttachLimitTimer(timers[i], LIMIT_PIN, HIGH), 0);
+    }
+}
+
+static void release(uint8_t *pts, uint8_t num_timers)
+{
+    pClearTimerOfPTrains(PTIMER1);
+    pClearTimerOfPTrains(PTIMER3);
+    for (uint8_t i = 0; i < num_timers; i++) {
+        pReleasePTrain(pts[i]);
+    }
+    pSimSetInput(LIMIT_PIN, LOW);
+    pClearLimitCause(PTIMER1);              // it stays until cleared
+    pClearLimitCause(PTIMER3);
+    pevent_t events[P_EVENT_QUEUE_SIZE];
+    pEventRead(events, P_EVENT_QUEUE_SIZE);
+}
+
+static uint64_t tripMidPulse(void)
+{
+    // trip the switch 1000 counts into the pulse of the second period and
+    // return the cycles the pin took to go LOW
+    pSimRun((uint64_t)11000 * PRESCALE);
+    P_CHECK_EQUAL(pSimReadPin(22), HIGH);
+    uint64_t trip = pSimCycles();
+    pSimSetInput(LIMIT_PIN, HIGH);
+    pSimRun(1000);
+    P_CHECK(!pIsTimerActive(PTIMER1));
+    P_CHECK_EQUAL(pSimReadPin(22), LOW);
+    P_CHECK_EQUAL(pGetLimitCause(PTIMER1), PLIMIT_INTERRUPT);
+    pevent_t event;
+    P_CHECK_EQUAL(pEventRead(&event, 1), 1);
+    P_CHECK_EQUAL(event.type, PEVENT_LIMIT);
+    P_CHECK_EQUAL(event.data, 2);
+    return p_fall_times[0] - trip;
+}
+
+int main()
+{
+    uint8_t pts[2];
+
+    // the stop comes within the interrupt, not at the end of the period
+    setup(pts, 1);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    uint64_t stop_cycles = tripMidPulse();
+    P_CHECK(stop_cycles < 4000 * PRESCALE);
+    printf("stopped %lu cycles after the trip\n", (unsigned long)stop_cycles);
+    release(pts, 1);
+
+    // a debounce keeps the interrupt that much longer before it stops
+    setup(pts, 1);
+    P_CHECK_EQUAL(pSetLimitDebounceUS(LIMIT_PIN, 5), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK_EQUAL(tripMidPulse(), stop_cycles + 5 * CLOCKCYCLESPERMICROSECOND);
+    P_CHECK_EQUAL(pSetLimitDebounceUS(LIMIT_PIN, 0), 0);
+    release(pts, 1);
+
+    // a glitch over before the interrupt runs leaves the run to finish
+    setup(pts, 1);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRun((uint64_t)11000 * PRESCALE);
+    pSimSetInput(LIMIT_PIN, HIGH);
+    pSimSetInput(LIMIT_PIN, LOW);
+    pSimRunUntilIdle((uint64_t)(PERIODS + 1) * 10000 * PRESCALE);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(pGetLimitCause(PTIMER1), PLIMIT_NONE);
+    pevent_t event;
+    P_CHECK_EQUAL(pEventRead(&event, 1), 1);
+    P_CHECK_EQUAL(event.type, PEVENT_DONE);
+    P_CHECK_EQUAL(event.data, PERIODS);
+    release(pts, 1);
+
+    // one switch stops both timers, each with its own event
+    setup(pts, 2);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER3), 0);
+    pSimRun((uint64_t)11000 * PRESCALE);
+    pSimSetInput(LIMIT_PIN, HIGH);
+    pSimRun(1000);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(pSimReadPin(22), LOW);
+    P_CHECK_EQUAL(pSimReadPin(23), LOW);
+    P_CHECK_EQUAL(pGetLimitCause(PTIMER1), PLIMIT_INTERRUPT);
+    P_CHECK_EQUAL(pGetLimitCause(PTIMER3), PLIMIT_INTERRUPT);
+    pevent_t events[2];
+    P_CHECK_EQUAL(pEventRead(events, 2), 2);
+    P_CHECK_EQUAL(events[0].type, PEVENT_LIMIT);
+    P_CHECK_EQUAL(events[1].type, PEVENT_LIMIT);
+    P_CHECK(events[0].timer != events[1].timer);
+
+    // a switch already tripped refuses the start, and says so
+    P_CHECK_EQUAL(pAttachLimitTimer(PTIMER1, LIMIT_PIN, HIGH), 0);
+    pClearLimitCause(PTIMER1);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), ERROR_LIMIT);
+    P_CHECK(!pIsTimerActive(PTIMER1));
+    P_CHECK_EQUAL(pGetLimitCause(PTIMER1), PLIMIT_AT_START);
+    P_CHECK_EQUAL(pEventRead(events, 2), 0);
+    release(pts, 2);
+
+    // a pin without an external interrupt is polled and has no debounce
+    P_CHECK_EQUAL(pSetLimitDebounceUS(30, 5), ERROR_LIMIT);
+    return pTestResult("test_limits");
+}
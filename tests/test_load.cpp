@@ -0,0 +1,68 @@
+// test_load.cpp - the P_LOAD_ cost model of pAnalyzeLoad agrees with the
+// simulation: with 1, 8 and 32 pins on a timer, in one port group or
+// spread over many, the CPU share it predicts is the share the simulated
+// ISRs take, for pulses and for DC.  The timers free run, so the periods
+// are the ones configured and not stretched by the ISR latency
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#include "pulsetrain.h"
+#include "ptest.h"
+
+static void checkLoad(const uint8_t *pins, uint8_t num_pins, uint32_t pulse_counts,
+                        uint32_t period_counts, uint16_t prescale)
+{
+    const uint32_t periods = 2000;
+    uint8_t pts[32];
+    pSimReset();
+    pSetupTimers();
+    for (uint8_t i = 0; i < num_pins; i++) {
+        pts[i] = pNewPTrain();
+        P_CHECK_EQUAL(pSetPulse(pts[i], period_counts, pulse_counts, periods, prescale, prescale), 0);
+        P_CHECK_EQUAL(pAttach(pts[i], pins[i], PTIMER1), pts[i]);
+    }
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_FREERUN), 0);
+    pload_t load;
+    P_CHECK_EQUAL(pAnalyzeLoad(_BV(PTIMER1), &load), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+
+    // measure whole periods of the steady run, leaving out the start
+    uint64_t interval = (uint64_t)((period_counts != 0) ? period_counts : pulse_counts) * prescale;
+    pSimRun(10 * interval);
+    uint64_t start_cycles = pSimCycles();
+    uint64_t start_isr = p_sim_isr_cycles;
+    pSimRun(1000 * interval);
+    uint64_t isr_cycles = p_sim_isr_cycles - start_isr;
+    uint64_t cycles = pSimCycles() - start_cycles;
+    uint32_t sim_permille = (uint32_t)((isr_cycles * 1000 + cycles / 2) / cycles);
+    printf("%u pins in %u groups, %lu/%lu counts: model %u, simulated %lu permille\n",
+            num_pins, timer_array[PTIMER1].number_of_port_groups,
+            (unsigned long)pulse_counts, (unsigned long)period_counts,
+            load.load_permille, (unsigned long)sim_permille);
+    P_CHECK(load.load_permille + 2U >= sim_permille);
+    P_CHECK(load.load_permille <= sim_permille + 2U);
+    pStopTimer(PTIMER1);
+    pClearTimerOfPTrains(PTIMER1);
+    for (uint8_t i = 0; i < num_pins; i++) {
+        pReleasePTrain(pts[i]);
+    }
+}
+
+int main()
+{
+    static const uint8_t one[] = { 22 };
+    // ports A, C, D, G, L, B, F and K
+    static const uint8_t eight[] = { 22, 30, 38, 39, 42, 50, 54, 62 };
+    uint8_t thirty_two[32];
+    for (uint8_t i = 0; i < 32; i++) {
+        thirty_two[i] = 22 + i;         // ports A, C, D, G, L and B
+    }
+    checkLoad(one, 1, 50, 200, 8);
+    checkLoad(eight, 8, 50, 200, 8);
+    checkLoad(thirty_two, 32, 50, 200, 8);
+    checkLoad(thirty_two, 32, 300, 1000, 1);
+
+    // a DC run has one edge every pulse
+    checkLoad(eight, 8, 400, 0, 8);
+    return pTestResult("test_load");
+}
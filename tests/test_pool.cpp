@@ -0,0 +1,113 @@
+// test_pool.cpp - released ptrains go back to pNewPTrain, every call that
+// takes a ptrain refuses one on the free list, and pRemoveFromTimer keeps
+// the slots of the timer consistent and leaves the pin it takes off a
+// running timer LOW
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_TIMER3
+#define P_USE_BAM
+#define P_USE_DDA
+#include "pulsetrain.h"
+#include "ptest.h"
+
+static void checkSlots(timers16bit_t timer)
+{
+    volatile timer16control_t *timer_control = &timer_array[timer];
+    for (uint8_t i = 0; i < timer_control->number_of_ptrains; i++) {
+        uint8_t ptrain_idx = timer_control->ptrain_idxs[i];
+        P_CHECK(pIsValidPTrain(ptrain_idx));
+        P_CHECK_EQUAL(ptrains[ptrain_idx].timer_number, timer);
+        P_CHECK_EQUAL(ptrains[ptrain_idx].timer_index, i);
+    }
+}
+
+int main()
+{
+    pSimReset();
+    pSetupTimers();
+
+    // a released ptrain is refused instead of corrupting the free list
+    uint8_t a = pNewPTrain();
+    P_CHECK_EQUAL(pAttach(a, 22, PTIMER1), a);
+    P_CHECK_EQUAL(pReleasePTrain(a), 0);
+    P_CHECK(!pIsValidPTrain(a));
+    P_CHECK_EQUAL(pAttach(a, 23, PTIMER1), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pReAttach(a), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pAddToTimer(PTIMER1, a), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pSetPulseUS(a, 1000, 100, 0), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pSetPulseMS(a, 1000, 100, 0), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(_pSetPulseUS(a, 1000, 100, 0, 8), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pSetPulseOnlyUS(a, 100), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pSetPeriodOnlyUS(a, 1000), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pSetPeriodNumberOnly(a, 10), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pReleasePTrain(a), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pGetPulseCounts(a), 0);
+    P_CHECK_EQUAL(pGetPeriodCounts(a), 0);
+    P_CHECK_EQUAL(pGetPeriodNumber(a), 0);
+    P_CHECK_EQUAL(pGetTimer(a), NUMBER_OF_16BIT_TIMERS);
+    P_CHECK_EQUAL(pSetBAMDuty(a, 1), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pSetDDASteps(a, 1), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(timer_array[PTIMER1].number_of_ptrains, 0);
+    uint8_t b = pNewPTrain();
+    uint8_t c = pNewPTrain();
+    P_CHECK_EQUAL(b, a);
+    P_CHECK(c != b);
+    P_CHECK(pIsValidPTrain(b) && pIsValidPTrain(c));
+    P_CHECK_EQUAL(pAttach(ERROR_PTRAIN_IDX - 1, 24, PTIMER1), ERROR_PTRAIN_IDX);
+    P_CHECK_EQUAL(pReleasePTrain(b), 0);
+    P_CHECK_EQUAL(pReleasePTrain(c), 0);
+
+    // swap remove moves the last ptrain into the slot left
+    uint8_t p[8];
+    for (uint8_t i = 0; i < 8; i++) {
+        p[i] = pNewPTrain();
+        pSetPulseUS(p[i], 1000, 100, 0);
+        P_CHECK_EQUAL(pAttach(p[i], 22 + i, PTIMER1), p[i]);
+    }
+    P_CHECK_EQUAL(pRemoveFromTimer(PTIMER1, p[2]), PTRAIN_REMOVED);
+    P_CHECK_EQUAL(timer_array[PTIMER1].ptrain_idxs[2], p[7]);
+    P_CHECK_EQUAL(pRemoveFromTimer(PTIMER1, p[2]), ERROR_PTRAIN_REMOVED);
+    checkSlots(PTIMER1);
+    P_CHECK_EQUAL(pAttach(p[3], 40, PTIMER3), p[3]);
+    P_CHECK(!pIsPTrainActive(p[3]));
+    checkSlots(PTIMER1);
+    checkSlots(PTIMER3);
+    P_CHECK_EQUAL(pReAttach(p[1]), p[1]);
+    P_CHECK_EQUAL(timer_array[PTIMER1].number_of_ptrains, 6);
+
+    // attach and release forever within NUMBER_OF_PTRAINS
+    for (uint32_t k = 0; k < 100000; k++) {
+        uint8_t x = pNewPTrain();
+        if (x == ERROR_PTRAIN_IDX) {
+            P_CHECK(x != ERROR_PTRAIN_IDX);
+            break;
+        }
+        pAttach(x, 22 + (k % 8), (k & 1) ? PTIMER1 : PTIMER3);
+        P_CHECK_EQUAL(pReleasePTrain(x), 0);
+    }
+    checkSlots(PTIMER1);
+    checkSlots(PTIMER3);
+    P_CHECK(ptrain_count <= 11);
+
+    // a pin taken off in the middle of its pulse goes LOW, the rest run on
+    pSimReset();
+    pSetupTimers();
+    uint8_t kept = pNewPTrain();
+    uint8_t taken = pNewPTrain();
+    P_CHECK_EQUAL(pSetPulse(kept, 1000, 400, 1000, 8, 8), 0);
+    P_CHECK_EQUAL(pSetPulse(taken, 1000, 400, 1000, 8, 8), 0);
+    P_CHECK_EQUAL(pAttach(kept, 60, PTIMER1), kept);
+    P_CHECK_EQUAL(pAttach(taken, 61, PTIMER1), taken);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRun(5 * 1000 * 8 + 200 * 8);        // in the sixth pulse
+    P_CHECK_EQUAL(pSimReadPin(61), HIGH);
+    P_CHECK_EQUAL(pRemoveFromTimer(PTIMER1, taken), PTRAIN_REMOVED);
+    P_CHECK_EQUAL(pSimReadPin(61), LOW);
+    P_CHECK_EQUAL(pSimReadPin(60), HIGH);
+    pSimRun(3 * 1000 * 8);
+    P_CHECK_EQUAL(pSimReadPin(61), LOW);
+    P_CHECK_EQUAL(pSimReadPin(60), HIGH);
+    pStopTimer(PTIMER1);
+    return pTestResult("test_pool");
+}
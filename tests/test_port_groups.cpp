@@ -0,0 +1,95 @@
+// test_port_groups.cpp - the per timer (port, mask) table matches the pins
+// attached, the pins of one port change on the same cycle, and an edge
+// costs less than the digitalWrite per pin loop it replaced
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#include "pulsetrain.h"
+#include "ptest.h"
+
+static uint64_t p_rise_cycle[P_SIM_NUMBER_OF_PINS];
+static uint8_t p_rises[P_SIM_NUMBER_OF_PINS];
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if ((level == HIGH) && (p_rises[pin]++ == 0)) {
+        p_rise_cycle[pin] = cycle;
+    }
+}
+
+static void checkGroups(const uint8_t *pins, uint8_t count)
+{
+    // every attached pin is in the group of its port and nothing else is
+    volatile timer16control_t *timer_control = &timer_array[PTIMER1];
+    uint8_t masks[P_SIM_NUMBER_OF_PORTS] = { 0 };
+    uint8_t ports = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t port = digitalPinToPort(pins[i]);
+        if (masks[port] == 0) {
+            ports++;
+        }
+        masks[port] |= digitalPinToBitMask(pins[i]);
+    }
+    P_CHECK_EQUAL(timer_control->number_of_port_groups, ports);
+    for (uint8_t i = 0; i < timer_control->number_of_port_groups; i++) {
+        volatile pportgroup_t *group = &timer_control->port_groups[i];
+        for (uint8_t port = 1; port < P_SIM_NUMBER_OF_PORTS; port++) {
+            if (portOutputRegister(port) == group->port) {
+                P_CHECK_EQUAL(group->mask, masks[port]);
+            }
+        }
+    }
+}
+
+int main()
+{
+    // pins on ports A, C, L, B and E
+    static const uint8_t pins[] = { 22, 23, 24, 29, 37, 36, 49, 48, 53, 52, 5 };
+    const uint8_t count = sizeof(pins);
+    uint8_t ptrain_idxs[sizeof(pins)];
+    pSimReset();
+    pSetupTimers();
+    for (uint8_t i = 0; i < count; i++) {
+        ptrain_idxs[i] = pNewPTrain();
+        pSetPulseUS(ptrain_idxs[i], 1000, 100, 5);
+        P_CHECK_EQUAL(pAttach(ptrain_idxs[i], pins[i], PTIMER1), ptrain_idxs[i]);
+        checkGroups(pins, i + 1);
+    }
+
+    // one port write per group, so the pins of a port rise together and
+    // the fifth port rises four port writes after the first
+    p_sim_edge_hook = edgeHook;
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRunUntilIdle(F_CPU);
+    uint64_t last_rise = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        P_CHECK_EQUAL(p_rises[pins[i]], 5);
+        for (uint8_t j = 0; j < count; j++) {
+            if (digitalPinToPort(pins[j]) == digitalPinToPort(pins[i])) {
+                P_CHECK_EQUAL(p_rise_cycle[pins[j]], p_rise_cycle[pins[i]]);
+            }
+        }
+        if (p_rise_cycle[pins[i]] > last_rise) {
+            last_rise = p_rise_cycle[pins[i]];
+        }
+    }
+    P_CHECK_EQUAL(last_rise - p_rise_cycle[pins[0]], 
+                    4 * (P_SIM_GROUP_CYCLES + P_SIM_PORT_WRITE_CYCLES));
+    // the last ISR is a falling edge, which moves the compare and checks
+    // the period count besides writing the pins
+    uint32_t overhead = P_SIM_ISR_ENTRY_CYCLES + P_SIM_ISR_BODY_CYCLES + P_SIM_ISR_EXIT_CYCLES +
+                            P_SIM_COMPARE_CYCLES + P_SIM_PERIOD_CYCLES;
+    uint32_t grouped = 5 * (P_SIM_GROUP_CYCLES + P_SIM_PORT_WRITE_CYCLES);
+    uint32_t per_pin = count * P_SIM_DIGITALWRITE_CYCLES;
+    P_CHECK_EQUAL(p_sim_last_isr_cycles, overhead + grouped);
+    P_CHECK(grouped * 4 < per_pin);
+    printf("edge ISR with %u pins: %u cycles, %u with a digitalWrite per pin\n",
+            count, overhead + grouped, overhead + per_pin);
+
+    // a pin taken off leaves its group, the last pin of a port drops it
+    P_CHECK_EQUAL(pRemoveFromTimer(PTIMER1, ptrain_idxs[count - 1]), PTRAIN_REMOVED);
+    checkGroups(pins, count - 1);
+    P_CHECK_EQUAL(pRemoveFromTimer(PTIMER1, ptrain_idxs[0]), PTRAIN_REMOVED);
+    checkGroups(&pins[1], count - 2);
+    return pTestResult("test_port_groups");
+}
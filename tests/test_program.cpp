@@ -0,0 +1,144 @@
+// test_program.cpp - a PMODE_PROGRAM sequence keeps the timing of a single
+// pulse train: every rise of every instruction is on the count the program
+// puts it on, however many instructions run between two periods
+
+#define P_SIMULATE
+#define P_USE_TIMER4
+#define P_USE_PROGRAM
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define MAX_EDGES       64
+#define PIN_A           22
+#define PIN_B           30
+#define PIN_SENSOR      31
+#define PRESCALE        8
+#define PULSE           US_TO_COUNTS(100, PRESCALE)
+#define PERIOD          US_TO_COUNTS(1000, PRESCALE)
+
+typedef struct {
+    uint8_t     pin;
+    uint64_t    rise;
+    uint64_t    fall;
+} pedge_t;
+
+static pedge_t p_edges[MAX_EDGES];
+static uint8_t p_num_edges = 0;
+static uint64_t p_sensor_cycle = 0;        // pin 31 goes HIGH here, 0 for never
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if (level == HIGH) {
+        if (p_num_edges < MAX_EDGES) {
+            p_edges[p_num_edges].pin = pin;
+            p_edges[p_num_edges].rise = cycle;
+            p_edges[p_num_edges++].fall = 0;
+        }
+        return;
+    }
+    for (uint8_t i = p_num_edges; i > 0; i--) {
+        if ((p_edges[i - 1].pin == pin) && (p_edges[i - 1].fall == 0)) {
+            p_edges[i - 1].fall = cycle;
+            return;
+        }
+    }
+}
+
+static void runProgram(const uint8_t *code, uint16_t length)
+{
+    pSimReset();
+    pSetupTimers();
+    p_num_edges = 0;
+    p_sim_edge_hook = edgeHook;
+    pinMode(PIN_SENSOR, INPUT);
+    uint8_t a = pNewPTrain();
+    uint8_t b = pNewPTrain();
+    P_CHECK_EQUAL(_pSetPulseUS(a, 1000, 100, 1, PRESCALE), 0);
+    P_CHECK_EQUAL(pAttach(a, PIN_A, PTIMER4), a);
+    P_CHECK_EQUAL(pAttach(b, PIN_B, PTIMER4), b);
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER4, PMODE_PROGRAM), 0);
+    P_CHECK_EQUAL(pLoadProgram(PTIMER4, code, length, false), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER4), 0);
+    if (p_sensor_cycle != 0) {
+        pSimRun(p_sensor_cycle);
+        pSimSetInput(PIN_SENSOR, HIGH);
+    }
+    pSimRunUntilIdle(F_CPU);
+    P_CHECK(pSimIsIdle());
+}
+
+static uint64_t riseCycles(uint8_t edge)
+{
+    // cycles of a rise from the first, less how far into the ISR its pin
+    // is written: B's port group comes after A's in the timer's table
+    uint64_t rise = p_edges[edge].rise - ((p_edges[edge].pin == PIN_B) ? P_SIM_GROUP_CYCLES : 0);
+    uint64_t first = p_edges[0].rise - ((p_edges[0].pin == PIN_B) ? P_SIM_GROUP_CYCLES : 0);
+    return rise - first;
+}
+
+static uint8_t checkPeriods(uint8_t edge, uint8_t pin, uint32_t periods, uint64_t *counts)
+{
+    // the next periods edges are pin's, one PERIOD apart from *counts on
+    // and PULSE wide.  Returns the edge after them
+    for (uint32_t i = 0; i < periods; i++, edge++) {
+        if (edge >= p_num_edges) {
+            P_CHECK(edge < p_num_edges);
+            return edge;
+        }
+        P_CHECK_EQUAL(p_edges[edge].pin, pin);
+        P_CHECK_EQUAL(riseCycles(edge), *counts * PRESCALE);
+        P_CHECK_EQUAL(p_edges[edge].fall - p_edges[edge].rise, (uint64_t)PULSE * PRESCALE);
+        *counts += PERIOD;
+    }
+    return edge;
+}
+
+int main()
+{
+    // three passes of five A periods, a 2 ms gap and two B periods, with
+    // nested loops run in the ISR between the gap and the B periods
+    static const uint8_t sequence[] = {
+        P_PROGRAM_PULSE(PULSE, PERIOD),
+        P_PROGRAM_LOOP(3),
+            P_PROGRAM_PINS(0x1),
+            P_PROGRAM_PERIODS(5),
+            P_PROGRAM_DELAY_US(2000, PRESCALE),
+            P_PROGRAM_LOOP(1),
+                P_PROGRAM_LOOP(1),
+                    P_PROGRAM_PINS(0x2),
+                P_PROGRAM_NEXT(),
+            P_PROGRAM_NEXT(),
+            P_PROGRAM_PERIODS(2),
+        P_PROGRAM_NEXT(),
+        P_PROGRAM_END()
+    };
+    runProgram(sequence, sizeof(sequence));
+    P_CHECK_EQUAL(p_num_edges, 3 * (5 + 2));
+    uint64_t counts = 0;
+    uint8_t edge = 0;
+    for (uint8_t pass = 0; pass < 3; pass++) {
+        edge = checkPeriods(edge, PIN_A, 5, &counts);
+        counts += US_TO_COUNTS(2000, PRESCALE);
+        edge = checkPeriods(edge, PIN_B, 2, &counts);
+    }
+    printf("sequence: %u pulses, last rise %llu cycles after the first\n", p_num_edges,
+            (unsigned long long)riseCycles(p_num_edges - 1));
+
+    // UNTIL checks its pin between two periods, the sensor rising during
+    // the fourth B period ends B after it and A follows on time
+    static const uint8_t until[] = {
+        P_PROGRAM_PULSE(PULSE, PERIOD),
+        P_PROGRAM_PINS(0x2),
+        P_PROGRAM_UNTIL(PIN_SENSOR, HIGH),
+        P_PROGRAM_PINS(0x1),
+        P_PROGRAM_PERIODS(2),
+        P_PROGRAM_END()
+    };
+    p_sensor_cycle = (uint64_t)(3 * PERIOD + PERIOD / 2) * PRESCALE;
+    runProgram(until, sizeof(until));
+    counts = 0;
+    edge = checkPeriods(0, PIN_B, 4, &counts);
+    edge = checkPeriods(edge, PIN_A, 2, &counts);
+    P_CHECK_EQUAL(p_num_edges, edge);
+    return pTestResult("test_program");
+}
@@ -0,0 +1,107 @@
+// test_ramp.cpp - the steps of a ramp follow the exact profile: speeding
+// up the n-th step brings 1/p^2 to 2 * a * (weights of steps 0 to n), the
+// cruise holds the top speed and slowing down mirrors speeding up.  Every
+// period lands within about a count of it and the whole ramp within a few
+// parts per million
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_RAMP
+#include <math.h>
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define MAX_STEPS   4000
+
+static uint64_t p_rises[MAX_STEPS + 1];
+static uint32_t p_num_rises = 0;
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if ((pin == 22) && (level == HIGH) && (p_num_rises <= MAX_STEPS)) {
+        p_rises[p_num_rises++] = cycle;
+    }
+}
+
+static double exactPeriod(uint32_t speed, uint32_t accel, uint32_t total_steps,
+                            uint8_t profile, uint16_t prescale, uint32_t n)
+{
+    // counts of step n of the profile, worked out from scratch
+    double frequency = (double)F_CPU / prescale;
+    uint32_t steps = (uint32_t)fmin((double)speed * speed / (2.0 * accel), total_steps / 2);
+    if (steps == 0) {
+        steps = 1;
+    }
+    if (n >= total_steps - steps) {
+        n = total_steps - 1 - n;            // slowing down mirrors speeding up
+    }
+    if (n >= steps) {
+        n = steps - 1;                      // cruise
+    }
+    uint32_t half = (steps + 1) / 2;
+    double weights = 0.0;
+    double weights_to_n = 0.0;
+    for (uint32_t i = 0; i < steps; i++) {
+        double weight = 1.0;
+        if (profile == PRAMP_SCURVE) {
+            weight = (i < half) ? (i + 1) : (steps - i);
+        }
+        weights += weight;
+        if (i <= n) {
+            weights_to_n += weight;
+        }
+    }
+    // the acceleration averages accel over the speeding up
+    double speed_sq = 2.0 * accel * steps / weights * weights_to_n;
+    return frequency / sqrt(speed_sq);
+}
+
+static void checkRamp(uint32_t speed, uint32_t accel, uint32_t total_steps, uint8_t profile,
+                        uint16_t prescale)
+{
+    pSimReset();
+    pSetupTimers();
+    p_num_rises = 0;
+    p_sim_edge_hook = edgeHook;
+    uint8_t pt = pNewPTrain();
+    P_CHECK_EQUAL(_pSetPulseUS(pt, 1000, 20, 1, prescale), 0);
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_FREERUN), 0);
+    P_CHECK_EQUAL(pSetRamp(PTIMER1, speed, accel, total_steps, profile), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRunUntilIdle((uint64_t)F_CPU * 60);
+    P_CHECK_EQUAL(p_num_rises, total_steps);
+
+    // step n runs from rise n to rise n + 1, the last step has no rise after it
+    double worst = 0.0;
+    double exact_total = 0.0;
+    for (uint32_t n = 0; n + 1 < p_num_rises; n++) {
+        double exact = exactPeriod(speed, accel, total_steps, profile, prescale, n);
+        double counts = (double)(p_rises[n + 1] - p_rises[n]) / prescale;
+        worst = fmax(worst, fabs(counts - exact));
+        exact_total += exact;
+    }
+    double total = (double)(p_rises[p_num_rises - 1] - p_rises[0]) / prescale;
+    double ppm = fabs(total - exact_total) / exact_total * 1e6;
+    P_CHECK(worst < 1.5);
+    P_CHECK(ppm < 20.0);
+    printf("%s %lu steps to %lu steps/s: worst step %.2f counts, total %.2f ppm\n",
+            (profile == PRAMP_SCURVE) ? "s-curve" : "trapezoid", (unsigned long)total_steps,
+            (unsigned long)speed, worst, ppm);
+}
+
+int main()
+{
+    // the s-curve starts slower, at prescale 8 its first step wouldn't fit
+    // the counter and would start a little faster
+    checkRamp(5000, 20000, 2000, PRAMP_TRAPEZOID, 8);
+    checkRamp(5000, 20000, 2000, PRAMP_SCURVE, 64);
+
+    // too few steps to reach the speed, turns round half way
+    checkRamp(5000, 20000, 400, PRAMP_TRAPEZOID, 8);
+    checkRamp(5000, 20000, 401, PRAMP_SCURVE, 64);
+
+    // a long acceleration, most of it past the table
+    checkRamp(8000, 10000, 4000, PRAMP_TRAPEZOID, 8);
+    return pTestResult("test_ramp");
+}
@@ -0,0 +1,100 @@
+// test_schedule.cpp - a PMODE_SCHEDULE timer puts every edge of every
+// ptrain on its own count, including gaps longer than half the counter
+// once the short ptrain next to a long one is done, and a DC pulse longer
+// than the counter
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_SCHEDULER
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define PRESCALE    8
+#define MAX_EDGES   128
+
+// pins 22, 23 and 24 are all on port A, so edges due together are written
+// together and every edge is on the cycle of its count
+typedef struct {
+    uint64_t    rises[MAX_EDGES];
+    uint64_t    falls[MAX_EDGES];
+    uint16_t    num_rises;
+    uint16_t    num_falls;
+} pedges_t;
+
+static pedges_t p_edges[3];
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if ((pin < 22) || (pin > 24)) {
+        return;
+    }
+    pedges_t *edges = &p_edges[pin - 22];
+    if ((level == HIGH) && (edges->num_rises < MAX_EDGES)) {
+        edges->rises[edges->num_rises++] = cycle;
+    }
+    else if ((level == LOW) && (edges->num_falls < MAX_EDGES)) {
+        edges->falls[edges->num_falls++] = cycle;
+    }
+}
+
+static uint8_t addPTrain(uint8_t pin, uint32_t period, uint32_t pulse, uint32_t limit)
+{
+    // in counts of the timer
+    uint8_t pt = pNewPTrain();
+    P_CHECK_EQUAL(pSetPulse(pt, period, pulse, limit, PRESCALE, PRESCALE), 0);
+    P_CHECK_EQUAL(pAttach(pt, pin, PTIMER1), pt);
+    return pt;
+}
+
+static void checkPTrain(uint8_t pin, uint32_t period, uint32_t pulse, uint32_t periods,
+                        uint64_t start)
+{
+    // periods pulses period counts apart from start, each pulse counts wide
+    const pedges_t *edges = &p_edges[pin - 22];
+    P_CHECK_EQUAL(edges->num_rises, periods);
+    P_CHECK_EQUAL(edges->num_falls, periods);
+    for (uint16_t i = 0; (i < edges->num_rises) && (i < edges->num_falls); i++) {
+        P_CHECK_EQUAL(edges->rises[i] - start, (uint64_t)i * period * PRESCALE);
+        P_CHECK_EQUAL(edges->falls[i] - edges->rises[i], (uint64_t)pulse * PRESCALE);
+    }
+}
+
+static void runSchedule(void)
+{
+    memset(p_edges, 0, sizeof(p_edges));
+    p_sim_edge_hook = edgeHook;
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_SCHEDULE), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRunUntilIdle((uint64_t)F_CPU * 10);
+    P_CHECK(pSimIsIdle());
+    p_sim_edge_hook = NULL;
+}
+
+int main()
+{
+    // a 60000 count period next to a 1000 count one.  Once the short one
+    // stops the long one has 59900 counts between its edges
+    pSimReset();
+    pSetupTimers();
+    addPTrain(22, 60000, 100, 4);
+    addPTrain(23, 1000, 300, 50);
+    runSchedule();
+    uint64_t start = p_edges[0].rises[0];
+    P_CHECK_EQUAL(p_edges[1].rises[0], start);
+    checkPTrain(22, 60000, 100, 4, start);
+    checkPTrain(23, 1000, 300, 50, start);
+    pClearTimerOfPTrains(PTIMER1);
+
+    // a DC pulse of 3 * 50000 counts takes the compare round the counter
+    // twice after a short ptrain is done
+    pSimReset();
+    pSetupTimers();
+    addPTrain(24, 0, 50000, 3);
+    addPTrain(23, 2000, 500, 10);
+    runSchedule();
+    start = p_edges[2].rises[0];
+    checkPTrain(24, 0, 150000, 1, start);
+    checkPTrain(23, 2000, 500, 10, start);
+    printf("59900 and 150000 count gaps: edges on their counts\n");
+    return pTestResult("test_schedule");
+}
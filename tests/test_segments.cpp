@@ -0,0 +1,72 @@
+// test_segments.cpp - queued segments run back to back with their whole
+// counts, including counts past 16 bits, and a start that is refused
+// leaves the first segment queued
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_SEGMENTS
+#define P_USE_LOAD_CHECK
+#include "pulsetrain.h"
+#include "ptest.h"
+
+static uint32_t p_rises = 0;
+static uint64_t p_last_rise = 0;
+static uint64_t p_last_period = 0;
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if ((pin == 22) && (level == HIGH)) {
+        p_last_period = cycle - p_last_rise;
+        p_last_rise = cycle;
+        p_rises++;
+    }
+}
+
+int main()
+{
+    pSimReset();
+    pSetupTimers();
+    p_sim_edge_hook = edgeHook;
+    uint8_t pt = pNewPTrain();
+    P_CHECK_EQUAL(_pSetPulseUS(pt, 160, 40, 1, 8), 0);
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_FREERUN), 0);
+
+    // 70000 periods no longer wrap to 4464
+    P_CHECK_EQUAL(pQueueSegment(PTIMER1, 80, 320, 70000UL), 0);
+    P_CHECK_EQUAL(pQueueSegmentUS(PTIMER1, 40, 10, 3), 0);
+    pEndSegments(PTIMER1);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRun(70000ULL * 320 * 8);
+    P_CHECK_EQUAL(p_rises, 70000);
+    P_CHECK_EQUAL(p_last_period, 320 * 8);
+    pSimRunUntilIdle(F_CPU);
+    P_CHECK_EQUAL(p_rises, 70003);
+    P_CHECK_EQUAL(p_last_period, 40 * CLOCKCYCLESPERMICROSECOND);
+    P_CHECK_EQUAL(pGetSegmentsDone(PTIMER1), 2);
+    P_CHECK_EQUAL(pGetSegmentUnderruns(PTIMER1), 0);
+
+    // 20 count periods at prescale 1 are too fast for the ISR, the refused
+    // start takes nothing off the queue and leaves the timer as it was
+    pClearSegments(PTIMER1);
+    pSetTimerPrescale(PTIMER1, 1);
+    P_CHECK_EQUAL(pQueueSegment(PTIMER1, 10, 20, 5), 0);
+    pEndSegments(PTIMER1);
+    uint32_t pulse_counts = timer_array[PTIMER1].pulse_counts;
+    uint32_t period_counts = timer_array[PTIMER1].period_counts;
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), ERROR_LOAD);
+    P_CHECK_EQUAL(pSegmentsFree(PTIMER1), P_SEGMENT_QUEUE_SIZE - 1);
+    P_CHECK_EQUAL(pGetSegmentsDone(PTIMER1), 0);
+    P_CHECK_EQUAL(timer_array[PTIMER1].pulse_counts, pulse_counts);
+    P_CHECK_EQUAL(timer_array[PTIMER1].period_counts, period_counts);
+
+    // at prescale 64 the same segment runs, and first
+    pSetTimerPrescale(PTIMER1, 64);
+    p_rises = 0;
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRunUntilIdle(F_CPU);
+    P_CHECK_EQUAL(p_rises, 5);
+    P_CHECK_EQUAL(p_last_period, 20 * 64);
+    P_CHECK_EQUAL(pGetSegmentsDone(PTIMER1), 1);
+    return pTestResult("test_segments");
+}
@@ -0,0 +1,107 @@
+// test_stats.cpp - the timer stats count every compare interrupt, put the
+// latency the simulated ISR entry takes in its log2 bucket, keep the
+// longest ISR in counts, count the compares an ISR finishes past and clear
+// with pResetTimerStats
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_TIMER_STATS
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define PERIODS     20
+
+static uint32_t p_max_isr_cycles;
+
+static void isrHook(uint8_t vector, uint32_t cycles)
+{
+    (void)vector;
+    if (cycles > p_max_isr_cycles) {
+        p_max_isr_cycles = cycles;
+    }
+}
+
+static uint8_t latencyBucket(uint16_t latency)
+{
+    uint8_t bucket = 0;
+    while ((latency != 0) && (bucket < P_LATENCY_BUCKETS - 1)) {
+        latency >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void run(uint8_t pt, uint32_t pulse_counts, uint32_t period_counts, uint16_t prescale,
+                    uint8_t mode, ptimerstats_t *stats)
+{
+    pSimReset();
+    pSetupTimers();
+    p_max_isr_cycles = 0;
+    p_sim_isr_hook = isrHook;
+    pResetTimerStats(PTIMER1);
+    P_CHECK_EQUAL(pSetPulse(pt, period_counts, pulse_counts, PERIODS, prescale, prescale), 0);
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, mode), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    // a missed compare in free run comes round again after a counter wrap
+    pSimRunUntilIdle((uint64_t)(PERIODS + 2) * (period_counts + 0x10000) * prescale);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(pGetTimerStats(PTIMER1, stats), 0);
+    pClearTimerOfPTrains(PTIMER1);
+}
+
+static void checkSteady(uint8_t pt, uint16_t prescale, uint8_t mode)
+{
+    // a run with room to spare between its edges
+    ptimerstats_t stats;
+    run(pt, 300, 1000, prescale, mode, &stats);
+    uint32_t entry_counts = (P_SIM_ISR_ENTRY_CYCLES + P_SIM_ISR_BODY_CYCLES) / prescale;
+    // from the count on entry to the count before the epilogue
+    uint32_t isr_counts = (p_max_isr_cycles - P_SIM_ISR_ENTRY_CYCLES - P_SIM_ISR_BODY_CYCLES -
+                            P_SIM_ISR_EXIT_CYCLES) / prescale;
+    printf("%s prescale %u: %lu ISRs, latency %u, longest %u counts, %u missed\n",
+            (mode == PMODE_CLEAR) ? "PMODE_CLEAR" : "PMODE_FREERUN", prescale,
+            (unsigned long)stats.isr_count, stats.max_latency, stats.max_isr_counts,
+            stats.missed_compares);
+    P_CHECK_EQUAL(stats.isr_count, 2 * PERIODS);
+    P_CHECK_EQUAL(stats.isr_count, p_sim_isr_count);
+    P_CHECK_EQUAL(stats.max_latency, entry_counts);
+    uint32_t in_buckets = 0;
+    for (uint8_t i = 0; i < P_LATENCY_BUCKETS; i++) {
+        in_buckets += stats.latency[i];
+    }
+    P_CHECK_EQUAL(in_buckets, stats.isr_count);
+    P_CHECK_EQUAL(stats.latency[latencyBucket(entry_counts)], stats.isr_count);
+    P_CHECK(stats.max_isr_counts + 1U >= isr_counts);
+    P_CHECK(stats.max_isr_counts <= isr_counts + 1U);
+    P_CHECK_EQUAL(stats.missed_compares, 0);
+}
+
+int main()
+{
+    uint8_t pt = pNewPTrain();
+    checkSteady(pt, 1, PMODE_FREERUN);
+    checkSteady(pt, 8, PMODE_FREERUN);
+    checkSteady(pt, 8, PMODE_CLEAR);
+
+    // a pulse shorter than the ISR: the rising edge ISR ends past the
+    // falling edge compare
+    ptimerstats_t stats;
+    run(pt, 50, 1000, 1, PMODE_FREERUN, &stats);
+    printf("PMODE_FREERUN 50/1000 counts: %lu ISRs, %u missed\n",
+            (unsigned long)stats.isr_count, stats.missed_compares);
+    P_CHECK_EQUAL(stats.isr_count, 2 * PERIODS);
+    P_CHECK_EQUAL(stats.missed_compares, PERIODS);
+
+    // pResetTimerStats clears every counter
+    pResetTimerStats(PTIMER1);
+    P_CHECK_EQUAL(pGetTimerStats(PTIMER1, &stats), 0);
+    P_CHECK_EQUAL(stats.isr_count, 0);
+    P_CHECK_EQUAL(stats.max_latency, 0);
+    P_CHECK_EQUAL(stats.max_isr_counts, 0);
+    P_CHECK_EQUAL(stats.missed_compares, 0);
+    for (uint8_t i = 0; i < P_LATENCY_BUCKETS; i++) {
+        P_CHECK_EQUAL(stats.latency[i], 0);
+    }
+    return pTestResult("test_stats");
+}
@@ -0,0 +1,113 @@
+// test_status_stream.cpp - the status stream of examples/ptwebserver, built
+// against the stand-ins in standin/ and run with loop() called every ms.
+// Lines go out only when a timer changed, at most every STATUS_MIN_MS while
+// a run goes on and at once when it starts or stops, each line is written
+// in one call however many observers there are, and an idle controller
+// only sends the line of every STATUS_FULL_MS
+
+#define P_SIMULATE
+#define setup sketchSetup
+#define loop sketchLoop
+#include "../examples/ptwebserver/ptwebserver.ino"
+#undef setup
+#undef loop
+#include "ptest.h"
+
+#define MAX_LINES   256
+
+typedef struct {
+    unsigned long   ms;         // millis() when it was written
+    char            text[STATUS_LINE_SIZE + 1];
+} pline_t;
+
+static pline_t p_lines[MAX_LINES];
+static uint16_t p_num_lines = 0;
+static uint16_t p_bad_writes = 0;   // writes that weren't one whole line
+static unsigned long p_stopped_ms = 0;  // the first loop() after timer 1 stopped
+
+static void statusWrite(uint16_t port, const uint8_t *bytes, size_t n)
+{
+    if (port != STATUS_PORT) {
+        return;
+    }
+    if ((n == 0) || (n > STATUS_LINE_SIZE) || (bytes[n - 1] != '\n') ||
+            (memchr(bytes, '\n', n) != &bytes[n - 1]) || (memcmp(bytes, "{\"ms\":", 6) != 0)) {
+        p_bad_writes++;
+        return;
+    }
+    if (p_num_lines < MAX_LINES) {
+        p_lines[p_num_lines].ms = millis();
+        memcpy(p_lines[p_num_lines].text, bytes, n);
+        p_lines[p_num_lines++].text[n] = '\0';
+    }
+}
+
+static uint16_t runLoop(unsigned long ms)
+{
+    // lines sent while loop() runs every ms for ms
+    uint16_t first = p_num_lines;
+    for (unsigned long i = 0; i < ms; i++) {
+        pSimRun(F_CPU / 1000);
+        pprogress_t progress;
+        pGetProgress(PTIMER1, &progress);
+        if (!progress.active && (p_stopped_ms == 0)) {
+            p_stopped_ms = millis();
+        }
+        sketchLoop();
+    }
+    return p_num_lines - first;
+}
+
+static bool hasEntry(const pline_t *line, uint32_t periods, bool active)
+{
+    char entry[STATUS_ENTRY_SIZE];
+    snprintf(entry, sizeof(entry), "[%u,%lu,%d,0]", waterp, (unsigned long)periods, active);
+    return strstr(line->text, entry) != NULL;
+}
+
+int main()
+{
+    pSimReset();
+    ethernet_write_hook = statusWrite;
+    sketchSetup();
+
+    // idle, only the full line every STATUS_FULL_MS
+    P_CHECK_EQUAL(runLoop(3000), 3000 / STATUS_FULL_MS);
+    P_CHECK(hasEntry(&p_lines[p_num_lines - 1], 0, false));
+
+    // a 5 s run at 1 kHz is streamed at most every STATUS_MIN_MS
+    P_CHECK_EQUAL(pSetPulseUS(waterp, 1000, 100, 5000), 0);
+    P_CHECK_EQUAL(pReloadToTimer(waterp), 1);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    uint16_t first = p_num_lines;
+    p_stopped_ms = 0;
+    uint16_t running = runLoop(5100);
+    P_CHECK(running >= 5000 / STATUS_MIN_MS);
+    P_CHECK(running <= 5100 / STATUS_MIN_MS + 5100 / STATUS_FULL_MS + 2);
+
+    // the start and the stop each go out on the next loop()
+    P_CHECK_EQUAL(p_lines[first].ms, 3001);
+    P_CHECK(strstr(p_lines[first].text, ",1,0]") != NULL);
+    uint16_t stop = first;
+    while ((stop < p_num_lines) && !hasEntry(&p_lines[stop], 5000, false)) {
+        stop++;
+    }
+    P_CHECK(stop < p_num_lines);
+    // each period restarts the count after the ISR, so the run ends a little
+    // after 5 s
+    P_CHECK(p_stopped_ms >= 3000 + 5000);
+    P_CHECK(p_stopped_ms <= 3000 + 5000 + 5000 / STATUS_MIN_MS);
+    P_CHECK_EQUAL(p_lines[stop].ms, p_stopped_ms);
+    for (uint16_t i = first + 1; i < stop; i++) {
+        // but for the full lines
+        if (p_lines[i].ms % STATUS_FULL_MS != 0) {
+            P_CHECK(p_lines[i].ms - p_lines[i - 1].ms >= STATUS_MIN_MS);
+        }
+    }
+
+    // idle again
+    P_CHECK_EQUAL(runLoop(2000), 2000 / STATUS_FULL_MS);
+    P_CHECK_EQUAL(p_bad_writes, 0);
+    printf("%u lines in 10.1 s, %u of them while the run went on\n", p_num_lines, running);
+    return pTestResult("test_status_stream");
+}
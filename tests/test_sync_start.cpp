@@ -0,0 +1,85 @@
+// test_sync_start.cpp - pStartTimers starts its timers on the same clock
+// edge, those at prescale 1 included, so the first edges of each come out
+// exactly their offsets apart
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_TIMER3
+#define P_USE_TIMER4
+#define P_USE_TIMER5
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define PERIODS     3
+
+static const uint8_t p_pins[NUMBER_OF_16BIT_TIMERS] = { 22, 23, 24, 25 };
+static uint64_t p_rises[NUMBER_OF_16BIT_TIMERS][PERIODS];
+static uint8_t p_num_rises[NUMBER_OF_16BIT_TIMERS];
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        if ((pin == p_pins[timer]) && (level == HIGH) && (p_num_rises[timer] < PERIODS)) {
+            p_rises[timer][p_num_rises[timer]++] = cycle;
+        }
+    }
+}
+
+static void setup(const uint16_t *prescales)
+{
+    pSimReset();
+    pSetupTimers();
+    p_sim_edge_hook = edgeHook;
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        p_num_rises[timer] = 0;
+        uint8_t pt = pNewPTrain();
+        P_CHECK_EQUAL(_pSetPulseUS(pt, 1000, 100, PERIODS, prescales[timer]), 0);
+        P_CHECK_EQUAL(pAttach(pt, p_pins[timer], (timers16bit_t)timer), pt);
+    }
+}
+
+static void checkStart(const uint16_t *prescales, const uint16_t *offsets)
+{
+    // the counters stand at minus their offsets as the prescaler lets go
+    // and each first edge is its offset in cycles after the earliest
+    setup(prescales);
+    P_CHECK_EQUAL(pStartTimers(0x0F, offsets), 0);
+    P_CHECK_EQUAL(TCNT1, (uint16_t)-offsets[PTIMER1]);
+    P_CHECK_EQUAL(TCNT3, (uint16_t)-offsets[PTIMER3]);
+    P_CHECK_EQUAL(TCNT4, (uint16_t)-offsets[PTIMER4]);
+    P_CHECK_EQUAL(TCNT5, (uint16_t)-offsets[PTIMER5]);
+    pSimRunUntilIdle(F_CPU);
+    for (uint8_t timer = 0; timer < NUMBER_OF_16BIT_TIMERS; timer++) {
+        P_CHECK_EQUAL(p_num_rises[timer], PERIODS);
+        int64_t skew = (int64_t)(p_rises[timer][0] - p_rises[PTIMER1][0]) -
+                        (int64_t)(offsets[timer] + SMALL_COUNT) * prescales[timer] +
+                        (int64_t)(offsets[PTIMER1] + SMALL_COUNT) * prescales[PTIMER1];
+        P_CHECK_EQUAL(skew, 0);
+        printf("timer %u at prescale %u: first edge skew %lld cycles\n",
+                timer, prescales[timer], (long long)skew);
+    }
+}
+
+int main()
+{
+    // all at prescale 1, where the counters don't wait for the prescaler
+    static const uint16_t fast[NUMBER_OF_16BIT_TIMERS] = { 1, 1, 1, 1 };
+    static const uint16_t spread[NUMBER_OF_16BIT_TIMERS] = { 0, 400, 800, 1200 };
+    checkStart(fast, spread);
+
+    // prescale 1 timers against prescaled ones
+    static const uint16_t mixed[NUMBER_OF_16BIT_TIMERS] = { 1, 8, 1, 64 };
+    static const uint16_t mixed_offsets[NUMBER_OF_16BIT_TIMERS] = { 0, 100, 2000, 30 };
+    checkStart(mixed, mixed_offsets);
+
+    // the preload of a prescale 1 timer leaves less room for its offset
+    setup(mixed);
+    uint16_t offsets[NUMBER_OF_16BIT_TIMERS] = { 0, 0, 0, 0 };
+    offsets[PTIMER1] = 0xFFFF - SMALL_COUNT - (NUMBER_OF_16BIT_TIMERS - 1) * P_SYNC_STORE_CYCLES -
+                        P_SYNC_RELEASE_CYCLES + 1;
+    P_CHECK_EQUAL(pStartTimers(0x0F, offsets), ERROR_OUT_OF_RANGE);
+    offsets[PTIMER1] = 0;
+    offsets[PTIMER3] = 0xFFFF - SMALL_COUNT;
+    P_CHECK_EQUAL(pStartTimers(0x0F, offsets), 0);
+    return pTestResult("test_sync_start");
+}
@@ -0,0 +1,149 @@
+// test_template.cpp - a PulseTrain puts out the same waveform as the p*
+// functions with the same pins and settings, pulsed and DC, from a cheaper
+// ISR that writes each port without walking a table or moving a 32 bit
+// compare, and leaves the p* timers working next to it
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#include "pulsetrain.h"
+#include "pulsetrain_template.h"
+#include "ptest.h"
+
+#define PINS        3
+#define MAX_EDGES   64
+#define PRESCALE    8
+// what an interval of the p* ISR may take longer: the port group walk, the
+// compare bookkeeping and a count of the prescaler
+#define SLACK       (P_SIM_GROUP_CYCLES + P_SIM_COMPARE_CYCLES + PRESCALE)
+
+typedef PulseTrain<PTimer4, PPins<22, 23, 53>, PPrescale<PRESCALE> > Train;
+P_PULSETRAIN_ISR(4, Train)
+
+static const uint8_t p_pins[PINS] = { 22, 23, 53 };
+
+typedef struct {
+    uint64_t times[PINS][MAX_EDGES];
+    uint8_t levels[PINS][MAX_EDGES];
+    uint8_t edges[PINS];
+} pedges_t;
+
+static pedges_t p_run[2];
+static pedges_t *p_recording = NULL;
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    for (uint8_t i = 0; i < PINS; i++) {
+        if ((pin == p_pins[i]) && (p_recording->edges[i] < MAX_EDGES)) {
+            p_recording->times[i][p_recording->edges[i]] = cycle;
+            p_recording->levels[i][p_recording->edges[i]] = level;
+            p_recording->edges[i]++;
+        }
+    }
+}
+
+static void runPTrains(uint32_t period_us, uint32_t pulse_us, uint16_t periods)
+{
+    // the p* functions on PTIMER1, a ptrain per pin
+    pSimReset();
+    pSetupTimers();
+    memset(&p_run[0], 0, sizeof(p_run[0]));
+    p_recording = &p_run[0];
+    p_sim_edge_hook = edgeHook;
+    for (uint8_t i = 0; i < PINS; i++) {
+        uint8_t pt = pNewPTrain();
+        P_CHECK_EQUAL(_pSetPulseUS(pt, period_us, pulse_us, periods, PRESCALE), 0);
+        P_CHECK_EQUAL(pAttach(pt, p_pins[i], PTIMER1), pt);
+    }
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRunUntilIdle((uint64_t)(periods + 2) * (period_us + pulse_us) * CLOCKCYCLESPERMICROSECOND);
+    P_CHECK(pSimIsIdle());
+}
+
+template <uint32_t period_us, uint32_t pulse_us> static void runTemplate(uint16_t periods)
+{
+    pSimReset();
+    pSetupTimers();
+    Train::begin();
+    memset(&p_run[1], 0, sizeof(p_run[1]));
+    p_recording = &p_run[1];
+    p_sim_edge_hook = edgeHook;
+    Train::setPulseUS<period_us, pulse_us>(periods);
+    P_CHECK_EQUAL(Train::start(), 0);
+    P_CHECK(Train::isActive());
+    P_CHECK_EQUAL(Train::start(), ERROR_TIMER_RUNNING);
+    pSimRunUntilIdle((uint64_t)(periods + 2) * (period_us + pulse_us) * CLOCKCYCLESPERMICROSECOND);
+    P_CHECK(pSimIsIdle());
+    P_CHECK(!Train::isActive());
+    P_CHECK_EQUAL(Train::getPeriodNumber(), periods);
+}
+
+static void checkSame(uint8_t edges, uint8_t periods_per_edge)
+{
+    // every edge of the two runs at the same level, every interval between
+    // them no longer in the PulseTrain and at most SLACK a period shorter
+    uint8_t off = 0;
+    for (uint8_t i = 0; i < PINS; i++) {
+        P_CHECK_EQUAL(p_run[0].edges[i], edges);
+        P_CHECK_EQUAL(p_run[1].edges[i], edges);
+        for (uint8_t j = 0; j < edges; j++) {
+            if (p_run[0].levels[i][j] != p_run[1].levels[i][j]) {
+                off++;
+            }
+            if (j > 0) {
+                uint64_t ptrain = p_run[0].times[i][j] - p_run[0].times[i][j - 1];
+                uint64_t train = p_run[1].times[i][j] - p_run[1].times[i][j - 1];
+                if ((train > ptrain) || (train + periods_per_edge * SLACK < ptrain)) {
+                    off++;
+                }
+            }
+        }
+        P_CHECK_EQUAL(pSimReadPin(p_pins[i]), LOW);
+    }
+    P_CHECK_EQUAL(off, 0);
+}
+
+int main()
+{
+    // pulsed, the ports of pins 22 and 23 (A) and 53 (B) a write apart
+    runPTrains(1000, 250, 10);
+    uint32_t p_isr_count = p_sim_isr_count;
+    uint32_t p_isr_cycles = p_sim_last_isr_cycles;
+    runTemplate<1000, 250>(10);
+    checkSame(2 * 10, 1);
+    P_CHECK_EQUAL(p_sim_isr_count, p_isr_count);
+    P_CHECK_EQUAL(p_run[1].times[2][0] - p_run[1].times[0][0], P_SIM_PORT_WRITE_CYCLES);
+    P_CHECK_EQUAL(p_run[1].times[1][0], p_run[1].times[0][0]);
+
+    // the falling edge ISR writes the two ports and checks the period count
+    uint32_t overhead = P_SIM_ISR_ENTRY_CYCLES + P_SIM_ISR_BODY_CYCLES + P_SIM_ISR_EXIT_CYCLES;
+    P_CHECK_EQUAL(p_sim_last_isr_cycles,
+                    overhead + 2 * P_SIM_PORT_WRITE_CYCLES + P_SIM_PERIOD_CYCLES);
+    P_CHECK_EQUAL(p_isr_cycles, p_sim_last_isr_cycles + 2 * P_SIM_GROUP_CYCLES +
+                    P_SIM_COMPARE_CYCLES);
+    printf("edge ISR with %u pins on 2 ports: %u cycles, %u with the p* functions\n", PINS,
+            p_sim_last_isr_cycles, p_isr_cycles);
+
+    // DC, HIGH for 4 pulse lengths
+    runPTrains(0, 500, 4);
+    runTemplate<0, 500>(4);
+    checkSame(2, 4);
+    P_CHECK(p_run[1].times[0][1] - p_run[1].times[0][0] >=
+                (uint64_t)4 * 500 * CLOCKCYCLESPERMICROSECOND);
+
+    // the p* functions keep PTIMER1 while the PulseTrain runs PTIMER4
+    pSimReset();
+    pSetupTimers();
+    Train::begin();
+    p_sim_edge_hook = NULL;
+    uint8_t pt = pNewPTrain();
+    P_CHECK_EQUAL(_pSetPulseUS(pt, 500, 100, 20, PRESCALE), 0);
+    P_CHECK_EQUAL(pAttach(pt, 30, PTIMER1), pt);
+    Train::setPulseUS<1000, 250>(10);
+    P_CHECK_EQUAL(Train::start(), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    pSimRunUntilIdle((uint64_t)12 * 1000 * CLOCKCYCLESPERMICROSECOND);
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(Train::getPeriodNumber(), 10);
+    P_CHECK_EQUAL(timer_array[PTIMER1].number_of_periods, 20);
+    return pTestResult("test_template");
+}
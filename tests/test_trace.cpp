@@ -0,0 +1,139 @@
+// test_trace.cpp - the edge trace records every edge the ISR makes in
+// order, counts what a full ring drops, and the VCD pVCDWriteTrace builds
+// from the records has the edges of the pin the simulation saw, the
+// same time apart
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#define P_USE_TRACE
+#include "pulsetrain.h"
+#include "pulsetrain_vcd.h"
+#include "ptest.h"
+
+#define PERIODS     12
+#define EDGES       (2 * PERIODS)
+#define PRESCALE    8
+
+static uint64_t p_pin_times[EDGES];
+static uint8_t p_pin_levels[EDGES];
+static uint8_t p_pin_edges;
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if ((pin == 22) && (p_pin_edges < EDGES)) {
+        p_pin_times[p_pin_edges] = cycle;
+        p_pin_levels[p_pin_edges] = level;
+        p_pin_edges++;
+    }
+}
+
+static void start(uint32_t pulse_counts, uint32_t period_counts, uint32_t periods, uint8_t mode)
+{
+    pSimReset();
+    pSetupTimers();
+    ptrace_t drop[P_TRACE_SIZE];
+    while (pTraceRead(drop, P_TRACE_SIZE) != 0) {
+    }
+    p_pin_edges = 0;
+    p_sim_edge_hook = edgeHook;
+    uint8_t pt = pNewPTrain();
+    P_CHECK_EQUAL(pSetPulse(pt, period_counts, pulse_counts, periods, PRESCALE, PRESCALE), 0);
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, mode), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+}
+
+static uint8_t readVCD(FILE *vcd, uint64_t *times, uint8_t *levels, uint8_t max_edges)
+{
+    // the changes of the PTIMER1 signal, '!', after the $dumpvars block
+    char line[64];
+    uint64_t time = 0;
+    uint8_t n = 0;
+    bool dumped = false;
+    rewind(vcd);
+    while (fgets(line, sizeof(line), vcd) != NULL) {
+        if (strcmp(line, "$end\n") == 0) {
+            dumped = true;
+        }
+        else if (line[0] == '#') {
+            time = strtoull(&line[1], NULL, 10);
+        }
+        else if (dumped && ((line[0] == '0') || (line[0] == '1')) && (line[1] == '!') &&
+                    (n < max_edges)) {
+            times[n] = time;
+            levels[n] = line[0] - '0';
+            n++;
+        }
+    }
+    return n;
+}
+
+static void checkRun(uint32_t pulse_counts, uint32_t period_counts, uint8_t mode)
+{
+    // drained every period, so nothing is dropped
+    ptrace_t records[EDGES + 1];
+    uint8_t n = 0;
+    start(pulse_counts, period_counts, PERIODS, mode);
+    for (uint8_t i = 0; i <= PERIODS; i++) {
+        pSimRun((uint64_t)period_counts * PRESCALE);
+        n += pTraceRead(&records[n], EDGES + 1 - n);
+    }
+    P_CHECK(pSimIsIdle());
+    P_CHECK_EQUAL(p_pin_edges, EDGES);
+    P_CHECK_EQUAL(n, EDGES);
+    P_CHECK_EQUAL(pTraceDropped(), 0);
+    for (uint8_t i = 0; i < n; i++) {
+        P_CHECK_EQUAL(records[i].timer, PTIMER1);
+        P_CHECK_EQUAL(records[i].state & P_TRACE_LEVEL, (i % 2 == 0) ? HIGH : LOW);
+        P_CHECK_EQUAL(records[i].period, i / 2 + 1);
+        P_CHECK_EQUAL((records[i].state & P_TRACE_CLEARED) != 0,
+                        (mode == PMODE_CLEAR) && (i % 2 == 0));
+    }
+
+    // the rebuilt edges are as far apart as the ones the pin made
+    uint16_t prescales[NUMBER_OF_16BIT_TIMERS] = { PRESCALE, 1, 1, 1 };
+    uint64_t times[EDGES + 1];
+    uint8_t levels[EDGES + 1];
+    FILE *vcd = tmpfile();
+    P_CHECK(vcd != NULL);
+    P_CHECK_EQUAL(pVCDWriteTrace(vcd, records, n, prescales), 0);
+    uint8_t edges = readVCD(vcd, times, levels, EDGES + 1);
+    fclose(vcd);
+    P_CHECK_EQUAL(edges, EDGES);
+    uint8_t off = 0;
+    for (uint8_t i = 0; (i < edges) && (i < EDGES); i++) {
+        P_CHECK_EQUAL(levels[i], p_pin_levels[i]);
+        if (i < 2) {
+            continue;
+        }
+        // against the same edge of the period before, which the ISR took
+        // the same path to
+        uint64_t vcd_cycles = (times[i] - times[i - 2]) / P_VCD_PS_PER_CYCLE;
+        uint64_t pin_cycles = p_pin_times[i] - p_pin_times[i - 2];
+        if (vcd_cycles != pin_cycles) {
+            off++;
+        }
+    }
+    P_CHECK_EQUAL(off, 0);
+    printf("%s %lu/%lu counts: %u records, %u edges in the VCD, %u off\n",
+            (mode == PMODE_CLEAR) ? "PMODE_CLEAR" : "PMODE_FREERUN",
+            (unsigned long)pulse_counts, (unsigned long)period_counts, n, edges, off);
+}
+
+int main()
+{
+    checkRun(300, 1000, PMODE_FREERUN);
+    checkRun(250, 2000, PMODE_FREERUN);
+    checkRun(300, 1000, PMODE_CLEAR);
+
+    // a ring left undrained keeps the first records and counts the rest
+    ptrace_t records[P_TRACE_SIZE];
+    start(300, 1000, P_TRACE_SIZE, PMODE_FREERUN);
+    pSimRunUntilIdle((uint64_t)(P_TRACE_SIZE + 1) * 1000 * PRESCALE);
+    P_CHECK_EQUAL(pTraceRead(records, P_TRACE_SIZE), P_TRACE_SIZE);
+    P_CHECK_EQUAL(pTraceDropped(), P_TRACE_SIZE);    // two edges a period
+    P_CHECK_EQUAL(records[0].period, 1);
+    P_CHECK_EQUAL(records[P_TRACE_SIZE - 1].period, P_TRACE_SIZE / 2);
+    P_CHECK_EQUAL(pTraceRead(records, P_TRACE_SIZE), 0);
+    return pTestResult("test_trace");
+}
@@ -0,0 +1,140 @@
+// test_update.cpp - pReloadToTimer on a running timer: the new values wait
+// in the shadow copies until the next period starts, so every period on the
+// pin is all old or all new values, pIsUpdatePending is true until then and
+// pGetUpdatePeriod says how many periods went out before.  An update to DC
+// waits for the next pStartTimer
+
+#define P_SIMULATE
+#define P_USE_TIMER1
+#include "pulsetrain.h"
+#include "ptest.h"
+
+#define PERIODS     20
+#define MAX_EDGES   64
+
+static uint64_t p_pin_times[MAX_EDGES];
+static uint8_t p_pin_levels[MAX_EDGES];
+static uint8_t p_pin_edges;
+
+static void edgeHook(uint8_t pin, uint8_t level, uint64_t cycle)
+{
+    if ((pin == 22) && (p_pin_edges < MAX_EDGES)) {
+        p_pin_times[p_pin_edges] = cycle;
+        p_pin_levels[p_pin_edges] = level;
+        p_pin_edges++;
+    }
+}
+
+static void start(uint8_t pt, uint32_t pulse_counts, uint32_t period_counts, uint16_t prescale)
+{
+    pSimReset();
+    pSetupTimers();
+    p_pin_edges = 0;
+    p_sim_edge_hook = edgeHook;
+    P_CHECK_EQUAL(pSetPulse(pt, period_counts, pulse_counts, PERIODS, prescale, prescale), 0);
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pSetTimerMode(PTIMER1, PMODE_FREERUN), 0);
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK(!pIsUpdatePending(PTIMER1));
+}
+
+static uint8_t reloadMidPulse(uint8_t pt, uint32_t pulse_counts, uint32_t period_counts,
+                                uint16_t prescale)
+{
+    // reload in the pulse of the sixth period, the periods started before
+    pSimRun((uint64_t)5 * 1000 * 8 + 100 * 8);
+    uint8_t periods_before = (p_pin_edges + 1) / 2;
+    P_CHECK_EQUAL(p_pin_levels[p_pin_edges - 1], HIGH);
+    P_CHECK_EQUAL(pSetPulse(pt, period_counts, pulse_counts, PERIODS, prescale, prescale), 0);
+    P_CHECK_EQUAL(pReloadToTimer(pt), 1);
+    P_CHECK(pIsUpdatePending(PTIMER1));
+    // not yet live at the falling edge, which is still the old pulse
+    pSimRun((uint64_t)600 * 8);
+    P_CHECK(pIsUpdatePending(PTIMER1));
+    return periods_before;
+}
+
+static void checkPeriods(uint8_t update_period, uint32_t old_pulse, uint32_t old_period,
+                            uint32_t new_pulse, uint32_t new_period)
+{
+    // each period has the pulse and the period of one set of values
+    P_CHECK_EQUAL(p_pin_edges, 2 * PERIODS);
+    uint8_t mixed = 0;
+    for (uint8_t i = 0; i + 1 < p_pin_edges; i += 2) {
+        bool is_new = (i / 2 >= update_period);
+        uint64_t high = p_pin_times[i + 1] - p_pin_times[i];
+        if (high != (is_new ? new_pulse : old_pulse)) {
+            mixed++;
+        }
+        if ((i + 2 < p_pin_edges) &&
+                (p_pin_times[i + 2] - p_pin_times[i] != (is_new ? new_period : old_period))) {
+            mixed++;
+        }
+    }
+    P_CHECK_EQUAL(mixed, 0);
+}
+
+int main()
+{
+    uint8_t pt = pNewPTrain();
+
+    // a new pulse and period at the same prescale
+    start(pt, 300, 1000, 8);
+    uint8_t periods_before = reloadMidPulse(pt, 500, 2000, 8);
+    pSimRunUntilIdle((uint64_t)PERIODS * 2000 * 8);
+    P_CHECK(!pIsUpdatePending(PTIMER1));
+    P_CHECK_EQUAL(pGetUpdatePeriod(PTIMER1), periods_before);
+    checkPeriods(periods_before, 300 * 8, 1000 * 8, 500 * 8, 2000 * 8);
+    printf("300/1000 to 500/2000 counts: live after %lu periods\n",
+            (unsigned long)pGetUpdatePeriod(PTIMER1));
+    pClearTimerOfPTrains(PTIMER1);
+
+    // a new prescale goes live with the rest.  The counts of the interrupt
+    // latency go by at the new prescale, so the first new pulse is short by
+    // them, the ones after are exact
+    start(pt, 300, 1000, 8);
+    periods_before = reloadMidPulse(pt, 100, 200, 64);
+    pSimRunUntilIdle((uint64_t)PERIODS * 200 * 64);
+    P_CHECK(!pIsUpdatePending(PTIMER1));
+    P_CHECK_EQUAL(pGetUpdatePeriod(PTIMER1), periods_before);
+    P_CHECK_EQUAL(p_pin_edges, 2 * PERIODS);
+    uint8_t first = 2 * periods_before;
+    uint64_t latency_cycles = (P_SIM_ISR_ENTRY_CYCLES + P_SIM_ISR_BODY_CYCLES) / 8 * 64 + 64;
+    P_CHECK(p_pin_times[first + 1] - p_pin_times[first] < 100 * 64);
+    P_CHECK(p_pin_times[first + 1] - p_pin_times[first] + latency_cycles >= 100 * 64);
+    uint8_t off = 0;
+    for (uint8_t i = first + 2; i + 1 < p_pin_edges; i += 2) {
+        if ((p_pin_times[i + 1] - p_pin_times[i] != 100 * 64) ||
+                ((i + 2 < p_pin_edges) && (p_pin_times[i + 2] - p_pin_times[i] != 200 * 64))) {
+            off++;
+        }
+    }
+    P_CHECK_EQUAL(off, 0);
+    pClearTimerOfPTrains(PTIMER1);
+
+    // an update to DC waits for the restart, the run ends on the old values
+    start(pt, 300, 1000, 8);
+    reloadMidPulse(pt, 400, 0, 8);
+    pSimRunUntilIdle((uint64_t)PERIODS * 1000 * 8);
+    checkPeriods(PERIODS, 300 * 8, 1000 * 8, 0, 0);
+    P_CHECK(pIsUpdatePending(PTIMER1));
+    p_pin_edges = 0;
+    P_CHECK_EQUAL(pStartTimer(PTIMER1), 0);
+    P_CHECK(!pIsUpdatePending(PTIMER1));
+    pSimRunUntilIdle((uint64_t)(PERIODS + 1) * 400 * 8);
+    P_CHECK_EQUAL(p_pin_edges, 2);
+    // the last ISR moves the compare and counts the period before it
+    // writes the pin, the first writes it straight away
+    P_CHECK_EQUAL(p_pin_times[1] - p_pin_times[0], (uint64_t)PERIODS * 400 * 8 +
+                    P_SIM_COMPARE_CYCLES + 2 * P_SIM_PERIOD_CYCLES);
+    pClearTimerOfPTrains(PTIMER1);
+
+    // a stopped timer takes the values at once
+    P_CHECK_EQUAL(pSetPulse(pt, 1000, 300, PERIODS, 8, 8), 0);
+    P_CHECK_EQUAL(pAttach(pt, 22, PTIMER1), pt);
+    P_CHECK_EQUAL(pReloadToTimer(pt), 1);
+    P_CHECK(!pIsUpdatePending(PTIMER1));
+    P_CHECK_EQUAL(timer_array[PTIMER1].pulse_counts, 300);
+    P_CHECK_EQUAL(timer_array[PTIMER1].period_counts, 1000);
+    return pTestResult("test_update");
+}